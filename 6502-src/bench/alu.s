@@ -0,0 +1,61 @@
+	;; ALU-heavy loop: an 8-bit xorshift and an 8x8 multiply by shift and
+	;; add, on registers and zero page only
+
+N1	= $10
+N2	= $11		; multiplier, then the low byte of the product
+HI	= $12
+SEED	= $13
+SUM	= $14
+
+	.org $8000
+Start:
+	LDA #$01
+	STA SEED
+	LDA #$00
+	STA SUM
+	LDX #$00
+
+Loop:
+	LDA SEED	; xorshift: seed ^= seed << 3, >> 5, << 2
+	ASL
+	ASL
+	ASL
+	EOR SEED
+	STA SEED
+	LSR
+	LSR
+	LSR
+	LSR
+	LSR
+	EOR SEED
+	STA SEED
+	ASL
+	ASL
+	EOR SEED
+	STA SEED
+
+	STA N1		; HI:N2 = seed * X
+	STX N2
+	LDA #$00
+	LDY #$08
+	LSR N2
+Mul:
+	BCC NoAdd
+	CLC
+	ADC N1
+NoAdd:
+	ROR
+	ROR N2
+	DEY
+	BNE Mul
+	STA HI
+
+	CLC		; fold the product into the sum
+	ADC SUM
+	SEC
+	SBC N2
+	AND #$7F
+	ORA #$01
+	STA SUM
+	INX
+	JMP Loop
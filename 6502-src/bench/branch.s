@@ -0,0 +1,60 @@
+	;; Branch-heavy code: a Galois LFSR drives data-dependent branches
+	;; through a chain of compares, with an overflow test every 256 steps
+
+SEED	= $10
+COUNTS	= $20		; 8 counters
+
+	.org $8000
+Start:
+	LDA #$01
+	STA SEED
+	LDX #$00
+
+Loop:
+	LDA SEED
+	LSR
+	BCC NoTap
+	EOR #$B8
+NoTap:
+	STA SEED
+
+	BMI Neg
+	CMP #$40
+	BCS Big
+	INC COUNTS
+	JMP Next
+Big:
+	CMP #$60
+	BCC Mid
+	INC COUNTS+1
+	JMP Next
+Mid:
+	INC COUNTS+2
+	JMP Next
+Neg:
+	AND #$03
+	BEQ Zero
+	CMP #$02
+	BCC One
+	BEQ Two
+	INC COUNTS+3
+	JMP Next
+Zero:
+	INC COUNTS+4
+	JMP Next
+One:
+	INC COUNTS+5
+	JMP Next
+Two:
+	INC COUNTS+6
+
+Next:
+	DEX
+	BNE Loop
+
+	CLC
+	LDA SEED
+	ADC #$40
+	BVC Loop
+	INC COUNTS+7
+	JMP Loop
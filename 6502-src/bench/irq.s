@@ -0,0 +1,76 @@
+	;; Interrupt-heavy loop: timer 1 of a VIA at $D000 (run with
+	;; --via 0xD0) interrupts every 100 cycles, the main loop polls timer
+	;; 2 in one-shot mode and rearms it every 1000 cycles
+
+VIA	= $D000
+T1CL	= VIA+4
+T1CH	= VIA+5
+T2CL	= VIA+8
+T2CH	= VIA+9
+ACR	= VIA+11
+IFR	= VIA+13
+IER	= VIA+14
+
+TICKS	= $10		; 16 bits, timer 1 interrupts
+POLLS	= $12		; 16 bits, timer 2 underflows
+SUM	= $14
+
+	.org $8000
+Start:
+	SEI
+	LDX #$FF
+	TXS
+	LDA #<Irq
+	STA $FFFE
+	LDA #>Irq
+	STA $FFFF
+	LDA #$00
+	STA TICKS
+	STA TICKS+1
+	STA POLLS
+	STA POLLS+1
+	STA SUM
+
+	LDA #$40	; timer 1 free-run, timer 2 one-shot
+	STA ACR
+	LDA #$C0	; timer 1 interrupts
+	STA IER
+	LDA #<98	; latch + 2 cycles a period
+	STA T1CL
+	LDA #>98
+	STA T1CH
+	JSR Arm
+	CLI
+
+Loop:
+	LDA SUM
+	ASL
+	ADC #$1D
+	EOR TICKS
+	STA SUM
+	LDA IFR
+	AND #$20
+	BEQ Loop
+	INC POLLS
+	BNE Rearm
+	INC POLLS+1
+Rearm:
+	JSR Arm
+	JMP Loop
+
+Arm:
+	LDA #<1000
+	STA T2CL
+	LDA #>1000
+	STA T2CH	; clears the flag
+	RTS
+
+Irq:
+	PHA
+	LDA T1CL	; clears the flag
+	INC TICKS
+	BNE Ret
+	INC TICKS+1
+Ret:
+	PLA
+	RTI
@@ -0,0 +1,28 @@
+	;; Memory copy: 2 KB from $1000 to $2000 with absolute indexed loads
+	;; and stores, 8 pages per pass
+
+	.org $8000
+Start:
+	LDX #$00
+Copy:
+	LDA $1000,X
+	STA $2000,X
+	LDA $1100,X
+	STA $2100,X
+	LDA $1200,X
+	STA $2200,X
+	LDA $1300,X
+	STA $2300,X
+	LDA $1400,X
+	STA $2400,X
+	LDA $1500,X
+	STA $2500,X
+	LDA $1600,X
+	STA $2600,X
+	LDA $1700,X
+	STA $2700,X
+	INX
+	BNE Copy
+
+	INC $1000	; different data on every pass
+	JMP Start
@@ -0,0 +1,50 @@
+	;; Deep JSR/RTS recursion: a recursive Fibonacci, then a call chain
+	;; 100 deep
+
+RES	= $10		; 16 bits
+
+	.org $8000
+Start:
+	LDX #$FF
+	TXS
+Loop:
+	LDA #$00
+	STA RES
+	STA RES+1
+	LDX #16
+	JSR Fib		; RES = fib(16)
+	LDX #100
+	JSR Deep
+	JMP Loop
+
+	;; RES += fib(X), X is kept
+Fib:
+	CPX #2
+	BCS Rec
+	TXA
+	CLC
+	ADC RES
+	STA RES
+	BCC Done
+	INC RES+1
+Done:
+	RTS
+Rec:
+	DEX
+	JSR Fib
+	DEX
+	JSR Fib
+	INX
+	INX
+	RTS
+
+	;; calls itself X times, X is kept
+Deep:
+	DEX
+	BNE Down
+	INX
+	RTS
+Down:
+	JSR Deep
+	INX
+	RTS
@@ -0,0 +1,37 @@
+	;; Self-modifying code: a copy loop whose load and store addresses are
+	;; patched page by page, an immediate operand patched on every byte, and
+	;; an opcode flipped between INC and DEC on every pass
+
+COUNT	= $10
+
+	.org $8000
+Start:
+	LDA #$30
+	STA Load+2
+	LDA #$40
+	STA Store+2
+Page:
+	LDX #$00
+Load:
+	LDA $3000,X
+	CLC
+Imm:
+	ADC #$00
+Store:
+	STA $4000,X
+	INC Imm+1
+	INX
+	BNE Load
+
+	INC Load+2
+	INC Store+2
+	LDA Load+2
+	CMP #$38
+	BNE Page
+
+	LDA Flip	; INC zp <-> DEC zp
+	EOR #$20
+	STA Flip
+Flip:
+	INC COUNT
+	JMP Start
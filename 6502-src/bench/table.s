@@ -0,0 +1,57 @@
+	;; Indirect-indexed table walk: 64 row pointers in zero page, rows of
+	;; 32 bytes 37 bytes apart, so that some of them cross a page. Every
+	;; row is summed with (PTR),Y and its first byte bumped with (ROWS,X)
+
+ROWS	= $40		; 64 pointers, up to $BF
+PTR	= $C0
+SUM	= $C2
+COUNT	= $C3
+
+	.org $8000
+Start:
+	LDA #<$3000	; ROWS[i] = $3000 + 37 * i
+	STA PTR
+	LDA #>$3000
+	STA PTR+1
+	LDX #$00
+Init:
+	LDA PTR
+	STA ROWS,X
+	CLC
+	ADC #37
+	STA PTR
+	LDA PTR+1
+	STA ROWS+1,X
+	ADC #$00
+	STA PTR+1
+	INX
+	INX
+	CPX #128
+	BNE Init
+
+Walk:
+	LDX #$00
+Row:
+	LDA ROWS,X
+	STA PTR
+	LDA ROWS+1,X
+	STA PTR+1
+	LDY #31
+	LDA #$00
+	CLC
+Col:
+	ADC (PTR),Y
+	DEY
+	BPL Col
+	STA SUM
+
+	LDA (ROWS,X)
+	ADC SUM
+	STA (ROWS,X)
+	INX
+	INX
+	CPX #128
+	BNE Row
+
+	INC COUNT
+	JMP Walk
@@ -0,0 +1,34 @@
+	;; Serial echo: every byte received on an ACIA at $D100 (run with
+	;; --acia 0xD1) is sent back, lower case letters in upper case
+
+ACIA	= $D100
+DATA	= ACIA
+STATUS	= ACIA+1
+COMMAND	= ACIA+2
+
+	.org $8000
+Start:
+	LDX #$FF
+	TXS
+	STA STATUS		; programmed reset
+	LDA #$0B		; DTR, no interrupts
+	STA COMMAND
+
+Loop:
+	LDA STATUS
+	AND #$08		; RDRF, a byte was received
+	BEQ Loop
+	LDA DATA
+	CMP #$61		; 'a'
+	BCC Send
+	CMP #$7B		; past 'z'
+	BCS Send
+	AND #$DF		; to upper case
+Send:
+	TAY
+Wait:
+	LDA STATUS
+	AND #$10		; TDRE, the transmitter is ready
+	BEQ Wait
+	STY DATA
+	JMP Loop
@@ -0,0 +1,59 @@
+#!/bin/sh
+#
+# Runs every benchmark of bench/ headless, loaded at $8000 with rom.bin at
+# $E000 for the reset vector, and prints one CSV row per benchmark from
+# the fastest of its runs:
+#
+#   benchmark,instructions,cycles,seconds,mips,mhz,ns_per_inst
+#
+# usage: bench/bench.sh [emulator [instructions [runs [emulator flags...]]]]
+# e.g.   bench/bench.sh bin/emulator.out 20000000 3 --jit
+#
+# The sources are in 6502-src/bench/. A benchmark that needs flags of its
+# own, a peripheral to be mapped for one, has them in <name>.flags.
+
+emulator=${1:-bin/emulator.out}
+insts=${2:-20000000}
+runs=${3:-3}
+[ $# -gt 3 ] && shift 3 || set --
+
+dir=$(dirname "$0")
+status=0
+
+echo "benchmark,instructions,cycles,seconds,mips,mhz,ns_per_inst"
+
+for bin in "$dir"/*.bin; do
+  name=$(basename "$bin" .bin)
+  flags=$(cat "$dir/$name.flags" 2>/dev/null)
+  best=
+
+  i=0
+  while [ "$i" -lt "$runs" ]; do
+    i=$((i + 1))
+
+    # "instructions cycles seconds" of a run that used up its budget
+    out=$("$emulator" --headless --insts "$insts" $flags "$@" \
+            -L "0x8000:$bin" -L "0xE000:$dir/../rom.bin" |
+          awk '/^stop:/ { stop = $2 }
+               /^instructions:/ { n = $2 }
+               /^cycles:/ { c = $2 }
+               /^seconds:/ { s = $2 }
+               END { if (stop == "budget") print n, c, s }')
+    if [ -z "$out" ]; then
+      echo "Error: $name didn't run its $insts instructions" >&2
+      status=1
+      continue 2
+    fi
+
+    best=$(printf '%s\n%s\n' "$best" "$out" |
+           awk 'NF == 3 && (b == "" || $3 < s) { b = $0; s = $3 } END { print b }')
+  done
+
+  echo "$best" | awk -v name="$name" '{
+    s = $3 > 0 ? $3 : 1e-9
+    printf "%s,%s,%s,%s,%.3f,%.3f,%.3f\n", name, $1, $2, $3,
+           $1 / s / 1e6, $2 / s / 1e6, s * 1e9 / $1
+  }'
+done
+
+exit $status
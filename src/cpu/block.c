@@ -0,0 +1,18 @@
+#include "block.h"
+
+#include "../machine/machine.h"
+
+/**
+ * block_cache_init: Empty the block cache and enable it. Code writing to
+ * memory behind the bus' back drops stale blocks with
+ * mem_code_invalidate_all() instead
+ * @param m The machine
+ * @return void
+ * */
+void block_cache_init(struct machine* m) {
+  for (unsigned i = 0; i < BLOCK_CACHE_SIZE; i++) {
+    m->blocks.blocks[i].count = 0;
+    m->blocks.blocks[i].native = NULL;
+  }
+  m->blocks.enabled = 1;
+}
@@ -0,0 +1,70 @@
+#ifndef INC_6502_BLOCK_H
+#define INC_6502_BLOCK_H
+
+#include <stdint.h>
+
+#include "../jit/jit.h"
+
+/*
+ * Predecoded block cache of cpu_run().
+ *
+ * A block is a straight-line run of instructions starting at some PC,
+ * decoded once into an array of (opcode, length, base cycles, operand) so
+ * that running it again reads no opcode nor operand byte from the bus.
+ * A block ends after a jump, a branch, a call, a return or a BRK, or before
+ * its next instruction would start outside the page it started in, so it
+ * spans at most two pages.
+ *
+ * Blocks are looked up by PC in a direct-mapped table. Each block remembers
+ * the generation of the memory pages its bytes come from; writing to such a
+ * page bumps its generation (see mem_code_invalidate()), which drops every
+ * block built from it, self-modifying programs included. A page invalidated
+ * MEM_CODE_WRITES_MAX times gets no block anymore and is single stepped
+ * until mem_code_invalidate_all().
+ */
+
+#define BLOCK_CACHE_SIZE 1024 // must be a power of two
+#define BLOCK_MAX_INSTS 16
+
+struct machine;
+
+struct block_inst {
+  uint8_t opcode;
+  uint8_t length; // in bytes, operand included
+  uint8_t cycles; // base cycles, from lookup[]
+  uint16_t operand; // the address of the constant for IMM
+};
+
+struct block {
+  uint16_t pc;
+  uint16_t end; // PC right after the last instruction
+  uint16_t last; // PC of the last instruction
+  uint8_t count; // 0 for an empty slot
+
+  // what cpu_run() needs to know to run it without checks in between
+  uint16_t max_cycles;
+  uint8_t has_brk;
+  uint8_t has_break; // starts on a breakpoint, see src/machine/debug.h
+
+  // backing pages of the bytes (mem.data offset >> 8) and their generation
+  // when the block was decoded
+  uint8_t page[2];
+  uint32_t gen[2];
+
+  // runs so far and the translation once hot, see src/jit/jit.h
+  uint32_t hits;
+  jit_native native;
+
+  struct block_inst insts[BLOCK_MAX_INSTS];
+};
+
+struct block_cache {
+  // cpu_run() falls back to fetching every instruction when 0
+  uint8_t enabled;
+
+  struct block blocks[BLOCK_CACHE_SIZE];
+};
+
+void block_cache_init(struct machine* m);
+
+#endif
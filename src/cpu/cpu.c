@@ -4,51 +4,64 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "../machine/machine.h"
+#include "../machine/profile.h"
+#include "../machine/sched.h"
 #include "../mem/mem.h"
 #include "../utils/misc.h"
+#include "../utils/trace.h"
 #include "instructions.h"
 
 /**
  * Little-endian 8-bit microprocessor that expects addresses
- * to be store in memory least significant byte first
+ * to be store in memory least significant byte first.
+ *
+ * The registers, the memory and the clock cycles all live in the
+ * struct machine passed to every function.
  * */
-struct central_processing_unit cpu;
-
-// clock cycles, every fetch implies a clock cycle
-uint32_t cycles = 0;
-
-// reference to the memory module
-struct mem* mem_ptr = NULL;
 
 /**
- * cpu_init: Initialize CPU by linking it to the memory
- * @param void
+ * cpu_init: Initialize CPU, no instruction is in flight
+ * @param m The machine
  * @return void
  */
-void cpu_init(void) { mem_ptr = mem_get_ptr(); }
+void cpu_init(struct machine* m) {
+  m->cycles = 0;
+  m->addr_abs = 0x0000;
+  m->addr_rel = 0x0000;
+  m->op = 0x00;
+  m->fetched = 0x00;
+  cpu_sr_unpack(&m->cpu, 0x00);
+}
 
 /**
  * cpu_extract_sr: Extract one of the 7 flags from the status reg.
+ * @param m The machine
  * @param flag The flag to be extracted
  * @return the bit of the wanted flag
  * */
-uint8_t cpu_extract_sr(uint8_t flag) { return ((cpu.sr >> (flag % 8)) & 1); }
+uint8_t cpu_extract_sr(struct machine* m, uint8_t flag) {
+  return ((cpu_sr_pack(&m->cpu) >> (flag % 8)) & 1);
+}
 
 /**
  * cpu_mod_sr: Modify the sr register (flags)
+ * @param m The machine
  * @param flag The flag to set
  * @param val The value
  * @return 0 if success, 1 if failure
  */
-uint8_t cpu_mod_sr(uint8_t flag, uint8_t val) {
+uint8_t cpu_mod_sr(struct machine* m, uint8_t flag, uint8_t val) {
   if (val != 0 && val != 1) return 1;
   
-  if (flag > 0 && flag < 8 && flag != 5) {
+  if (flag < 8 && flag != 5) {
+    uint8_t sr = cpu_sr_pack(&m->cpu);
     if (val == 1) {
-      SET_BIT(cpu.sr, flag);
+      SET_BIT(sr, flag);
     } else {
-      CLEAR_BIT(cpu.sr, flag);
+      CLEAR_BIT(sr, flag);
     }
+    cpu_sr_unpack(&m->cpu, sr);
     return 0;
   } else {
     return 1;
@@ -58,107 +71,115 @@ uint8_t cpu_mod_sr(uint8_t flag, uint8_t val) {
 /**
  * cpu_reset: Reset the CPU to its initial state. Wrapper around reset()
  *
- * @param void
+ * @param m The machine
  * @return void
  * */
-void cpu_reset(void) {
-  reset();
+void cpu_reset(struct machine* m) {
+  reset(m);
   
-  cycles = 8;
+  m->cycles = 8;
 }
 
 /**
  * get_mem: Wrapper to handle memory accessing, due to the pages being separated
+ * @param m The machine
  * @param addr The address we want to access
  * @return The retrieved data
  */
-int8_t get_mem(uint16_t addr) {
+int8_t get_mem(struct machine* m, uint16_t addr) {
   // this yields "warning: comparison is always true due to limited range of
   // data type" if (!(addr >= 0x0000 && addr <= 0xFFFF)) return -1;
   //debug_print("(get_mem) reading at: 0x%X\n", addr);
   
   // no need to check >= 0x0000, it's unsigned
   //if (addr <= 0x00FF) {
-  //      return mem_ptr->zero_page[addr];
+  //      return m->mem.zero_page[addr];
   //    } else if (addr >= 0x0100 && addr <= 0x01FF) {
-  //return mem_ptr->stack[addr - 0x0100];
+  //return m->mem.stack[addr - 0x0100];
   
   //} else if (addr >= 0xFFFA) {
-  //return mem_ptr->last_six[addr - 0xFDFA];
+  //return m->mem.last_six[addr - 0xFDFA];
   //    } else {
   //debug_print("(get_mem) parsed: 0x%X\n", addr - 0x0200);
-  //return mem_ptr->data[addr - 0x0200];
+  //return m->mem.data[addr - 0x0200];
   //      debug_print("(get_mem) parsed: 0x%X\n", addr);
-  return mem_ptr->data[addr];
+  return machine_read(m, addr);
   //    }
 }
 
 /**
  * write_mem: Write bytes to a given address
+ * @param m The machine
  * @param addr The location in memory where to write to
  * @param data The data to be written
  * @return 0 if success, 1 if failure
  */
-static uint8_t write_mem(uint16_t addr, uint8_t data) {
+static uint8_t write_mem(struct machine* m, uint16_t addr, uint8_t data) {
   // this yields "warning: comparison is always true due to limited range of
   // data type" if (!(addr >= 0x0000 && addr <= 0xFFFF)) return 1;
   
   //  if (addr <= 0x00FF) {
-  //    mem_ptr->zero_page[addr] = data;
+  //    m->mem.zero_page[addr] = data;
   //  } else if (addr >= 0x0100 && addr <= 0x01FF) {
-  //    mem_ptr->stack[addr - 0x0100] = data;
+  //    m->mem.stack[addr - 0x0100] = data;
   //} else if (addr >= 0xFFFA) {
-  //    mem_ptr->last_six[addr - 0xFDFA] = data;
+  //    m->mem.last_six[addr - 0xFDFA] = data;
   //  } else {
-  //mem_ptr->data[addr - 0x0200] = data;
-  mem_ptr->data[addr] = data;
+  //m->mem.data[addr - 0x0200] = data;
+  machine_write(m, addr, data);
   //  }
   
   return 0;
 }
 
 /**
- * cpu_fetch: Fetch memory from a given address
- * @param void
- * @return void
+ * cpu_fetch: Fetch memory from a given address. The PC is left untouched,
+ * reading the instruction stream is done with cpu_fetch(m, m->cpu.pc++)
+ * @param m The machine
+ * @param addr The address to be read
+ * @return the read byte
  */
-uint8_t cpu_fetch(uint16_t addr) {
-  debug_print("(cpu_fetch) reading at: 0x%X\n", addr);
-  uint8_t data = get_mem(addr);
-  debug_print("(cpu_fetch) GOT: 0x%X\n", data);
-  if (addr == cpu.pc) cpu.pc++;
-  
-  return data;
+uint8_t cpu_fetch(struct machine* m, uint16_t addr) {
+  return get_mem(m, addr);
 }
 
 /**
  * cpu_write: Wrapper for write_mem()
+ * @param m The machine
  * @param addr The address to be written to
  * @param data The data to be written
  * @return 0 if success, 1 if failure
  */
-uint8_t cpu_write(uint16_t addr, uint8_t data) {
-  return write_mem(addr, data) == 1 ? 1 : 0;
+uint8_t cpu_write(struct machine* m, uint16_t addr, uint8_t data) {
+  return write_mem(m, addr, data) == 1 ? 1 : 0;
 }
 
 /**
- * cpu_exec: Execute fetched data (single stepping)
- * @param void
- * @return void
+ * cpu_exec: Execute fetched data (single stepping). A step fires the
+ * events that are due and executes one instruction, or takes a pending
+ * interrupt, or only burns the cycles left by a reset, and then consumes
+ * all of its clock cycles at once
+ * @param m The machine
+ * @return the amount of clock cycles the step took
  */
-void cpu_exec(void) {
-  debug_print("(cpu_exec) cycles: %d, mem: %p\n", cycles, (void*)mem_ptr);
-  
-  int8_t fetched;
-  do {
-    debug_print("(loop) cycles: %d\n", cycles);
-    // executing in a take
-    if (cycles == 0) {
-      fetched = cpu_fetch(cpu.pc);
-      
-      debug_print("(cpu_exec) fetched: 0x%X\n", fetched);
-      inst_exec(fetched, &cycles);
-    }
-    cycles--;
-  } while (cycles != 0);
+uint32_t cpu_exec(struct machine* m) {
+  if (m->cycles == 0 && m->clock.cycles >= m->sched.next) sched_run(m);
+
+  // executing in a take
+  if (m->cycles == 0 && !interrupt(m)) {
+    uint16_t pc = m->cpu.pc;
+    uint8_t fetched = machine_read(m, pc);
+    
+    TRACE_EMIT(m, TRACE_EXEC, pc, fetched);
+    m->cpu.pc++;
+    inst_exec(m, fetched);
+    m->clock.instructions++;
+    if (m->profile != NULL) profile_count(m->profile, pc, fetched, m->cycles, m->cpu.pc);
+  }
+
+  uint32_t elapsed = m->cycles;
+  m->cycles = 0;
+  m->clock.cycles += elapsed;
+
+  return elapsed;
 }
@@ -21,8 +21,18 @@ struct central_processing_unit {
    * bit 5: 0
    * bit 6: Overflow (V)
    * bit 7: Negative
+   *
+   * Only I, D, B and bit 5 are kept in sr. N, Z, C and V are kept
+   * unpacked, written as plain bytes by the core and only folded back
+   * into a status byte when something needs it (PHP, BRK, the UI),
+   * see cpu_sr_pack() and cpu_sr_unpack().
    * */
   uint8_t sr;
+
+  uint8_t n; // bit 7 is N
+  uint8_t z; // Z is set when this is 0
+  uint8_t c; // 0 or 1
+  uint8_t v; // 0 or 1
 };
 
 #define C 0
@@ -33,15 +43,75 @@ struct central_processing_unit {
 #define V 6
 #define N 7
 
-extern struct central_processing_unit cpu;
+#define CPU_SR_LAZY ((1 << N) | (1 << V) | (1 << Z) | (1 << C))
+
+/**
+ * cpu_sr_pack: Materialize the status register from sr and the unpacked
+ * N, Z, C and V flags
+ * @param cpu The CPU
+ * @return the status register
+ * */
+static inline uint8_t cpu_sr_pack(const struct central_processing_unit* cpu) {
+  return (uint8_t)((cpu->sr & ~CPU_SR_LAZY) | (cpu->n & 0x80) |
+                   ((cpu->v & 1) << V) | ((cpu->z == 0) << Z) |
+                   (cpu->c & 1));
+}
+
+/**
+ * cpu_sr_unpack: Load the status register, splitting N, Z, C and V out of it
+ * @param cpu The CPU
+ * @param val The new status register
+ * @return void
+ * */
+static inline void cpu_sr_unpack(struct central_processing_unit* cpu,
+                                 uint8_t val) {
+  cpu->sr = val & ~CPU_SR_LAZY;
+  cpu->n = val;
+  cpu->z = ((val >> Z) & 1) ^ 1;
+  cpu->c = (val >> C) & 1;
+  cpu->v = (val >> V) & 1;
+}
+
+struct machine;
+
+// why cpu_run() returned
+enum cpu_stop {
+  CPU_STOP_BUDGET,
+  CPU_STOP_PC,
+  CPU_STOP_BRK,
+  CPU_STOP_SELF_JUMP,
+  CPU_STOP_BREAK, // breakpoint, see src/machine/debug.h
+  CPU_STOP_WATCH, // watchpoint
+  CPU_STOP_IDLE   // idle loop, see cpu_run()
+};
+
+struct cpu_limits {
+  // 0 means no limit
+  uint64_t max_cycles;
+  uint64_t max_instructions;
+
+  // stop conditions
+  uint8_t stop_on_pc;
+  uint16_t stop_pc;
+  uint8_t stop_on_brk;
+  uint8_t stop_on_self_jump;
+  uint8_t stop_on_idle;
+};
+
+struct cpu_counters {
+  uint64_t instructions;
+  uint64_t cycles;
+};
 
-void cpu_reset(void);
-uint8_t cpu_extract_sr(uint8_t flag);
-uint8_t cpu_mod_sr(uint8_t flag, uint8_t val);
-uint8_t cpu_fetch(uint16_t addr);
-uint8_t cpu_write(uint16_t addr, uint8_t data);
-void cpu_exec(void);
-void cpu_init(void);
-int8_t get_mem(uint16_t addr);
+void cpu_reset(struct machine* m);
+uint8_t cpu_extract_sr(struct machine* m, uint8_t flag);
+uint8_t cpu_mod_sr(struct machine* m, uint8_t flag, uint8_t val);
+uint8_t cpu_fetch(struct machine* m, uint16_t addr);
+uint8_t cpu_write(struct machine* m, uint16_t addr, uint8_t data);
+uint32_t cpu_exec(struct machine* m);
+enum cpu_stop cpu_run(struct machine* m, const struct cpu_limits* limits,
+                      struct cpu_counters* counters);
+void cpu_init(struct machine* m);
+int8_t get_mem(struct machine* m, uint16_t addr);
 
 #endif
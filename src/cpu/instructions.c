@@ -1,8 +1,7 @@
 /*
  * NOTE: this is meant to be an extension of cpu.c, in fact these two files
- * share the same cpu struct.
+ * share the same machine struct.
  *
- * TODO: check for errors on cpu_fetch()
  * TODO: add missing comments
  */
 
@@ -13,8 +12,15 @@
 #include <stdio.h>
 
 #include "../utils/misc.h"
+#include "../utils/trace.h"
 #include "cpu.h"
+#include "opcodes.h"
 
+#include "../jit/jit.h"
+#include "../machine/debug.h"
+#include "../machine/machine.h"
+#include "../machine/profile.h"
+#include "../machine/sched.h"
 #include "../mem/mem.h"
 
 /*
@@ -23,18 +29,31 @@
  * =============================================
  */
 
-static uint8_t IMP(void);
-static uint8_t IMM(void);
-static uint8_t ZP0(void);
-static uint8_t ZPX(void);
-static uint8_t ZPY(void);
-static uint8_t ABS(void);
-static uint8_t ABX(void);
-static uint8_t ABY(void);
-static uint8_t IND(void);
-static uint8_t IZX(void);
-static uint8_t IZY(void);
-static uint8_t REL(void);
+CORE_INLINE uint8_t IMP(struct machine* m);
+CORE_INLINE uint8_t IMM(struct machine* m);
+CORE_INLINE uint8_t ZP0(struct machine* m);
+CORE_INLINE uint8_t ZPX(struct machine* m);
+CORE_INLINE uint8_t ZPY(struct machine* m);
+CORE_INLINE uint8_t ABS(struct machine* m);
+CORE_INLINE uint8_t ABX(struct machine* m);
+CORE_INLINE uint8_t ABY(struct machine* m);
+CORE_INLINE uint8_t IND(struct machine* m);
+CORE_INLINE uint8_t IZX(struct machine* m);
+CORE_INLINE uint8_t IZY(struct machine* m);
+CORE_INLINE uint8_t REL(struct machine* m);
+
+CORE_INLINE uint8_t IMP_PRE(struct machine* m, uint16_t operand);
+CORE_INLINE uint8_t IMM_PRE(struct machine* m, uint16_t operand);
+CORE_INLINE uint8_t ZP0_PRE(struct machine* m, uint16_t operand);
+CORE_INLINE uint8_t ZPX_PRE(struct machine* m, uint16_t operand);
+CORE_INLINE uint8_t ZPY_PRE(struct machine* m, uint16_t operand);
+CORE_INLINE uint8_t ABS_PRE(struct machine* m, uint16_t operand);
+CORE_INLINE uint8_t ABX_PRE(struct machine* m, uint16_t operand);
+CORE_INLINE uint8_t ABY_PRE(struct machine* m, uint16_t operand);
+CORE_INLINE uint8_t IND_PRE(struct machine* m, uint16_t operand);
+CORE_INLINE uint8_t IZX_PRE(struct machine* m, uint16_t operand);
+CORE_INLINE uint8_t IZY_PRE(struct machine* m, uint16_t operand);
+CORE_INLINE uint8_t REL_PRE(struct machine* m, uint16_t operand);
 
 /*
  * =============================================
@@ -42,166 +61,80 @@ static uint8_t REL(void);
  * =============================================
  */
 
-static uint8_t XXX(void);
-static uint8_t LDA(void);
-static uint8_t LDX(void);
-static uint8_t LDY(void);
-static uint8_t BRK(void);
-static uint8_t BPL(void);
-static uint8_t JSR(void);
-static uint8_t BMI(void);
-static uint8_t RTI(void);
-static uint8_t BVC(void);
-static uint8_t RTS(void);
-static uint8_t BVS(void);
-static uint8_t NOP(void);
-static uint8_t BCC(void);
-static uint8_t BCS(void);
-static uint8_t BNE(void);
-static uint8_t CPX(void);
-static uint8_t CPY(void);
-static uint8_t BEQ(void);
-static uint8_t ORA(void);
-static uint8_t AND(void);
-static uint8_t EOR(void);
-static uint8_t BIT(void);
-static uint8_t ADC(void);
-static uint8_t STA(void);
-static uint8_t STX(void);
-static uint8_t STY(void);
-static uint8_t CMP(void);
-static uint8_t SBC(void);
-static uint8_t ASL(void);
-static uint8_t ROL(void);
-static uint8_t LSR(void);
-static uint8_t ROR(void);
-static uint8_t DEC(void);
-static uint8_t DEX(void);
-static uint8_t DEY(void);
-static uint8_t INC(void);
-static uint8_t INX(void);
-static uint8_t INY(void);
-static uint8_t PHP(void);
-static uint8_t SEC(void);
-static uint8_t CLC(void);
-static uint8_t CLI(void);
-static uint8_t PLP(void);
-static uint8_t PLA(void);
-static uint8_t PHA(void);
-static uint8_t SEI(void);
-static uint8_t TYA(void);
-static uint8_t CLV(void);
-static uint8_t CLD(void);
-static uint8_t SED(void);
-static uint8_t TXA(void);
-static uint8_t TXS(void);
-static uint8_t TAX(void);
-static uint8_t TAY(void);
-static uint8_t TSX(void);
-static uint8_t JMP(void);
-
-// the populated matrix of opcodes, not a clean solution but it's easily
-// understandable
-struct instruction lookup[256] = {
-  {"BRK", &BRK, &IMM, 7}, {"ORA", &ORA, &IZX, 6}, {"???", &XXX, &IMP, 2},
-  {"???", &XXX, &IMP, 8}, {"???", &NOP, &IMP, 3}, {"ORA", &ORA, &ZP0, 3},
-  {"ASL", &ASL, &ZP0, 5}, {"???", &XXX, &IMP, 5}, {"PHP", &PHP, &IMP, 3},
-  {"ORA", &ORA, &IMM, 2}, {"ASL", &ASL, &IMP, 2}, {"???", &XXX, &IMP, 2},
-  {"???", &NOP, &IMP, 4}, {"ORA", &ORA, &ABS, 4}, {"ASL", &ASL, &ABS, 6},
-  {"???", &XXX, &IMP, 6}, {"BPL", &BPL, &REL, 2}, {"ORA", &ORA, &IZY, 5},
-  {"???", &XXX, &IMP, 2}, {"???", &XXX, &IMP, 8}, {"???", &NOP, &IMP, 4},
-  {"ORA", &ORA, &ZPX, 4}, {"ASL", &ASL, &ZPX, 6}, {"???", &XXX, &IMP, 6},
-  {"CLC", &CLC, &IMP, 2}, {"ORA", &ORA, &ABY, 4}, {"???", &NOP, &IMP, 2},
-  {"???", &XXX, &IMP, 7}, {"???", &NOP, &IMP, 4}, {"ORA", &ORA, &ABX, 4},
-  {"ASL", &ASL, &ABX, 7}, {"???", &XXX, &IMP, 7}, {"JSR", &JSR, &ABS, 6},
-  {"AND", &AND, &IZX, 6}, {"???", &XXX, &IMP, 2}, {"???", &XXX, &IMP, 8},
-  {"BIT", &BIT, &ZP0, 3}, {"AND", &AND, &ZP0, 3}, {"ROL", &ROL, &ZP0, 5},
-  {"???", &XXX, &IMP, 5}, {"PLP", &PLP, &IMP, 4}, {"AND", &AND, &IMM, 2},
-  {"ROL", &ROL, &IMP, 2}, {"???", &XXX, &IMP, 2}, {"BIT", &BIT, &ABS, 4},
-  {"AND", &AND, &ABS, 4}, {"ROL", &ROL, &ABS, 6}, {"???", &XXX, &IMP, 6},
-  {"BMI", &BMI, &REL, 2}, {"AND", &AND, &IZY, 5}, {"???", &XXX, &IMP, 2},
-  {"???", &XXX, &IMP, 8}, {"???", &NOP, &IMP, 4}, {"AND", &AND, &ZPX, 4},
-  {"ROL", &ROL, &ZPX, 6}, {"???", &XXX, &IMP, 6}, {"SEC", &SEC, &IMP, 2},
-  {"AND", &AND, &ABY, 4}, {"???", &NOP, &IMP, 2}, {"???", &XXX, &IMP, 7},
-  {"???", &NOP, &IMP, 4}, {"AND", &AND, &ABX, 4}, {"ROL", &ROL, &ABX, 7},
-  {"???", &XXX, &IMP, 7}, {"RTI", &RTI, &IMP, 6}, {"EOR", &EOR, &IZX, 6},
-  {"???", &XXX, &IMP, 2}, {"???", &XXX, &IMP, 8}, {"???", &NOP, &IMP, 3},
-  {"EOR", &EOR, &ZP0, 3}, {"LSR", &LSR, &ZP0, 5}, {"???", &XXX, &IMP, 5},
-  {"PHA", &PHA, &IMP, 3}, {"EOR", &EOR, &IMM, 2}, {"LSR", &LSR, &IMP, 2},
-  {"???", &XXX, &IMP, 2}, {"JMP", &JMP, &ABS, 3}, {"EOR", &EOR, &ABS, 4},
-  {"LSR", &LSR, &ABS, 6}, {"???", &XXX, &IMP, 6}, {"BVC", &BVC, &REL, 2},
-  {"EOR", &EOR, &IZY, 5}, {"???", &XXX, &IMP, 2}, {"???", &XXX, &IMP, 8},
-  {"???", &NOP, &IMP, 4}, {"EOR", &EOR, &ZPX, 4}, {"LSR", &LSR, &ZPX, 6},
-  {"???", &XXX, &IMP, 6}, {"CLI", &CLI, &IMP, 2}, {"EOR", &EOR, &ABY, 4},
-  {"???", &NOP, &IMP, 2}, {"???", &XXX, &IMP, 7}, {"???", &NOP, &IMP, 4},
-  {"EOR", &EOR, &ABX, 4}, {"LSR", &LSR, &ABX, 7}, {"???", &XXX, &IMP, 7},
-  {"RTS", &RTS, &IMP, 6}, {"ADC", &ADC, &IZX, 6}, {"???", &XXX, &IMP, 2},
-  {"???", &XXX, &IMP, 8}, {"???", &NOP, &IMP, 3}, {"ADC", &ADC, &ZP0, 3},
-  {"ROR", &ROR, &ZP0, 5}, {"???", &XXX, &IMP, 5}, {"PLA", &PLA, &IMP, 4},
-  {"ADC", &ADC, &IMM, 2}, {"ROR", &ROR, &IMP, 2}, {"???", &XXX, &IMP, 2},
-  {"JMP", &JMP, &IND, 5}, {"ADC", &ADC, &ABS, 4}, {"ROR", &ROR, &ABS, 6},
-  {"???", &XXX, &IMP, 6}, {"BVS", &BVS, &REL, 2}, {"ADC", &ADC, &IZY, 5},
-  {"???", &XXX, &IMP, 2}, {"???", &XXX, &IMP, 8}, {"???", &NOP, &IMP, 4},
-  {"ADC", &ADC, &ZPX, 4}, {"ROR", &ROR, &ZPX, 6}, {"???", &XXX, &IMP, 6},
-  {"SEI", &SEI, &IMP, 2}, {"ADC", &ADC, &ABY, 4}, {"???", &NOP, &IMP, 2},
-  {"???", &XXX, &IMP, 7}, {"???", &NOP, &IMP, 4}, {"ADC", &ADC, &ABX, 4},
-  {"ROR", &ROR, &ABX, 7}, {"???", &XXX, &IMP, 7}, {"???", &NOP, &IMP, 2},
-  {"STA", &STA, &IZX, 6}, {"???", &NOP, &IMP, 2}, {"???", &XXX, &IMP, 6},
-  {"STY", &STY, &ZP0, 3}, {"STA", &STA, &ZP0, 3}, {"STX", &STX, &ZP0, 3},
-  {"???", &XXX, &IMP, 3}, {"DEY", &DEY, &IMP, 2}, {"???", &NOP, &IMP, 2},
-  {"TXA", &TXA, &IMP, 2}, {"???", &XXX, &IMP, 2}, {"STY", &STY, &ABS, 4},
-  {"STA", &STA, &ABS, 4}, {"STX", &STX, &ABS, 4}, {"???", &XXX, &IMP, 4},
-  {"BCC", &BCC, &REL, 2}, {"STA", &STA, &IZY, 6}, {"???", &XXX, &IMP, 2},
-  {"???", &XXX, &IMP, 6}, {"STY", &STY, &ZPX, 4}, {"STA", &STA, &ZPX, 4},
-  {"STX", &STX, &ZPY, 4}, {"???", &XXX, &IMP, 4}, {"TYA", &TYA, &IMP, 2},
-  {"STA", &STA, &ABY, 5}, {"TXS", &TXS, &IMP, 2}, {"???", &XXX, &IMP, 5},
-  {"???", &NOP, &IMP, 5}, {"STA", &STA, &ABX, 5}, {"???", &XXX, &IMP, 5},
-  {"???", &XXX, &IMP, 5}, {"LDY", &LDY, &IMM, 2}, {"LDA", &LDA, &IZX, 6},
-  {"LDX", &LDX, &IMM, 2}, {"???", &XXX, &IMP, 6}, {"LDY", &LDY, &ZP0, 3},
-  {"LDA", &LDA, &ZP0, 3}, {"LDX", &LDX, &ZP0, 3}, {"???", &XXX, &IMP, 3},
-  {"TAY", &TAY, &IMP, 2}, {"LDA", &LDA, &IMM, 2}, {"TAX", &TAX, &IMP, 2},
-  {"???", &XXX, &IMP, 2}, {"LDY", &LDY, &ABS, 4}, {"LDA", &LDA, &ABS, 4},
-  {"LDX", &LDX, &ABS, 4}, {"???", &XXX, &IMP, 4}, {"BCS", &BCS, &REL, 2},
-  {"LDA", &LDA, &IZY, 5}, {"???", &XXX, &IMP, 2}, {"???", &XXX, &IMP, 5},
-  {"LDY", &LDY, &ZPX, 4}, {"LDA", &LDA, &ZPX, 4}, {"LDX", &LDX, &ZPY, 4},
-  {"???", &XXX, &IMP, 4}, {"CLV", &CLV, &IMP, 2}, {"LDA", &LDA, &ABY, 4},
-  {"TSX", &TSX, &IMP, 2}, {"???", &XXX, &IMP, 4}, {"LDY", &LDY, &ABX, 4},
-  {"LDA", &LDA, &ABX, 4}, {"LDX", &LDX, &ABY, 4}, {"???", &XXX, &IMP, 4},
-  {"CPY", &CPY, &IMM, 2}, {"CMP", &CMP, &IZX, 6}, {"???", &NOP, &IMP, 2},
-  {"???", &XXX, &IMP, 8}, {"CPY", &CPY, &ZP0, 3}, {"CMP", &CMP, &ZP0, 3},
-  {"DEC", &DEC, &ZP0, 5}, {"???", &XXX, &IMP, 5}, {"INY", &INY, &IMP, 2},
-  {"CMP", &CMP, &IMM, 2}, {"DEX", &DEX, &IMP, 2}, {"???", &XXX, &IMP, 2},
-  {"CPY", &CPY, &ABS, 4}, {"CMP", &CMP, &ABS, 4}, {"DEC", &DEC, &ABS, 6},
-  {"???", &XXX, &IMP, 6}, {"BNE", &BNE, &REL, 2}, {"CMP", &CMP, &IZY, 5},
-  {"???", &XXX, &IMP, 2}, {"???", &XXX, &IMP, 8}, {"???", &NOP, &IMP, 4},
-  {"CMP", &CMP, &ZPX, 4}, {"DEC", &DEC, &ZPX, 6}, {"???", &XXX, &IMP, 6},
-  {"CLD", &CLD, &IMP, 2}, {"CMP", &CMP, &ABY, 4}, {"NOP", &NOP, &IMP, 2},
-  {"???", &XXX, &IMP, 7}, {"???", &NOP, &IMP, 4}, {"CMP", &CMP, &ABX, 4},
-  {"DEC", &DEC, &ABX, 7}, {"???", &XXX, &IMP, 7}, {"CPX", &CPX, &IMM, 2},
-  {"SBC", &SBC, &IZX, 6}, {"???", &NOP, &IMP, 2}, {"???", &XXX, &IMP, 8},
-  {"CPX", &CPX, &ZP0, 3}, {"SBC", &SBC, &ZP0, 3}, {"INC", &INC, &ZP0, 5},
-  {"???", &XXX, &IMP, 5}, {"INX", &INX, &IMP, 2}, {"SBC", &SBC, &IMM, 2},
-  {"NOP", &NOP, &IMP, 2}, {"???", &SBC, &IMP, 2}, {"CPX", &CPX, &ABS, 4},
-  {"SBC", &SBC, &ABS, 4}, {"INC", &INC, &ABS, 6}, {"???", &XXX, &IMP, 6},
-  {"BEQ", &BEQ, &REL, 2}, {"SBC", &SBC, &IZY, 5}, {"???", &XXX, &IMP, 2},
-  {"???", &XXX, &IMP, 8}, {"???", &NOP, &IMP, 4}, {"SBC", &SBC, &ZPX, 4},
-  {"INC", &INC, &ZPX, 6}, {"???", &XXX, &IMP, 6}, {"SED", &SED, &IMP, 2},
-  {"SBC", &SBC, &ABY, 4}, {"NOP", &NOP, &IMP, 2}, {"???", &XXX, &IMP, 7},
-  {"???", &NOP, &IMP, 4}, {"SBC", &SBC, &ABX, 4}, {"INC", &INC, &ABX, 7},
-  {"???", &XXX, &IMP, 7},
+CORE_INLINE uint8_t XXX(struct machine* m);
+CORE_INLINE uint8_t LDA(struct machine* m);
+CORE_INLINE uint8_t LDX(struct machine* m);
+CORE_INLINE uint8_t LDY(struct machine* m);
+CORE_INLINE uint8_t BRK(struct machine* m);
+CORE_INLINE uint8_t BPL(struct machine* m);
+CORE_INLINE uint8_t JSR(struct machine* m);
+CORE_INLINE uint8_t BMI(struct machine* m);
+CORE_INLINE uint8_t RTI(struct machine* m);
+CORE_INLINE uint8_t BVC(struct machine* m);
+CORE_INLINE uint8_t RTS(struct machine* m);
+CORE_INLINE uint8_t BVS(struct machine* m);
+CORE_INLINE uint8_t NOP(struct machine* m);
+CORE_INLINE uint8_t BCC(struct machine* m);
+CORE_INLINE uint8_t BCS(struct machine* m);
+CORE_INLINE uint8_t BNE(struct machine* m);
+CORE_INLINE uint8_t CPX(struct machine* m);
+CORE_INLINE uint8_t CPY(struct machine* m);
+CORE_INLINE uint8_t BEQ(struct machine* m);
+CORE_INLINE uint8_t ORA(struct machine* m);
+CORE_INLINE uint8_t AND(struct machine* m);
+CORE_INLINE uint8_t EOR(struct machine* m);
+CORE_INLINE uint8_t BIT(struct machine* m);
+CORE_INLINE uint8_t ADC(struct machine* m);
+CORE_INLINE uint8_t STA(struct machine* m);
+CORE_INLINE uint8_t STX(struct machine* m);
+CORE_INLINE uint8_t STY(struct machine* m);
+CORE_INLINE uint8_t CMP(struct machine* m);
+CORE_INLINE uint8_t SBC(struct machine* m);
+CORE_INLINE uint8_t ASL(struct machine* m);
+CORE_INLINE uint8_t ROL(struct machine* m);
+CORE_INLINE uint8_t LSR(struct machine* m);
+CORE_INLINE uint8_t ROR(struct machine* m);
+CORE_INLINE uint8_t DEC(struct machine* m);
+CORE_INLINE uint8_t DEX(struct machine* m);
+CORE_INLINE uint8_t DEY(struct machine* m);
+CORE_INLINE uint8_t INC(struct machine* m);
+CORE_INLINE uint8_t INX(struct machine* m);
+CORE_INLINE uint8_t INY(struct machine* m);
+CORE_INLINE uint8_t PHP(struct machine* m);
+CORE_INLINE uint8_t SEC(struct machine* m);
+CORE_INLINE uint8_t CLC(struct machine* m);
+CORE_INLINE uint8_t CLI(struct machine* m);
+CORE_INLINE uint8_t PLP(struct machine* m);
+CORE_INLINE uint8_t PLA(struct machine* m);
+CORE_INLINE uint8_t PHA(struct machine* m);
+CORE_INLINE uint8_t SEI(struct machine* m);
+CORE_INLINE uint8_t TYA(struct machine* m);
+CORE_INLINE uint8_t CLV(struct machine* m);
+CORE_INLINE uint8_t CLD(struct machine* m);
+CORE_INLINE uint8_t SED(struct machine* m);
+CORE_INLINE uint8_t TXA(struct machine* m);
+CORE_INLINE uint8_t TXS(struct machine* m);
+CORE_INLINE uint8_t TAX(struct machine* m);
+CORE_INLINE uint8_t TAY(struct machine* m);
+CORE_INLINE uint8_t TSX(struct machine* m);
+CORE_INLINE uint8_t JMP(struct machine* m);
+
+// the populated matrix of opcodes, generated from the OPCODES list in
+// opcodes.h so that it's still easily understandable
+#define X(code, name, operation, mode, cyc) {name, &operation, &mode, cyc},
+const struct instruction lookup[256] = {
+  OPCODES(X)
 };
+#undef X
 
-// absolute address in memory
-uint16_t addr_abs = 0x0000;
-
-// relative address in memory
-uint16_t addr_rel = 0x0000;
-
-uint8_t op = 0x00;
-uint32_t* cys = 0x000000;
-
-// a pointer to the fetched opcode in the cpu module
-uint8_t fetched = 0x00;
+#ifndef FUSED_CORE
+// the predecoded modes, in the same order, for blocks of the readable core
+#define X(code, name, operation, mode, cyc) &mode##_PRE,
+static uint8_t (*const lookup_pre[256])(struct machine*, uint16_t) = {
+  OPCODES(X)
+};
+#undef X
+#endif
 
 /*
  * =============================================
@@ -210,74 +143,142 @@ uint8_t fetched = 0x00;
  */
 
 /**
- * fetch: wrapper around cpu_fetch
- * @param void
+ * fetch_pc: reads the byte the PC points to and steps the PC past it
+ * @param m The machine
+ * @return the read byte
+ * */
+CORE_INLINE uint8_t fetch_pc(struct machine* m) {
+  return machine_read(m, m->cpu.pc++);
+}
+
+/**
+ * fetch: reads the operand at the address computed by the addressing mode.
+ * Shifts and rotates can work on the accumulator, they must check
+ * accumulator_mode() before calling this.
+ * @param m The machine
  * @return void
  * */
-static void fetch(void) {
-  if (lookup[op].mode != &IMP) fetched = cpu_fetch(addr_abs);
+CORE_INLINE void fetch(struct machine* m) {
+  m->fetched = machine_read(m, m->addr_abs);
+}
+
+/**
+ * accumulator_mode: whether a shift or a rotate works on the accumulator
+ * (IMP, fetched already holds cpu.ac) rather than on memory
+ * @param m The machine
+ * @return true if the instruction works on the accumulator
+ * */
+CORE_INLINE bool accumulator_mode(struct machine* m) {
+  return lookup[m->op].mode == &IMP;
 }
 
 /**
  * branch: executes a branch to defined, see:
  * https://en.wikipedia.org/wiki/Branch_(computer_science)
  *
- * @param void
+ * @param m The machine
  * @return void
  * */
-static void branch(void) {
-  (*cys)++;
-  addr_abs = cpu.pc + addr_rel;
+CORE_INLINE void branch(struct machine* m) {
+  m->cycles++;
+  m->addr_abs = m->cpu.pc + m->addr_rel;
   
-  if ((addr_abs & 0xFF00) != (cpu.pc & 0xFF00)) {
-    (*cys)++;
+  if ((m->addr_abs & 0xFF00) != (m->cpu.pc & 0xFF00)) {
+    m->cycles++;
   }
   
-  cpu.pc = addr_abs;
-  debug_print("(branch) now we are at 0x%X\n", cpu.pc);
+  m->cpu.pc = m->addr_abs;
+  TRACE_EMIT(m, TRACE_BRANCH, m->cpu.pc, 0);
 }
 
 /**
  * set_flag: sets or unsets corresponding bit in SR depending on the passed
- * expression
+ * expression. Only for I, D and B, the other flags are kept unpacked
+ * @param m The machine
  * @param flag the bit you want to set in the SR
  * @param exp boolean that determines the bit status
  * @return void
  * */
-static void set_flag(uint8_t flag, bool exp) {
+CORE_INLINE void set_flag(struct machine* m, uint8_t flag, bool exp) {
   if (exp) {
-    cpu_mod_sr(flag, 1);
+    SET_BIT(m->cpu.sr, flag);
   } else {
-    cpu_mod_sr(flag, 0);
+    CLEAR_BIT(m->cpu.sr, flag);
   }
 }
 
+/**
+ * set_nz: sets N and Z from a result byte. Both are kept unpacked, so this
+ * is two plain stores instead of two compare-and-mask sequences
+ * @param m The machine
+ * @param result the byte N and Z are derived from
+ * @return void
+ * */
+CORE_INLINE void set_nz(struct machine* m, uint8_t result) {
+  m->cpu.n = result;
+  m->cpu.z = result;
+}
+
 /**
  * reset: actual reset process, must use the cpu_reset wrapper
- * @param void
+ * @param m The machine
  * @return void
  * */
-void reset(void) {
+void reset(struct machine* m) {
   
-  //addr_abs = 0x8000;
-  //cpu.pc = addr_abs;
+  //m->addr_abs = 0x8000;
+  //m->cpu.pc = m->addr_abs;
 
-  uint8_t low = get_mem(0xFFFC);
-  uint8_t high = get_mem(0xFFFD);
+  uint8_t low = machine_read(m, 0xFFFC);
+  uint8_t high = machine_read(m, 0xFFFD);
     
-  cpu.pc = ( high << 8 | low );
+  m->cpu.pc = ( high << 8 | low );
   
-  debug_print("(reset) PC: 0x%X\n", cpu.pc);
+  TRACE_EMIT(m, TRACE_RESET, m->cpu.pc, 0);
   
-  cpu.ac = 0;
-  cpu.x = 0;
-  cpu.y = 0;
-  cpu.sp = 0xFF;
-  cpu.sr = 0x00;
+  m->cpu.ac = 0;
+  m->cpu.x = 0;
+  m->cpu.y = 0;
+  m->cpu.sp = 0xFF;
+  cpu_sr_unpack(&m->cpu, 0x00);
   
-  addr_rel = 0x0000;
-  addr_abs = 0x0000;
-  fetched = 0x00;
+  m->addr_rel = 0x0000;
+  m->addr_abs = 0x0000;
+  m->fetched = 0x00;
+}
+
+/**
+ * interrupt: Take a pending NMI, or the IRQ if the I flag lets it through,
+ * in between two instructions: push the PC and the status register with B
+ * clear, set I and jump through the vector, 0xFFFA for an NMI and 0xFFFE
+ * for an IRQ. See machine_irq() and machine_nmi()
+ * @param m The machine, its cycles are set to the 7 the sequence takes
+ * @return 1 if an interrupt was taken, 0 if none is pending
+ * */
+uint8_t interrupt(struct machine* m) {
+  uint8_t nmi = m->nmi;
+  uint16_t vector = nmi ? 0xFFFA : 0xFFFE;
+  uint16_t from = m->cpu.pc;
+
+  if (!nmi && (m->irq == 0 || (m->cpu.sr & (1 << I)))) return 0;
+
+  m->nmi = 0;
+
+  machine_write(m, 0x0100 + m->cpu.sp, (from >> 8) & 0x00FF);
+  m->cpu.sp--;
+  machine_write(m, 0x0100 + m->cpu.sp, from & 0x00FF);
+  m->cpu.sp--;
+  machine_write(m, 0x0100 + m->cpu.sp, cpu_sr_pack(&m->cpu) & ~(1 << B));
+  m->cpu.sp--;
+
+  set_flag(m, I, true);
+  m->cpu.pc = (uint16_t)machine_read(m, vector) | ((uint16_t)machine_read(m, vector + 1) << 8);
+  m->cycles = 7;
+
+  TRACE_EMIT(m, TRACE_IRQ, m->cpu.pc, nmi);
+  if (m->profile != NULL) profile_enter(m->profile, m->cpu.pc, from);
+
+  return 1;
 }
 
 /*
@@ -291,22 +292,22 @@ void reset(void) {
 /**
  * IMP: Implicit mode. This is used in instructions such as CLC.
  *      we target the accumulator for instructions like PHA
- * @param void
+ * @param m The machine
  * @return 0
  */
-static uint8_t IMP(void) {
-  fetched = cpu.ac;
+CORE_INLINE uint8_t IMP(struct machine* m) {
+  m->fetched = m->cpu.ac;
   return 0;
 }
 
 /**
  * IMM: Immediate Mode. Allow the programmer to directly specify an 8-bit
  * constant within the instruction. LDA #10 --> load 10 into the accumulator
- * @param void
+ * @param m The machine
  * @return 0
  */
-static uint8_t IMM(void) {
-  addr_abs = cpu.pc++;
+CORE_INLINE uint8_t IMM(struct machine* m) {
+  m->addr_abs = m->cpu.pc++;
   return 0;
 }
 
@@ -316,96 +317,228 @@ static uint8_t IMM(void) {
  * bytes of memory (e.g. $0000 to $00FF) where the most significant byte of the
  * address is always zero
  *      --> 0xFF55 can be seen as: FF = Page, 55 = Offset in that page
- * @param void
+ * @param m The machine
  * @return 0
  */
-static uint8_t ZP0(void) {
-  addr_abs = (cpu_fetch(cpu.pc) & 0x00FF);
-  return 0;
+CORE_INLINE uint8_t ZP0(struct machine* m) {
+  return ZP0_PRE(m, fetch_pc(m));
 }
 
 /**
- * ZPX: Same mode as ZP0 but this time we add cpu.x to the final address
- * @param void
+ * ZPX: Same mode as ZP0 but this time we add m->cpu.x to the final address
+ * @param m The machine
  * @return 0
  */
-static uint8_t ZPX(void) {
-  addr_abs = ((cpu_fetch(cpu.pc) + cpu.x) & 0x00FF);
-  return 0;
+CORE_INLINE uint8_t ZPX(struct machine* m) {
+  return ZPX_PRE(m, fetch_pc(m));
 }
 
 /**
- * ZPY: Same mode as ZPX but with the cpu.y register instead of x.
- * @param void
+ * ZPY: Same mode as ZPX but with the m->cpu.y register instead of x.
+ * @param m The machine
  * @return 0
  */
-static uint8_t ZPY(void) {
-  addr_abs = ((cpu_fetch(cpu.pc) + cpu.y) & 0x00FF);
-  return 0;
+CORE_INLINE uint8_t ZPY(struct machine* m) {
+  return ZPY_PRE(m, fetch_pc(m));
 }
 
 /**
  * ABS: Absolute mode. Instructions using this mode contain a full 16 bit
  * address to identify the target location
- * @param void
+ * @param m The machine
  * @return
  */
-static uint8_t ABS(void) {
-  uint16_t low = cpu_fetch(cpu.pc);
-  uint16_t high = cpu_fetch(cpu.pc);
+CORE_INLINE uint8_t ABS(struct machine* m) {
+  uint16_t low = fetch_pc(m);
+  uint16_t high = fetch_pc(m);
 
   // combine them to form a 16 bit address word
-  addr_abs = (high << 8) | low;
-  return 0;
+  return ABS_PRE(m, (high << 8) | low);
 }
 
 /**
- * ABX: Same mode as ABS but this time we add cpu.x to the final address.
- * @param void
+ * ABX: Same mode as ABS but this time we add m->cpu.x to the final address.
+ * @param m The machine
  * @return 1 if an extra cycles is requires due to page change, 0 if not
  */
-static uint8_t ABX(void) {
-  uint16_t low = cpu_fetch(cpu.pc);
-  uint16_t high = cpu_fetch(cpu.pc);
+CORE_INLINE uint8_t ABX(struct machine* m) {
+  uint16_t low = fetch_pc(m);
+  uint16_t high = fetch_pc(m);
   
-  // combine them to form a 16 bit address word and add the offset
-  addr_abs = (high << 8) | low;
-  addr_abs += cpu.x;
-  
-  // if the high bytes are different, we have changed page (due to overflow
-  // from low to high)
-  return ((addr_abs & 0xFF00) != (high << 8)) ? 1 : 0;
+  return ABX_PRE(m, (high << 8) | low);
 }
 
 /**
- * ABY: Same mode as ABX but involving the cpu.y register instead of x
- * @param void
+ * ABY: Same mode as ABX but involving the m->cpu.y register instead of x
+ * @param m The machine
  * @return void
  */
-static uint8_t ABY(void) {
-  uint16_t low = cpu_fetch(cpu.pc);
-  uint16_t high = cpu_fetch(cpu.pc);
-
-  // combine them to form a 16 bit address word and add the offset
-  addr_abs = (high << 8) | low;
-  addr_abs += cpu.y;
+CORE_INLINE uint8_t ABY(struct machine* m) {
+  uint16_t low = fetch_pc(m);
+  uint16_t high = fetch_pc(m);
 
-  // if the high bytes are different, we have changed page (due to overflow
-  // from low to high)
-  return ((addr_abs & 0xFF00) != (high << 8)) ? 1 : 0;
+  return ABY_PRE(m, (high << 8) | low);
 }
 
 /**
  * IND: Indirect mode. 6502 way of implementing pointers.
  *      The only instruction that uses this mode is JMP
- * @param void
+ * @param m The machine
  * @return void
  */
-static uint8_t IND(void) {
-  uint16_t low = cpu_fetch(cpu.pc);
-  uint16_t high = cpu_fetch(cpu.pc);
-  
-  uint16_t ptr = (high << 8) | low;
+CORE_INLINE uint8_t IND(struct machine* m) {
+  uint16_t low = fetch_pc(m);
+  uint16_t high = fetch_pc(m);
+
+  return IND_PRE(m, (high << 8) | low);
+}
+
+/**
+ * IZX: Indirect addressing of the zero page with X offset
+ *      The supplied 8-bit address is offset by X Register to index
+ *      a location in page 0x00. The actual 16-bit address is read
+ *      from this location.
+ * @param m The machine
+ * @return void
+ */
+CORE_INLINE uint8_t IZX(struct machine* m) {
+  // reading an address in the zero page
+  return IZX_PRE(m, fetch_pc(m));
+}
+
+/**
+ * IZY: Indirect addressing of the zero page with Y offset.
+ *      Note that this behaves in a different way from the X variation!
+ * @param m The machine
+ * @return void
+ */
+CORE_INLINE uint8_t IZY(struct machine* m) {
+  return IZY_PRE(m, fetch_pc(m));
+}
+
+/**
+ * REL: Relative addressing mode is used by branch instructions which contain a
+ * signed 8 bit relative offset (-128 to +127) which is added to m->cpu.pc if the
+ * condition is true.
+ * @param m The machine
+ * @return void
+ */
+CORE_INLINE uint8_t REL(struct machine* m) {
+  return REL_PRE(m, fetch_pc(m));
+}
+
+/*
+ * =============================================
+ * PREDECODED MODES
+ * =============================================
+ *
+ * The same modes, for an operand that was already read from the
+ * instruction stream: by the modes above, or ahead of time by the block
+ * cache (see cpu_run()). m->cpu.pc is already past the operand.
+ *
+ * [!] Return 1 if the operation needs an extra clock cycle
+ */
+
+/**
+ * IMP_PRE: IMP, there's no operand
+ * @param m The machine
+ * @param operand Unused
+ * @return 0
+ */
+CORE_INLINE uint8_t IMP_PRE(struct machine* m, uint16_t operand) {
+  (void)operand;
+  return IMP(m);
+}
+
+/**
+ * IMM_PRE: IMM with the address of the constant, the operation reads it
+ * @param m The machine
+ * @param operand The address of the constant
+ * @return 0
+ */
+CORE_INLINE uint8_t IMM_PRE(struct machine* m, uint16_t operand) {
+  m->addr_abs = operand;
+  return 0;
+}
+
+/**
+ * ZP0_PRE: ZP0 with its 8 bit address
+ * @param m The machine
+ * @param operand The address in the zero page
+ * @return 0
+ */
+CORE_INLINE uint8_t ZP0_PRE(struct machine* m, uint16_t operand) {
+  m->addr_abs = (operand & 0x00FF);
+  return 0;
+}
+
+/**
+ * ZPX_PRE: ZPX with its 8 bit address
+ * @param m The machine
+ * @param operand The address in the zero page
+ * @return 0
+ */
+CORE_INLINE uint8_t ZPX_PRE(struct machine* m, uint16_t operand) {
+  m->addr_abs = ((operand + m->cpu.x) & 0x00FF);
+  return 0;
+}
+
+/**
+ * ZPY_PRE: ZPY with its 8 bit address
+ * @param m The machine
+ * @param operand The address in the zero page
+ * @return 0
+ */
+CORE_INLINE uint8_t ZPY_PRE(struct machine* m, uint16_t operand) {
+  m->addr_abs = ((operand + m->cpu.y) & 0x00FF);
+  return 0;
+}
+
+/**
+ * ABS_PRE: ABS with its 16 bit address
+ * @param m The machine
+ * @param operand The address
+ * @return 0
+ */
+CORE_INLINE uint8_t ABS_PRE(struct machine* m, uint16_t operand) {
+  m->addr_abs = operand;
+  return 0;
+}
+
+/**
+ * ABX_PRE: ABX with its 16 bit address
+ * @param m The machine
+ * @param operand The address, before adding m->cpu.x
+ * @return 1 if an extra cycles is requires due to page change, 0 if not
+ */
+CORE_INLINE uint8_t ABX_PRE(struct machine* m, uint16_t operand) {
+  m->addr_abs = operand + m->cpu.x;
+
+  // if the high bytes are different, we have changed page (due to overflow
+  // from low to high)
+  return ((m->addr_abs & 0xFF00) != (operand & 0xFF00)) ? 1 : 0;
+}
+
+/**
+ * ABY_PRE: ABY with its 16 bit address
+ * @param m The machine
+ * @param operand The address, before adding m->cpu.y
+ * @return 1 if an extra cycles is requires due to page change, 0 if not
+ */
+CORE_INLINE uint8_t ABY_PRE(struct machine* m, uint16_t operand) {
+  m->addr_abs = operand + m->cpu.y;
+
+  return ((m->addr_abs & 0xFF00) != (operand & 0xFF00)) ? 1 : 0;
+}
+
+/**
+ * IND_PRE: IND with the address of the pointer
+ * @param m The machine
+ * @param operand The address of the pointer
+ * @return 0
+ */
+CORE_INLINE uint8_t IND_PRE(struct machine* m, uint16_t operand) {
+  uint16_t ptr = operand;
   
   /*
    * If the low byte of the supplied address is 0xFF,
@@ -416,68 +549,64 @@ static uint8_t IND(void) {
    *
    * see: https://www.nesdev.com/6502bugs.txt
    * */
-  if (low == 0x00FF) {
+  if ((ptr & 0x00FF) == 0x00FF) {
     // simulate actual hardware bug!
-    addr_abs = (cpu_fetch(ptr & 0xFF00) << 8) | cpu_fetch(ptr + 0);
+    m->addr_abs = (machine_read(m, ptr & 0xFF00) << 8) | machine_read(m, ptr + 0);
     
   } else {
-    addr_abs = (cpu_fetch(ptr + 1) << 8) | cpu_fetch(ptr + 0);
+    m->addr_abs = (machine_read(m, ptr + 1) << 8) | machine_read(m, ptr + 0);
   }
   
   return 0;
 }
 
 /**
- * IZX: Indirect addressing of the zero page with X offset
- *      The supplied 8-bit address is offset by X Register to index
- *      a location in page 0x00. The actual 16-bit address is read
- *      from this location.
- * @param void
- * @return void
+ * IZX_PRE: IZX with its zero page address
+ * @param m The machine
+ * @param operand The address in the zero page, before adding m->cpu.x
+ * @return 0
  */
-static uint8_t IZX(void) {
-  // reading an address in the zero page
-  uint16_t addr_0p = cpu_fetch(cpu.pc);
+CORE_INLINE uint8_t IZX_PRE(struct machine* m, uint16_t operand) {
+  uint16_t addr_0p = operand & 0x00FF;
 
-  uint16_t low =  cpu_fetch((uint16_t)(addr_0p + (uint16_t)cpu.x) & 0x00FF);
-  uint16_t high = cpu_fetch((uint16_t)(addr_0p + (uint16_t)cpu.x + 1) & 0x00FF);
+  uint16_t low =  machine_read(m, (uint16_t)(addr_0p + (uint16_t)m->cpu.x) & 0x00FF);
+  uint16_t high = machine_read(m, (uint16_t)(addr_0p + (uint16_t)m->cpu.x + 1) & 0x00FF);
   
-  addr_abs = (high << 8) | low;
+  m->addr_abs = (high << 8) | low;
   
   return 0;
 }
 
 /**
- * IZY: Indirect addressing of the zero page with Y offset.
- *      Note that this behaves in a different way from the X variation!
- * @param void
- * @return void
+ * IZY_PRE: IZY with its zero page address
+ * @param m The machine
+ * @param operand The address in the zero page
+ * @return 1 if an extra cycles is requires due to page change, 0 if not
  */
-static uint8_t IZY(void) {
-  uint16_t addr_0p = cpu_fetch(cpu.pc);
+CORE_INLINE uint8_t IZY_PRE(struct machine* m, uint16_t operand) {
+  uint16_t addr_0p = operand & 0x00FF;
   
-  uint16_t low = cpu_fetch(addr_0p & 0x00FF);
-  uint16_t high = cpu_fetch((addr_0p + 1) & 0x00FF);
+  uint16_t low = machine_read(m, addr_0p & 0x00FF);
+  uint16_t high = machine_read(m, (addr_0p + 1) & 0x00FF);
   
-  addr_abs = (high << 8) | low;
-  addr_abs += cpu.y;
+  m->addr_abs = (high << 8) | low;
+  m->addr_abs += m->cpu.y;
   
-  return ((addr_abs & 0xFF00) != (high << 8)) ? 1 : 0;
+  return ((m->addr_abs & 0xFF00) != (high << 8)) ? 1 : 0;
 }
 
 /**
- * REL: Relative addressing mode is used by branch instructions which contain a
- * signed 8 bit relative offset (-128 to +127) which is added to cpu.pc if the
- * condition is true.
- * @param void
- * @return void
+ * REL_PRE: REL with its offset
+ * @param m The machine
+ * @param operand The signed 8 bit offset
+ * @return 0
  */
-static uint8_t REL(void) {
-  addr_rel = cpu_fetch(cpu.pc);
+CORE_INLINE uint8_t REL_PRE(struct machine* m, uint16_t operand) {
+  m->addr_rel = operand & 0x00FF;
 
   // reading a single byte to see if it's signed
-  if (addr_rel & 0x80) {
-    addr_rel |= 0xFF00;
+  if (m->addr_rel & 0x80) {
+    m->addr_rel |= 0xFF00;
   }
 
   return 0;
@@ -491,593 +620,1206 @@ static uint8_t REL(void) {
 
 /**
  * XXX: Used to handle unknown opcodes
- * @param void
+ * @param m The machine
  * @return 0
  */
-static uint8_t XXX(void) { return 0; }
+CORE_INLINE uint8_t XXX(struct machine* m) {
+  (void)m;
+  return 0;
+}
 
 /**
  * LDA: Load Accumulator
- * @param void
+ * @param m The machine
  * @return 1
  */
-static uint8_t LDA(void) {
-  fetch();
-  cpu.ac = fetched;
+CORE_INLINE uint8_t LDA(struct machine* m) {
+  fetch(m);
+  m->cpu.ac = m->fetched;
   
-  set_flag(Z, cpu.ac == 0);
-  set_flag(N, cpu.ac & (1 << 7));
+  set_nz(m, m->cpu.ac);
   
   return 1;
 }
 
 /**
  * LDX: Load X register
- * @param void
+ * @param m The machine
  * @return 1
  */
-static uint8_t LDX(void) {
-  fetch();
-  cpu.x = fetched;
+CORE_INLINE uint8_t LDX(struct machine* m) {
+  fetch(m);
+  m->cpu.x = m->fetched;
   
-  set_flag(Z, cpu.x == 0);
-  set_flag(N, cpu.x & (1 << 7));
+  set_nz(m, m->cpu.x);
   
   return 1;
 }
 
 /**
  * LDY: Load Y register
- * @param void
+ * @param m The machine
  * @return 1
  */
-static uint8_t LDY(void) {
-  fetch();
-  cpu.y = fetched;
+CORE_INLINE uint8_t LDY(struct machine* m) {
+  fetch(m);
+  m->cpu.y = m->fetched;
   
-  set_flag(Z, cpu.y == 0);
-  set_flag(N, cpu.y & (1 << 7));
+  set_nz(m, m->cpu.y);
   
   return 1;
 }
 
-static uint8_t BRK(void) {
-  cpu.pc++;
-  set_flag(I, true);
+CORE_INLINE uint8_t BRK(struct machine* m) {
+  m->cpu.pc++;
+  set_flag(m, I, true);
   
-  cpu_write(0x0100 + cpu.sp, (cpu.pc >> 8) & 0x00FF);
-  cpu.sp--;
-  cpu_write(0x0100 + cpu.sp, cpu.pc & 0x00FF);
-  cpu.sp--;
+  machine_write(m, 0x0100 + m->cpu.sp, (m->cpu.pc >> 8) & 0x00FF);
+  m->cpu.sp--;
+  machine_write(m, 0x0100 + m->cpu.sp, m->cpu.pc & 0x00FF);
+  m->cpu.sp--;
   
-  set_flag(B, true);
-  cpu_write(0x0100 + cpu.sp, cpu.sr);
-  cpu.sp--;
-  set_flag(B, false);
+  machine_write(m, 0x0100 + m->cpu.sp, cpu_sr_pack(&m->cpu) | (1 << B));
+  m->cpu.sp--;
   
-  cpu.pc = (uint16_t)cpu_fetch(0xFFFE) | ((uint16_t)cpu_fetch(0xFFFF) << 8);
+  m->cpu.pc = (uint16_t)machine_read(m, 0xFFFE) | ((uint16_t)machine_read(m, 0xFFFF) << 8);
   return 0;
 }
 
-static uint8_t JSR(void) {
-  cpu.pc--;
+CORE_INLINE uint8_t JSR(struct machine* m) {
+  m->cpu.pc--;
   
-  cpu_write(0x0100 + cpu.sp, (cpu.pc >> 8) & 0x00FF);
-  cpu.sp--;
-  cpu_write(0x0100 + cpu.sp, cpu.pc & 0x00FF);
-  cpu.sp--;
+  machine_write(m, 0x0100 + m->cpu.sp, (m->cpu.pc >> 8) & 0x00FF);
+  m->cpu.sp--;
+  machine_write(m, 0x0100 + m->cpu.sp, m->cpu.pc & 0x00FF);
+  m->cpu.sp--;
   
-  cpu.pc = addr_abs;
+  m->cpu.pc = m->addr_abs;
   
   return 0;
 }
 
-static uint8_t RTI(void) {
-  cpu.sp++;
+CORE_INLINE uint8_t RTI(struct machine* m) {
+  m->cpu.sp++;
   
-  cpu.sr = cpu_fetch(0x0100 + cpu.sp);
-  cpu.sr &= ~B;
-    
-  cpu.sp++;
-  cpu.pc = (uint16_t)cpu_fetch(0x0100 + cpu.sp);
-  cpu.sp++;
-  cpu.pc |= (uint16_t)cpu_fetch(0x0100 + cpu.sp) << 8;
+  cpu_sr_unpack(&m->cpu, machine_read(m, 0x0100 + m->cpu.sp) & ~(1 << B));
+  if (m->irq) sched_poke(&m->sched);
+
+  m->cpu.sp++;
+  m->cpu.pc = (uint16_t)machine_read(m, 0x0100 + m->cpu.sp);
+  m->cpu.sp++;
+  m->cpu.pc |= (uint16_t)machine_read(m, 0x0100 + m->cpu.sp) << 8;
   
   return 0;
 }
 
-static uint8_t RTS(void) {
-  cpu.sp++;
-  cpu.pc = (uint16_t)cpu_fetch(0x0100 + cpu.sp);
-  cpu.sp++;
-  cpu.pc |= (uint16_t)cpu_fetch(0x0100 + cpu.sp) << 8;
-  cpu.pc++;
+CORE_INLINE uint8_t RTS(struct machine* m) {
+  m->cpu.sp++;
+  m->cpu.pc = (uint16_t)machine_read(m, 0x0100 + m->cpu.sp);
+  m->cpu.sp++;
+  m->cpu.pc |= (uint16_t)machine_read(m, 0x0100 + m->cpu.sp) << 8;
+  m->cpu.pc++;
   
   return 0;
 }
 
-static uint8_t NOP(void) {
-  cpu.pc++;
+CORE_INLINE uint8_t NOP(struct machine* m) {
+  m->cpu.pc++;
   return 0;
 }
 
-static uint8_t BCC(void) {
-  if (cpu_extract_sr(C) == 0) {
-    branch();
+CORE_INLINE uint8_t BCC(struct machine* m) {
+  if (!m->cpu.c) {
+    branch(m);
   }
   return 0;
 }
 
-static uint8_t BCS(void) {
-  if (cpu_extract_sr(C) == 1) {
-    branch();
+CORE_INLINE uint8_t BCS(struct machine* m) {
+  if (m->cpu.c) {
+    branch(m);
   }
   return 0;
 }
 
-static uint8_t BEQ(void) {
-  if (cpu_extract_sr(Z) == 1) {
-    branch();
+CORE_INLINE uint8_t BEQ(struct machine* m) {
+  if (m->cpu.z == 0) {
+    branch(m);
   }
   return 0;
 }
 
-static uint8_t BMI(void) {
-  if (cpu_extract_sr(N) == 1) {
-    branch();
+CORE_INLINE uint8_t BMI(struct machine* m) {
+  if (m->cpu.n & 0x80) {
+    branch(m);
   }
   return 0;
 }
 
-static uint8_t BNE(void) {
-  if (cpu_extract_sr(Z) == 0) {
-    branch();
+CORE_INLINE uint8_t BNE(struct machine* m) {
+  if (m->cpu.z != 0) {
+    branch(m);
   }
   return 0;
 }
 
-static uint8_t BPL(void) {
-  if (cpu_extract_sr(N) == 0) {
-    branch();
+CORE_INLINE uint8_t BPL(struct machine* m) {
+  if (!(m->cpu.n & 0x80)) {
+    branch(m);
   }
   return 0;
 }
 
-static uint8_t BVC(void) {
-  if (cpu_extract_sr(V) == 0) {
-    branch();
+CORE_INLINE uint8_t BVC(struct machine* m) {
+  if (!m->cpu.v) {
+    branch(m);
   }
   return 0;
 }
 
-static uint8_t BVS(void) {
-  if (cpu_extract_sr(V) == 1) {
-    branch();
+CORE_INLINE uint8_t BVS(struct machine* m) {
+  if (m->cpu.v) {
+    branch(m);
   }
   return 0;
 }
 
 /**
  * CPX: Compare a value in mem to the X register
- * @param void
+ * @param m The machine
  * @return 0
  */
-static uint8_t CPX(void) {
-  fetch();
+CORE_INLINE uint8_t CPX(struct machine* m) {
+  fetch(m);
   
   // comparing (I think this is just beautiful)
-  uint16_t tmp = (uint16_t)cpu.x - (uint16_t)fetched;
+  uint16_t tmp = (uint16_t)m->cpu.x - (uint16_t)m->fetched;
   
-  set_flag(C, cpu.x >= fetched);
-  set_flag(Z, (tmp & 0x00FF) == 0x0000);
-  set_flag(N, tmp & (1 << 7));
+  m->cpu.c = m->cpu.x >= m->fetched;
+  set_nz(m, tmp & 0x00FF);
   
   return 0;
 }
 
 /**
  * CPY: Compare a value in mem to the Y register
- * @param void
+ * @param m The machine
  * @return 0
  */
-static uint8_t CPY(void) {
-  fetch();
+CORE_INLINE uint8_t CPY(struct machine* m) {
+  fetch(m);
   
-  uint16_t tmp = (uint16_t)cpu.y - (uint16_t)fetched;
+  uint16_t tmp = (uint16_t)m->cpu.y - (uint16_t)m->fetched;
 
-  set_flag(C, cpu.y >= fetched);
-  set_flag(Z, (tmp & 0x00FF) == 0x0000);
-  set_flag(N, tmp & (1 << 7));
+  m->cpu.c = m->cpu.y >= m->fetched;
+  set_nz(m, tmp & 0x00FF);
   
   return 0;
 }
 
 /**
  * ORA: OR bitwise op on the AC register with a fetched mem value
- * @param void
+ * @param m The machine
  * @return 1
  */
-static uint8_t ORA(void) {
-    fetch();
-    cpu.ac = cpu.ac | fetched;
+CORE_INLINE uint8_t ORA(struct machine* m) {
+    fetch(m);
+    m->cpu.ac = m->cpu.ac | m->fetched;
 
-    set_flag(C, cpu.ac == 0);
-    set_flag(N, cpu.ac & (1 << 7));
+    set_nz(m, m->cpu.ac);
 
     return 1;
 }
 
 /**
  * AND: AND bitwise op on the AC register with a fetched mem value
- * @param void
+ * @param m The machine
  * @return 1
  */
-static uint8_t AND(void) {
-    fetch();
-    cpu.ac = cpu.ac & fetched;
+CORE_INLINE uint8_t AND(struct machine* m) {
+    fetch(m);
+    m->cpu.ac = m->cpu.ac & m->fetched;
 
-    set_flag(C, cpu.ac == 0);
-    set_flag(N, cpu.ac & (1 << 7));
+    set_nz(m, m->cpu.ac);
 
     return 1;
 }
 
 /**
  * EOR: XOR bitwise op on the AC register with a fetched mem value
- * @param void
+ * @param m The machine
  * @return 1
  */
-static uint8_t EOR(void) {
-    fetch();
-    cpu.ac = cpu.ac ^ fetched;
+CORE_INLINE uint8_t EOR(struct machine* m) {
+    fetch(m);
+    m->cpu.ac = m->cpu.ac ^ m->fetched;
 
-    set_flag(C, cpu.ac == 0);
-    set_flag(N, cpu.ac & (1 << 7));
+    set_nz(m, m->cpu.ac);
 
     return 1;
 }
 
-static uint8_t BIT(void) {
-    fetch();
-    uint16_t tmp = cpu.ac & fetched;
-
-    set_flag(Z, (tmp & 0x00F) == 0x00);
-    set_flag(N, (fetched & (1 << 7)));
-    set_flag(V, (fetched & (1 << 6)));
+CORE_INLINE uint8_t BIT(struct machine* m) {
+    fetch(m);
+    m->cpu.z = m->cpu.ac & m->fetched;
+    m->cpu.n = m->fetched;
+    m->cpu.v = (m->fetched >> 6) & 1;
 
     return 0;
 }
 
-static uint8_t ADC(void) {
-    fetch();
+CORE_INLINE uint8_t ADC(struct machine* m) {
+    fetch(m);
 
     uint16_t tmp =
-        (uint16_t)cpu.ac + (uint16_t)fetched + (uint16_t)cpu_extract_sr(C);
+        (uint16_t)m->cpu.ac + (uint16_t)m->fetched + (uint16_t)m->cpu.c;
 
-    set_flag(C, tmp > 255);
-    set_flag(Z, (tmp & 0x00FF) == 0);
-    set_flag(V, ((~((uint16_t)cpu.ac ^ (uint16_t)fetched) &
-                  ((uint16_t)cpu.ac ^ (uint16_t)tmp)) &
-                 0x0080));
+    m->cpu.c = tmp > 255;
+    set_nz(m, tmp & 0x00FF);
+    m->cpu.v = ((~((uint16_t)m->cpu.ac ^ (uint16_t)m->fetched) &
+                 ((uint16_t)m->cpu.ac ^ (uint16_t)tmp)) &
+                0x0080) >> 7;
 
-    set_flag(N, tmp & 0x0080);
 
-    cpu.ac = tmp & 0x00FF;
+    m->cpu.ac = tmp & 0x00FF;
     return 1;
 }
 
-static uint8_t STA(void) {
-    cpu_write(addr_abs, cpu.ac);
+CORE_INLINE uint8_t STA(struct machine* m) {
+    machine_write(m, m->addr_abs, m->cpu.ac);
     return 0;
 }
 
-static uint8_t STX(void) {
-    cpu_write(addr_abs, cpu.x);
+CORE_INLINE uint8_t STX(struct machine* m) {
+    machine_write(m, m->addr_abs, m->cpu.x);
     return 0;
 }
 
-static uint8_t STY(void) {
-    cpu_write(addr_abs, cpu.y);
+CORE_INLINE uint8_t STY(struct machine* m) {
+    machine_write(m, m->addr_abs, m->cpu.y);
     return 0;
 }
 
-static uint8_t CMP(void) {
-    fetch();
+CORE_INLINE uint8_t CMP(struct machine* m) {
+    fetch(m);
 
     // comparing (I think this is just beautiful)
-    uint16_t tmp = (uint16_t)cpu.ac - (uint16_t)fetched;
+    uint16_t tmp = (uint16_t)m->cpu.ac - (uint16_t)m->fetched;
 
-    set_flag(C, cpu.ac >= fetched);
-    set_flag(Z, (tmp & 0x00FF) == 0x0000);
-    set_flag(N, tmp & (1 << 7));
+    m->cpu.c = m->cpu.ac >= m->fetched;
+    set_nz(m, tmp & 0x00FF);
 
     return 1;
 }
 
-static uint8_t SBC(void) {
-    fetch();
+CORE_INLINE uint8_t SBC(struct machine* m) {
+    fetch(m);
 
     // inverting the bottom 8 bits
-    uint16_t val = ((uint16_t)fetched) ^ 0x00FF;
+    uint16_t val = ((uint16_t)m->fetched) ^ 0x00FF;
 
-    uint16_t tmp = (uint16_t)cpu.ac + val + (uint16_t)cpu_extract_sr(C);
+    uint16_t tmp = (uint16_t)m->cpu.ac + val + (uint16_t)m->cpu.c;
 
-    set_flag(C, tmp & 0xFF00);
-    set_flag(Z, (tmp & 0x00FF) == 0);
-    set_flag(V, ((tmp ^ (uint16_t)cpu.ac) & (tmp ^ val) & 0x0080));
-    set_flag(N, tmp & 0x0080);
+    m->cpu.c = (tmp >> 8) & 1;
+    set_nz(m, tmp & 0x00FF);
+    m->cpu.v = ((tmp ^ (uint16_t)m->cpu.ac) & (tmp ^ val) & 0x0080) >> 7;
 
-    cpu.ac = tmp & 0x00FF;
+    m->cpu.ac = tmp & 0x00FF;
     return 1;
 }
 
-static uint8_t ASL(void) {
-    fetch();
-    uint16_t tmp = (uint16_t)fetched << 1;
+CORE_INLINE uint8_t ASL(struct machine* m) {
+    if (!accumulator_mode(m)) fetch(m);
+    uint16_t tmp = (uint16_t)m->fetched << 1;
 
-    set_flag(C, (tmp & 0xFF00) > 0);
-    set_flag(Z, (tmp & 0x00FF) == 0x00);
-    set_flag(N, tmp & (1 << 7));
+    m->cpu.c = (tmp >> 8) & 1;
+    set_nz(m, tmp & 0x00FF);
 
-    if (lookup[op].mode == &IMP) {
-        cpu.ac = tmp & 0x00FF;
+    if (accumulator_mode(m)) {
+        m->cpu.ac = tmp & 0x00FF;
     } else {
-        cpu_write(addr_abs, tmp & 0x00FF);
+        machine_write(m, m->addr_abs, tmp & 0x00FF);
     }
 
     return 0;
 }
 
-static uint8_t ROL(void) {
-    fetch();
-    uint16_t tmp = (uint16_t)(fetched << 1) | cpu_extract_sr(C);
+CORE_INLINE uint8_t ROL(struct machine* m) {
+    if (!accumulator_mode(m)) fetch(m);
+    uint16_t tmp = (uint16_t)(m->fetched << 1) | m->cpu.c;
 
-    set_flag(C, tmp & 0xFF00);
-    set_flag(Z, (tmp & 0x00FF) == 0x00);
-    set_flag(N, tmp & (1 << 7));
+    m->cpu.c = (tmp >> 8) & 1;
+    set_nz(m, tmp & 0x00FF);
 
-    if (lookup[op].mode == &IMP) {
-        cpu.ac = tmp & 0x00FF;
+    if (accumulator_mode(m)) {
+        m->cpu.ac = tmp & 0x00FF;
     } else {
-        cpu_write(addr_abs, tmp & 0x00FF);
+        machine_write(m, m->addr_abs, tmp & 0x00FF);
     }
 
     return 0;
 }
 
-static uint8_t ROR(void) {
-    fetch();
-    uint16_t tmp = (uint16_t)(cpu_extract_sr(C) << 7) | (fetched >> 1);
+CORE_INLINE uint8_t ROR(struct machine* m) {
+    if (!accumulator_mode(m)) fetch(m);
+    uint16_t tmp = (uint16_t)(m->cpu.c << 7) | (m->fetched >> 1);
 
-    set_flag(C, fetched & 0x0001);
-    set_flag(Z, (tmp & 0x00FF) == 0x00);
-    set_flag(N, tmp & (1 << 7));
+    m->cpu.c = m->fetched & 0x0001;
+    set_nz(m, tmp & 0x00FF);
 
-    if (lookup[op].mode == &IMP) {
-        cpu.ac = tmp & 0x00FF;
+    if (accumulator_mode(m)) {
+        m->cpu.ac = tmp & 0x00FF;
     } else {
-        cpu_write(addr_abs, tmp & 0x00FF);
+        machine_write(m, m->addr_abs, tmp & 0x00FF);
     }
 
     return 0;
 }
 
-static uint8_t LSR(void) {
-    fetch();
-    uint16_t tmp = (uint16_t)fetched >> 1;
+CORE_INLINE uint8_t LSR(struct machine* m) {
+    if (!accumulator_mode(m)) fetch(m);
+    uint16_t tmp = (uint16_t)m->fetched >> 1;
 
-    set_flag(C, fetched & 0x0001);
-    set_flag(Z, (tmp & 0x00FF) == 0x00);
-    set_flag(N, tmp & (1 << 7));
+    m->cpu.c = m->fetched & 0x0001;
+    set_nz(m, tmp & 0x00FF);
 
-    if (lookup[op].mode == &IMP) {
-        cpu.ac = tmp & 0x00FF;
+    if (accumulator_mode(m)) {
+        m->cpu.ac = tmp & 0x00FF;
     } else {
-        cpu_write(addr_abs, tmp & 0x00FF);
+        machine_write(m, m->addr_abs, tmp & 0x00FF);
     }
 
     return 0;
 }
 
-static uint8_t DEC(void) {
-    fetch();
-    uint16_t tmp = fetched - 1;
+CORE_INLINE uint8_t DEC(struct machine* m) {
+    fetch(m);
+    uint16_t tmp = m->fetched - 1;
 
-    cpu_write(addr_abs, tmp & 0x00FF);
+    machine_write(m, m->addr_abs, tmp & 0x00FF);
 
-    set_flag(Z, ((tmp & 0x00FF) == 0x0000));
-    set_flag(N, (tmp & (1 << 7)));
+    set_nz(m, tmp & 0x00FF);
 
     return 0;
 }
 
-static uint8_t DEX(void) {
-    cpu.x++;
+CORE_INLINE uint8_t DEX(struct machine* m) {
+    m->cpu.x--;
 
-    set_flag(Z, cpu.x == 0x00);
-    set_flag(N, cpu.x & (1 << 7));
+    set_nz(m, m->cpu.x);
 
     return 0;
 }
 
-static uint8_t DEY(void) {
-    cpu.y--;
+CORE_INLINE uint8_t DEY(struct machine* m) {
+    m->cpu.y--;
 
-    set_flag(Z, cpu.y == 0x00);
-    set_flag(N, cpu.y & (1 << 7));
+    set_nz(m, m->cpu.y);
 
     return 0;
 }
 
-static uint8_t INC(void) {
-    fetch();
-    uint16_t tmp = (uint16_t)fetched + 1;
+CORE_INLINE uint8_t INC(struct machine* m) {
+    fetch(m);
+    uint16_t tmp = (uint16_t)m->fetched + 1;
 
-    cpu_write(addr_abs, tmp & 0x00FF);
+    machine_write(m, m->addr_abs, tmp & 0x00FF);
 
-    set_flag(Z, ((tmp & 0x00FF) == 0x0000));
-    set_flag(N, tmp & (1 << 7));
+    set_nz(m, tmp & 0x00FF);
 
     return 0;
 }
 
-static uint8_t INX(void) {
-    cpu.x++;
+CORE_INLINE uint8_t INX(struct machine* m) {
+    m->cpu.x++;
 
-    set_flag(Z, cpu.x == 0x00);
-    set_flag(N, cpu.x & (1 << 7));
+    set_nz(m, m->cpu.x);
 
     return 0;
 }
 
-static uint8_t INY(void) {
-    cpu.y++;
+CORE_INLINE uint8_t INY(struct machine* m) {
+    m->cpu.y++;
 
-    set_flag(Z, cpu.y == 0x00);
-    set_flag(N, cpu.y & (1 << 7));
+    set_nz(m, m->cpu.y);
 
     return 0;
 }
 
-static uint8_t PHP(void) {
-    cpu_write(0x0100 + cpu.sp, cpu.sr);
-    cpu.sp--;
+CORE_INLINE uint8_t PHP(struct machine* m) {
+    machine_write(m, 0x0100 + m->cpu.sp, cpu_sr_pack(&m->cpu));
+    m->cpu.sp--;
 
     return 0;
 }
 
-static uint8_t SEC(void) {
-    set_flag(C, true);
+CORE_INLINE uint8_t SEC(struct machine* m) {
+    m->cpu.c = 1;
     return 0;
 }
 
-static uint8_t CLC(void) {
-    set_flag(C, false);
+CORE_INLINE uint8_t CLC(struct machine* m) {
+    m->cpu.c = 0;
     return 0;
 }
 
-static uint8_t PLP(void) {
-    cpu.sp++;
-    cpu.sr = cpu_fetch(0x0100 + cpu.sp);
+CORE_INLINE uint8_t PLP(struct machine* m) {
+    m->cpu.sp++;
+    cpu_sr_unpack(&m->cpu, machine_read(m, 0x0100 + m->cpu.sp));
+    if (m->irq) sched_poke(&m->sched);
 
     return 0;
 }
 
-static uint8_t PLA(void) {
-    cpu.sp++;
-    cpu.ac = cpu_fetch(0x0100 + cpu.sp);
+CORE_INLINE uint8_t PLA(struct machine* m) {
+    m->cpu.sp++;
+    m->cpu.ac = machine_read(m, 0x0100 + m->cpu.sp);
 
-    set_flag(Z, cpu.ac == 0);
-    set_flag(N, cpu.ac & (1 << 7));
+    set_nz(m, m->cpu.ac);
 
     return 0;
 }
 
-static uint8_t PHA(void) {
+CORE_INLINE uint8_t PHA(struct machine* m) {
     // 0x0100 is the starting addr of the stack
-    cpu_write(0x0100 + cpu.sp, cpu.ac);
-    cpu.sp--;
+    machine_write(m, 0x0100 + m->cpu.sp, m->cpu.ac);
+    m->cpu.sp--;
 
     return 0;
 }
 
-static uint8_t CLI(void) {
-    set_flag(I, 0);
+CORE_INLINE uint8_t CLI(struct machine* m) {
+    set_flag(m, I, 0);
+    // an active IRQ is taken right after
+    if (m->irq) sched_poke(&m->sched);
     return 0;
 }
 
-static uint8_t SEI(void) {
-    set_flag(I, true);
+CORE_INLINE uint8_t SEI(struct machine* m) {
+    set_flag(m, I, true);
     return 0;
 }
 
-static uint8_t TYA(void) {
-    cpu.ac = cpu.y;
+CORE_INLINE uint8_t TYA(struct machine* m) {
+    m->cpu.ac = m->cpu.y;
 
-    set_flag(Z, cpu.ac == 0);
-    set_flag(N, cpu.ac & (1 << 7));
+    set_nz(m, m->cpu.ac);
 
     return 0;
 }
 
-static uint8_t CLV(void) {
-    set_flag(V, false);
+CORE_INLINE uint8_t CLV(struct machine* m) {
+    m->cpu.v = 0;
     return 0;
 }
 
-static uint8_t CLD(void) {
-    set_flag(D, false);
+CORE_INLINE uint8_t CLD(struct machine* m) {
+    set_flag(m, D, false);
     return 0;
 }
 
-static uint8_t SED(void) {
-    set_flag(D, true);
+CORE_INLINE uint8_t SED(struct machine* m) {
+    set_flag(m, D, true);
     return 0;
 }
 
-static uint8_t TXA(void) {
-    cpu.ac = cpu.x;
+CORE_INLINE uint8_t TXA(struct machine* m) {
+    m->cpu.ac = m->cpu.x;
 
-    set_flag(Z, cpu.ac == 0);
-    set_flag(N, (cpu.ac & (1 << 7)));
+    set_nz(m, m->cpu.ac);
 
     return 0;
 }
 
-static uint8_t TXS(void) {
-    cpu.sp = cpu.x;
+CORE_INLINE uint8_t TXS(struct machine* m) {
+    m->cpu.sp = m->cpu.x;
     return 0;
 }
 
-static uint8_t TAX(void) {
-    cpu.x = cpu.ac;
+CORE_INLINE uint8_t TAX(struct machine* m) {
+    m->cpu.x = m->cpu.ac;
 
-    set_flag(Z, cpu.x == 0);
-    set_flag(N, (cpu.x & (1 << 7)));
+    set_nz(m, m->cpu.x);
 
     return 0;
 }
 
-static uint8_t TAY(void) {
-    cpu.y = cpu.ac;
+CORE_INLINE uint8_t TAY(struct machine* m) {
+    m->cpu.y = m->cpu.ac;
 
-    set_flag(Z, cpu.y == 0);
-    set_flag(N, (cpu.y & (1 << 7)));
+    set_nz(m, m->cpu.y);
 
     return 0;
 }
 
-static uint8_t TSX(void) {
-    cpu.x = cpu.sp;
+CORE_INLINE uint8_t TSX(struct machine* m) {
+    m->cpu.x = m->cpu.sp;
 
-    set_flag(Z, cpu.x == 0);
-    set_flag(N, (cpu.x & (1 << 7)));
+    set_nz(m, m->cpu.x);
 
     return 0;
 }
 
-static uint8_t JMP(void) {
-    cpu.pc = addr_abs;
+CORE_INLINE uint8_t JMP(struct machine* m) {
+    m->cpu.pc = m->addr_abs;
     return 0;
 }
 
+#ifdef FUSED_CORE
+
+/**
+ * dispatch: Execute an instruction whose opcode was already fetched
+ * (fused core)
+ *
+ * Every opcode gets its own case, generated from OPCODES, in which the
+ * addressing mode and the operation are plain calls to static functions
+ * the compiler inlines: one indirect jump per instruction instead of two
+ * calls through lookup[].
+ *
+ * @param m The machine, its cycles are set to the ones the instruction takes
+ * @param opcode The opcode
+ * @return void
+ */
+CORE_INLINE void dispatch(struct machine* m, uint8_t opcode) {
+    uint8_t additional_cycle;
+
+    m->op = opcode;
+
+    switch (opcode) {
+#define X(code, name, operation, mode, cyc)            \
+    case code:                                         \
+        m->cycles = cyc;                               \
+        additional_cycle = mode(m);                    \
+        additional_cycle &= operation(m);              \
+        break;
+        OPCODES(X)
+#undef X
+    }
+
+    m->cycles += additional_cycle;
+}
+
+#else
+
+/**
+ * dispatch: Execute an instruction whose opcode was already fetched
+ * (readable core, through the lookup[] table)
+ * @param m The machine, its cycles are set to the ones the instruction takes
+ * @param opcode The opcode
+ * @return void
+ */
+CORE_INLINE void dispatch(struct machine* m, uint8_t opcode) {
+    // saving the opcode in the decode scratch of the machine
+    m->op = opcode;
+
+    m->cycles = lookup[opcode].cycles;
+
+    uint8_t additional_cycle_0 = (*(lookup[opcode].mode))(m);
+    uint8_t additional_cycle_1 = (*(lookup[opcode].op))(m);
+
+    m->cycles += (additional_cycle_0 & additional_cycle_1);
+}
+
+#endif
+
+#ifdef FUSED_CORE
+
+/**
+ * dispatch_block: Execute an instruction of a predecoded block (fused core)
+ * @param m The machine, its cycles are set to the ones the instruction takes
+ * @param inst The instruction, m->cpu.pc must already be past it
+ * @return void
+ */
+CORE_INLINE void dispatch_block(struct machine* m, const struct block_inst* inst) {
+    uint8_t additional_cycle;
+
+    m->op = inst->opcode;
+    m->cycles = inst->cycles;
+
+    switch (inst->opcode) {
+#define X(code, name, operation, mode, cyc)                \
+    case code:                                             \
+        additional_cycle = mode##_PRE(m, inst->operand);   \
+        additional_cycle &= operation(m);                  \
+        break;
+        OPCODES(X)
+#undef X
+    }
+
+    m->cycles += additional_cycle;
+}
+
+#else
+
+/**
+ * dispatch_block: Execute an instruction of a predecoded block (readable
+ * core, through lookup_pre[] and lookup[])
+ * @param m The machine, its cycles are set to the ones the instruction takes
+ * @param inst The instruction, m->cpu.pc must already be past it
+ * @return void
+ */
+CORE_INLINE void dispatch_block(struct machine* m, const struct block_inst* inst) {
+    m->op = inst->opcode;
+    m->cycles = inst->cycles;
+
+    uint8_t additional_cycle_0 = (*lookup_pre[inst->opcode])(m, inst->operand);
+    uint8_t additional_cycle_1 = (*(lookup[inst->opcode].op))(m);
+
+    m->cycles += (additional_cycle_0 & additional_cycle_1);
+}
+
+#endif
+
+/*
+ * =============================================
+ * BLOCK CACHE
+ * =============================================
+ */
+
+/**
+ * inst_length: Bytes taken by an instruction, opcode included
+ * @param opcode The opcode
+ * @return 1, 2 or 3
+ */
+static uint8_t inst_length(uint8_t opcode) {
+    uint8_t (*mode)(struct machine*) = lookup[opcode].mode;
+
+    if (mode == &IMP) return 1;
+    if (mode == &ABS || mode == &ABX || mode == &ABY || mode == &IND) return 3;
+    return 2;
+}
+
+/**
+ * inst_ends_block: Whether an instruction may leave the PC anywhere but on
+ * the next instruction, NOP is one of them since it skips a byte, or may
+ * clear the I flag under a pending IRQ, which is taken right after it
+ * @param opcode The opcode
+ * @return true if the block must end with this instruction
+ */
+static bool inst_ends_block(uint8_t opcode) {
+    const struct instruction* inst = &lookup[opcode];
+
+    return inst->mode == &REL || inst->op == &JMP || inst->op == &JSR ||
+           inst->op == &RTS || inst->op == &RTI || inst->op == &BRK ||
+           inst->op == &NOP || inst->op == &CLI || inst->op == &PLP;
+}
+
+/**
+ * block_peek: Read a code byte straight from its backing page, so that
+ * decoding emits no trace record nor touches I/O
+ * @param m The machine
+ * @param addr The address, its page must not be MEM_PAGE_IO
+ * @return the byte
+ */
+static uint8_t block_peek(struct machine* m, uint16_t addr) {
+    return m->mem.data[m->mem.read_page[addr >> 8] | (addr & 0xFF)];
+}
+
+/**
+ * block_build: Decode the block starting at pc into a cache slot
+ * @param m The machine
+ * @param b The slot, overwritten
+ * @param pc Where the block starts
+ * @return the block, NULL if its pages are I/O or self-modifying code
+ */
+static struct block* block_build(struct machine* m, struct block* b,
+                                 uint16_t pc) {
+    uint8_t first = pc >> 8;
+    uint8_t second = first + 1;
+
+    if (m->mem.read_page[first] == MEM_PAGE_IO ||
+        m->mem.read_page[second] == MEM_PAGE_IO) {
+        b->count = 0;
+        return NULL;
+    }
+
+    // rewritten too often to be worth decoding, see mem_code_invalidate()
+    if (m->mem.code_writes[m->mem.read_page[first] >> 8] >=
+            MEM_CODE_WRITES_MAX ||
+        m->mem.code_writes[m->mem.read_page[second] >> 8] >=
+            MEM_CODE_WRITES_MAX) {
+        b->count = 0;
+        return NULL;
+    }
+
+    const struct debug* debug = m->debug;
+    uint16_t at = pc;
+    uint8_t count = 0;
+    uint16_t max_cycles = 0;
+
+    while (count < BLOCK_MAX_INSTS) {
+        // a breakpoint starts a block of its own
+        if (count > 0 && debug != NULL && debug_break_at(debug, at)) break;
+
+        struct block_inst* inst = &b->insts[count++];
+
+        inst->opcode = block_peek(m, at);
+        inst->length = inst_length(inst->opcode);
+        inst->cycles = lookup[inst->opcode].cycles;
+        inst->operand = 0;
+        if (lookup[inst->opcode].mode == &IMM) {
+            inst->operand = at + 1;
+        } else if (inst->length > 1) {
+            inst->operand = block_peek(m, at + 1);
+            if (inst->length > 2) inst->operand |= block_peek(m, at + 2) << 8;
+        }
+
+        // page crossing and taken branches add at most 2 cycles
+        max_cycles += inst->cycles + 2;
+
+        // the last byte of this one may be on the second page, but the
+        // next instruction must start on the first one
+        uint16_t last = at + inst->length - 1;
+        at += inst->length;
+        if (inst_ends_block(inst->opcode) || (last >> 8) != first ||
+            (at >> 8) != first) {
+            break;
+        }
+    }
+
+    uint16_t last = at - 1;
+
+    b->pc = pc;
+    b->end = at;
+    b->last = at - b->insts[count - 1].length;
+    b->count = count;
+    b->max_cycles = max_cycles;
+    b->has_brk = b->insts[count - 1].opcode == 0x00;
+    b->has_break = debug != NULL && debug_break_at(debug, pc);
+    b->page[0] = m->mem.read_page[first] >> 8;
+    b->page[1] = (last >> 8) != first ? m->mem.read_page[second] >> 8
+                                      : b->page[0];
+    b->gen[0] = m->mem.code_gen[b->page[0]];
+    b->gen[1] = m->mem.code_gen[b->page[1]];
+
+    m->mem.code[b->page[0]] = 1;
+    m->mem.code[b->page[1]] = 1;
+
+    b->hits = 0;
+    b->native = NULL;
+
+    return b;
+}
+
+/**
+ * block_lookup: Find the block starting at pc, decoding it on a miss
+ * @param m The machine
+ * @param pc The PC
+ * @return the block, NULL if it can't be cached
+ */
+CORE_INLINE struct block* block_lookup(struct machine* m, uint16_t pc) {
+    struct block* b =
+        &m->blocks.blocks[(pc ^ (pc >> 10)) & (BLOCK_CACHE_SIZE - 1)];
+
+    if (b->count != 0 && b->pc == pc &&
+        m->mem.code_gen[b->page[0]] == b->gen[0] &&
+        m->mem.code_gen[b->page[1]] == b->gen[1]) {
+        return b;
+    }
+
+    return block_build(m, b, pc);
+}
+
+/**
+ * block_fits: Whether a block can run without any check in between its
+ * instructions: it can't run out of budget, reach the next event, the stop
+ * PC, a BRK that must stop the run or a breakpoint. If it doesn't fit,
+ * cpu_run() single steps it
+ * @param b The block
+ * @param limits Stop conditions
+ * @param cycles_left Cycles left before the budget ends or an event is due
+ * @param instructions_left Instructions left in the budget
+ * @return true if the block can run as a whole
+ */
+CORE_INLINE bool block_fits(const struct block* b,
+                            const struct cpu_limits* limits,
+                            uint64_t cycles_left, uint64_t instructions_left) {
+    if (b->max_cycles > cycles_left || b->count > instructions_left) {
+        return false;
+    }
+
+    if (limits->stop_on_brk && b->has_brk) return false;
+    if (b->has_break) return false;
+
+    if (limits->stop_on_pc &&
+        (uint16_t)(limits->stop_pc - b->pc) < (uint16_t)(b->end - b->pc)) {
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * run_block: Execute a predecoded block. Only its last instruction may
+ * jump, so the only check in between is for a write that dropped decoded
+ * code (this very block may be stale), a watchpoint, an interrupt or an
+ * event scheduled by an I/O access, which all bump the code epoch
+ * @param m The machine
+ * @param b The block
+ * @param first The instruction to start from, at m->cpu.pc
+ * @param profile Counts every instruction unless NULL, see src/machine/profile.h
+ * @param instructions Executed instructions, updated
+ * @param now The machine clock, updated and stored after each instruction
+ * @return the PC of the last executed instruction
+ */
+CORE_INLINE uint16_t run_block(struct machine* m, const struct block* b,
+                               unsigned first, struct profile* profile,
+                               uint64_t* instructions, uint64_t* now) {
+    uint32_t epoch = m->mem.code_epoch;
+    uint16_t pc = m->cpu.pc;
+    const struct block_inst* inst = b->insts + first;
+    const struct block_inst* end = b->insts + b->count;
+
+    for (;;) {
+        uint16_t next = pc + inst->length;
+
+        TRACE_EMIT(m, TRACE_EXEC, pc, inst->opcode);
+        m->cpu.pc = next;
+        dispatch_block(m, inst);
+        if (profile != NULL) profile_count(profile, pc, inst->opcode, m->cycles, m->cpu.pc);
+
+        *now += m->cycles;
+        m->clock.cycles = *now;
+        m->cycles = 0;
+        (*instructions)++;
+
+        if (++inst == end || m->mem.code_epoch != epoch) break;
+        pc = next;
+    }
+
+    return pc;
+}
+
+/**
+ * run_native: Execute the translation of a block, see src/jit/jit.h, and
+ * interpret what it left of the block unless a store dropped decoded code
+ * @param m The machine
+ * @param b The block, starting at m->cpu.pc
+ * @param cycles_left Cycles left before the budget ends or an event is due
+ * @param instructions_left Instructions left in the budget
+ * @param instructions Executed instructions, updated
+ * @param now The machine clock, updated and stored
+ * @return the PC of the last executed instruction
+ */
+CORE_INLINE uint16_t run_native(struct machine* m, const struct block* b,
+                                uint64_t cycles_left,
+                                uint64_t instructions_left,
+                                uint64_t* instructions, uint64_t* now) {
+    uint32_t epoch = m->mem.code_epoch;
+    uint64_t result =
+        b->native(m, cycles_left < INT32_MAX ? cycles_left : INT32_MAX,
+                  instructions_left < INT32_MAX ? instructions_left : INT32_MAX);
+    uint32_t done = result >> 32;
+    unsigned part = done % b->count;
+
+    *now += (uint32_t)result;
+    m->clock.cycles = *now;
+    *instructions += done;
+
+    // whole passes, the last one ended with the jump
+    if (part == 0) return b->last;
+
+    if (m->mem.code_epoch != epoch) {
+        return m->cpu.pc - b->insts[part - 1].length;
+    }
+
+    return run_block(m, b, part, NULL, instructions, now);
+}
+
+/**
+ * idle_cycles: Whether the instruction at pc, which just left the PC on
+ * itself, is an idle loop: a JMP or a taken branch to itself that reads
+ * nothing but plain memory, so that running it again changes nothing but
+ * the counters. JSR, RTS, RTI and BRK landing on themselves move the stack
+ * @param m The machine
+ * @param pc Its address
+ * @return the cycles of one pass, 0 if it isn't an idle loop
+ */
+CORE_INLINE uint32_t idle_cycles(const struct machine* m, uint16_t pc) {
+    const uint32_t* page = m->mem.read_page;
+    uint16_t lo = pc + 1;
+    uint16_t hi = pc + 2;
+
+    // I/O and watched pages
+    if (page[pc >> 8] == MEM_PAGE_IO || page[hi >> 8] == MEM_PAGE_IO) return 0;
+
+    uint8_t opcode = m->mem.data[page[pc >> 8] | (pc & 0xFF)];
+
+    // branches are xxx10000, a taken one costs 1 more, 2 across a page
+    if ((opcode & 0x1F) == 0x10) {
+        return lookup[opcode].cycles + 1 + ((pc & 0xFF00) != (hi & 0xFF00));
+    }
+
+    if (opcode == 0x6C) {
+        uint16_t ptr = m->mem.data[page[lo >> 8] | (lo & 0xFF)] |
+                       (m->mem.data[page[hi >> 8] | (hi & 0xFF)] << 8);
+
+        if (page[ptr >> 8] == MEM_PAGE_IO ||
+            page[(uint16_t)(ptr + 1) >> 8] == MEM_PAGE_IO) {
+            return 0;
+        }
+    } else if (opcode != 0x4C) {
+        return 0;
+    }
+
+    return lookup[opcode].cycles;
+}
+
+/**
+ * idle: Handle the idle loop the CPU is in, if any, see idle_cycles(). With
+ * an event pending, skip the clock to it as if the loop had run until
+ * then, or to the end of the budget if that comes first. Without, nothing
+ * can leave the loop: stop if asked to or if no budget would ever end the
+ * run, otherwise skip to the end of the budget. Stop PCs and breakpoints
+ * on the loop are left to the run, which stops on them next
+ * @param m The machine, its PC on the instruction that jumped to itself
+ * @param limits Budgets and stop conditions
+ * @param skip Whether the clock can be skipped, no instruction is recorded
+ * @param end The clock at which the cycle budget ends, UINT64_MAX for none
+ * @param max_instructions The instruction budget, UINT64_MAX for none
+ * @param instructions Executed instructions, updated
+ * @param now The machine clock, updated and stored
+ * @return CPU_STOP_IDLE to stop, CPU_STOP_BUDGET to go on
+ */
+static enum cpu_stop idle(struct machine* m, const struct cpu_limits* limits,
+                          int skip, uint64_t end, uint64_t max_instructions,
+                          uint64_t* instructions, uint64_t* now) {
+    uint16_t pc = m->cpu.pc;
+    uint32_t pass = idle_cycles(m, pc);
+    uint64_t next = m->sched.next;
+
+    if (pass == 0) return CPU_STOP_BUDGET;
+    if (limits->stop_on_pc && pc == limits->stop_pc) return CPU_STOP_BUDGET;
+    if (m->debug != NULL && debug_break_at(m->debug, pc)) return CPU_STOP_BUDGET;
+
+    if (next == SCHED_NEVER &&
+        (limits->stop_on_idle ||
+         (end == UINT64_MAX && max_instructions == UINT64_MAX))) {
+        return CPU_STOP_IDLE;
+    }
+
+    if (next < end) end = next;
+
+    if (skip && *now < end && *instructions < max_instructions) {
+        // the last pass may end past the deadline, as a run would
+        uint64_t left = end - *now;
+        uint64_t passes = left / pass + (left % pass != 0);
+
+        if (max_instructions - *instructions < passes) {
+            passes = max_instructions - *instructions;
+        }
+        *instructions += passes;
+        *now += passes * pass;
+        m->clock.cycles = *now;
+    }
+
+    return CPU_STOP_BUDGET;
+}
+
+/**
+ * attend: What cpu_run() does between two instructions once an event is
+ * due or the scheduler was poked: fire the events and take a pending
+ * interrupt
+ * @param m The machine
+ * @param now The machine clock, updated and stored
+ * @return 1 if an interrupt was taken, 0 otherwise
+ */
+static int attend(struct machine* m, uint64_t* now) {
+    sched_run(m);
+    if (!interrupt(m)) return 0;
+
+    *now += m->cycles;
+    m->clock.cycles = *now;
+    m->cycles = 0;
+    return 1;
+}
+
 /**
  * inst_exec: Parse and execute a fetched instruction
+ * @param m The machine, its cycles are set to the ones the instruction takes
  * @param opcode The retrieved opcode from cpu_exec()
- * @param cycles The amount of clock cycles happening
  * @return void
  */
-void inst_exec(uint8_t opcode, uint32_t* cycles) {
-    // saving variables to the corresponding global ones
-    op = opcode;
-    cys = cycles;
+void inst_exec(struct machine* m, uint8_t opcode) {
+    dispatch(m, opcode);
+}
 
-    *cycles = lookup[opcode].cycles;
+/**
+ * cpu_run: Execute instructions back to back until a limit is reached.
+ * This is the hot loop of headless runs: fetch, stop checks and dispatch
+ * all live in this file so that the compiler can keep the machine state
+ * in registers and, with the fused core, inline every handler.
+ *
+ * Must be called between instructions (no cycles left from a reset).
+ *
+ * Cycles are counted on the machine clock, m->clock.cycles, as they go.
+ * Events scheduled in m->sched fire at the first instruction boundary
+ * at or past their cycle, see src/machine/sched.h, and a pending NMI or an
+ * IRQ let through by the I flag is taken before the next instruction; in
+ * between, the run goes straight ahead.
+ *
+ * Unless disabled in m->blocks, or a trace hook wants to see every fetch,
+ * instructions run from the predecoded block cache, see src/cpu/block.h;
+ * pages rewritten MEM_CODE_WRITES_MAX times are single stepped instead.
+ * With the JIT enabled, blocks that ran JIT_HOT times are translated and
+ * run as native code from then on, unless a trace hook is installed or a
+ * profile is attached, see src/machine/profile.h.
+ *
+ * Breakpoints and watchpoints armed in m->debug stop the run too, see
+ * src/machine/debug.h; with none armed that's one NULL test per block.
+ *
+ * A JMP or a taken branch to itself is an idle loop: it skips to the next
+ * event, which may raise an interrupt to leave it. With no event pending
+ * nothing can leave it, the run stops on it with limits->stop_on_idle or
+ * without any budget, otherwise it skips to the end of the budget at once.
+ * Skipping is off while a profile or a trace hook wants to see every pass.
+ * limits->stop_on_self_jump stops on any jump to itself, right after its
+ * first pass, before any skipping.
+ *
+ * @param m The machine
+ * @param limits Budgets and stop conditions, 0 budgets mean no limit
+ * @param counters Instructions and cycles are added to it
+ * @return why the run stopped
+ */
+enum cpu_stop cpu_run(struct machine* m, const struct cpu_limits* limits,
+                      struct cpu_counters* counters) {
+    uint64_t instructions = counters->instructions;
+    uint64_t start = m->clock.cycles;
+    // the machine clock, stored back after every instruction
+    uint64_t now = start;
+    // the clock at which the cycle budget ends
+    uint64_t end = UINT64_MAX;
+    uint64_t max_instructions =
+        limits->max_instructions ? limits->max_instructions : UINT64_MAX;
+    enum cpu_stop reason = CPU_STOP_BUDGET;
+    int use_blocks = m->blocks.enabled;
+    struct debug* debug = m->debug;
+    struct profile* profile = m->profile;
+    int use_jit = m->jit != NULL && profile == NULL;
+    int skip_idle = profile == NULL;
+
+    if (limits->max_cycles) {
+        uint64_t left = counters->cycles < limits->max_cycles
+                            ? limits->max_cycles - counters->cycles
+                            : 0;
+        end = left < UINT64_MAX - start ? start + left : UINT64_MAX - 1;
+    }
+
+#ifdef TRACE
+    // blocks report their instructions but fetch nothing, translated code
+    // reports nothing at all
+    if (m->trace != NULL) {
+        use_blocks = use_blocks && !(m->trace_events & TRACE_EVENT(TRACE_READ));
+        use_jit = 0;
+        skip_idle = 0;
+    }
+#endif
+
+    // the lines or the I flag may have changed since the last run
+    if (m->nmi || m->irq) sched_poke(&m->sched);
+
+    while (now < end && instructions < max_instructions) {
+        if (debug != NULL && debug->hit && !debug->quiet) {
+            reason = CPU_STOP_WATCH;
+            break;
+        }
+
+        if (now >= m->sched.next && attend(m, &now)) continue;
+
+        uint16_t pc = m->cpu.pc;
+        // cycles the run can go straight for
+        uint64_t straight = (m->sched.next < end ? m->sched.next : end) - now;
+
+        uint32_t page = m->mem.read_page[pc >> 8];
+
+        // I/O and self-modifying pages get no block, see block_build()
+        if (use_blocks && page != MEM_PAGE_IO &&
+            m->mem.code_writes[page >> 8] < MEM_CODE_WRITES_MAX) {
+            struct block* b = block_lookup(m, pc);
+
+            if (b != NULL && block_fits(b, limits, straight,
+                                        max_instructions - instructions)) {
+                uint16_t last;
+
+                if (use_jit && b->native != NULL) {
+                    last = run_native(m, b, straight,
+                                      max_instructions - instructions,
+                                      &instructions, &now);
+                } else {
+                    if (use_jit && ++b->hits == JIT_HOT) {
+                        b->native = jit_compile(m, b);
+                    }
+                    last = run_block(m, b, 0, profile, &instructions, &now);
+                }
+
+                if (m->cpu.pc == last) {
+                    // right after the first pass, before the loop is skipped
+                    if (limits->stop_on_self_jump) {
+                        reason = CPU_STOP_SELF_JUMP;
+                        break;
+                    }
+                    reason = idle(m, limits, skip_idle, end, max_instructions,
+                                  &instructions, &now);
+                    if (reason != CPU_STOP_BUDGET) break;
+                }
+                continue;
+            }
+        }
+
+        if (limits->stop_on_pc && pc == limits->stop_pc) {
+            reason = CPU_STOP_PC;
+            break;
+        }
+
+        if (debug != NULL && debug_break_at(debug, pc) && !debug->quiet &&
+            m->clock.instructions + (instructions - counters->instructions) !=
+                debug->resume_at) {
+            debug->hit = 1;
+            debug->last.kind = DEBUG_HIT_BREAK;
+            debug->last.addr = pc;
+            reason = CPU_STOP_BREAK;
+            break;
+        }
+
+        uint8_t opcode = machine_read(m, pc);
+
+        if (limits->stop_on_brk && opcode == 0x00) {
+            reason = CPU_STOP_BRK;
+            break;
+        }
+
+        TRACE_EMIT(m, TRACE_EXEC, pc, opcode);
+        m->cpu.pc++;
+        dispatch(m, opcode);
+        if (profile != NULL) profile_count(profile, pc, opcode, m->cycles, m->cpu.pc);
+
+        now += m->cycles;
+        m->clock.cycles = now;
+        m->cycles = 0;
+        instructions++;
+
+        if (m->cpu.pc == pc) {
+            // right after the first pass, before the loop is skipped
+            if (limits->stop_on_self_jump) {
+                reason = CPU_STOP_SELF_JUMP;
+                break;
+            }
+            reason = idle(m, limits, skip_idle, end, max_instructions,
+                          &instructions, &now);
+            if (reason != CPU_STOP_BUDGET) break;
+        }
+    }
+
+    // a watchpoint fired by the last instruction of the budget
+    if (reason == CPU_STOP_BUDGET && debug != NULL && debug->hit &&
+        !debug->quiet) {
+        reason = CPU_STOP_WATCH;
+    }
 
-    uint8_t additional_cycle_0 = (*(lookup[opcode].mode))();
-    uint8_t additional_cycle_1 = (*(lookup[opcode].op))();
+    m->clock.instructions += instructions - counters->instructions;
 
-    *cycles += (additional_cycle_0 & additional_cycle_1);
+    counters->instructions = instructions;
+    counters->cycles += now - start;
 
-    debug_print("(inst_exec) cycles: %d, %p\n", *(cycles), (void*)cycles);
+    return reason;
 }
@@ -3,16 +3,17 @@
 
 #include <stdint.h>
 
-extern uint8_t DEBUG;
+struct machine;
 
 struct instruction {
     char* name;
-    uint8_t (*op)(void);
-    uint8_t (*mode)(void);
+    uint8_t (*op)(struct machine*);
+    uint8_t (*mode)(struct machine*);
     uint8_t cycles;
 };
 
-void inst_exec(uint8_t opcode, uint32_t* cycles);
-void reset(void);
+void inst_exec(struct machine* m, uint8_t opcode);
+void reset(struct machine* m);
+uint8_t interrupt(struct machine* m);
 
 #endif
@@ -0,0 +1,449 @@
+#include "farm.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../cpu/cpu.h"
+#include "../headless/headless.h"
+#include "../machine/machine.h"
+#include "../mem/mem.h"
+
+/**
+ * The farm runs many short headless jobs on a pool of worker threads.
+ *
+ * Job list: one job per line, blank lines and lines starting with '#' are
+ * ignored. A line is made of whitespace separated words:
+ *
+ *   0x<hex address>:<filename>      load a binary, as -L does (at least one)
+ *   stop=brk|self|idle|pc=0x<addr>  stop condition, as --stop does
+ *   cycles=N / insts=N              budgets, as --cycles and --insts do
+ *
+ *   0x8000:prog.bin 0xE000:rom.bin stop=pc=0x8020 cycles=1000000
+ *
+ * Scheduling: the jobs are split in contiguous ranges, one per worker.
+ * A worker pops jobs from the bottom of its own range; when it runs dry it
+ * steals the upper half of the range of another worker. Since jobs never
+ * spawn jobs, a worker that finds every range empty is done.
+ *
+ * Every worker owns one pre-allocated machine that is re-initialised for
+ * each job, and binaries are read once and shared by every job.
+ * */
+
+#define FARM_MAX_LINE 4096
+
+struct farm_queue {
+  pthread_mutex_t lock;
+  // the jobs [top, bottom) are still to be run
+  size_t top;
+  size_t bottom;
+};
+
+struct farm_worker {
+  struct farm* farm;
+  struct farm_queue* queues;
+  unsigned id;
+  unsigned count;
+  struct machine* machine;
+  pthread_t thread;
+};
+
+/**
+ * now: Monotonic host time
+ * @param void
+ * @return seconds since an arbitrary starting point
+ * */
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/**
+ * farm_image: Index of the image of a file, reading it the first time
+ * @param farm The farm
+ * @param path Path to the binary on the host machine
+ * @param index Filled with the index in farm->images
+ * @return 0 if success, 1 if failure
+ * */
+static int farm_image(struct farm* farm, const char* path, size_t* index) {
+  for (size_t i = 0; i < farm->image_count; i++) {
+    if (strcmp(farm->images[i].path, path) == 0) {
+      *index = i;
+      return 0;
+    }
+  }
+
+  FILE* fp = fopen(path, "rb");
+  if (fp == NULL) {
+    fprintf(stderr, "[FAILED] Error while loading '%s'.\n", path);
+    return 1;
+  }
+
+  // nothing bigger than the address space can be loaded anyway
+  uint8_t* data = malloc(TOTAL_MEM);
+  if (data == NULL) {
+    fclose(fp);
+    return 1;
+  }
+  size_t len = fread(data, 1, TOTAL_MEM, fp);
+  fclose(fp);
+
+  struct farm_image* images =
+      realloc(farm->images, (farm->image_count + 1) * sizeof(*images));
+  if (images == NULL) {
+    free(data);
+    return 1;
+  }
+  farm->images = images;
+
+  farm->images[farm->image_count].path = strdup(path);
+  farm->images[farm->image_count].data = data;
+  farm->images[farm->image_count].len = len;
+  *index = farm->image_count++;
+
+  return 0;
+}
+
+/**
+ * farm_parse_word: Apply one word of a job line to the job
+ * @param farm The farm, for the shared images
+ * @param job The job being built
+ * @param word The word
+ * @param stop_given Whether a stop= word was already seen on this line
+ * @return 0 if success, 1 if failure
+ * */
+static int farm_parse_word(struct farm* farm, struct farm_job* job,
+                           char* word, int* stop_given) {
+  char* endptr;
+
+  if (strncmp(word, "stop=", 5) == 0) {
+    if (!*stop_given) {
+      job->config.limits.stop_on_brk = 0;
+      job->config.limits.stop_on_self_jump = 0;
+      job->config.limits.stop_on_idle = 0;
+      *stop_given = 1;
+    }
+    return headless_parse_stop(&job->config, word + 5);
+  }
+
+  if (strncmp(word, "cycles=", 7) == 0 || strncmp(word, "insts=", 6) == 0) {
+    char* val = strchr(word, '=') + 1;
+    errno = 0;
+    unsigned long long budget = strtoull(val, &endptr, 10);
+    if (errno != 0 || *endptr != '\0' || *val == '-') return 1;
+
+    if (word[0] == 'c') {
+      job->config.limits.max_cycles = budget;
+    } else {
+      job->config.limits.max_instructions = budget;
+    }
+    return 0;
+  }
+
+  // anything else must be a 0x<hex address>:<filename> load
+  char* colon_pos = strchr(word, ':');
+  if (colon_pos == NULL) return 1;
+  if (strncmp(word, "0x", 2) != 0 && strncmp(word, "0X", 2) != 0) return 1;
+
+  *colon_pos = '\0';
+  errno = 0;
+  long address = strtol(word, &endptr, 16);
+  if (errno != 0 || *endptr != '\0' || address < 0 || address > 0xFFFF)
+    return 1;
+
+  struct farm_load* loads =
+      realloc(job->loads, (job->load_count + 1) * sizeof(*loads));
+  if (loads == NULL) return 1;
+  job->loads = loads;
+
+  job->loads[job->load_count].address = (uint16_t)address;
+  if (farm_image(farm, colon_pos + 1, &job->loads[job->load_count].image))
+    return 1;
+  job->load_count++;
+
+  return 0;
+}
+
+/**
+ * farm_load_jobs: Read a job list, see the top of this file for the format
+ * @param farm The farm to fill, must be zeroed
+ * @param path Path to the job list
+ * @return 0 if success, 1 if failure
+ * */
+int farm_load_jobs(struct farm* farm, const char* path) {
+  FILE* fp = fopen(path, "r");
+  if (fp == NULL) {
+    fprintf(stderr, "[FAILED] Error while opening job list '%s'.\n", path);
+    return 1;
+  }
+
+  char line[FARM_MAX_LINE];
+  unsigned line_number = 0;
+
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    line_number++;
+    line[strcspn(line, "\r\n")] = '\0';
+
+    char* start = line + strspn(line, " \t");
+    if (*start == '\0' || *start == '#') continue;
+
+    struct farm_job* jobs =
+        realloc(farm->jobs, (farm->job_count + 1) * sizeof(*jobs));
+    if (jobs == NULL) {
+      fclose(fp);
+      return 1;
+    }
+    farm->jobs = jobs;
+
+    struct farm_job* job = &farm->jobs[farm->job_count++];
+    memset(job, 0, sizeof(*job));
+    headless_config_init(&job->config);
+    job->name = strdup(start);
+
+    int stop_given = 0;
+    for (char* word = strtok(start, " \t"); word != NULL;
+         word = strtok(NULL, " \t")) {
+      if (farm_parse_word(farm, job, word, &stop_given)) {
+        fprintf(stderr, "[FAILED] %s:%u: invalid word '%s'.\n", path,
+                line_number, word);
+        fclose(fp);
+        return 1;
+      }
+    }
+
+    if (job->load_count == 0) {
+      fprintf(stderr, "[FAILED] %s:%u: a job must load at least a binary.\n",
+              path, line_number);
+      fclose(fp);
+      return 1;
+    }
+  }
+
+  fclose(fp);
+  return 0;
+}
+
+/**
+ * farm_pop: Take the next job from the bottom of our own range
+ * @param queue The queue of the calling worker
+ * @param job Filled with the index of the job
+ * @return 1 if a job was taken, 0 if the queue is empty
+ * */
+static int farm_pop(struct farm_queue* queue, size_t* job) {
+  int taken = 0;
+
+  pthread_mutex_lock(&queue->lock);
+  if (queue->top < queue->bottom) {
+    *job = --queue->bottom;
+    taken = 1;
+  }
+  pthread_mutex_unlock(&queue->lock);
+
+  return taken;
+}
+
+/**
+ * farm_steal: Move the upper half of the range of another worker into our
+ * own, empty, queue
+ * @param worker The calling worker
+ * @return 1 if something was stolen, 0 if every queue is empty
+ * */
+static int farm_steal(struct farm_worker* worker) {
+  for (unsigned i = 1; i < worker->count; i++) {
+    struct farm_queue* victim =
+        &worker->queues[(worker->id + i) % worker->count];
+    size_t start = 0;
+    size_t n = 0;
+
+    pthread_mutex_lock(&victim->lock);
+    if (victim->top < victim->bottom) {
+      n = (victim->bottom - victim->top + 1) / 2;
+      start = victim->top;
+      victim->top += n;
+    }
+    pthread_mutex_unlock(&victim->lock);
+
+    if (n) {
+      struct farm_queue* own = &worker->queues[worker->id];
+
+      pthread_mutex_lock(&own->lock);
+      own->top = start;
+      own->bottom = start + n;
+      pthread_mutex_unlock(&own->lock);
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * farm_run_job: Run one job from power-on on the machine of a worker
+ * @param farm The farm
+ * @param m The machine of the worker
+ * @param job The job
+ * @return void
+ * */
+static void farm_run_job(struct farm* farm, struct machine* m,
+                         struct farm_job* job) {
+  machine_reset(m);
+
+  for (size_t i = 0; i < job->load_count; i++) {
+    struct farm_image* image = &farm->images[job->loads[i].image];
+    load_image(m, job->loads[i].address, image->data, image->len);
+  }
+
+  cpu_reset(m);
+  headless_run(m, &job->config, &job->result);
+}
+
+// farm_worker_main: pthread entry point of a worker
+static void* farm_worker_main(void* arg) {
+  struct farm_worker* worker = arg;
+  struct farm_queue* own = &worker->queues[worker->id];
+  size_t job;
+
+  for (;;) {
+    while (farm_pop(own, &job)) {
+      farm_run_job(worker->farm, worker->machine, &worker->farm->jobs[job]);
+    }
+
+    if (!farm_steal(worker)) break;
+  }
+
+  return NULL;
+}
+
+/**
+ * farm_run: Run every job on a pool of worker threads
+ * @param farm The farm, results are stored in each job
+ * @param workers The amount of worker threads
+ * @return 0 if success, 1 if failure
+ * */
+int farm_run(struct farm* farm, unsigned workers) {
+  if (workers == 0) workers = 1;
+
+  struct farm_queue* queues = calloc(workers, sizeof(*queues));
+  struct farm_worker* pool = calloc(workers, sizeof(*pool));
+  if (queues == NULL || pool == NULL) {
+    free(queues);
+    free(pool);
+    return 1;
+  }
+
+  // split the jobs in contiguous ranges and allocate the machines up front
+  int failed = 0;
+  for (unsigned i = 0; i < workers; i++) {
+    pthread_mutex_init(&queues[i].lock, NULL);
+    queues[i].top = farm->job_count * i / workers;
+    queues[i].bottom = farm->job_count * (i + 1) / workers;
+
+    pool[i].farm = farm;
+    pool[i].queues = queues;
+    pool[i].id = i;
+    pool[i].count = workers;
+    pool[i].machine = malloc(sizeof(struct machine));
+    if (pool[i].machine == NULL) {
+      failed = 1;
+    } else {
+      machine_init(pool[i].machine);
+    }
+  }
+
+  unsigned started = 0;
+  double start = now();
+
+  if (!failed) {
+    for (; started < workers; started++) {
+      if (pthread_create(&pool[started].thread, NULL, farm_worker_main,
+                         &pool[started]) != 0) {
+        // the workers already running steal what was meant for the others
+        failed = started == 0;
+        break;
+      }
+    }
+  }
+
+  for (unsigned i = 0; i < started; i++) {
+    pthread_join(pool[i].thread, NULL);
+  }
+
+  farm->seconds = now() - start;
+
+  for (unsigned i = 0; i < workers; i++) {
+    pthread_mutex_destroy(&queues[i].lock);
+    free(pool[i].machine);
+  }
+  free(queues);
+  free(pool);
+
+  return failed;
+}
+
+/**
+ * farm_report: Print one tab separated line per job followed by the totals
+ * as "key: value" lines, idle counting the jobs that stopped in an idle loop
+ * @param fp Where to print
+ * @param farm The farm, after farm_run()
+ * @param workers The amount of worker threads that were used
+ * @return void
+ * */
+void farm_report(FILE* fp, const struct farm* farm, unsigned workers) {
+  uint64_t instructions = 0;
+  uint64_t cycles = 0;
+  size_t idle = 0;
+  double busy = 0;
+
+  fprintf(fp, "job\tstop\tpc\tinstructions\tcycles\tseconds\tname\n");
+
+  for (size_t i = 0; i < farm->job_count; i++) {
+    const struct farm_job* job = &farm->jobs[i];
+
+    fprintf(fp, "%zu\t%s\t0x%04X\t%llu\t%llu\t%.6f\t%s\n", i,
+            headless_stop_name(job->result.reason), job->result.pc,
+            (unsigned long long)job->result.instructions,
+            (unsigned long long)job->result.cycles, job->result.seconds,
+            job->name);
+
+    instructions += job->result.instructions;
+    cycles += job->result.cycles;
+    busy += job->result.seconds;
+    if (job->result.reason == CPU_STOP_IDLE) idle++;
+  }
+
+  double seconds = farm->seconds > 0 ? farm->seconds : 1e-9;
+
+  fprintf(fp, "jobs: %zu\n", farm->job_count);
+  fprintf(fp, "idle: %zu\n", idle);
+  fprintf(fp, "workers: %u\n", workers);
+  fprintf(fp, "instructions: %llu\n", (unsigned long long)instructions);
+  fprintf(fp, "cycles: %llu\n", (unsigned long long)cycles);
+  fprintf(fp, "seconds: %.6f\n", farm->seconds);
+  fprintf(fp, "busy_seconds: %.6f\n", busy);
+  fprintf(fp, "mips: %.3f\n", (double)instructions / seconds / 1e6);
+  fprintf(fp, "mhz: %.3f\n", (double)cycles / seconds / 1e6);
+}
+
+/**
+ * farm_free: Release everything farm_load_jobs() allocated
+ * @param farm The farm
+ * @return void
+ * */
+void farm_free(struct farm* farm) {
+  for (size_t i = 0; i < farm->job_count; i++) {
+    free(farm->jobs[i].name);
+    free(farm->jobs[i].loads);
+  }
+  for (size_t i = 0; i < farm->image_count; i++) {
+    free(farm->images[i].path);
+    free(farm->images[i].data);
+  }
+  free(farm->jobs);
+  free(farm->images);
+  memset(farm, 0, sizeof(*farm));
+}
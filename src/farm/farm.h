@@ -0,0 +1,50 @@
+#ifndef INC_6502_FARM_H
+#define INC_6502_FARM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "../headless/headless.h"
+
+// a binary read once on the host and shared by every job loading it
+struct farm_image {
+  char* path;
+  uint8_t* data;
+  size_t len;
+};
+
+struct farm_load {
+  uint16_t address;
+  // index in farm.images
+  size_t image;
+};
+
+struct farm_job {
+  // the line of the job list, used in the report
+  char* name;
+
+  struct farm_load* loads;
+  size_t load_count;
+
+  struct headless_config config;
+  struct headless_result result;
+};
+
+struct farm {
+  struct farm_job* jobs;
+  size_t job_count;
+
+  struct farm_image* images;
+  size_t image_count;
+
+  // wall time of the whole run
+  double seconds;
+};
+
+int farm_load_jobs(struct farm* farm, const char* path);
+int farm_run(struct farm* farm, unsigned workers);
+void farm_report(FILE* fp, const struct farm* farm, unsigned workers);
+void farm_free(struct farm* farm);
+
+#endif
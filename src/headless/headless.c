@@ -0,0 +1,142 @@
+#include "headless.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../cpu/cpu.h"
+#include "../machine/debug.h"
+#include "../machine/history.h"
+#include "../machine/machine.h"
+
+/**
+ * now: Monotonic host time
+ * @param void
+ * @return seconds since an arbitrary starting point
+ * */
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/**
+ * headless_config_init: No budget, stop on BRK or in an idle loop
+ * @param config The configuration to be filled
+ * @return void
+ * */
+void headless_config_init(struct headless_config* config) {
+  memset(config, 0, sizeof(*config));
+  config->limits.stop_on_brk = 1;
+  config->limits.stop_on_idle = 1;
+}
+
+/**
+ * headless_parse_stop: Parse a --stop argument. Accepted values are "brk",
+ * "self", "idle" and "pc=0x<hex address>".
+ * @param config The configuration to be modified
+ * @param arg The argument given on the command line
+ * @return 0 if success, 1 if failure
+ * */
+int headless_parse_stop(struct headless_config* config, const char* arg) {
+  if (strcmp(arg, "brk") == 0) {
+    config->limits.stop_on_brk = 1;
+    return 0;
+  }
+
+  if (strcmp(arg, "self") == 0) {
+    config->limits.stop_on_self_jump = 1;
+    return 0;
+  }
+
+  if (strcmp(arg, "idle") == 0) {
+    config->limits.stop_on_idle = 1;
+    return 0;
+  }
+
+  if (strncmp(arg, "pc=0x", 5) == 0 || strncmp(arg, "pc=0X", 5) == 0) {
+    char* endptr;
+    errno = 0;
+    long addr = strtol(arg + 3, &endptr, 16);
+
+    if (errno != 0 || *endptr != '\0' || addr < 0 || addr > 0xFFFF) return 1;
+
+    config->limits.stop_on_pc = 1;
+    config->limits.stop_pc = (uint16_t)addr;
+    return 0;
+  }
+
+  return 1;
+}
+
+/**
+ * headless_run: Free-run the CPU until a budget is exhausted or a stop
+ * condition is met. The CPU must already be initialised and reset, or
+ * restored from a snapshot. Checkpoints are recorded on the way if the
+ * machine has a history, breakpoints and watchpoints stop it if armed; one
+ * at the PC it starts from lets it through.
+ * @param m The machine to run
+ * @param config What to run for and when to stop
+ * @param result Filled with the stop reason and the counters
+ * @return void
+ * */
+void headless_run(struct machine* m, const struct headless_config* config,
+                  struct headless_result* result) {
+  struct cpu_counters counters = {0, 0};
+
+  double start = now();
+
+  // the first step only burns the cycles of the reset sequence, a restored
+  // snapshot may have none left
+  if (m->cycles != 0) counters.cycles += cpu_exec(m);
+
+  debug_resume(m);
+  result->reason = history_run(m, &config->limits, &counters);
+
+  result->seconds = now() - start;
+  result->pc = m->cpu.pc;
+  result->instructions = counters.instructions;
+  result->cycles = counters.cycles;
+}
+
+/**
+ * headless_stop_name: Short name of a stop reason, as printed in reports
+ * @param reason The stop reason
+ * @return a static string
+ * */
+const char* headless_stop_name(enum cpu_stop reason) {
+  static const char* reasons[] = {
+    [CPU_STOP_BUDGET] = "budget",
+    [CPU_STOP_PC] = "pc",
+    [CPU_STOP_BRK] = "brk",
+    [CPU_STOP_SELF_JUMP] = "self-jump",
+    [CPU_STOP_BREAK] = "break",
+    [CPU_STOP_WATCH] = "watch",
+    [CPU_STOP_IDLE] = "idle",
+  };
+
+  return reasons[reason];
+}
+
+/**
+ * headless_report: Print the counters of a headless run, one "key: value"
+ * per line so that scripts can parse it
+ * @param fp Where to print
+ * @param result The result of headless_run()
+ * @return void
+ * */
+void headless_report(FILE* fp, const struct headless_result* result) {
+  // avoid dividing by zero on very short runs
+  double seconds = result->seconds > 0 ? result->seconds : 1e-9;
+
+  fprintf(fp, "stop: %s\n", headless_stop_name(result->reason));
+  fprintf(fp, "pc: 0x%04X\n", result->pc);
+  fprintf(fp, "instructions: %llu\n", (unsigned long long)result->instructions);
+  fprintf(fp, "cycles: %llu\n", (unsigned long long)result->cycles);
+  fprintf(fp, "seconds: %.6f\n", result->seconds);
+  fprintf(fp, "mips: %.3f\n", (double)result->instructions / seconds / 1e6);
+  fprintf(fp, "mhz: %.3f\n", (double)result->cycles / seconds / 1e6);
+}
@@ -0,0 +1,34 @@
+#ifndef INC_6502_HEADLESS_H
+#define INC_6502_HEADLESS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "../cpu/cpu.h"
+
+// exit status of a headless run that stopped in an idle loop
+#define HEADLESS_EXIT_IDLE 3
+
+struct headless_config {
+  // budgets and stop conditions handed to cpu_run()
+  struct cpu_limits limits;
+};
+
+struct headless_result {
+  enum cpu_stop reason;
+  uint16_t pc;
+  uint64_t instructions;
+  uint64_t cycles;
+  double seconds;
+};
+
+struct machine;
+
+void headless_config_init(struct headless_config* config);
+int headless_parse_stop(struct headless_config* config, const char* arg);
+void headless_run(struct machine* m, const struct headless_config* config,
+                  struct headless_result* result);
+const char* headless_stop_name(enum cpu_stop reason);
+void headless_report(FILE* fp, const struct headless_result* result);
+
+#endif
@@ -0,0 +1,1131 @@
+// MAP_ANONYMOUS is not POSIX
+#define _DEFAULT_SOURCE
+
+#include "jit.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../cpu/block.h"
+#include "../cpu/opcodes.h"
+#include "../machine/machine.h"
+#include "../mem/mem.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <sys/mman.h>
+
+/*
+ * Code generation
+ *
+ * Register allocation, for the whole life of a native block:
+ *
+ *   rbx  the machine           r8d   A          r12d  cycles done
+ *   eax  scratch               r9d   X          r13d  instructions done by
+ *   ecx  scratch, address      r10d  Y                the previous loops
+ *   edx  scratch               r11d  N          r14d  cycles budget
+ *   esi  Z                     ebp   V          r15d  instructions budget
+ *   edi  C
+ *
+ * Guest registers hold a byte zero extended to 32 bits, N, Z, C and V are
+ * the unpacked flags of struct central_processing_unit, with the same
+ * meaning. Every memory operand is [rbx + index + disp32], disp32 being the
+ * offset of a field in struct machine.
+ *
+ * Cycles of straight-line code are summed when compiling and only added to
+ * r12d on the way out; page crossings of indexed modes are added as they
+ * happen.
+ */
+
+#define JIT_BLOCK_BYTES 8192 // room for the worst block, exits included
+#define JIT_MAX_EXITS (2 * BLOCK_MAX_INSTS + 2)
+
+#define OFF(field) ((int32_t)offsetof(struct machine, field))
+
+enum {
+  RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+  R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+#define REG_A R8
+#define REG_X R9
+#define REG_Y R10
+#define REG_N R11
+#define REG_Z RSI
+#define REG_C RDI
+#define REG_V RBP
+#define REG_CYCLES R12
+#define REG_LOOPS R13
+#define REG_CYCLES_LEFT R14
+#define REG_INSTS_LEFT R15
+
+// x86 condition codes
+#define CC_AE 0x3
+#define CC_Z 0x4
+#define CC_NZ 0x5
+#define CC_A 0x7
+
+// ALU opcodes, "op r32, r/m32" and the /digit of "op r/m32, imm32"
+#define ALU_ADD 0x03, 0
+#define ALU_OR 0x0B, 1
+#define ALU_AND 0x23, 4
+#define ALU_SUB 0x2B, 5
+#define ALU_XOR 0x33, 6
+#define ALU_CMP 0x3B, 7
+
+/*
+ * Operations and modes of every opcode, from the same list as the cores
+ */
+
+#define JIT_OPERATIONS(X) \
+  X(XXX) X(LDA) X(LDX) X(LDY) X(BRK) X(BPL) X(JSR) X(BMI) X(RTI) X(BVC) \
+  X(RTS) X(BVS) X(NOP) X(BCC) X(BCS) X(BNE) X(CPX) X(CPY) X(BEQ) X(ORA) \
+  X(AND) X(EOR) X(BIT) X(ADC) X(STA) X(STX) X(STY) X(CMP) X(SBC) X(ASL) \
+  X(ROL) X(LSR) X(ROR) X(DEC) X(DEX) X(DEY) X(INC) X(INX) X(INY) X(PHP) \
+  X(SEC) X(CLC) X(CLI) X(PLP) X(PLA) X(PHA) X(SEI) X(TYA) X(CLV) X(CLD) \
+  X(SED) X(TXA) X(TXS) X(TAX) X(TAY) X(TSX) X(JMP)
+
+enum jit_operation {
+#define X(operation) OP_##operation,
+  JIT_OPERATIONS(X)
+#undef X
+};
+
+enum jit_mode {
+  MODE_IMP, MODE_IMM, MODE_ZP0, MODE_ZPX, MODE_ZPY, MODE_ABS,
+  MODE_ABX, MODE_ABY, MODE_IND, MODE_IZX, MODE_IZY, MODE_REL
+};
+
+static const struct {
+  uint8_t operation;
+  uint8_t mode;
+} opcodes[256] = {
+#define X(code, name, operation, mode, cyc) \
+  [code] = {OP_##operation, MODE_##mode},
+  OPCODES(X)
+#undef X
+};
+
+/*
+ * Emitter
+ */
+
+struct jit_exit {
+  size_t patch; // rel32 to point at the stub
+  uint16_t pc;
+  uint32_t cycles;
+  uint32_t insts;
+
+  // after a store to decoded code: the backing page to invalidate,
+  // EXIT_PAGE_IN_EAX when it is only known at run time, EXIT_PLAIN if none
+  int page;
+};
+
+#define EXIT_PLAIN -1
+#define EXIT_PAGE_IN_EAX -2
+
+struct jit_ctx {
+  struct machine* m;
+  struct block* b;
+
+  uint8_t* code;
+  size_t at;
+  size_t size;
+
+  struct jit_exit exits[JIT_MAX_EXITS];
+  unsigned exit_count;
+};
+
+// where an operand lives
+enum jit_ref_kind { REF_MEM, REF_CONST, REF_DROP };
+
+struct jit_ref {
+  enum jit_ref_kind kind;
+  int index; // -1 or a register added to disp
+  int32_t disp;
+  uint8_t value; // REF_CONST
+
+  // writes only: backing page for the code check, -1 if it is index >> 8
+  int page;
+};
+
+static void emit8(struct jit_ctx* c, uint8_t byte) {
+  if (c->at < c->size) c->code[c->at] = byte;
+  c->at++;
+}
+
+static void emit16(struct jit_ctx* c, uint16_t v) {
+  emit8(c, v & 0xFF);
+  emit8(c, v >> 8);
+}
+
+static void emit32(struct jit_ctx* c, uint32_t v) {
+  emit16(c, v & 0xFFFF);
+  emit16(c, v >> 16);
+}
+
+static void emit64(struct jit_ctx* c, uint64_t v) {
+  emit32(c, (uint32_t)v);
+  emit32(c, (uint32_t)(v >> 32));
+}
+
+/**
+ * emit_rex: REX prefix, left out when it would be empty unless a byte
+ * register is involved (spl to dil need it to not mean ah to bh)
+ * @param c The compilation
+ * @param w 64-bit operand size
+ * @param reg ModRM.reg register
+ * @param index SIB.index register, 0 if none
+ * @param rm ModRM.rm or SIB.base register
+ * @param byte_regs Whether an operand is a byte register
+ * @return void
+ */
+static void emit_rex(struct jit_ctx* c, int w, int reg, int index, int rm,
+                     bool byte_regs) {
+  uint8_t rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | ((index >> 3) << 1) |
+                (rm >> 3);
+
+  if (rex != 0x40 || byte_regs) emit8(c, rex);
+}
+
+static void emit_opcode(struct jit_ctx* c, uint16_t opcode) {
+  if (opcode > 0xFF) emit8(c, opcode >> 8);
+  emit8(c, opcode & 0xFF);
+}
+
+/**
+ * emit_rr: An instruction with a register-direct ModRM
+ * @param c The compilation
+ * @param opcode One or two opcode bytes (0x0F escaped ones)
+ * @param w 64-bit operand size
+ * @param byte_regs Whether an operand is a byte register
+ * @param reg ModRM.reg, a register or an opcode extension
+ * @param rm ModRM.rm register
+ * @return void
+ */
+static void emit_rr(struct jit_ctx* c, uint16_t opcode, int w, bool byte_regs,
+                    int reg, int rm) {
+  emit_rex(c, w, reg, 0, rm, byte_regs);
+  emit_opcode(c, opcode);
+  emit8(c, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/**
+ * emit_rm: An instruction with a [base + index + disp32] operand
+ * @param c The compilation
+ * @param opcode One or two opcode bytes
+ * @param byte_regs Whether the reg operand is a byte register
+ * @param reg ModRM.reg, a register or an opcode extension
+ * @param base The base register, never rsp
+ * @param index The index register, -1 if none
+ * @param disp The displacement
+ * @return void
+ */
+static void emit_rm(struct jit_ctx* c, uint16_t opcode, bool byte_regs,
+                    int reg, int base, int index, int32_t disp) {
+  emit_rex(c, 0, reg, index < 0 ? 0 : index, base, byte_regs);
+  emit_opcode(c, opcode);
+
+  if (index < 0 && (base & 7) != RSP) {
+    emit8(c, 0x80 | ((reg & 7) << 3) | (base & 7));
+  } else {
+    emit8(c, 0x80 | ((reg & 7) << 3) | 4);
+    emit8(c, ((index < 0 ? RSP : index & 7) << 3) | (base & 7));
+  }
+  emit32(c, (uint32_t)disp);
+}
+
+static void mov_rr(struct jit_ctx* c, int dst, int src) {
+  emit_rr(c, 0x89, 0, false, src, dst);
+}
+
+static void mov_ri(struct jit_ctx* c, int dst, uint32_t imm) {
+  emit_rex(c, 0, 0, 0, dst, false);
+  emit8(c, 0xB8 | (dst & 7));
+  emit32(c, imm);
+}
+
+// movzx dst, src8
+static void zext8(struct jit_ctx* c, int dst, int src) {
+  emit_rr(c, 0x0FB6, 0, true, dst, src);
+}
+
+// movzx dst, src16
+static void zext16(struct jit_ctx* c, int dst, int src) {
+  emit_rr(c, 0x0FB7, 0, false, dst, src);
+}
+
+// movzx dst, byte [rbx + index + disp]
+static void load8(struct jit_ctx* c, int dst, int index, int32_t disp) {
+  emit_rm(c, 0x0FB6, false, dst, RBX, index, disp);
+}
+
+// mov byte [rbx + index + disp], src8
+static void store8(struct jit_ctx* c, int src, int index, int32_t disp) {
+  emit_rm(c, 0x88, true, src, RBX, index, disp);
+}
+
+// lea dst, [base + index + disp]
+static void lea(struct jit_ctx* c, int dst, int base, int index, int32_t disp) {
+  emit_rm(c, 0x8D, false, dst, base, index, disp);
+}
+
+static void alu_rr(struct jit_ctx* c, uint8_t opcode, int ext, int dst,
+                   int src) {
+  (void)ext;
+  emit_rr(c, opcode, 0, false, dst, src);
+}
+
+static void alu_ri(struct jit_ctx* c, uint8_t opcode, int ext, int dst,
+                   uint32_t imm) {
+  (void)opcode;
+  emit_rr(c, 0x81, 0, false, ext, dst);
+  emit32(c, imm);
+}
+
+static void shift_ri(struct jit_ctx* c, int ext, int dst, uint8_t count) {
+  emit_rr(c, 0xC1, 0, false, ext, dst);
+  emit8(c, count);
+}
+
+#define shl_ri(c, dst, count) shift_ri(c, 4, dst, count)
+#define shr_ri(c, dst, count) shift_ri(c, 5, dst, count)
+
+static void test_ri(struct jit_ctx* c, int dst, uint32_t imm) {
+  emit_rr(c, 0xF7, 0, false, 0, dst);
+  emit32(c, imm);
+}
+
+static void test_rr(struct jit_ctx* c, int a, int b) {
+  emit_rr(c, 0x85, 0, false, b, a);
+}
+
+// "op byte [rbx + disp], imm8", ext being the /digit of opcode 0x80
+static void mem8_imm(struct jit_ctx* c, int ext, int index, int32_t disp,
+                     uint8_t imm) {
+  emit_rm(c, 0x80, false, ext, RBX, index, disp);
+  emit8(c, imm);
+}
+
+// mov byte [rbx + index + disp], imm8
+static void mem8_mov(struct jit_ctx* c, int index, int32_t disp, uint8_t imm) {
+  emit_rm(c, 0xC6, false, 0, RBX, index, disp);
+  emit8(c, imm);
+}
+
+static void store_pc(struct jit_ctx* c, uint16_t pc) {
+  emit8(c, 0x66);
+  emit_rm(c, 0xC7, false, 0, RBX, -1, OFF(cpu.pc));
+  emit16(c, pc);
+}
+
+static void push(struct jit_ctx* c, int reg) {
+  emit_rex(c, 0, 0, 0, reg, false);
+  emit8(c, 0x50 | (reg & 7));
+}
+
+static void pop(struct jit_ctx* c, int reg) {
+  emit_rex(c, 0, 0, 0, reg, false);
+  emit8(c, 0x58 | (reg & 7));
+}
+
+/**
+ * jump: jmp or jcc rel32 to a target not emitted yet
+ * @param c The compilation
+ * @param cc A condition code, -1 for an unconditional jump
+ * @return where the rel32 is, see patch()
+ */
+static size_t jump(struct jit_ctx* c, int cc) {
+  if (cc < 0) {
+    emit8(c, 0xE9);
+  } else {
+    emit8(c, 0x0F);
+    emit8(c, 0x80 | cc);
+  }
+  emit32(c, 0);
+  return c->at - 4;
+}
+
+static void patch(struct jit_ctx* c, size_t at, size_t target) {
+  uint32_t rel = (uint32_t)(target - (at + 4));
+
+  if (at + 4 <= c->size) memcpy(c->code + at, &rel, 4);
+}
+
+static void jump_back(struct jit_ctx* c, size_t target) {
+  patch(c, jump(c, -1), target);
+}
+
+/**
+ * exit_to: Leave the native block, to a stub emitted after it
+ * @param c The compilation
+ * @param cc A condition code, -1 to always leave
+ * @param pc Where the interpreter resumes
+ * @param cycles Cycles known when compiling, r12d holds the others
+ * @param insts Instructions executed in this pass
+ * @param page What to invalidate first, see struct jit_exit
+ * @return false if there are too many exits
+ */
+static bool exit_to(struct jit_ctx* c, int cc, uint16_t pc, uint32_t cycles,
+                    uint32_t insts, int page) {
+  if (c->exit_count == JIT_MAX_EXITS) return false;
+
+  struct jit_exit* e = &c->exits[c->exit_count++];
+
+  e->patch = jump(c, cc);
+  e->pc = pc;
+  e->cycles = cycles;
+  e->insts = insts;
+  e->page = page;
+  return true;
+}
+
+static void set_nz(struct jit_ctx* c, int reg) {
+  mov_rr(c, REG_N, reg);
+  mov_rr(c, REG_Z, reg);
+}
+
+static void write_back(struct jit_ctx* c) {
+  store8(c, REG_A, -1, OFF(cpu.ac));
+  store8(c, REG_X, -1, OFF(cpu.x));
+  store8(c, REG_Y, -1, OFF(cpu.y));
+  store8(c, REG_N, -1, OFF(cpu.n));
+  store8(c, REG_Z, -1, OFF(cpu.z));
+  store8(c, REG_C, -1, OFF(cpu.c));
+  store8(c, REG_V, -1, OFF(cpu.v));
+}
+
+/*
+ * Addressing modes
+ */
+
+/**
+ * page_ref: Where the bytes of a page are for the bus, as of now: the
+ * memory map can't change under a native block, since remapping drops
+ * every decoded block
+ * @param c The compilation
+ * @param page The page
+ * @param write Whether for writing
+ * @param ref Set to the page's first byte, index left alone
+ * @return false for I/O
+ */
+static bool page_ref(struct jit_ctx* c, uint8_t page, bool write,
+                     struct jit_ref* ref) {
+  const struct mem* mem = &c->m->mem;
+  uint32_t offset = write ? mem->write_page[page] : mem->read_page[page];
+
+  // watched, every access goes through the bus
+  if (mem->trapped[page]) return false;
+
+  if (offset == MEM_PAGE_IO) {
+    // ROM, or writes the handlers would drop anyway
+    if (write && mem->io[page].write == NULL) {
+      ref->kind = REF_DROP;
+      return true;
+    }
+    return false;
+  }
+
+  ref->kind = REF_MEM;
+  ref->disp = OFF(mem.data) + (int32_t)offset;
+  ref->page = offset >> 8;
+  return true;
+}
+
+/**
+ * direct_ref: An address computed at run time in ecx, the bus must be
+ * direct so that it indexes data as it is
+ * @param c The compilation
+ * @param write Whether for writing
+ * @param ref Set
+ * @return false if the page table is in use
+ */
+static bool direct_ref(struct jit_ctx* c, bool write, struct jit_ref* ref) {
+  if (!(write ? c->m->mem.write_direct : c->m->mem.read_direct)) return false;
+
+  ref->kind = REF_MEM;
+  ref->index = RCX;
+  ref->disp = OFF(mem.data);
+  ref->page = -1;
+  return true;
+}
+
+/**
+ * address: Emit the effective address computation of an instruction and
+ * tell where its operand is read from and written to
+ * @param c The compilation
+ * @param mode The addressing mode
+ * @param operand The operand, as predecoded
+ * @param extra Whether the operation takes the page crossing cycle
+ * @param read Set for reading, NULL if the operand isn't read
+ * @param write Set for writing, NULL if the operand isn't written
+ * @return false if this can't be compiled
+ */
+static bool address(struct jit_ctx* c, uint8_t mode, uint16_t operand,
+                    bool extra, struct jit_ref* read, struct jit_ref* write) {
+  const struct mem* mem = &c->m->mem;
+  struct jit_ref zp;
+  uint16_t addr;
+
+  if (read != NULL) read->index = -1;
+  if (write != NULL) write->index = -1;
+
+  switch (mode) {
+  case MODE_IMM:
+    // the constant is a byte of the block, stores to it leave the block
+    if (read == NULL || write != NULL) return false;
+    read->kind = REF_CONST;
+    read->value =
+        mem->data[mem->read_page[operand >> 8] | (operand & 0xFF)];
+    return true;
+
+  case MODE_ZP0:
+  case MODE_ABS:
+    addr = mode == MODE_ZP0 ? operand & 0xFF : operand;
+    if (read != NULL) {
+      if (!page_ref(c, addr >> 8, false, read)) return false;
+      read->disp += addr & 0xFF;
+    }
+    if (write != NULL) {
+      if (!page_ref(c, addr >> 8, true, write)) return false;
+      write->disp += addr & 0xFF;
+    }
+    return true;
+
+  case MODE_ZPX:
+  case MODE_ZPY:
+    if ((read != NULL && !page_ref(c, 0x00, false, read)) ||
+        (write != NULL && !page_ref(c, 0x00, true, write))) {
+      return false;
+    }
+    lea(c, RCX, mode == MODE_ZPX ? REG_X : REG_Y, -1, operand & 0xFF);
+    zext8(c, RCX, RCX);
+    if (read != NULL) read->index = RCX;
+    if (write != NULL) write->index = RCX;
+    return true;
+
+  case MODE_ABX:
+  case MODE_ABY:
+    if ((read != NULL && !direct_ref(c, false, read)) ||
+        (write != NULL && !direct_ref(c, true, write))) {
+      return false;
+    }
+    {
+      int reg = mode == MODE_ABX ? REG_X : REG_Y;
+
+      if (extra) {
+        lea(c, RAX, reg, -1, operand & 0xFF);
+        shr_ri(c, RAX, 8);
+        alu_rr(c, ALU_ADD, REG_CYCLES, RAX);
+      }
+      lea(c, RCX, reg, -1, operand);
+      zext16(c, RCX, RCX);
+    }
+    return true;
+
+  case MODE_IZX:
+    if (!page_ref(c, 0x00, false, &zp) || zp.kind != REF_MEM ||
+        (read != NULL && !direct_ref(c, false, read)) ||
+        (write != NULL && !direct_ref(c, true, write))) {
+      return false;
+    }
+    lea(c, RDX, REG_X, -1, operand & 0xFF);
+    zext8(c, RDX, RDX);
+    load8(c, RCX, RDX, zp.disp);
+    lea(c, RDX, RDX, -1, 1);
+    zext8(c, RDX, RDX);
+    load8(c, RAX, RDX, zp.disp);
+    shl_ri(c, RAX, 8);
+    alu_rr(c, ALU_OR, RCX, RAX);
+    return true;
+
+  case MODE_IZY:
+    if (!page_ref(c, 0x00, false, &zp) || zp.kind != REF_MEM ||
+        (read != NULL && !direct_ref(c, false, read)) ||
+        (write != NULL && !direct_ref(c, true, write))) {
+      return false;
+    }
+    load8(c, RCX, -1, zp.disp + (operand & 0xFF));
+    load8(c, RAX, -1, zp.disp + ((operand + 1) & 0xFF));
+    if (extra) {
+      lea(c, RDX, RCX, REG_Y, 0);
+      shr_ri(c, RDX, 8);
+      alu_rr(c, ALU_ADD, REG_CYCLES, RDX);
+    }
+    shl_ri(c, RAX, 8);
+    alu_rr(c, ALU_OR, RCX, RAX);
+    alu_rr(c, ALU_ADD, RCX, REG_Y);
+    zext16(c, RCX, RCX);
+    return true;
+
+  default:
+    return false;
+  }
+}
+
+// load the operand into dst
+static void load_ref(struct jit_ctx* c, int dst, const struct jit_ref* ref) {
+  if (ref->kind == REF_CONST) {
+    mov_ri(c, dst, ref->value);
+  } else {
+    load8(c, dst, ref->index, ref->disp);
+  }
+}
+
+/**
+ * store_ref: Store a byte register into the operand and mark its page
+ * dirty, then leave if it landed on decoded code, as the bus does
+ * @param c The compilation
+ * @param src The register
+ * @param ref The operand
+ * @param next PC of the next instruction
+ * @param cycles Cycles up to this instruction included
+ * @param insts Instructions up to this one included
+ * @return false if there are too many exits
+ */
+static bool store_ref(struct jit_ctx* c, int src, const struct jit_ref* ref,
+                      uint16_t next, uint32_t cycles, uint32_t insts) {
+  if (ref->kind == REF_DROP) return true;
+
+  store8(c, src, ref->index, ref->disp);
+
+  if (ref->page >= 0) {
+    mem8_mov(c, -1, OFF(mem.dirty) + ref->page, MEM_DIRTY_ALL);
+    mem8_imm(c, 7, -1, OFF(mem.code) + ref->page, 0);
+    return exit_to(c, CC_NZ, next, cycles, insts, ref->page);
+  }
+
+  mov_rr(c, RAX, ref->index);
+  shr_ri(c, RAX, 8);
+  mem8_mov(c, RAX, OFF(mem.dirty), MEM_DIRTY_ALL);
+  mem8_imm(c, 7, RAX, OFF(mem.code), 0);
+  return exit_to(c, CC_NZ, next, cycles, insts, EXIT_PAGE_IN_EAX);
+}
+
+/*
+ * Instructions
+ */
+
+static bool takes_extra_cycle(uint8_t operation) {
+  switch (operation) {
+  case OP_ADC: case OP_AND: case OP_CMP: case OP_EOR: case OP_LDA:
+  case OP_LDX: case OP_LDY: case OP_ORA: case OP_SBC:
+    return true;
+  default:
+    return false;
+  }
+}
+
+/**
+ * compile_branch: The conditional or unconditional jump ending a block.
+ * A jump back to the start of the block loops in native code while the
+ * budgets allow for a whole pass, as cpu_run() would run it again
+ * @param c The compilation
+ * @param operation The operation
+ * @param target Where it jumps to
+ * @param next PC of the next instruction
+ * @param cycles Cycles up to this instruction included, not taken
+ * @param insts Instructions up to this one included
+ * @param top Start of the loop body
+ * @return false if there are too many exits
+ */
+static bool compile_branch(struct jit_ctx* c, uint8_t operation,
+                           uint16_t target, uint16_t next, uint32_t cycles,
+                           uint32_t insts, size_t top) {
+  const struct block* b = c->b;
+  int cond = -1; // taken when cond is set
+  int flag = -1;
+  uint32_t mask = 0;
+
+  switch (operation) {
+  case OP_BCC: flag = REG_C; cond = CC_Z; break;
+  case OP_BCS: flag = REG_C; cond = CC_NZ; break;
+  case OP_BNE: flag = REG_Z; cond = CC_NZ; break;
+  case OP_BEQ: flag = REG_Z; cond = CC_Z; break;
+  case OP_BVC: flag = REG_V; cond = CC_Z; break;
+  case OP_BVS: flag = REG_V; cond = CC_NZ; break;
+  case OP_BPL: flag = REG_N; cond = CC_Z; mask = 0x80; break;
+  case OP_BMI: flag = REG_N; cond = CC_NZ; mask = 0x80; break;
+  default: break;
+  }
+
+  if (cond >= 0) {
+    if (mask) {
+      test_ri(c, flag, mask);
+    } else {
+      test_rr(c, flag, flag);
+    }
+    if (!exit_to(c, cond ^ 1, next, cycles, insts, EXIT_PLAIN)) return false;
+
+    // taken: one more cycle, two when landing on another page
+    cycles += 1 + ((target & 0xFF00) != (next & 0xFF00));
+  }
+
+  if (target != b->pc || b->count == 1) {
+    return exit_to(c, -1, target, cycles, insts, EXIT_PLAIN);
+  }
+
+  alu_ri(c, ALU_ADD, REG_CYCLES, cycles);
+  alu_ri(c, ALU_ADD, REG_LOOPS, insts);
+
+  // another pass if cycles + max_cycles <= budget and the same for
+  // instructions, see block_fits()
+  lea(c, RAX, REG_CYCLES, -1, b->max_cycles);
+  alu_rr(c, ALU_CMP, RAX, REG_CYCLES_LEFT);
+  if (!exit_to(c, CC_A, target, 0, 0, EXIT_PLAIN)) return false;
+  lea(c, RAX, REG_LOOPS, -1, b->count);
+  alu_rr(c, ALU_CMP, RAX, REG_INSTS_LEFT);
+  if (!exit_to(c, CC_A, target, 0, 0, EXIT_PLAIN)) return false;
+  jump_back(c, top);
+  return true;
+}
+
+/**
+ * compile_inst: Translate an instruction, with the same results as its
+ * handlers in instructions.c
+ * @param c The compilation
+ * @param inst The predecoded instruction
+ * @param pc Its PC
+ * @param cycles Cycles of the instructions before it
+ * @param index How many instructions are before it
+ * @param top Start of the loop body
+ * @return false if it can't be translated, nothing is emitted then
+ */
+static bool compile_inst(struct jit_ctx* c, const struct block_inst* inst,
+                         uint16_t pc, uint32_t cycles, uint32_t index,
+                         size_t top) {
+  uint8_t operation = opcodes[inst->opcode].operation;
+  uint8_t mode = opcodes[inst->opcode].mode;
+  bool extra = takes_extra_cycle(operation);
+  uint16_t next = pc + inst->length;
+  uint32_t done = cycles + inst->cycles;
+  struct jit_ref rd;
+  struct jit_ref wr;
+  size_t start = c->at;
+  unsigned exits = c->exit_count;
+  int reg;
+
+  // anything emitted by a failed attempt is dropped
+#define TRY(x)                 \
+  do {                         \
+    if (!(x)) {                \
+      c->at = start;           \
+      c->exit_count = exits;   \
+      return false;            \
+    }                          \
+  } while (0)
+
+  switch (operation) {
+  case OP_LDA:
+  case OP_LDX:
+  case OP_LDY:
+    reg = operation == OP_LDA ? REG_A : operation == OP_LDX ? REG_X : REG_Y;
+    TRY(address(c, mode, inst->operand, extra, &rd, NULL));
+    load_ref(c, reg, &rd);
+    set_nz(c, reg);
+    return true;
+
+  case OP_STA:
+  case OP_STX:
+  case OP_STY:
+    reg = operation == OP_STA ? REG_A : operation == OP_STX ? REG_X : REG_Y;
+    TRY(address(c, mode, inst->operand, false, NULL, &wr));
+    TRY(store_ref(c, reg, &wr, next, done, index + 1));
+    return true;
+
+  case OP_AND:
+  case OP_ORA:
+  case OP_EOR:
+    TRY(address(c, mode, inst->operand, extra, &rd, NULL));
+    load_ref(c, RAX, &rd);
+    if (operation == OP_AND) alu_rr(c, ALU_AND, REG_A, RAX);
+    if (operation == OP_ORA) alu_rr(c, ALU_OR, REG_A, RAX);
+    if (operation == OP_EOR) alu_rr(c, ALU_XOR, REG_A, RAX);
+    set_nz(c, REG_A);
+    return true;
+
+  case OP_ADC:
+  case OP_SBC:
+    TRY(address(c, mode, inst->operand, extra, &rd, NULL));
+    load_ref(c, RAX, &rd);
+    if (operation == OP_SBC) alu_ri(c, ALU_XOR, RAX, 0xFF);
+
+    // edx = A + M + C, at most 0x1FF
+    lea(c, RDX, REG_A, RAX, 0);
+    alu_rr(c, ALU_ADD, RDX, REG_C);
+
+    // V = ~(A ^ M) & (A ^ result) & 0x80 for ADC, M being the inverted
+    // operand for SBC: (result ^ A) & (result ^ M) & 0x80
+    mov_rr(c, RCX, REG_A);
+    alu_rr(c, ALU_XOR, RCX, RDX);
+    if (operation == OP_ADC) {
+      alu_rr(c, ALU_XOR, RAX, REG_A);
+      emit_rr(c, 0xF7, 0, false, 2, RAX); // not eax
+    } else {
+      alu_rr(c, ALU_XOR, RAX, RDX);
+    }
+    alu_rr(c, ALU_AND, RCX, RAX);
+    shr_ri(c, RCX, 7);
+    alu_ri(c, ALU_AND, RCX, 1);
+    mov_rr(c, REG_V, RCX);
+
+    mov_rr(c, REG_C, RDX);
+    shr_ri(c, REG_C, 8);
+    zext8(c, REG_A, RDX);
+    set_nz(c, REG_A);
+    return true;
+
+  case OP_CMP:
+  case OP_CPX:
+  case OP_CPY:
+    reg = operation == OP_CMP ? REG_A : operation == OP_CPX ? REG_X : REG_Y;
+    TRY(address(c, mode, inst->operand, extra, &rd, NULL));
+    load_ref(c, RAX, &rd);
+    mov_rr(c, RDX, reg);
+    alu_rr(c, ALU_XOR, REG_C, REG_C);
+    alu_rr(c, ALU_SUB, RDX, RAX);
+    emit_rr(c, 0x0F90 | CC_AE, 0, true, 0, REG_C); // setae dil
+    zext8(c, RDX, RDX);
+    set_nz(c, RDX);
+    return true;
+
+  case OP_BIT:
+    TRY(address(c, mode, inst->operand, false, &rd, NULL));
+    load_ref(c, RAX, &rd);
+    mov_rr(c, REG_Z, REG_A);
+    alu_rr(c, ALU_AND, REG_Z, RAX);
+    mov_rr(c, REG_N, RAX);
+    mov_rr(c, REG_V, RAX);
+    shr_ri(c, REG_V, 6);
+    alu_ri(c, ALU_AND, REG_V, 1);
+    return true;
+
+  case OP_INC:
+  case OP_DEC:
+  case OP_ASL:
+  case OP_LSR:
+  case OP_ROL:
+  case OP_ROR:
+    if (mode == MODE_IMP) {
+      mov_rr(c, RAX, REG_A);
+    } else {
+      TRY(address(c, mode, inst->operand, false, &rd, &wr));
+      load_ref(c, RAX, &rd);
+    }
+
+    switch (operation) {
+    case OP_INC:
+      alu_ri(c, ALU_ADD, RAX, 1);
+      break;
+    case OP_DEC:
+      alu_ri(c, ALU_SUB, RAX, 1);
+      break;
+    case OP_ASL:
+      alu_rr(c, ALU_ADD, RAX, RAX);
+      mov_rr(c, REG_C, RAX);
+      shr_ri(c, REG_C, 8);
+      break;
+    case OP_ROL:
+      alu_rr(c, ALU_ADD, RAX, RAX);
+      alu_rr(c, ALU_OR, RAX, REG_C);
+      mov_rr(c, REG_C, RAX);
+      shr_ri(c, REG_C, 8);
+      break;
+    case OP_LSR:
+      mov_rr(c, REG_C, RAX);
+      alu_ri(c, ALU_AND, REG_C, 1);
+      shr_ri(c, RAX, 1);
+      break;
+    case OP_ROR:
+      // ecx holds the address
+      mov_rr(c, RDX, REG_C);
+      shl_ri(c, RDX, 7);
+      mov_rr(c, REG_C, RAX);
+      alu_ri(c, ALU_AND, REG_C, 1);
+      shr_ri(c, RAX, 1);
+      alu_rr(c, ALU_OR, RAX, RDX);
+      break;
+    }
+    zext8(c, RAX, RAX);
+    set_nz(c, RAX);
+
+    if (mode == MODE_IMP) {
+      mov_rr(c, REG_A, RAX);
+    } else {
+      TRY(store_ref(c, RAX, &wr, next, done, index + 1));
+    }
+    return true;
+
+  case OP_INX:
+  case OP_INY:
+  case OP_DEX:
+  case OP_DEY:
+    reg = operation == OP_INX || operation == OP_DEX ? REG_X : REG_Y;
+    if (operation == OP_INX || operation == OP_INY) {
+      alu_ri(c, ALU_ADD, reg, 1);
+    } else {
+      alu_ri(c, ALU_SUB, reg, 1);
+    }
+    zext8(c, reg, reg);
+    set_nz(c, reg);
+    return true;
+
+  case OP_TAX: mov_rr(c, REG_X, REG_A); set_nz(c, REG_X); return true;
+  case OP_TAY: mov_rr(c, REG_Y, REG_A); set_nz(c, REG_Y); return true;
+  case OP_TXA: mov_rr(c, REG_A, REG_X); set_nz(c, REG_A); return true;
+  case OP_TYA: mov_rr(c, REG_A, REG_Y); set_nz(c, REG_A); return true;
+
+  case OP_TSX:
+    load8(c, REG_X, -1, OFF(cpu.sp));
+    set_nz(c, REG_X);
+    return true;
+
+  case OP_TXS:
+    store8(c, REG_X, -1, OFF(cpu.sp));
+    return true;
+
+  case OP_CLC: alu_rr(c, ALU_XOR, REG_C, REG_C); return true;
+  case OP_SEC: mov_ri(c, REG_C, 1); return true;
+  case OP_CLV: alu_rr(c, ALU_XOR, REG_V, REG_V); return true;
+
+  // I and D stay in sr, see cpu.h. CLI is left to the interpreter, which
+  // has cpu_run() look at a pending IRQ after it
+  case OP_SEI: mem8_imm(c, 1, -1, OFF(cpu.sr), 1 << I); return true;
+  case OP_CLD: mem8_imm(c, 4, -1, OFF(cpu.sr), (uint8_t)~(1 << D)); return true;
+  case OP_SED: mem8_imm(c, 1, -1, OFF(cpu.sr), 1 << D); return true;
+
+  case OP_BCC: case OP_BCS: case OP_BNE: case OP_BEQ:
+  case OP_BVC: case OP_BVS: case OP_BPL: case OP_BMI:
+    TRY(compile_branch(c, operation,
+                       (uint16_t)(next + (int8_t)(inst->operand & 0xFF)),
+                       next, done, index + 1, top));
+    return true;
+
+  case OP_JMP:
+    if (mode != MODE_ABS) return false;
+    TRY(compile_branch(c, operation, inst->operand, next, done, index + 1,
+                       top));
+    return true;
+
+  default:
+    // stack, subroutines, interrupts and NOP are left to the interpreter
+    return false;
+  }
+#undef TRY
+}
+
+/**
+ * emit_exits: The stubs the native block leaves through. Each one sets
+ * the PC and the counters for the common epilogue, a store to decoded code
+ * first has the page invalidated like machine_write() would
+ * @param c The compilation
+ * @param epilogue Where registers are written back and the block returns
+ * @param leave Same, past the write back
+ * @return void
+ */
+static void emit_exits(struct jit_ctx* c, size_t epilogue, size_t leave) {
+  for (unsigned i = 0; i < c->exit_count; i++) {
+    const struct jit_exit* e = &c->exits[i];
+    void (*invalidate)(struct machine*, uint8_t) = mem_code_invalidate;
+    uint64_t target;
+
+    patch(c, e->patch, c->at);
+
+    if (e->page != EXIT_PLAIN) {
+      write_back(c);
+      if (e->page == EXIT_PAGE_IN_EAX) {
+        mov_rr(c, RSI, RAX);
+      } else {
+        mov_ri(c, RSI, (uint32_t)e->page);
+      }
+      emit_rr(c, 0x89, 1, false, RBX, RDI); // mov rdi, rbx
+      memcpy(&target, &invalidate, sizeof(target));
+      emit8(c, 0x48); // movabs rax, target
+      emit8(c, 0xB8);
+      emit64(c, target);
+      emit8(c, 0xFF); // call rax
+      emit8(c, 0xD0);
+    }
+
+    store_pc(c, e->pc);
+    if (e->cycles) alu_ri(c, ALU_ADD, REG_CYCLES, e->cycles);
+    mov_ri(c, RDX, e->insts);
+    jump_back(c, e->page != EXIT_PLAIN ? leave : epilogue);
+  }
+}
+
+/**
+ * jit_compile: Translate the longest prefix of a block that can be
+ * @param m The machine, its JIT enabled
+ * @param b The block, just decoded from the current memory map
+ * @return the native code, NULL if not even the first instruction is
+ * supported
+ */
+jit_native jit_compile(struct machine* m, struct block* b) {
+  struct jit* j = m->jit;
+
+  if (j->size - j->used < JIT_BLOCK_BYTES) {
+    // start over, dropping every translation: blocks count their runs
+    // again, or those that were hot would never be translated anymore
+    for (unsigned i = 0; i < BLOCK_CACHE_SIZE; i++) {
+      m->blocks.blocks[i].native = NULL;
+      m->blocks.blocks[i].hits = 0;
+    }
+    j->used = 0;
+    j->flushes++;
+  }
+
+  struct jit_ctx ctx;
+  struct jit_ctx* c = &ctx;
+
+  c->m = m;
+  c->b = b;
+  c->code = j->code + j->used;
+  c->at = 0;
+  c->size = JIT_BLOCK_BYTES;
+  c->exit_count = 0;
+
+  // prologue: uint64_t native(struct machine* m, uint32_t cycles_left,
+  // uint32_t insts_left), rsp stays 16-byte aligned for the calls
+  push(c, RBX);
+  push(c, RBP);
+  push(c, R12);
+  push(c, R13);
+  push(c, R14);
+  push(c, R15);
+  emit_rr(c, 0x83, 1, false, 5, RSP); // sub rsp, 8
+  emit8(c, 8);
+
+  emit_rr(c, 0x89, 1, false, RDI, RBX); // mov rbx, rdi
+  mov_rr(c, REG_CYCLES_LEFT, RSI);
+  mov_rr(c, REG_INSTS_LEFT, RDX);
+  alu_rr(c, ALU_XOR, REG_CYCLES, REG_CYCLES);
+  alu_rr(c, ALU_XOR, REG_LOOPS, REG_LOOPS);
+
+  load8(c, REG_A, -1, OFF(cpu.ac));
+  load8(c, REG_X, -1, OFF(cpu.x));
+  load8(c, REG_Y, -1, OFF(cpu.y));
+  load8(c, REG_N, -1, OFF(cpu.n));
+  load8(c, REG_Z, -1, OFF(cpu.z));
+  load8(c, REG_C, -1, OFF(cpu.c));
+  load8(c, REG_V, -1, OFF(cpu.v));
+
+  size_t top = c->at;
+  uint16_t pc = b->pc;
+  uint32_t cycles = 0;
+  bool jumped = false;
+  unsigned i;
+
+  for (i = 0; i < b->count; i++) {
+    const struct block_inst* inst = &b->insts[i];
+
+    if (!compile_inst(c, inst, pc, cycles, i, top)) break;
+    cycles += inst->cycles;
+    pc += inst->length;
+    jumped = opcodes[inst->opcode].mode == MODE_REL ||
+             opcodes[inst->opcode].operation == OP_JMP;
+  }
+
+  // the interpreter takes over at the first unsupported instruction or
+  // right after the block, unless it ended with a jump that left already
+  bool ok = i > 0 && (jumped || exit_to(c, -1, pc, cycles, i, EXIT_PLAIN));
+
+  // epilogue: rax = instructions << 32 | cycles
+  size_t epilogue = c->at;
+  write_back(c);
+  size_t leave = c->at;
+  alu_rr(c, ALU_ADD, RDX, REG_LOOPS);
+  mov_rr(c, RAX, REG_CYCLES);
+  emit_rr(c, 0xC1, 1, false, 4, RDX); // shl rdx, 32
+  emit8(c, 32);
+  emit_rr(c, 0x09, 1, false, RDX, RAX); // or rax, rdx
+  emit_rr(c, 0x83, 1, false, 0, RSP); // add rsp, 8
+  emit8(c, 8);
+  pop(c, R15);
+  pop(c, R14);
+  pop(c, R13);
+  pop(c, R12);
+  pop(c, RBP);
+  pop(c, RBX);
+  emit8(c, 0xC3); // ret
+
+  emit_exits(c, epilogue, leave);
+
+  jit_native native = NULL;
+
+  if (ok && c->at <= c->size) {
+    void* code = c->code;
+
+    memcpy(&native, &code, sizeof(native));
+    j->used += (c->at + 15) & ~(size_t)15;
+    j->compiled++;
+  }
+
+  return native;
+}
+
+/**
+ * jit_enable: Give a machine an executable buffer, cpu_run() then
+ * translates its hot blocks
+ * @param m The machine
+ * @return 0 on success, 1 if the buffer can't be mapped
+ */
+int jit_enable(struct machine* m) {
+  if (m->jit != NULL) return 0;
+
+  struct jit* j = calloc(1, sizeof(*j));
+  if (j == NULL) return 1;
+
+  void* code = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (code == MAP_FAILED) {
+    free(j);
+    return 1;
+  }
+
+  j->code = code;
+  j->size = JIT_BUFFER_SIZE;
+  m->jit = j;
+  return 0;
+}
+
+/**
+ * jit_disable: Drop every translation and the buffer, cpu_run() goes back
+ * to interpreting everything. Can be called between any two cpu_run()
+ * @param m The machine
+ * @return void
+ */
+void jit_disable(struct machine* m) {
+  if (m->jit == NULL) return;
+
+  for (unsigned i = 0; i < BLOCK_CACHE_SIZE; i++) {
+    m->blocks.blocks[i].native = NULL;
+    m->blocks.blocks[i].hits = 0;
+  }
+
+  munmap(m->jit->code, m->jit->size);
+  free(m->jit);
+  m->jit = NULL;
+}
+
+#else
+
+int jit_enable(struct machine* m) {
+  (void)m;
+  return 1;
+}
+
+void jit_disable(struct machine* m) {
+  (void)m;
+}
+
+jit_native jit_compile(struct machine* m, struct block* b) {
+  (void)m;
+  (void)b;
+  return NULL;
+}
+
+#endif
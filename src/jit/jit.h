@@ -0,0 +1,57 @@
+#ifndef INC_6502_JIT_H
+#define INC_6502_JIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Dynamic recompiler, Linux x86-64 only.
+ *
+ * Blocks of the block cache (src/cpu/block.h) that ran JIT_HOT times are
+ * translated to native code in an mmap'd buffer. While a translated block
+ * runs, the guest A, X, Y and the unpacked N, Z, C, V live in host
+ * registers; they are written back to the machine on every exit.
+ *
+ * Only the longest translatable prefix of a block is compiled: the native
+ * code exits to the interpreter in instructions.c right before anything it
+ * doesn't handle (stack, subroutines, interrupts and CLI, indirect jumps, I/O
+ * pages, memory maps it can't resolve when compiling). It also exits right
+ * after a store that lands on a page holding decoded code, once the page is
+ * invalidated. A page invalidated MEM_CODE_WRITES_MAX times gets no block,
+ * so nothing of it is translated either, see src/cpu/block.h.
+ *
+ * A native block returns the cycles it took in the low 32 bits and the
+ * instructions it executed in the high 32 bits, with m->cpu.pc set to
+ * where the interpreter has to resume. A block ending with a jump back to
+ * its own start keeps looping in native code while another whole pass fits
+ * in the budgets it is given.
+ */
+
+#define JIT_HOT 16
+// a smaller buffer, -DJIT_BUFFER_SIZE=..., makes the tests flush it
+#ifndef JIT_BUFFER_SIZE
+#define JIT_BUFFER_SIZE (4 * 1024 * 1024)
+#endif
+
+struct machine;
+struct block;
+
+// cycles_left and insts_left bound the passes of a block looping on itself
+typedef uint64_t (*jit_native)(struct machine* m, uint32_t cycles_left,
+                               uint32_t insts_left);
+
+struct jit {
+  uint8_t* code;
+  size_t size;
+  size_t used;
+
+  // blocks translated since the buffer was last emptied
+  uint64_t compiled;
+  uint64_t flushes;
+};
+
+int jit_enable(struct machine* m);
+void jit_disable(struct machine* m);
+jit_native jit_compile(struct machine* m, struct block* b);
+
+#endif
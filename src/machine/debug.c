@@ -0,0 +1,284 @@
+#include "debug.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../mem/mem.h"
+#include "machine.h"
+
+/**
+ * attach: The debugger of a machine, allocated on the first breakpoint or
+ * watchpoint
+ * @param m The machine
+ * @return the debugger, NULL if out of memory
+ * */
+static struct debug* attach(struct machine* m) {
+  if (m->debug == NULL) {
+    m->debug = calloc(1, sizeof(*m->debug));
+    if (m->debug != NULL) m->debug->resume_at = UINT64_MAX;
+  }
+  return m->debug;
+}
+
+// detach: give the hot loop its NULL back once nothing is armed
+static void detach(struct machine* m) {
+  if (m->debug->break_count == 0 && m->debug->watch_count == 0) {
+    free(m->debug);
+    m->debug = NULL;
+  }
+}
+
+/**
+ * debug_break: Stop runs before the instruction at some PC
+ * @param m The machine
+ * @param addr The PC
+ * @return 0 if success, 1 if failure
+ * */
+int debug_break(struct machine* m, uint16_t addr) {
+  struct debug* d = attach(m);
+  if (d == NULL) return 1;
+
+  if (!debug_break_at(d, addr)) {
+    d->breaks[addr >> 3] |= (uint8_t)(1 << (addr & 7));
+    d->break_count++;
+    // blocks are cut at breakpoints when decoded
+    mem_code_invalidate_all(m);
+  }
+  return 0;
+}
+
+/**
+ * debug_unbreak: Remove the breakpoint at some PC, if any
+ * @param m The machine
+ * @param addr The PC
+ * @return void
+ * */
+void debug_unbreak(struct machine* m, uint16_t addr) {
+  struct debug* d = m->debug;
+  if (d == NULL || !debug_break_at(d, addr)) return;
+
+  d->breaks[addr >> 3] &= (uint8_t)~(1 << (addr & 7));
+  d->break_count--;
+  mem_code_invalidate_all(m);
+  detach(m);
+}
+
+/**
+ * debug_watch: Watch a range of addresses, adding to their watches
+ * @param m The machine
+ * @param first The first address
+ * @param last The last address, inclusive
+ * @param kinds DEBUG_WATCH_* bits
+ * @return 0 if success, 1 if failure
+ * */
+int debug_watch(struct machine* m, uint16_t first, uint16_t last, uint8_t kinds) {
+  struct debug* d = attach(m);
+  if (d == NULL) return 1;
+
+  for (uint32_t addr = first; addr <= last; addr++) {
+    if (d->watches[addr] == 0) d->watch_count++;
+    d->watches[addr] |= kinds;
+    mem_trap(m, (uint8_t)(addr >> 8));
+  }
+  return 0;
+}
+
+/**
+ * debug_clear: Remove every breakpoint and watchpoint
+ * @param m The machine
+ * @return void
+ * */
+void debug_clear(struct machine* m) {
+  struct debug* d = m->debug;
+  if (d == NULL) return;
+
+  for (unsigned page = 0; page < MEM_PAGES; page++) {
+    if (m->mem.trapped[page]) mem_untrap(m, (uint8_t)page);
+  }
+  mem_code_invalidate_all(m);
+
+  free(d);
+  m->debug = NULL;
+}
+
+// parse_addr: parse a 0x<hex address> ending at end
+static int parse_addr(const char* str, const char* end, uint16_t* addr) {
+  char* endptr;
+
+  if (strncmp(str, "0x", 2) != 0 && strncmp(str, "0X", 2) != 0) return 1;
+
+  errno = 0;
+  long val = strtol(str, &endptr, 16);
+  if (errno != 0 || endptr != end || val < 0 || val > 0xFFFF) return 1;
+
+  *addr = (uint16_t)val;
+  return 0;
+}
+
+/**
+ * debug_parse_addr: Parse a whole 0x<hex address>
+ * @param spec The address
+ * @param addr Set to it
+ * @return 0 if success, 1 if failure
+ * */
+int debug_parse_addr(const char* spec, uint16_t* addr) {
+  return parse_addr(spec, spec + strlen(spec), addr);
+}
+
+/**
+ * debug_parse_break: Set a breakpoint written as 0x<hex address>
+ * @param m The machine
+ * @param spec The breakpoint
+ * @return 0 if success, 1 if failure
+ * */
+int debug_parse_break(struct machine* m, const char* spec) {
+  uint16_t addr;
+
+  if (debug_parse_addr(spec, &addr)) return 1;
+  return debug_break(m, addr);
+}
+
+/**
+ * debug_parse_watch: Set a watchpoint written as
+ *
+ *   0x<first>[-0x<last>][:r|w|c...]
+ *
+ * r for reads, w for writes, c for writes changing the value, w if none
+ * is given, e.g. "0x0200-0x020F:rw" or "0x00FE:c"
+ * @param m The machine
+ * @param spec The watchpoint
+ * @return 0 if success, 1 if failure
+ * */
+int debug_parse_watch(struct machine* m, const char* spec) {
+  const char* colon_pos = strchr(spec, ':');
+  const char* end = colon_pos != NULL ? colon_pos : spec + strlen(spec);
+  const char* dash_pos = memchr(spec, '-', end - spec);
+  uint16_t first, last;
+  uint8_t kinds = 0;
+
+  if (dash_pos == NULL) {
+    if (parse_addr(spec, end, &first)) return 1;
+    last = first;
+  } else {
+    if (parse_addr(spec, dash_pos, &first)) return 1;
+    if (parse_addr(dash_pos + 1, end, &last)) return 1;
+    if (last < first) return 1;
+  }
+
+  if (colon_pos == NULL) {
+    kinds = DEBUG_WATCH_WRITE;
+  } else {
+    for (const char* k = colon_pos + 1; *k != '\0'; k++) {
+      switch (*k) {
+      case 'r': kinds |= DEBUG_WATCH_READ; break;
+      case 'w': kinds |= DEBUG_WATCH_WRITE; break;
+      case 'c': kinds |= DEBUG_WATCH_CHANGE; break;
+      default: return 1;
+      }
+    }
+    if (kinds == 0) return 1;
+  }
+
+  return debug_watch(m, first, last, kinds);
+}
+
+/**
+ * debug_resume: Forget the last hit before running again, a breakpoint at
+ * the current PC lets the CPU through
+ * @param m The machine
+ * @return void
+ * */
+void debug_resume(struct machine* m) {
+  if (m->debug == NULL) return;
+
+  m->debug->hit = 0;
+  m->debug->resume_at = m->clock.instructions;
+}
+
+/**
+ * debug_set_quiet: Let everything through, or not, e.g. while history runs
+ * forward to where it steps back to
+ * @param m The machine
+ * @param quiet 1 for quiet
+ * @return whether it was quiet, to be set back
+ * */
+uint8_t debug_set_quiet(struct machine* m, uint8_t quiet) {
+  uint8_t was = 0;
+
+  if (m->debug != NULL) {
+    was = m->debug->quiet;
+    m->debug->quiet = quiet;
+  }
+  return was;
+}
+
+/**
+ * debug_access: Check an access to a trapped page against the watches of
+ * its address, called by the bus
+ * @param m The machine
+ * @param addr The address
+ * @param kind DEBUG_WATCH_READ or DEBUG_WATCH_WRITE
+ * @param old The byte before a write
+ * @param value The byte read or written
+ * @return void
+ * */
+void debug_access(struct machine* m, uint16_t addr, uint8_t kind, uint8_t old,
+                  uint8_t value) {
+  struct debug* d = m->debug;
+  if (d == NULL || d->quiet || d->hit) return;
+
+  uint8_t fired = d->watches[addr] & kind;
+  if (kind == DEBUG_WATCH_WRITE && old != value) {
+    fired |= d->watches[addr] & DEBUG_WATCH_CHANGE;
+  }
+  if (fired == 0) return;
+
+  d->hit = 1;
+  d->last.kind = fired & DEBUG_WATCH_CHANGE ? DEBUG_WATCH_CHANGE : fired;
+  d->last.addr = addr;
+  d->last.old = old;
+  d->last.value = value;
+
+  // a block being interpreted stops after this instruction, as it does
+  // after a store to its own code
+  m->mem.code_epoch++;
+}
+
+/**
+ * debug_hit_name: Short name of the kind of a hit
+ * @param kind DEBUG_HIT_BREAK or a DEBUG_WATCH_* bit
+ * @return a static string
+ * */
+const char* debug_hit_name(uint8_t kind) {
+  switch (kind) {
+  case DEBUG_HIT_BREAK: return "break";
+  case DEBUG_WATCH_READ: return "read";
+  case DEBUG_WATCH_WRITE: return "write";
+  case DEBUG_WATCH_CHANGE: return "change";
+  default: return "none";
+  }
+}
+
+/**
+ * debug_report: Print the last hit, in the "key: value" lines of
+ * headless_report()
+ * @param fp Where to print
+ * @param m The machine
+ * @return void
+ * */
+void debug_report(FILE* fp, const struct machine* m) {
+  const struct debug* d = m->debug;
+  if (d == NULL || !d->hit) return;
+
+  fprintf(fp, "hit: %s\n", debug_hit_name(d->last.kind));
+  fprintf(fp, "hit-addr: 0x%04X\n", d->last.addr);
+  if (d->last.kind == DEBUG_WATCH_WRITE || d->last.kind == DEBUG_WATCH_CHANGE) {
+    fprintf(fp, "hit-old: 0x%02X\n", d->last.old);
+  }
+  if (d->last.kind != DEBUG_HIT_BREAK) {
+    fprintf(fp, "hit-value: 0x%02X\n", d->last.value);
+  }
+}
@@ -0,0 +1,90 @@
+#ifndef INC_6502_DEBUG_H
+#define INC_6502_DEBUG_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "../mem/mem.h"
+#include "machine.h"
+
+/*
+ * Breakpoints and watchpoints.
+ *
+ * Nothing is allocated while none is armed: m->debug is NULL and the hot
+ * loop of cpu_run() only tests that pointer once per block.
+ *
+ * A PC breakpoint is a bit of a 64K bitmap. Blocks are cut right before
+ * one, and a block starting on one never runs as a whole, so cpu_run()
+ * only looks the bitmap up while single stepping.
+ *
+ * A watchpoint traps the page of its address, see mem_trap(): every access
+ * to that page then takes the I/O path of the bus, which checks the watches
+ * of the address. The other pages keep their fast paths. Instruction
+ * fetches from a trapped page are reads too, and value-change watches only
+ * see the bytes of RAM pages.
+ *
+ * A hit stops cpu_run() right after the instruction that made it (for a
+ * watchpoint) or right before the instruction (for a breakpoint), with
+ * CPU_STOP_WATCH or CPU_STOP_BREAK.
+ */
+
+#define DEBUG_WATCH_READ 0x01
+#define DEBUG_WATCH_WRITE 0x02
+#define DEBUG_WATCH_CHANGE 0x04
+
+// kind of a struct debug_hit that isn't a watch
+#define DEBUG_HIT_BREAK 0x80
+
+struct debug_hit {
+  uint8_t kind; // DEBUG_HIT_BREAK or the DEBUG_WATCH_* bit that fired
+  uint16_t addr; // the PC of a breakpoint
+  uint8_t old;
+  uint8_t value;
+};
+
+struct debug {
+  // one bit per PC
+  uint8_t breaks[TOTAL_MEM / 8];
+  unsigned break_count;
+
+  // DEBUG_WATCH_* bits of every address
+  uint8_t watches[TOTAL_MEM];
+  unsigned watch_count;
+
+  // clock.instructions at which a breakpoint lets the CPU through, so that
+  // a run resumed from one doesn't stop right away
+  uint64_t resume_at;
+
+  // set while history replays instructions, nothing fires
+  uint8_t quiet;
+
+  // set by the first hit since debug_resume(), which it describes
+  uint8_t hit;
+  struct debug_hit last;
+};
+
+int debug_break(struct machine* m, uint16_t addr);
+void debug_unbreak(struct machine* m, uint16_t addr);
+int debug_watch(struct machine* m, uint16_t first, uint16_t last, uint8_t kinds);
+void debug_clear(struct machine* m);
+int debug_parse_addr(const char* spec, uint16_t* addr);
+int debug_parse_break(struct machine* m, const char* spec);
+int debug_parse_watch(struct machine* m, const char* spec);
+void debug_resume(struct machine* m);
+uint8_t debug_set_quiet(struct machine* m, uint8_t quiet);
+void debug_access(struct machine* m, uint16_t addr, uint8_t kind, uint8_t old,
+                  uint8_t value);
+const char* debug_hit_name(uint8_t kind);
+void debug_report(FILE* fp, const struct machine* m);
+
+/**
+ * debug_break_at: Whether a breakpoint is set at some PC
+ * @param d The breakpoints
+ * @param pc The PC
+ * @return 1 if set, 0 if not
+ * */
+static inline int debug_break_at(const struct debug* d, uint16_t pc) {
+  return (d->breaks[pc >> 3] >> (pc & 7)) & 1;
+}
+
+#endif
@@ -0,0 +1,416 @@
+#include "history.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../cpu/cpu.h"
+#include "../mem/mem.h"
+#include "debug.h"
+#include "machine.h"
+#include "profile.h"
+
+// a page number and its bytes
+#define SAVED_PAGE_SIZE (1 + MEM_PAGE_SIZE)
+
+#define RING_INITIAL 64
+
+/**
+ * history_enable: Start recording checkpoints, the first one is taken by
+ * the next history_tick(), history_run() or history_checkpoint()
+ * @param m The machine
+ * @param budget Bytes the history may take, the shadow of the memory
+ * included
+ * @return 0 if success, 1 if failure
+ * */
+int history_enable(struct machine* m, size_t budget) {
+  struct history* h = calloc(1, sizeof(*h));
+  if (h == NULL) return 1;
+
+  h->budget = budget;
+  h->used = sizeof(h->shadow);
+  m->history = h;
+  return 0;
+}
+
+/**
+ * history_disable: Stop recording and free every checkpoint
+ * @param m The machine
+ * @return void
+ * */
+void history_disable(struct machine* m) {
+  if (m->history == NULL) return;
+
+  history_clear(m);
+  free(m->history->ring);
+  free(m->history);
+  m->history = NULL;
+}
+
+static struct history_checkpoint* at(struct history* h, size_t i) {
+  return &h->ring[(h->head + i) % h->capacity];
+}
+
+static void drop_saved(struct history* h, struct history_checkpoint* c) {
+  h->used -= (size_t)c->pages * SAVED_PAGE_SIZE;
+  free(c->saved);
+  c->saved = NULL;
+  c->pages = 0;
+}
+
+static void drop_devices(struct history* h, struct history_checkpoint* c) {
+  h->used -= c->devices_size;
+  free(c->devices);
+  c->devices = NULL;
+  c->devices_size = 0;
+}
+
+static void drop_oldest(struct history* h) {
+  drop_saved(h, at(h, 0));
+  drop_devices(h, at(h, 0));
+  h->head = (h->head + 1) % h->capacity;
+  h->count--;
+}
+
+static void drop_newest(struct history* h) {
+  drop_saved(h, at(h, h->count - 1));
+  drop_devices(h, at(h, h->count - 1));
+  h->count--;
+}
+
+/**
+ * history_clear: Forget every checkpoint, the next tick takes a new one
+ * @param m The machine
+ * @return void
+ * */
+void history_clear(struct machine* m) {
+  struct history* h = m->history;
+  if (h == NULL) return;
+
+  while (h->count > 0) drop_newest(h);
+  h->head = 0;
+  h->next = 0;
+}
+
+/**
+ * grow: Double the ring, oldest checkpoint first
+ * @param h The history
+ * @return 0 if success, 1 if failure
+ * */
+static int grow(struct history* h) {
+  size_t capacity = h->capacity ? h->capacity * 2 : RING_INITIAL;
+  struct history_checkpoint* ring = malloc(capacity * sizeof(*ring));
+  if (ring == NULL) return 1;
+
+  for (size_t i = 0; i < h->count; i++) ring[i] = *at(h, i);
+
+  free(h->ring);
+  h->used += (capacity - h->capacity) * sizeof(*ring);
+  h->ring = ring;
+  h->capacity = capacity;
+  h->head = 0;
+  return 0;
+}
+
+/**
+ * close_interval: Give the newest checkpoint the pages written since it was
+ * taken, as they were then, and bring the shadow up to date
+ * @param m The machine
+ * @return 0 if success, 1 if failure
+ * */
+static int close_interval(struct machine* m) {
+  struct history* h = m->history;
+  struct history_checkpoint* c = at(h, h->count - 1);
+  uint8_t written[MEM_PAGES];
+  unsigned count = 0;
+
+  // pages written to may still hold what they held
+  for (unsigned page = 0; page < MEM_PAGES; page++) {
+    size_t offset = page * MEM_PAGE_SIZE;
+
+    if (!mem_dirty(m, (uint8_t)page, MEM_DIRTY_HISTORY)) continue;
+
+    if (memcmp(h->shadow + offset, m->mem.data + offset, MEM_PAGE_SIZE) != 0) {
+      written[count++] = (uint8_t)page;
+    }
+  }
+  if (count == 0) return 0;
+
+  c->saved = malloc((size_t)count * SAVED_PAGE_SIZE);
+  if (c->saved == NULL) return 1;
+
+  for (unsigned i = 0; i < count; i++) {
+    uint8_t* saved = c->saved + (size_t)i * SAVED_PAGE_SIZE;
+    size_t offset = written[i] * MEM_PAGE_SIZE;
+
+    saved[0] = written[i];
+    memcpy(saved + 1, h->shadow + offset, MEM_PAGE_SIZE);
+    memcpy(h->shadow + offset, m->mem.data + offset, MEM_PAGE_SIZE);
+  }
+
+  c->pages = count;
+  h->used += (size_t)count * SAVED_PAGE_SIZE;
+  return 0;
+}
+
+/**
+ * save_devices: Give a checkpoint the state of every attached device
+ * @param m The machine
+ * @param c The checkpoint
+ * @return 0 if success, 1 if failure
+ * */
+static int save_devices(struct machine* m, struct history_checkpoint* c) {
+  size_t size = 0;
+
+  c->devices = NULL;
+  c->devices_size = 0;
+  if (m->device_count == 0) return 0;
+
+  for (unsigned i = 0; i < m->device_count; i++) {
+    const struct machine_device* d = &m->devices[i];
+    size += 4 + d->save(m, d->ctx, MACHINE_STATE_CHECKPOINT, NULL);
+  }
+
+  c->devices = malloc(size);
+  if (c->devices == NULL) return 1;
+
+  uint8_t* p = c->devices;
+  for (unsigned i = 0; i < m->device_count; i++) {
+    const struct machine_device* d = &m->devices[i];
+    uint32_t n = d->save(m, d->ctx, MACHINE_STATE_CHECKPOINT, p + 4);
+
+    memcpy(p, &n, 4);
+    p += 4 + n;
+  }
+
+  c->devices_size = size;
+  m->history->used += size;
+  return 0;
+}
+
+/**
+ * load_devices: Bring every attached device back to a checkpoint, once
+ * the clock is
+ * @param m The machine
+ * @param c The checkpoint
+ * @return void
+ * */
+static void load_devices(struct machine* m, const struct history_checkpoint* c) {
+  const uint8_t* p = c->devices;
+
+  for (unsigned i = 0; i < m->device_count; i++) {
+    const struct machine_device* d = &m->devices[i];
+    uint32_t n;
+
+    memcpy(&n, p, 4);
+    d->load(m, d->ctx, MACHINE_STATE_CHECKPOINT, p + 4, n);
+    p += 4 + n;
+  }
+
+  // an IRQ line left low has to be looked at again
+  sched_poke(&m->sched);
+}
+
+/**
+ * history_checkpoint: Record the machine as it is now, dropping the oldest
+ * checkpoints if the history is over budget
+ * @param m The machine
+ * @return void
+ * */
+void history_checkpoint(struct machine* m) {
+  struct history* h = m->history;
+  if (h == NULL) return;
+
+  h->next = m->clock.cycles + HISTORY_INTERVAL;
+
+  if (h->count > 0) {
+    const struct history_checkpoint* newest = at(h, h->count - 1);
+
+    if (newest->clock.instructions == m->clock.instructions &&
+        newest->clock.cycles == m->clock.cycles) {
+      return;
+    }
+
+    // out of memory, start over from here
+    if (close_interval(m)) history_clear(m);
+  }
+
+  if (h->count == 0) memcpy(h->shadow, m->mem.data, sizeof(h->shadow));
+  mem_dirty_clear(m, MEM_DIRTY_HISTORY);
+
+  while (h->count > 1 && h->used > h->budget) drop_oldest(h);
+
+  if (h->count == h->capacity) {
+    // grow while the budget allows, recycle the oldest slot otherwise
+    int fits = h->count < 2 ||
+               h->used + h->capacity * sizeof(*h->ring) <= h->budget;
+
+    if (!fits || grow(h) != 0) {
+      if (h->count == 0) return;
+      drop_oldest(h);
+    }
+  }
+
+  struct history_checkpoint* c = &h->ring[(h->head + h->count) % h->capacity];
+  c->cpu = m->cpu;
+  c->cycles = m->cycles;
+  c->clock = m->clock;
+  c->pages = 0;
+  c->saved = NULL;
+  // out of memory, start over at the next tick
+  if (save_devices(m, c)) {
+    history_clear(m);
+    return;
+  }
+  h->count++;
+}
+
+/**
+ * history_run: cpu_run() cut into slices of HISTORY_INTERVAL cycles with a
+ * checkpoint before each that is due, same stops and counters as one
+ * cpu_run()
+ * @param m The machine
+ * @param limits Budgets and stop conditions, 0 budgets mean no limit
+ * @param counters Instructions and cycles are added to it
+ * @return why the run stopped
+ * */
+enum cpu_stop history_run(struct machine* m, const struct cpu_limits* limits,
+                          struct cpu_counters* counters) {
+  if (m->history == NULL) return cpu_run(m, limits, counters);
+
+  struct cpu_limits slice = *limits;
+  enum cpu_stop reason;
+
+  // without a budget an idle loop stops the run, not only the slices
+  if (!limits->max_cycles && !limits->max_instructions) slice.stop_on_idle = 1;
+
+  do {
+    uint64_t end = counters->cycles + HISTORY_INTERVAL;
+
+    history_tick(m);
+    slice.max_cycles =
+        limits->max_cycles && limits->max_cycles < end ? limits->max_cycles : end;
+    reason = cpu_run(m, &slice, counters);
+  } while (reason == CPU_STOP_BUDGET &&
+           (!limits->max_cycles || counters->cycles < limits->max_cycles) &&
+           (!limits->max_instructions ||
+            counters->instructions < limits->max_instructions));
+
+  return reason;
+}
+
+/**
+ * rewind_to: Bring the machine back to the first instruction boundary at
+ * or past a point of the clock, or to the oldest checkpoint if the point is
+ * older than that
+ * @param m The machine
+ * @param by_cycles Whether target counts cycles rather than instructions
+ * @param target The point of the clock
+ * @return void
+ * */
+static void rewind_to(struct machine* m, int by_cycles, uint64_t target) {
+  struct history* h = m->history;
+
+  // the pages written since the newest checkpoint are saved by a new one
+  history_checkpoint(m);
+  if (h->count == 0) return;
+
+  size_t k = h->count - 1;
+  while (k > 0) {
+    const struct history_checkpoint* c = at(h, k);
+    if ((by_cycles ? c->clock.cycles : c->clock.instructions) <= target) break;
+    k--;
+  }
+
+  // undo the newest intervals first, the checkpoint's own last
+  for (size_t i = h->count; i-- > k;) {
+    const struct history_checkpoint* c = at(h, i);
+
+    for (uint32_t p = 0; p < c->pages; p++) {
+      const uint8_t* saved = c->saved + (size_t)p * SAVED_PAGE_SIZE;
+      memcpy(m->mem.data + saved[0] * MEM_PAGE_SIZE, saved + 1, MEM_PAGE_SIZE);
+      m->mem.dirty[saved[0]] = MEM_DIRTY_ALL;
+    }
+  }
+  while (h->count > k + 1) drop_newest(h);
+  drop_saved(h, at(h, k));
+
+  const struct history_checkpoint* c = at(h, k);
+  m->cpu = c->cpu;
+  m->cycles = c->cycles;
+  m->clock = c->clock;
+  load_devices(m, c);
+  h->next = m->clock.cycles + HISTORY_INTERVAL;
+
+  memcpy(h->shadow, m->mem.data, sizeof(h->shadow));
+  mem_dirty_clear(m, MEM_DIRTY_HISTORY);
+  mem_code_invalidate_all(m);
+
+  // run forward again, quietly
+#ifdef TRACE
+  trace_hook trace = m->trace;
+  m->trace = NULL;
+#endif
+  uint8_t quiet = debug_set_quiet(m, 1);
+  struct profile* profile = m->profile;
+  m->profile = NULL;
+  m->replaying = 1;
+
+  struct cpu_limits limits = {0};
+  struct cpu_counters counters = {0, 0};
+  uint64_t now = by_cycles ? m->clock.cycles : m->clock.instructions;
+
+  if (now < target) {
+    if (m->cycles != 0) cpu_exec(m);
+
+    now = by_cycles ? m->clock.cycles : m->clock.instructions;
+    if (now < target) {
+      if (by_cycles) {
+        limits.max_cycles = target - now;
+      } else {
+        limits.max_instructions = target - now;
+      }
+      cpu_run(m, &limits, &counters);
+    }
+  }
+
+  m->replaying = 0;
+  debug_set_quiet(m, quiet);
+  m->profile = profile;
+#ifdef TRACE
+  m->trace = trace;
+#endif
+}
+
+/**
+ * history_step_back: Undo the last instruction
+ * @param m The machine
+ * @return 0 if success, 1 if the history doesn't go back that far
+ * */
+int history_step_back(struct machine* m) {
+  struct history* h = m->history;
+
+  if (h == NULL || h->count == 0 || m->clock.instructions == 0 ||
+      at(h, 0)->clock.instructions >= m->clock.instructions) {
+    return 1;
+  }
+
+  rewind_to(m, 0, m->clock.instructions - 1);
+  return 0;
+}
+
+/**
+ * history_rewind: Go back some cycles, to the first instruction boundary
+ * at or past that point, or as far as the history goes
+ * @param m The machine
+ * @param cycles The cycles to go back
+ * @return the cycles actually gone back
+ * */
+uint64_t history_rewind(struct machine* m, uint64_t cycles) {
+  uint64_t from = m->clock.cycles;
+
+  if (m->history == NULL) return 0;
+
+  rewind_to(m, 1, from > cycles ? from - cycles : 0);
+  return from - m->clock.cycles;
+}
@@ -0,0 +1,89 @@
+#ifndef INC_6502_HISTORY_H
+#define INC_6502_HISTORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../cpu/cpu.h"
+#include "../mem/mem.h"
+#include "machine.h"
+
+/*
+ * Time travel for the debugger.
+ *
+ * Every HISTORY_INTERVAL cycles a checkpoint keeps the registers, the
+ * clock and the state of the attached devices. The memory is not copied:
+ * a shadow of the memory as it was at the newest checkpoint is compared
+ * against the live one when the next is taken, on the pages the bus
+ * marked MEM_DIRTY_HISTORY since, and only the backing pages that differ
+ * are kept, as they were, with the checkpoint they belong to. Going back
+ * to some instruction restores the newest checkpoint before it, and the
+ * devices to their state there, undoing the saved pages from
+ * the newest checkpoint down, and runs forward again up to the
+ * instruction: the cores are deterministic, so nothing has to be recorded
+ * per instruction and the bus keeps its fast paths. I/O handlers are
+ * called again while running forward, with m->replaying set: a device
+ * doesn't repeat to the host what it already got, and gives input from
+ * the host again as it came the first time.
+ *
+ * The checkpoints live in a ring that drops the oldest ones once the
+ * history outgrows its budget. A reset or anything else that changes the
+ * machine without the clock moving has to clear the history.
+ */
+
+#define HISTORY_INTERVAL 1000000
+#define HISTORY_DEFAULT_MB 16
+
+struct history_checkpoint {
+  struct central_processing_unit cpu;
+  uint32_t cycles;
+  struct cpu_counters clock;
+
+  // backing pages written before the next checkpoint, each a page number
+  // and its 256 bytes as they were at this one
+  uint32_t pages;
+  uint8_t* saved;
+
+  // the state of every attached device, each a u32 size and the state
+  size_t devices_size;
+  uint8_t* devices;
+};
+
+struct history {
+  // bytes the ring, the saved pages and the shadow may take
+  size_t budget;
+  size_t used;
+
+  struct history_checkpoint* ring;
+  size_t capacity;
+  size_t head;
+  size_t count;
+
+  // clock.cycles the next checkpoint is due at
+  uint64_t next;
+
+  uint8_t shadow[TOTAL_MEM];
+};
+
+int history_enable(struct machine* m, size_t budget);
+void history_disable(struct machine* m);
+void history_clear(struct machine* m);
+void history_checkpoint(struct machine* m);
+enum cpu_stop history_run(struct machine* m, const struct cpu_limits* limits,
+                          struct cpu_counters* counters);
+int history_step_back(struct machine* m);
+uint64_t history_rewind(struct machine* m, uint64_t cycles);
+
+/**
+ * history_tick: Take a checkpoint if one is due, for whoever steps the CPU
+ * by hand
+ * @param m The machine
+ * @return void
+ * */
+static inline void history_tick(struct machine* m) {
+  if (m->history != NULL && m->clock.cycles >= m->history->next) {
+    history_checkpoint(m);
+  }
+}
+
+#endif
@@ -0,0 +1,75 @@
+#include "machine.h"
+
+#include <stdio.h>
+
+#include "../cpu/block.h"
+#include "../cpu/cpu.h"
+#include "../mem/mem.h"
+#include "../utils/trace.h"
+#include "history.h"
+#include "sched.h"
+
+/**
+ * machine_init: Bring a machine to its power-on state, memory zeroed and
+ * CPU linked to it. The CPU still has to be reset.
+ * @param m The machine
+ * @return void
+ * */
+void machine_init(struct machine* m) {
+  mem_init(m);
+  cpu_init(m);
+  m->clock.instructions = 0;
+  m->clock.cycles = 0;
+  sched_init(m);
+  m->irq = 0;
+  m->nmi = 0;
+  block_cache_init(m);
+  m->jit = NULL;
+  m->history = NULL;
+  m->debug = NULL;
+  m->profile = NULL;
+  m->device_count = 0;
+  m->replaying = 0;
+  trace_set_hook(m, NULL, NULL);
+}
+
+/**
+ * machine_reset: Same as machine_init() for a machine that already ran,
+ * cheaper since only the memory it wrote is zeroed. The JIT and the
+ * history stay attached, the history is emptied, scheduled events,
+ * interrupts and devices are dropped
+ * @param m The machine
+ * @return void
+ * */
+void machine_reset(struct machine* m) {
+  mem_reset(m);
+  cpu_init(m);
+  m->clock.instructions = 0;
+  m->clock.cycles = 0;
+  sched_reset(m);
+  m->irq = 0;
+  m->nmi = 0;
+  block_cache_init(m);
+  m->device_count = 0;
+  history_clear(m);
+}
+
+/**
+ * machine_attach: Have snapshots and the history keep the state of a
+ * device, from now on. The history is emptied, its checkpoints don't have
+ * the device's state
+ * @param m The machine
+ * @param device The device, copied
+ * @return 0 if success, 1 if MACHINE_MAX_DEVICES are attached already
+ * */
+int machine_attach(struct machine* m, const struct machine_device* device) {
+  if (m->device_count == MACHINE_MAX_DEVICES) {
+    fprintf(stderr, "[FAILED] More than %d devices attached.\n",
+            MACHINE_MAX_DEVICES);
+    return 1;
+  }
+
+  m->devices[m->device_count++] = *device;
+  history_clear(m);
+  return 0;
+}
@@ -0,0 +1,218 @@
+#ifndef INC_6502_MACHINE_H
+#define INC_6502_MACHINE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "../cpu/block.h"
+#include "../cpu/cpu.h"
+#include "../jit/jit.h"
+#include "../mem/mem.h"
+#include "../utils/trace.h"
+#include "sched.h"
+
+struct debug;
+struct history;
+struct machine;
+struct profile;
+
+#define MACHINE_MAX_DEVICES 4
+
+// what the state of a device is taken for, see struct machine_device
+enum machine_state { MACHINE_STATE_SNAPSHOT, MACHINE_STATE_CHECKPOINT };
+
+typedef uint32_t (*machine_save_fn)(struct machine* m, void* ctx,
+                                    enum machine_state kind, uint8_t* state);
+typedef void (*machine_load_fn)(struct machine* m, void* ctx,
+                                enum machine_state kind, const uint8_t* state,
+                                uint32_t size);
+
+/**
+ * A peripheral whose state snapshots and history checkpoints keep, see
+ * machine_attach(). save() writes the state as of now, between two
+ * instructions, and returns its size, or only returns the size with a NULL
+ * state. The state is the little-endian payload of the device's snapshot
+ * chunk, its page first. load() brings the device back to a state once
+ * the registers, the clock and the memory are restored: whatever counts
+ * from the clock is rebased on it and the events are scheduled again. A
+ * snapshot without the device's chunk loads a NULL state, a reset
+ * */
+struct machine_device {
+  // tag of the snapshot chunk
+  char tag[4];
+  uint8_t page;
+  // the shortest state load() accepts, longer ones may come from newer
+  // versions
+  uint32_t min_size;
+  machine_save_fn save;
+  machine_load_fn load;
+  void* ctx;
+};
+
+/**
+ * A whole 6502 system: registers, memory, clock and the scratch values
+ * shared by the addressing modes and the operations while an instruction
+ * is being decoded. Nothing is process-wide, so a process can host as many
+ * machines as it wants.
+ * */
+struct machine {
+  struct central_processing_unit cpu;
+  struct mem mem;
+
+  // clock cycles left for the current instruction, every fetch implies
+  // a clock cycle
+  uint32_t cycles;
+
+  // instructions and cycles run since power-on, kept by cpu_exec() and
+  // cpu_run() and carried over by snapshots. clock.cycles is the 64-bit
+  // machine clock: while cpu_run() executes it is the cycle the current
+  // instruction started at, instructions are counted in when it returns
+  struct cpu_counters clock;
+
+  // "fire at cycle N" callbacks of the peripherals
+  struct sched sched;
+
+  // interrupt inputs, taken between two instructions, see
+  // machine_irq() and machine_nmi()
+  uint32_t irq;
+  uint8_t nmi;
+
+  // absolute address in memory
+  uint16_t addr_abs;
+
+  // relative address in memory
+  uint16_t addr_rel;
+
+  // the opcode being executed
+  uint8_t op;
+
+  // the value fetched by the addressing mode
+  uint8_t fetched;
+
+  // predecoded blocks of cpu_run()
+  struct block_cache blocks;
+
+  // translations of the hot blocks, NULL while the JIT is off
+  struct jit* jit;
+
+  // checkpoints to step back to, NULL while not recording
+  struct history* history;
+
+  // breakpoints and watchpoints, NULL while none is armed
+  struct debug* debug;
+
+  // instructions and cycles per opcode and PC, NULL while not profiling
+  struct profile* profile;
+
+  // peripherals that keep state, see struct machine_device
+  struct machine_device devices[MACHINE_MAX_DEVICES];
+  unsigned device_count;
+
+  // set while the history runs forward again after going back, the
+  // devices don't repeat to the host what it already got
+  uint8_t replaying;
+
+#ifdef TRACE
+  // receives every trace record, NULL when not tracing
+  trace_hook trace;
+  void* trace_ctx;
+  // TRACE_EVENT() bits of the records it receives
+  unsigned trace_events;
+#endif
+};
+
+void machine_init(struct machine* m);
+void machine_reset(struct machine* m);
+int machine_attach(struct machine* m, const struct machine_device* device);
+
+// sources of the IRQ line, see machine_irq()
+#define MACHINE_IRQ_VIA (1u << 0)
+#define MACHINE_IRQ_ACIA (1u << 1)
+
+/**
+ * machine_irq: Drive the IRQ line. It is wired-OR: every source holds its
+ * own bit and the line stays low while any of them does. A low line is
+ * taken before the next instruction once the I flag is clear
+ * @param m The machine
+ * @param source The bit of the source
+ * @param low 1 to pull the line low, 0 to release it
+ * @return void
+ * */
+static inline void machine_irq(struct machine* m, uint32_t source, int low) {
+  uint32_t irq = low ? m->irq | source : m->irq & ~source;
+
+  if (irq == m->irq) return;
+  m->irq = irq;
+  if (!low) return;
+
+  sched_poke(&m->sched);
+  // a block being interpreted stops after this instruction, as it does
+  // after a store to its own code
+  m->mem.code_epoch++;
+}
+
+/**
+ * machine_nmi: Signal a falling edge on the NMI line, taken before the
+ * next instruction whatever the I flag
+ * @param m The machine
+ * @return void
+ * */
+static inline void machine_nmi(struct machine* m) {
+  m->nmi = 1;
+  sched_poke(&m->sched);
+  m->mem.code_epoch++;
+}
+
+/**
+ * machine_read: The memory bus, read side. Inline so that the CPU core
+ * pays no call per memory access: while no page is remapped for reading it
+ * is a plain array access, otherwise RAM and ROM pages are one page table
+ * load plus an index and only I/O pages call out.
+ * @param m The machine
+ * @param addr The address to be read
+ * @return the read byte
+ * */
+static inline uint8_t machine_read(struct machine* m, uint16_t addr) {
+  uint8_t data;
+
+  if (m->mem.read_direct) {
+    data = m->mem.data[addr];
+  } else {
+    uint32_t page = m->mem.read_page[addr >> 8];
+    data = page != MEM_PAGE_IO ? m->mem.data[page | (addr & 0xFF)]
+                               : mem_read_io(m, addr);
+  }
+  TRACE_EMIT(m, TRACE_READ, addr, data);
+  return data;
+}
+
+/**
+ * machine_write: The memory bus, write side, same fast paths as
+ * machine_read(). The backing page is marked dirty, writing to a page the
+ * block cache decoded code from drops its blocks
+ * @param m The machine
+ * @param addr The address to be written to
+ * @param data The data to be written
+ * @return void
+ * */
+static inline void machine_write(struct machine* m, uint16_t addr, uint8_t data) {
+  TRACE_EMIT(m, TRACE_WRITE, addr, data);
+
+  if (m->mem.write_direct) {
+    m->mem.data[addr] = data;
+    m->mem.dirty[addr >> 8] = MEM_DIRTY_ALL;
+    if (m->mem.code[addr >> 8]) mem_code_invalidate(m, addr >> 8);
+    return;
+  }
+
+  uint32_t page = m->mem.write_page[addr >> 8];
+  if (page != MEM_PAGE_IO) {
+    m->mem.data[page | (addr & 0xFF)] = data;
+    m->mem.dirty[page >> 8] = MEM_DIRTY_ALL;
+    if (m->mem.code[page >> 8]) mem_code_invalidate(m, page >> 8);
+  } else {
+    mem_write_io(m, addr, data);
+  }
+}
+
+#endif
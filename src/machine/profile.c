@@ -0,0 +1,728 @@
+#include "profile.h"
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "../cpu/opcodes.h"
+#include "machine.h"
+
+struct opcode_info {
+  const char* name;
+  const char* mode;
+  uint8_t cycles;
+};
+
+static const struct opcode_info opcodes[256] = {
+#define X(opcode, name, operation, mode, cycles) [opcode] = {name, #mode, cycles},
+  OPCODES(X)
+#undef X
+};
+
+static const char* const modes[] = {"IMP", "IMM", "ZP0", "ZPX", "ZPY", "REL",
+                                    "ABS", "ABX", "ABY", "IND", "IZX", "IZY"};
+
+#define MODES (sizeof(modes) / sizeof(modes[0]))
+
+const uint8_t profile_flow[256] = {
+  [0x20] = PROFILE_CALL,   // JSR
+  [0x00] = PROFILE_CALL,   // BRK
+  [0x60] = PROFILE_RETURN, // RTS
+  [0x40] = PROFILE_RETURN, // RTI
+};
+
+// call tree nodes allocated at first, doubled when full
+#define INITIAL_NODES 1024
+
+// call tree levels indented in <prefix>.calls, deeper ones show their depth
+#define MAX_INDENT 32
+
+// what a row of the CSV adds up
+struct totals {
+  uint64_t instructions;
+  uint64_t cycles;
+  uint64_t base;
+  uint64_t page;
+  uint64_t branch;
+};
+
+/**
+ * profile_enable: Attach an empty profile to a machine
+ * @param m The machine
+ * @return 0 if success, 1 if out of memory
+ * */
+int profile_enable(struct machine* m) {
+  struct profile* p;
+
+  if (m->profile != NULL) return 0;
+
+  p = calloc(1, sizeof(*p));
+  if (p == NULL) return 1;
+
+  p->nodes = calloc(INITIAL_NODES, sizeof(*p->nodes));
+  if (p->nodes == NULL) {
+    free(p);
+    return 1;
+  }
+  p->node_capacity = INITIAL_NODES;
+  // the root
+  p->node_count = 1;
+
+  m->profile = p;
+  return 0;
+}
+
+/**
+ * profile_disable: Drop the profile of a machine, if any
+ * @param m The machine
+ * @return void
+ * */
+void profile_disable(struct machine* m) {
+  struct profile* p = m->profile;
+
+  if (p == NULL) return;
+
+  if (p->symbols != NULL) {
+    for (unsigned addr = 0; addr < TOTAL_MEM; addr++) free(p->symbols[addr]);
+    free(p->symbols);
+  }
+  free(p->nodes);
+  free(p);
+  m->profile = NULL;
+}
+
+// parse_value: "$8100", "0x8100" or "33024", 0 if it isn't an address
+static int parse_value(const char* s, unsigned* out) {
+  unsigned long v;
+  char* end;
+  int base = 10;
+
+  if (*s == '$') {
+    s++;
+    base = 16;
+  } else if (s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+    s += 2;
+    base = 16;
+  }
+  if (!isxdigit((unsigned char)*s)) return 0;
+
+  v = strtoul(s, &end, base);
+  if (*end != '\0' || v >= TOTAL_MEM) return 0;
+
+  *out = (unsigned)v;
+  return 1;
+}
+
+/**
+ * profile_load_symbols: Name the routines of the call graph from a label
+ * file, with lines such as
+ *
+ *   init = $8100          (also 0x8100 or decimal, and "init equ $8100")
+ *   al C:8100 .init       (VICE, as written by ld65 -Ln)
+ *
+ * Other lines are skipped, and the first name of an address wins.
+ * @param m The machine, with a profile
+ * @param path The label file
+ * @return 0 if success, 1 if failure
+ * */
+int profile_load_symbols(struct machine* m, const char* path) {
+  struct profile* p = m->profile;
+  char line[256];
+  FILE* fp;
+  int status = 0;
+
+  if (p->symbols == NULL) {
+    p->symbols = calloc(TOTAL_MEM, sizeof(*p->symbols));
+    if (p->symbols == NULL) return 1;
+  }
+
+  fp = fopen(path, "r");
+  if (fp == NULL) {
+    fprintf(stderr, "[FAILED] Error while opening symbols '%s'.\n", path);
+    return 1;
+  }
+
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    char* words[3];
+    unsigned count = 0;
+    char* name;
+    const char* value;
+    unsigned addr;
+
+    char* comment = strchr(line, ';');
+    if (comment != NULL) *comment = '\0';
+
+    for (char* w = strtok(line, " \t\r\n"); w != NULL && count < 3;
+         w = strtok(NULL, " \t\r\n")) {
+      words[count++] = w;
+    }
+    if (count != 3) continue;
+
+    if (strcmp(words[0], "al") == 0) {
+      value = words[1];
+      if (strncmp(value, "C:", 2) == 0) value += 2;
+      name = words[2][0] == '.' ? words[2] + 1 : words[2];
+      if (!isxdigit((unsigned char)*value)) continue;
+      char* end;
+      addr = (unsigned)strtoul(value, &end, 16);
+      if (*end != '\0' || addr >= TOTAL_MEM) continue;
+    } else if (strcmp(words[1], "=") == 0 || strcasecmp(words[1], "equ") == 0) {
+      name = words[0];
+      if (!parse_value(words[2], &addr)) continue;
+    } else {
+      continue;
+    }
+
+    size_t length = strlen(name);
+    if (length > 0 && name[length - 1] == ':') name[--length] = '\0';
+    if (length == 0 || p->symbols[addr] != NULL) continue;
+
+    p->symbols[addr] = malloc(length + 1);
+    if (p->symbols[addr] == NULL) {
+      status = 1;
+      break;
+    }
+    memcpy(p->symbols[addr], name, length + 1);
+  }
+
+  if (ferror(fp)) {
+    fprintf(stderr, "[FAILED] Error while reading symbols '%s'.\n", path);
+    status = 1;
+  }
+  fclose(fp);
+  return status;
+}
+
+/**
+ * child: The node of a routine called from the current one, new on its
+ * first call. Callees found are moved first, so that hot ones are found
+ * at once
+ * @param p The profile
+ * @param routine Its address
+ * @return the node, 0 when the tree is full or deep enough
+ * */
+static uint32_t child(struct profile* p, uint16_t routine) {
+  struct profile_node* parent = &p->nodes[p->current];
+  uint32_t prev = 0;
+
+  if (parent->depth == PROFILE_MAX_DEPTH) return 0;
+
+  for (uint32_t n = parent->child; n != 0; prev = n, n = p->nodes[n].sibling) {
+    if (p->nodes[n].routine != routine) continue;
+
+    if (prev != 0) {
+      p->nodes[prev].sibling = p->nodes[n].sibling;
+      p->nodes[n].sibling = parent->child;
+      parent->child = n;
+    }
+    return n;
+  }
+
+  if (p->node_count == p->node_capacity) {
+    if (p->node_capacity == PROFILE_MAX_NODES) return 0;
+
+    struct profile_node* nodes =
+        realloc(p->nodes, 2 * p->node_capacity * sizeof(*nodes));
+    if (nodes == NULL) return 0;
+    p->nodes = nodes;
+    p->node_capacity *= 2;
+    parent = &p->nodes[p->current];
+  }
+
+  uint32_t n = p->node_count++;
+  p->nodes[n] = (struct profile_node){routine, parent->depth + 1, p->current,
+                                      0, parent->child, 0, 0};
+  parent->child = n;
+  return n;
+}
+
+/**
+ * profile_enter: Follow a call (JSR, BRK or an interrupt) into a routine
+ * @param p The profile
+ * @param routine Its address
+ * @param ret The PC the call returns to
+ * @return void
+ * */
+void profile_enter(struct profile* p, uint16_t routine, uint16_t ret) {
+  uint32_t n = child(p, routine);
+
+  if (p->depth == PROFILE_MAX_DEPTH || n == 0) p->overflows++;
+
+  if (p->depth == PROFILE_MAX_DEPTH) {
+    memmove(p->stack, p->stack + 1, (PROFILE_MAX_DEPTH - 1) * sizeof(*p->stack));
+    p->depth--;
+  }
+  p->stack[p->depth++] = (struct profile_frame){p->current, ret};
+
+  // no node: the callee counts as its caller, returns still match
+  if (n == 0) return;
+  p->nodes[n].calls++;
+  p->current = n;
+}
+
+/**
+ * profile_leave: Follow a return (RTS or RTI) back to the caller it
+ * returns to. A mismatched return unwinds to the newest call returning
+ * where it went, or is taken for a jump if there is none
+ * @param p The profile
+ * @param pc The PC of the return
+ * @param target Where it went
+ * @return void
+ * */
+void profile_leave(struct profile* p, uint16_t pc, uint16_t target) {
+  unsigned i = p->depth;
+
+  if (i > 0 && p->stack[i - 1].ret == target) {
+    p->depth--;
+    p->current = p->stack[p->depth].node;
+    return;
+  }
+
+  if (p->mismatches < PROFILE_MISMATCH_SAMPLES) {
+    struct profile_mismatch* s = &p->mismatch[p->mismatches];
+    s->pc = pc;
+    s->target = target;
+    s->expected = i > 0 ? p->stack[i - 1].ret : 0;
+    s->depth = (uint16_t)i;
+  }
+  p->mismatches++;
+
+  while (i > 0 && p->stack[i - 1].ret != target) i--;
+  if (i == 0) return;
+
+  p->depth = i - 1;
+  p->current = p->stack[p->depth].node;
+}
+
+// add: the counters of an opcode, its extra cycles split by their cause
+static void add(struct totals* t, const struct profile* p, unsigned opcode) {
+  uint64_t base = p->op_instructions[opcode] * opcodes[opcode].cycles;
+  uint64_t extra = p->op_cycles[opcode] - base;
+
+  t->instructions += p->op_instructions[opcode];
+  t->cycles += p->op_cycles[opcode];
+  t->base += base;
+  if (strcmp(opcodes[opcode].mode, "REL") == 0) {
+    t->branch += extra;
+  } else {
+    t->page += extra;
+  }
+}
+
+static void print_totals(FILE* fp, const struct totals* t) {
+  fprintf(fp, "%llu,%llu,%llu,%llu,%llu\n",
+          (unsigned long long)t->instructions, (unsigned long long)t->cycles,
+          (unsigned long long)t->base, (unsigned long long)t->page,
+          (unsigned long long)t->branch);
+}
+
+/**
+ * write_csv: One row per executed opcode, addressing mode and PC, then the
+ * totals:
+ *
+ *   kind,key,name,mode,instructions,cycles,base_cycles,page_cycles,branch_cycles
+ *   opcode,0xBD,LDA,ABX,1000,4210,4000,210,0
+ *   mode,ABX,,ABX,1500,6300,6000,300,0
+ *   pc,0x8009,LDA,ABX,1000,4210,,,
+ *   total,,,,...
+ *
+ * PC rows name the opcode last executed there and leave the split of
+ * their cycles out.
+ * @param fp Where to write
+ * @param p The profile
+ * @return void
+ * */
+static void write_csv(FILE* fp, const struct profile* p) {
+  struct totals total = {0, 0, 0, 0, 0};
+
+  fprintf(fp, "kind,key,name,mode,instructions,cycles,base_cycles,"
+              "page_cycles,branch_cycles\n");
+
+  for (unsigned op = 0; op < 256; op++) {
+    if (p->op_instructions[op] == 0) continue;
+
+    struct totals t = {0, 0, 0, 0, 0};
+    add(&t, p, op);
+    add(&total, p, op);
+    fprintf(fp, "opcode,0x%02X,%s,%s,", op, opcodes[op].name, opcodes[op].mode);
+    print_totals(fp, &t);
+  }
+
+  for (unsigned mode = 0; mode < MODES; mode++) {
+    struct totals t = {0, 0, 0, 0, 0};
+
+    for (unsigned op = 0; op < 256; op++) {
+      if (strcmp(opcodes[op].mode, modes[mode]) == 0) add(&t, p, op);
+    }
+    if (t.instructions == 0) continue;
+
+    fprintf(fp, "mode,%s,,%s,", modes[mode], modes[mode]);
+    print_totals(fp, &t);
+  }
+
+  for (unsigned pc = 0; pc < TOTAL_MEM; pc++) {
+    if (p->pc_instructions[pc] == 0) continue;
+
+    const struct opcode_info* op = &opcodes[p->pc_opcode[pc]];
+    fprintf(fp, "pc,0x%04X,%s,%s,%llu,%llu,,,\n", pc, op->name, op->mode,
+            (unsigned long long)p->pc_instructions[pc],
+            (unsigned long long)p->pc_cycles[pc]);
+  }
+
+  fprintf(fp, "total,,,,");
+  print_totals(fp, &total);
+}
+
+/**
+ * write_folded: Cycles as folded stacks, one "mode;opcode;pc cycles" line
+ * per PC, for flamegraph tools
+ * @param fp Where to write
+ * @param p The profile
+ * @return void
+ * */
+static void write_folded(FILE* fp, const struct profile* p) {
+  for (unsigned pc = 0; pc < TOTAL_MEM; pc++) {
+    if (p->pc_cycles[pc] == 0) continue;
+
+    const struct opcode_info* op = &opcodes[p->pc_opcode[pc]];
+    fprintf(fp, "%s;%s;$%04X %llu\n", op->mode, op->name, pc,
+            (unsigned long long)p->pc_cycles[pc]);
+  }
+}
+
+// the call tree as written: inclusive cycles per node, and the callees of
+// every node (first, then next) by decreasing inclusive cycles
+struct tree {
+  const struct profile* p;
+  uint64_t* inclusive;
+  uint32_t* first;
+  uint32_t* next;
+};
+
+struct order {
+  uint64_t inclusive;
+  uint32_t parent;
+  uint32_t node;
+};
+
+static int compare_order(const void* a, const void* b) {
+  const struct order* x = a;
+  const struct order* y = b;
+
+  if (x->parent != y->parent) return x->parent < y->parent ? -1 : 1;
+  if (x->inclusive != y->inclusive) return x->inclusive > y->inclusive ? -1 : 1;
+  return x->node < y->node ? -1 : x->node > y->node;
+}
+
+static void tree_free(struct tree* t) {
+  free(t->inclusive);
+  free(t->first);
+  free(t->next);
+}
+
+/**
+ * tree_build: Add up the inclusive cycles of the call tree and sort the
+ * callees, nodes are always created after their parent
+ * @param t The tree
+ * @param p The profile
+ * @return 0 if success, 1 if out of memory
+ * */
+static int tree_build(struct tree* t, const struct profile* p) {
+  uint32_t count = p->node_count;
+  struct order* order = malloc(count * sizeof(*order));
+
+  t->p = p;
+  t->inclusive = malloc(count * sizeof(*t->inclusive));
+  t->first = calloc(count, sizeof(*t->first));
+  t->next = calloc(count, sizeof(*t->next));
+  if (order == NULL || t->inclusive == NULL || t->first == NULL ||
+      t->next == NULL) {
+    free(order);
+    tree_free(t);
+    return 1;
+  }
+
+  for (uint32_t n = 0; n < count; n++) t->inclusive[n] = p->nodes[n].cycles;
+  for (uint32_t n = count - 1; n > 0; n--) {
+    t->inclusive[p->nodes[n].parent] += t->inclusive[n];
+  }
+
+  for (uint32_t n = 1; n < count; n++) {
+    order[n - 1] = (struct order){t->inclusive[n], p->nodes[n].parent, n};
+  }
+  qsort(order, count - 1, sizeof(*order), compare_order);
+  for (uint32_t i = count - 1; i > 0; i--) {
+    const struct order* o = &order[i - 1];
+    t->next[o->node] = t->first[o->parent];
+    t->first[o->parent] = o->node;
+  }
+
+  free(order);
+  return 0;
+}
+
+/**
+ * tree_walk: The node after n in depth-first order
+ * @param t The tree
+ * @param n The node, 0 for the first one
+ * @param leave Called on every node the walk is done with, may be NULL
+ * @param ctx Passed to leave
+ * @return the node, 0 at the end
+ * */
+static uint32_t tree_walk(const struct tree* t, uint32_t n,
+                          void (*leave)(uint32_t, void*), void* ctx) {
+  if (t->first[n] != 0) return t->first[n];
+
+  while (n != 0) {
+    if (leave != NULL) leave(n, ctx);
+    if (t->next[n] != 0) return t->next[n];
+    n = t->p->nodes[n].parent;
+  }
+  return 0;
+}
+
+// print_routine: "$8100 init", or "$8100" without a symbol
+static void print_routine(FILE* fp, const struct profile* p, uint16_t routine) {
+  fprintf(fp, "$%04X", routine);
+  if (p->symbols != NULL && p->symbols[routine] != NULL) {
+    fprintf(fp, " %s", p->symbols[routine]);
+  }
+}
+
+// per routine, all of its nodes together
+struct routines {
+  const struct profile* p;
+  uint64_t inclusive[TOTAL_MEM];
+  uint64_t exclusive[TOTAL_MEM];
+  uint64_t calls[TOTAL_MEM];
+  // nodes of the routine on the way to the node being walked
+  uint32_t active[TOTAL_MEM];
+};
+
+struct routine_order {
+  uint64_t inclusive;
+  uint16_t addr;
+};
+
+static int compare_routines(const void* a, const void* b) {
+  const struct routine_order* x = a;
+  const struct routine_order* y = b;
+
+  if (x->inclusive != y->inclusive) return x->inclusive > y->inclusive ? -1 : 1;
+  return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+static void leave_routine(uint32_t n, void* ctx) {
+  struct routines* r = ctx;
+
+  r->active[r->p->nodes[n].routine]--;
+}
+
+/**
+ * write_calls: The cycles of every routine, then the call tree and the
+ * mismatched returns:
+ *
+ *      inclusive    exclusive      calls  routine
+ *         812345          345          1  $8000 main
+ *   call tree:
+ *         900000        87655          -  root
+ *         812345          345          1    $8000 main
+ *
+ * Recursive routines count their inclusive cycles once.
+ * @param fp Where to write
+ * @param t The call tree
+ * @return 0 if success, 1 if out of memory
+ * */
+static int write_calls(FILE* fp, const struct tree* t) {
+  const struct profile* p = t->p;
+  struct routines* r = calloc(1, sizeof(*r));
+  struct routine_order* sorted;
+  unsigned count = 0;
+
+  if (r == NULL) return 1;
+  r->p = p;
+
+  for (uint32_t n = tree_walk(t, 0, NULL, NULL); n != 0;
+       n = tree_walk(t, n, leave_routine, r)) {
+    const struct profile_node* node = &p->nodes[n];
+
+    // an outer call of the routine has them already
+    if (r->active[node->routine]++ == 0) {
+      r->inclusive[node->routine] += t->inclusive[n];
+    }
+    r->exclusive[node->routine] += node->cycles;
+    r->calls[node->routine] += node->calls;
+  }
+
+  sorted = malloc(TOTAL_MEM * sizeof(*sorted));
+  if (sorted == NULL) {
+    free(r);
+    return 1;
+  }
+  for (unsigned addr = 0; addr < TOTAL_MEM; addr++) {
+    if (r->calls[addr] == 0) continue;
+    sorted[count++] = (struct routine_order){r->inclusive[addr], (uint16_t)addr};
+  }
+  qsort(sorted, count, sizeof(*sorted), compare_routines);
+
+  fprintf(fp, "%14s %12s %10s  routine\n", "inclusive", "exclusive", "calls");
+  fprintf(fp, "%14llu %12llu %10s  root\n", (unsigned long long)t->inclusive[0],
+          (unsigned long long)p->nodes[0].cycles, "-");
+  for (unsigned i = 0; i < count; i++) {
+    uint16_t addr = sorted[i].addr;
+    fprintf(fp, "%14llu %12llu %10llu  ", (unsigned long long)r->inclusive[addr],
+            (unsigned long long)r->exclusive[addr],
+            (unsigned long long)r->calls[addr]);
+    print_routine(fp, p, addr);
+    fputc('\n', fp);
+  }
+
+  fprintf(fp, "\ncall tree:\n");
+  fprintf(fp, "%14llu %12llu %10s  root\n", (unsigned long long)t->inclusive[0],
+          (unsigned long long)p->nodes[0].cycles, "-");
+  for (uint32_t n = tree_walk(t, 0, NULL, NULL); n != 0;
+       n = tree_walk(t, n, NULL, NULL)) {
+    const struct profile_node* node = &p->nodes[n];
+
+    fprintf(fp, "%14llu %12llu %10llu  ", (unsigned long long)t->inclusive[n],
+            (unsigned long long)node->cycles, (unsigned long long)node->calls);
+    if (node->depth > MAX_INDENT) {
+      fprintf(fp, "%*s[%u] ", 2 * MAX_INDENT, "", node->depth);
+    } else {
+      fprintf(fp, "%*s", 2 * node->depth, "");
+    }
+    print_routine(fp, p, node->routine);
+    fputc('\n', fp);
+  }
+
+  fprintf(fp, "\nmismatched returns: %llu\n", (unsigned long long)p->mismatches);
+  for (unsigned i = 0; i < p->mismatches && i < PROFILE_MISMATCH_SAMPLES; i++) {
+    const struct profile_mismatch* s = &p->mismatch[i];
+    const char* name = opcodes[p->pc_opcode[s->pc]].name;
+
+    if (s->depth == 0) {
+      fprintf(fp, "  $%04X %s to $%04X, outside any call\n", s->pc, name,
+              s->target);
+    } else {
+      fprintf(fp, "  $%04X %s to $%04X, expected $%04X at depth %u\n", s->pc,
+              name, s->target, s->expected, s->depth);
+    }
+  }
+  if (p->overflows != 0) {
+    fprintf(fp, "calls past the shadow stack or the tree: %llu\n",
+            (unsigned long long)p->overflows);
+  }
+
+  free(sorted);
+  free(r);
+  return 0;
+}
+
+// print_frame: a folded stack frame, the symbol alone if there is one
+static void print_frame(FILE* fp, const struct profile* p, uint16_t routine) {
+  if (p->symbols != NULL && p->symbols[routine] != NULL) {
+    fputs(p->symbols[routine], fp);
+  } else {
+    fprintf(fp, "$%04X", routine);
+  }
+}
+
+/**
+ * write_calls_folded: The exclusive cycles of every node of the call tree
+ * as a folded stack, "root;$8000;init cycles", for flamegraph tools
+ * @param fp Where to write
+ * @param t The call tree
+ * @return 0
+ * */
+static int write_calls_folded(FILE* fp, const struct tree* t) {
+  const struct profile* p = t->p;
+  uint32_t path[PROFILE_MAX_DEPTH];
+
+  for (uint32_t n = 0; n < p->node_count; n++) {
+    unsigned length = 0;
+
+    if (p->nodes[n].cycles == 0) continue;
+
+    for (uint32_t up = n; up != 0; up = p->nodes[up].parent) path[length++] = up;
+
+    fputs("root", fp);
+    while (length > 0) {
+      fputc(';', fp);
+      print_frame(fp, p, p->nodes[path[--length]].routine);
+    }
+    fprintf(fp, " %llu\n", (unsigned long long)p->nodes[n].cycles);
+  }
+
+  return 0;
+}
+
+/**
+ * profile_write: Write the profile of a machine to <prefix>.csv and
+ * <prefix>.folded, and its call graph to <prefix>.calls and
+ * <prefix>.calls.folded
+ * @param m The machine
+ * @param prefix Path of the files, without the extension
+ * @return 0 if success, 1 if failure
+ * */
+int profile_write(const struct machine* m, const char* prefix) {
+  static const char* const extensions[] = {".csv", ".folded", ".calls",
+                                           ".calls.folded"};
+  struct tree tree;
+  int status = 0;
+
+  if (m->profile == NULL) return 0;
+
+  if (tree_build(&tree, m->profile)) {
+    fprintf(stderr, "[FAILED] Error while allocating the call tree.\n");
+    return 1;
+  }
+
+  for (unsigned i = 0; i < 4; i++) {
+    size_t size = strlen(prefix) + strlen(extensions[i]) + 1;
+    char* path = malloc(size);
+    FILE* fp;
+    int err = 0;
+
+    if (path == NULL) {
+      status = 1;
+      break;
+    }
+    snprintf(path, size, "%s%s", prefix, extensions[i]);
+
+    fp = fopen(path, "w");
+    if (fp == NULL) {
+      fprintf(stderr, "[FAILED] Error while opening profile '%s'.\n", path);
+      free(path);
+      status = 1;
+      break;
+    }
+
+    switch (i) {
+    case 0:
+      write_csv(fp, m->profile);
+      break;
+    case 1:
+      write_folded(fp, m->profile);
+      break;
+    case 2:
+      err = write_calls(fp, &tree);
+      break;
+    default:
+      err = write_calls_folded(fp, &tree);
+      break;
+    }
+
+    if (ferror(fp)) err = 1;
+    if (fclose(fp) != 0 || err) {
+      fprintf(stderr, "[FAILED] Error while writing profile '%s'.\n", path);
+      status = 1;
+    }
+    free(path);
+  }
+
+  tree_free(&tree);
+  return status;
+}
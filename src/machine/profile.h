@@ -0,0 +1,133 @@
+#ifndef INC_6502_PROFILE_H
+#define INC_6502_PROFILE_H
+
+#include <stdint.h>
+
+#include "../mem/mem.h"
+#include "machine.h"
+
+/*
+ * Where guest programs spend their cycles.
+ *
+ * While a profile is attached (m->profile, NULL otherwise) cpu_run() and
+ * cpu_exec() count the instructions and cycles of every executed
+ * instruction in plain arrays, per opcode and per PC. The rest is derived
+ * when the profile is written: addressing modes from the opcodes, and the
+ * cycles beyond the base ones of lookup[] from the mode, since only
+ * branch() adds cycles to REL instructions (1 when taken, 2 across a page)
+ * and only page crossings add one to the others (ABX, ABY and IZY).
+ *
+ * The cycles of every instruction also go to the node of the call tree
+ * the CPU is in. A shadow stack follows JSR and BRK, which enter the node
+ * of their target under the current one, and RTS and RTI, which go back to
+ * the caller they return to. A return that lands anywhere but right after
+ * the newest call is a mismatched return: stack tricks (an RTS used as a
+ * jump, a routine dropping its return address) or a corrupted stack. It
+ * is counted, and the shadow stack unwinds to the newest call it does
+ * return to, if any. Inclusive cycles are added up from the tree when
+ * the profile is written. Stepping back in the history leaves the shadow
+ * stack where it was.
+ *
+ * The JIT sits out while a profile is attached, translated code counts
+ * nothing, and history replays aren't counted twice.
+ */
+
+// deeper calls drop the oldest frames of the shadow stack, and stay in the
+// node of their caller
+#define PROFILE_MAX_DEPTH 256
+// calls past this many call tree nodes stay in their caller's
+#define PROFILE_MAX_NODES (1 << 20)
+// mismatched returns kept for the report
+#define PROFILE_MISMATCH_SAMPLES 16
+
+// profile_flow[] of the opcodes that change routine
+#define PROFILE_CALL 1
+#define PROFILE_RETURN 2
+
+struct profile_node {
+  uint16_t routine;
+  uint16_t depth; // the root is 0
+  uint32_t parent;
+  // first callee and next callee of the parent, 0 for none (0 is the root)
+  uint32_t child;
+  uint32_t sibling;
+  uint64_t calls;
+  uint64_t cycles; // exclusive
+};
+
+struct profile_frame {
+  uint32_t node; // of the caller
+  uint16_t ret;  // PC the call returns to
+};
+
+struct profile_mismatch {
+  uint16_t pc;       // of the RTS or RTI
+  uint16_t target;   // where it went
+  uint16_t expected; // where the newest call returns to
+  uint16_t depth;    // of the shadow stack, expected is unset when 0
+};
+
+struct profile {
+  uint64_t op_instructions[256];
+  uint64_t op_cycles[256];
+
+  uint64_t pc_instructions[TOTAL_MEM];
+  uint64_t pc_cycles[TOTAL_MEM];
+  // the opcode last executed at every PC, self-modifying code may change it
+  uint8_t pc_opcode[TOTAL_MEM];
+
+  // the call tree, nodes[0] is the root: code outside any call
+  struct profile_node* nodes;
+  uint32_t node_count;
+  uint32_t node_capacity;
+  uint32_t current;
+
+  struct profile_frame stack[PROFILE_MAX_DEPTH];
+  unsigned depth;
+
+  uint64_t mismatches;
+  struct profile_mismatch mismatch[PROFILE_MISMATCH_SAMPLES];
+  // calls that dropped a frame or didn't get a node of their own
+  uint64_t overflows;
+
+  // names of addresses from a label file, NULL without one
+  char** symbols;
+};
+
+extern const uint8_t profile_flow[256];
+
+int profile_enable(struct machine* m);
+void profile_disable(struct machine* m);
+int profile_load_symbols(struct machine* m, const char* path);
+void profile_enter(struct profile* p, uint16_t routine, uint16_t ret);
+void profile_leave(struct profile* p, uint16_t pc, uint16_t target);
+int profile_write(const struct machine* m, const char* prefix);
+
+/**
+ * profile_count: Count an executed instruction
+ * @param p The profile
+ * @param pc Its PC
+ * @param opcode Its opcode
+ * @param cycles The cycles it took
+ * @param next_pc The PC it left
+ * @return void
+ * */
+static inline void profile_count(struct profile* p, uint16_t pc,
+                                 uint8_t opcode, uint32_t cycles,
+                                 uint16_t next_pc) {
+  p->op_instructions[opcode]++;
+  p->op_cycles[opcode] += cycles;
+  p->pc_instructions[pc]++;
+  p->pc_cycles[pc] += cycles;
+  p->pc_opcode[pc] = opcode;
+  p->nodes[p->current].cycles += cycles;
+
+  // JSR and BRK return right after their 3 bytes, as the cores push them
+  if (profile_flow[opcode] == PROFILE_CALL) {
+    profile_enter(p, next_pc, pc + 3);
+  } else if (profile_flow[opcode] == PROFILE_RETURN) {
+    profile_leave(p, pc, next_pc);
+  }
+}
+
+#endif
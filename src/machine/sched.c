@@ -0,0 +1,184 @@
+#include "sched.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "machine.h"
+
+// earlier cycle first, then earlier scheduling
+static int before(const struct sched_event* a, const struct sched_event* b) {
+  return a->when < b->when || (a->when == b->when && a->seq < b->seq);
+}
+
+static void place(struct sched* s, struct sched_event* ev, unsigned slot) {
+  s->heap[slot] = ev;
+  ev->slot = (int)slot;
+}
+
+static void sift_up(struct sched* s, unsigned slot) {
+  struct sched_event* ev = s->heap[slot];
+
+  while (slot > 0) {
+    unsigned parent = (slot - 1) / 2;
+    if (!before(ev, s->heap[parent])) break;
+    place(s, s->heap[parent], slot);
+    slot = parent;
+  }
+  place(s, ev, slot);
+}
+
+static void sift_down(struct sched* s, unsigned slot) {
+  struct sched_event* ev = s->heap[slot];
+
+  for (;;) {
+    unsigned child = 2 * slot + 1;
+    if (child >= s->count) break;
+    if (child + 1 < s->count && before(s->heap[child + 1], s->heap[child])) {
+      child++;
+    }
+    if (!before(s->heap[child], ev)) break;
+    place(s, s->heap[child], slot);
+    slot = child;
+  }
+  place(s, ev, slot);
+}
+
+// detach: Take a pending event out of the heap
+static void detach(struct sched* s, struct sched_event* ev) {
+  unsigned slot = (unsigned)ev->slot;
+  struct sched_event* last = s->heap[--s->count];
+
+  ev->slot = -1;
+  if (last == ev) return;
+
+  place(s, last, slot);
+  if (slot > 0 && before(last, s->heap[(slot - 1) / 2])) {
+    sift_up(s, slot);
+  } else {
+    sift_down(s, slot);
+  }
+}
+
+// update_next: Track the earliest event, a poke stays until sched_run()
+static void update_next(struct sched* s) {
+  if (s->next != 0) s->next = s->count > 0 ? s->heap[0]->when : SCHED_NEVER;
+}
+
+/**
+ * sched_init: Empty the scheduler of a new machine, for machine_init()
+ * @param m The machine
+ * @return void
+ * */
+void sched_init(struct machine* m) {
+  m->sched.count = 0;
+  m->sched.seq = 0;
+  m->sched.next = SCHED_NEVER;
+}
+
+/**
+ * sched_reset: Drop every pending event, for machine_reset(): the
+ * peripherals see them as not pending anymore
+ * @param m The machine
+ * @return void
+ * */
+void sched_reset(struct machine* m) {
+  for (unsigned i = 0; i < m->sched.count; i++) m->sched.heap[i]->slot = -1;
+
+  sched_init(m);
+}
+
+/**
+ * sched_event_init: Prepare an event, not pending, before its first use
+ * @param ev The event
+ * @param fire Called with the machine and the event once it is due
+ * @param ctx Left to the callback, as ev->ctx
+ * @return void
+ * */
+void sched_event_init(struct sched_event* ev, sched_fn fire, void* ctx) {
+  ev->when = 0;
+  ev->seq = 0;
+  ev->fire = fire;
+  ev->ctx = ctx;
+  ev->slot = -1;
+}
+
+/**
+ * sched_at: Schedule an event at a cycle of the machine clock, moving it if
+ * it is already pending. A cycle already reached fires at the next
+ * instruction boundary
+ * @param m The machine
+ * @param ev The event
+ * @param when The cycle
+ * @return 0 if success, 1 if SCHED_MAX_EVENTS are pending already
+ * */
+int sched_at(struct machine* m, struct sched_event* ev, uint64_t when) {
+  struct sched* s = &m->sched;
+  uint64_t next = s->next;
+
+  if (sched_pending(ev)) {
+    detach(s, ev);
+  } else if (s->count == SCHED_MAX_EVENTS) {
+    fprintf(stderr, "[FAILED] More than %d events scheduled.\n",
+            SCHED_MAX_EVENTS);
+    return 1;
+  }
+
+  ev->when = when;
+  ev->seq = s->seq++;
+  place(s, ev, s->count++);
+  sift_up(s, (unsigned)ev->slot);
+  update_next(s);
+
+  // scheduled by an I/O access: a block being interpreted was let run up
+  // to the old deadline, it stops after this instruction instead
+  if (s->next < next) m->mem.code_epoch++;
+
+  return 0;
+}
+
+/**
+ * sched_in: sched_at() some cycles from now
+ * @param m The machine
+ * @param ev The event
+ * @param delay Cycles from m->clock.cycles
+ * @return 0 if success, 1 if SCHED_MAX_EVENTS are pending already
+ * */
+int sched_in(struct machine* m, struct sched_event* ev, uint64_t delay) {
+  uint64_t when = m->clock.cycles + delay;
+
+  return sched_at(m, ev, when < delay ? SCHED_NEVER - 1 : when);
+}
+
+/**
+ * sched_cancel: Unschedule an event, nothing happens if it isn't pending
+ * @param m The machine
+ * @param ev The event
+ * @return void
+ * */
+void sched_cancel(struct machine* m, struct sched_event* ev) {
+  if (!sched_pending(ev)) return;
+
+  detach(&m->sched, ev);
+  update_next(&m->sched);
+}
+
+/**
+ * sched_run: Fire, earliest first, every event due by m->clock.cycles,
+ * those scheduled by the callbacks included, and drop the poke, if any.
+ * Called by the CPU between two instructions, right before it looks at
+ * its interrupt lines
+ * @param m The machine
+ * @return void
+ * */
+void sched_run(struct machine* m) {
+  struct sched* s = &m->sched;
+
+  while (s->count > 0 && s->heap[0]->when <= m->clock.cycles) {
+    struct sched_event* ev = s->heap[0];
+
+    detach(s, ev);
+    ev->fire(m, ev);
+  }
+
+  s->next = s->count > 0 ? s->heap[0]->when : SCHED_NEVER;
+}
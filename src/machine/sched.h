@@ -0,0 +1,89 @@
+#ifndef INC_6502_SCHED_H
+#define INC_6502_SCHED_H
+
+#include <stdint.h>
+
+/*
+ * Event scheduler for the peripherals.
+ *
+ * Instead of being polled after every instruction, a peripheral asks to be
+ * called back when the machine clock (m->clock.cycles) reaches some cycle.
+ * cpu_run() and cpu_exec() fire the events that are due between two
+ * instructions, at the first instruction boundary at or past their cycle,
+ * whatever the core: cpu_run() runs blocks and translated code straight up
+ * to the next deadline and single steps the ones that could pass it.
+ *
+ * An event is a struct sched_event the peripheral embeds in its own state,
+ * the scheduler keeps pointers to the pending ones in a min-heap ordered by
+ * cycle, events due at the same cycle fire in the order they were
+ * scheduled. A callback may schedule events again, its own included.
+ *
+ * Scheduling is bounded by SCHED_MAX_EVENTS and allocates nothing. Events
+ * are state of the peripherals: snapshots and history checkpoints don't
+ * keep them, a device schedules its own again when its state is restored
+ * (see struct machine_device), and machine_reset() drops them all.
+ */
+
+#define SCHED_MAX_EVENTS 32
+
+// no event pending
+#define SCHED_NEVER UINT64_MAX
+
+struct machine;
+struct sched_event;
+
+typedef void (*sched_fn)(struct machine* m, struct sched_event* ev);
+
+struct sched_event {
+  // clock.cycles it is due at
+  uint64_t when;
+  // order of scheduling, for events due at the same cycle
+  uint64_t seq;
+
+  sched_fn fire;
+  void* ctx;
+
+  // index in the heap, -1 while not pending
+  int slot;
+};
+
+struct sched {
+  struct sched_event* heap[SCHED_MAX_EVENTS];
+  unsigned count;
+  uint64_t seq;
+
+  // when of the earliest event, SCHED_NEVER while none is pending, or 0
+  // after sched_poke() until the CPU has looked at its interrupt lines
+  uint64_t next;
+};
+
+void sched_init(struct machine* m);
+void sched_reset(struct machine* m);
+void sched_event_init(struct sched_event* ev, sched_fn fire, void* ctx);
+int sched_at(struct machine* m, struct sched_event* ev, uint64_t when);
+int sched_in(struct machine* m, struct sched_event* ev, uint64_t delay);
+void sched_cancel(struct machine* m, struct sched_event* ev);
+void sched_run(struct machine* m);
+
+/**
+ * sched_poke: Have the CPU look at its interrupt lines before the next
+ * instruction, as it does when an event is due, so that cpu_run() has a
+ * single deadline to check in between instructions. Called when a line
+ * goes active and when the I flag is cleared under an active IRQ
+ * @param s The scheduler of the machine
+ * @return void
+ * */
+static inline void sched_poke(struct sched* s) {
+  s->next = 0;
+}
+
+/**
+ * sched_pending: Whether an event is scheduled and hasn't fired yet
+ * @param ev The event
+ * @return 1 if pending, 0 otherwise
+ * */
+static inline int sched_pending(const struct sched_event* ev) {
+  return ev->slot >= 0;
+}
+
+#endif
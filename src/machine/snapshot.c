@@ -0,0 +1,373 @@
+#include "snapshot.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../cpu/cpu.h"
+#include "../mem/mem.h"
+#include "machine.h"
+
+#define CHUNK_HEADER_SIZE 8
+#define CHUNK_CPU_SIZE 7
+#define CHUNK_CLK_SIZE 20
+#define CHUNK_MAP_SIZE (MEM_PAGES * 8)
+#define CHUNK_PAGE_SIZE (1 + MEM_PAGE_SIZE)
+
+// everything a snapshot sets, checked as a whole before touching a machine
+struct snapshot_state {
+  uint8_t has_cpu;
+  uint8_t has_clk;
+  struct central_processing_unit cpu;
+  uint32_t cycles;
+  struct cpu_counters clock;
+
+  uint32_t read_page[MEM_PAGES];
+  uint32_t write_page[MEM_PAGES];
+  uint8_t data[TOTAL_MEM];
+
+  // chunks of the attached devices, NULL for those the snapshot hasn't
+  uint8_t* device[MACHINE_MAX_DEVICES];
+  uint32_t device_size[MACHINE_MAX_DEVICES];
+};
+
+static void put16(uint8_t* p, uint16_t v) {
+  p[0] = v & 0xFF;
+  p[1] = v >> 8;
+}
+
+static void put32(uint8_t* p, uint32_t v) {
+  put16(p, v & 0xFFFF);
+  put16(p + 2, v >> 16);
+}
+
+static void put64(uint8_t* p, uint64_t v) {
+  put32(p, (uint32_t)v);
+  put32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint16_t get16(const uint8_t* p) {
+  return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t get32(const uint8_t* p) {
+  return get16(p) | ((uint32_t)get16(p + 2) << 16);
+}
+
+static uint64_t get64(const uint8_t* p) {
+  return get32(p) | ((uint64_t)get32(p + 4) << 32);
+}
+
+/**
+ * write_chunk: Write a chunk header and its payload
+ * @param fp The snapshot file
+ * @param tag The 4-character tag
+ * @param payload The payload
+ * @param size The payload size
+ * @return 0 if success, 1 if failure
+ * */
+static int write_chunk(FILE* fp, const char* tag, const uint8_t* payload,
+                       uint32_t size) {
+  uint8_t header[CHUNK_HEADER_SIZE];
+
+  memcpy(header, tag, 4);
+  put32(header + 4, size);
+
+  if (fwrite(header, 1, sizeof(header), fp) != sizeof(header)) return 1;
+  return size != 0 && fwrite(payload, 1, size, fp) != size;
+}
+
+/**
+ * snapshot_save: Write the state of a machine, between two instructions
+ * or right after a reset
+ * @param m The machine
+ * @param path Where to write the snapshot
+ * @return 0 if success, 1 if failure
+ * */
+int snapshot_save(struct machine* m, const char* path) {
+  static const uint8_t zeros[MEM_PAGE_SIZE];
+  uint8_t buf[CHUNK_MAP_SIZE];
+  int err = 0;
+
+  FILE* fp = fopen(path, "wb");
+  if (fp == NULL) {
+    fprintf(stderr, "[FAILED] Error while opening snapshot '%s'.\n", path);
+    return 1;
+  }
+
+  memcpy(buf, SNAPSHOT_MAGIC, 8);
+  put32(buf + 8, SNAPSHOT_VERSION);
+  err |= fwrite(buf, 1, 12, fp) != 12;
+
+  put16(buf, m->cpu.pc);
+  buf[2] = m->cpu.sp;
+  buf[3] = m->cpu.ac;
+  buf[4] = m->cpu.x;
+  buf[5] = m->cpu.y;
+  buf[6] = cpu_sr_pack(&m->cpu);
+  err |= write_chunk(fp, "CPU ", buf, CHUNK_CPU_SIZE);
+
+  put32(buf, m->cycles);
+  put64(buf + 4, m->clock.instructions);
+  put64(buf + 12, m->clock.cycles);
+  err |= write_chunk(fp, "CLK ", buf, CHUNK_CLK_SIZE);
+
+  // the page table as mapped, watched pages included, if it isn't plain RAM
+  int mapped = 0;
+  for (unsigned page = 0; page < MEM_PAGES; page++) {
+    mapped |= mem_page_entry(m, (uint8_t)page, 0) != page * MEM_PAGE_SIZE ||
+              mem_page_entry(m, (uint8_t)page, 1) != page * MEM_PAGE_SIZE;
+  }
+
+  if (mapped) {
+    for (unsigned page = 0; page < MEM_PAGES; page++) {
+      put32(buf + page * 8, mem_page_entry(m, (uint8_t)page, 0));
+      put32(buf + page * 8 + 4, mem_page_entry(m, (uint8_t)page, 1));
+    }
+    err |= write_chunk(fp, "MAP ", buf, CHUNK_MAP_SIZE);
+  }
+
+  // the memory of a fresh machine is all zeros, so are most pages
+  for (unsigned page = 0; page < MEM_PAGES; page++) {
+    const uint8_t* bytes = m->mem.data + page * MEM_PAGE_SIZE;
+
+    if (memcmp(bytes, zeros, MEM_PAGE_SIZE) == 0) continue;
+
+    buf[0] = (uint8_t)page;
+    memcpy(buf + 1, bytes, MEM_PAGE_SIZE);
+    err |= write_chunk(fp, "PAGE", buf, CHUNK_PAGE_SIZE);
+  }
+
+  for (unsigned i = 0; i < m->device_count; i++) {
+    const struct machine_device* d = &m->devices[i];
+    uint32_t size = d->save(m, d->ctx, MACHINE_STATE_SNAPSHOT, NULL);
+    uint8_t* state = malloc(size);
+
+    if (state == NULL) {
+      err = 1;
+      break;
+    }
+    d->save(m, d->ctx, MACHINE_STATE_SNAPSHOT, state);
+    err |= write_chunk(fp, d->tag, state, size);
+    free(state);
+  }
+
+  err |= write_chunk(fp, "END ", NULL, 0);
+
+  if (fclose(fp) != 0) err = 1;
+  if (err) {
+    fprintf(stderr, "[FAILED] Error while writing snapshot '%s'.\n", path);
+  }
+
+  return err;
+}
+
+/**
+ * device_of: The attached device a chunk belongs to, by its tag and page
+ * @param m The machine
+ * @param fp The snapshot file, at the payload of the chunk
+ * @param header The header of the chunk
+ * @return the index of the device, -1 if none
+ * */
+static int device_of(struct machine* m, FILE* fp, const uint8_t* header) {
+  int page = -1;
+
+  for (unsigned i = 0; i < m->device_count; i++) {
+    if (memcmp(header, m->devices[i].tag, 4) != 0) continue;
+
+    // peek at the page
+    if (page < 0) {
+      page = get32(header + 4) > 0 ? fgetc(fp) : -1;
+      if (page < 0 || ungetc(page, fp) == EOF) return -1;
+    }
+    if (m->devices[i].page == page) return (int)i;
+  }
+
+  return -1;
+}
+
+/**
+ * read_chunks: Parse the chunks of a snapshot
+ * @param fp The snapshot file, past the version
+ * @param m The machine, for the chunks of its devices
+ * @param s Filled with what the chunks hold
+ * @return NULL if success, an error message if not
+ * */
+static const char* read_chunks(FILE* fp, struct machine* m,
+                               struct snapshot_state* s) {
+  uint8_t buf[CHUNK_MAP_SIZE];
+
+  for (;;) {
+    uint8_t header[CHUNK_HEADER_SIZE];
+
+    if (fread(header, 1, sizeof(header), fp) != sizeof(header)) {
+      return "truncated";
+    }
+
+    uint32_t size = get32(header + 4);
+    uint32_t expected = 0;
+
+    if (memcmp(header, "END ", 4) == 0) return NULL;
+
+    int device = device_of(m, fp, header);
+    if (device >= 0) {
+      if (size < m->devices[device].min_size) return "corrupted chunk";
+      if (s->device[device] != NULL) return "device saved twice";
+
+      s->device[device] = malloc(size);
+      if (s->device[device] == NULL) return "out of memory";
+      s->device_size[device] = size;
+      if (fread(s->device[device], 1, size, fp) != size) return "truncated";
+      continue;
+    }
+
+    if (memcmp(header, "CPU ", 4) == 0) {
+      expected = CHUNK_CPU_SIZE;
+    } else if (memcmp(header, "CLK ", 4) == 0) {
+      expected = CHUNK_CLK_SIZE;
+    } else if (memcmp(header, "MAP ", 4) == 0) {
+      expected = CHUNK_MAP_SIZE;
+    } else if (memcmp(header, "PAGE", 4) == 0) {
+      expected = CHUNK_PAGE_SIZE;
+    } else {
+      // someone else's chunk
+      if (fseek(fp, size, SEEK_CUR) != 0) return "truncated";
+      continue;
+    }
+
+    if (size != expected) return "corrupted chunk";
+    if (fread(buf, 1, size, fp) != size) return "truncated";
+
+    if (memcmp(header, "CPU ", 4) == 0) {
+      s->cpu.pc = get16(buf);
+      s->cpu.sp = buf[2];
+      s->cpu.ac = buf[3];
+      s->cpu.x = buf[4];
+      s->cpu.y = buf[5];
+      cpu_sr_unpack(&s->cpu, buf[6]);
+      s->has_cpu = 1;
+    } else if (memcmp(header, "CLK ", 4) == 0) {
+      s->cycles = get32(buf);
+      s->clock.instructions = get64(buf + 4);
+      s->clock.cycles = get64(buf + 12);
+      s->has_clk = 1;
+    } else if (memcmp(header, "MAP ", 4) == 0) {
+      for (unsigned page = 0; page < MEM_PAGES; page++) {
+        s->read_page[page] = get32(buf + page * 8);
+        s->write_page[page] = get32(buf + page * 8 + 4);
+      }
+    } else {
+      memcpy(s->data + buf[0] * MEM_PAGE_SIZE, buf + 1, MEM_PAGE_SIZE);
+    }
+  }
+}
+
+/**
+ * valid_entry: Whether a page table entry of a snapshot can be restored
+ * @param entry The entry
+ * @return 1 if valid, 0 if not
+ * */
+static int valid_entry(uint32_t entry) {
+  return entry == MEM_PAGE_IO ||
+         (entry % MEM_PAGE_SIZE == 0 && entry < TOTAL_MEM);
+}
+
+/**
+ * free_state: Free what snapshot_load() read
+ * @param s The state
+ * @return void
+ * */
+static void free_state(struct snapshot_state* s) {
+  for (unsigned i = 0; i < MACHINE_MAX_DEVICES; i++) free(s->device[i]);
+  free(s);
+}
+
+/**
+ * snapshot_load: Bring a machine to the state of a snapshot: registers,
+ * clock, memory map, memory and devices. Pages of the snapshot handled by
+ * devices must already be mapped to some, attached devices the snapshot
+ * doesn't have are reset; the machine is left untouched if the snapshot
+ * can't be restored
+ * @param m The machine
+ * @param path The snapshot
+ * @return 0 if success, 1 if failure
+ * */
+int snapshot_load(struct machine* m, const char* path) {
+  const char* error = NULL;
+  uint8_t header[12];
+
+  FILE* fp = fopen(path, "rb");
+  if (fp == NULL) {
+    fprintf(stderr, "[FAILED] Error while opening snapshot '%s'.\n", path);
+    return 1;
+  }
+
+  struct snapshot_state* s = calloc(1, sizeof(*s));
+  if (s == NULL) {
+    fclose(fp);
+    return 1;
+  }
+
+  // plain RAM unless the snapshot has a map
+  for (unsigned page = 0; page < MEM_PAGES; page++) {
+    s->read_page[page] = page * MEM_PAGE_SIZE;
+    s->write_page[page] = page * MEM_PAGE_SIZE;
+  }
+
+  if (fread(header, 1, sizeof(header), fp) != sizeof(header) ||
+      memcmp(header, SNAPSHOT_MAGIC, 8) != 0) {
+    error = "not a snapshot";
+  } else if (get32(header + 8) > SNAPSHOT_VERSION) {
+    error = "made by a newer version";
+  } else {
+    error = read_chunks(fp, m, s);
+  }
+  fclose(fp);
+
+  if (error == NULL && (!s->has_cpu || !s->has_clk)) error = "incomplete";
+
+  for (unsigned page = 0; error == NULL && page < MEM_PAGES; page++) {
+    if (!valid_entry(s->read_page[page]) || !valid_entry(s->write_page[page])) {
+      error = "corrupted memory map";
+    } else if (s->read_page[page] == MEM_PAGE_IO &&
+               mem_page_entry(m, (uint8_t)page, 0) != MEM_PAGE_IO) {
+      fprintf(stderr, "[FAILED] Snapshot '%s' needs a device on page 0x%02X.\n",
+              path, page);
+      free_state(s);
+      return 1;
+    }
+  }
+
+  if (error != NULL) {
+    fprintf(stderr, "[FAILED] Error while loading snapshot '%s': %s.\n", path,
+            error);
+    free_state(s);
+    return 1;
+  }
+
+  for (unsigned page = 0; page < MEM_PAGES; page++) {
+    uint8_t* bytes = m->mem.data + page * MEM_PAGE_SIZE;
+
+    if (memcmp(bytes, s->data + page * MEM_PAGE_SIZE, MEM_PAGE_SIZE) != 0) {
+      memcpy(bytes, s->data + page * MEM_PAGE_SIZE, MEM_PAGE_SIZE);
+      m->mem.dirty[page] = MEM_DIRTY_ALL;
+    }
+  }
+  mem_map_restore(m, s->read_page, s->write_page);
+  mem_code_invalidate_all(m);
+
+  m->cpu = s->cpu;
+  m->cycles = s->cycles;
+  m->clock = s->clock;
+
+  for (unsigned i = 0; i < m->device_count; i++) {
+    const struct machine_device* d = &m->devices[i];
+    d->load(m, d->ctx, MACHINE_STATE_SNAPSHOT, s->device[i], s->device_size[i]);
+  }
+  // an IRQ line left low has to be looked at again
+  sched_poke(&m->sched);
+
+  free_state(s);
+  return 0;
+}
@@ -0,0 +1,36 @@
+#ifndef INC_6502_SNAPSHOT_H
+#define INC_6502_SNAPSHOT_H
+
+/*
+ * Save states of a whole machine.
+ *
+ * A snapshot is the magic "6502SNAP", a little-endian u32 version and a
+ * list of chunks, each a 4-character tag, a u32 payload size and the
+ * payload, up to an "END " chunk:
+ *
+ *   "CPU "  pc (u16), sp, a, x, y, status register (u8 each)
+ *   "CLK "  cycles left of the current instruction (u32), instructions
+ *           and cycles since power-on (u64 each)
+ *   "MAP "  read and write entry (u32 each) of the 256 pages, only when
+ *           some page is not plain RAM
+ *   "PAGE"  a backing page number (u8) and its 256 bytes, only for pages
+ *           that are not all zeros
+ *
+ * followed by a chunk per attached device, see struct machine_device in
+ * machine.h: its tag, and a payload starting with the page it is on.
+ *
+ * A loader skips chunks it doesn't know, so devices can add their own
+ * without bumping the version; the version changes when a known chunk
+ * changes meaning. The chunk of a device is matched by tag and page
+ * against the devices attached to the machine being restored.
+ */
+
+#define SNAPSHOT_MAGIC "6502SNAP"
+#define SNAPSHOT_VERSION 1
+
+struct machine;
+
+int snapshot_save(struct machine* m, const char* path);
+int snapshot_load(struct machine* m, const char* path);
+
+#endif
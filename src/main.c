@@ -7,25 +7,110 @@
 #include <unistd.h>
 
 #include "cpu/cpu.h"
+#include "farm/farm.h"
+#include "headless/headless.h"
+#include "jit/jit.h"
+#include "machine/debug.h"
+#include "machine/history.h"
+#include "machine/profile.h"
+#include "machine/machine.h"
+#include "machine/snapshot.h"
 #include "mem/mem.h"
+#include "peripherals/acia.h"
 #include "peripherals/interface.h"
 #include "peripherals/kinput.h"
+#include "peripherals/runner.h"
+#include "peripherals/via.h"
+#include "utils/trace.h"
+#include "utils/tracebin.h"
 
 #define MIN_COLUMNS 150
 #define MIN_ROWS 50
 
-uint8_t DEBUG = 0;
+// the emulated system
+static struct machine machine;
+// its binary trace, with --trace-bin
+static struct tracebin trace_bin;
+// its timers, with --via
+static struct via via;
+// its serial port, with --acia
+static struct acia acia;
 int opt;
 int dump_flag = 0;
 int follow_flag = 0;
+int headless_flag = 0;
+int no_blocks_flag = 0;
+int jit_flag = 0;
+char *farm_file = NULL;
+unsigned farm_workers = 0;
+char *trace_file = NULL;
+char *trace_bin_file = NULL;
+char *profile_prefix = NULL;
+char *symbols_file = NULL;
+char *save_file = NULL;
+char *restore_file = NULL;
+uint64_t history_mb = HISTORY_DEFAULT_MB;
+uint64_t rewind_cycles = 0;
+uint64_t clock_hz = 0;
+int rewind_flag = 0;
+int via_flag = 0;
+uint8_t via_page = 0;
+int acia_flag = 0;
+uint8_t acia_page = 0;
+int screen_flag = 0;
+uint16_t screen_addr = 0;
+uint8_t screen_columns = 0;
+uint8_t screen_rows = 0;
+uint64_t fps = KINPUT_REFRESH_HZ;
 
 typedef struct {
     unsigned short address;
     char *filename;
 } LoadEntry;
 
+// -M and --map, applied in command line order
+typedef struct {
+    int is_file;
+    char *arg;
+} MapEntry;
+
+// --break and --watch, armed once the machine is set up
+typedef struct {
+    int is_watch;
+    char *arg;
+} DebugEntry;
+
 void print_usage(char *prog_name) {
-    fprintf(stderr, "Usage: %s [-d|--dump] [-f|--follow] -L 0x<hex address>:<filename>...\n", prog_name);
+    fprintf(stderr, "Usage: %s [--help] [-d|--dump] [-f|--follow] -L 0x<hex address>:<filename>...\n", prog_name);
+    fprintf(stderr, "       %s --headless [--cycles N] [--insts N] [--stop brk|self|idle|pc=0x<hex address>]... -L 0x<hex address>:<filename>...\n", prog_name);
+    fprintf(stderr, "       a headless run exits with %d when it stopped in an idle loop, 0 on any other stop\n", HEADLESS_EXIT_IDLE);
+    fprintf(stderr, "       %s --farm <job list> [-j|--jobs N]\n", prog_name);
+    fprintf(stderr, "       --trace <file|->: write the trace records (bin/emulator-trace.out only)\n");
+    fprintf(stderr, "       --trace-bin <file>: record a compact binary trace, bin/trace-dump.out decodes it (bin/emulator-trace.out only)\n");
+    fprintf(stderr, "       --profile <prefix>: count instructions and cycles per opcode, mode and PC, written to <prefix>.csv and <prefix>.folded at exit, and per subroutine to <prefix>.calls and <prefix>.calls.folded\n");
+    fprintf(stderr, "       --symbols <file>: name the subroutines of --profile from an assembler label file (name = $8100, or al C:8100 .name)\n");
+    fprintf(stderr, "       --no-blocks: fetch and decode every instruction, no block cache\n");
+    fprintf(stderr, "       --jit: translate hot blocks to native code (Linux x86-64)\n");
+    fprintf(stderr, "       --restore <file>: start from a snapshot instead of a reset, --save <file>: write one at exit\n");
+    fprintf(stderr, "       --history <MB>: memory for stepping back, 0 to turn it off, --rewind N: go back N cycles after a headless run (the B key otherwise)\n");
+    fprintf(stderr, "       --clock <Hz>: pace the run started with G in the interface, full speed by default\n");
+    fprintf(stderr, "       --break 0x<hex address>: stop before the instruction there, --watch 0x<first>[-0x<last>][:r|w|c...]: stop after reads, writes or changes (writes by default)\n");
+    fprintf(stderr, "       -M|--map-pages 0x<first page>[-0x<last page>]:ram|rom|mirror=0x<page>, --map <file>: memory map\n");
+    fprintf(stderr, "       --via 0x<page>: map the timers and the IRQ of a 6522 VIA on a page\n");
+    fprintf(stderr, "       --acia 0x<page>: map a 6551 ACIA on a page, on stdin and stdout headless, on a console pane in the interface\n");
+    fprintf(stderr, "       --screen 0x<hex address>:<columns>x<rows>: show memory as a text screen in the interface, --fps N: refresh it N times a second while running, 30 by default\n");
+}
+
+// parse a decimal budget such as --cycles 1000000
+static int parse_budget(const char *arg, uint64_t *out) {
+  char *endptr;
+  errno = 0;
+  unsigned long long val = strtoull(arg, &endptr, 10);
+
+  if (errno != 0 || *endptr != '\0' || arg[0] == '-') return 1;
+
+  *out = (uint64_t)val;
+  return 0;
 }
 
 int main(int argc, char* argv[]) {
@@ -34,15 +119,52 @@ int main(int argc, char* argv[]) {
   LoadEntry *load_entries = NULL;
   size_t load_count = 0;
 
+  MapEntry *map_entries = NULL;
+  size_t map_count = 0;
+
+  DebugEntry *debug_entries = NULL;
+  size_t debug_count = 0;
+
+  // Headless run configuration, the first --stop replaces the defaults
+  struct headless_config headless_config;
+  int stop_given = 0;
+  headless_config_init(&headless_config);
+
   // Long options for getopt_long
   struct option long_options[] = {
     {"dump", no_argument, 0, 'd'},
     {"follow", no_argument, 0, 'f'},
+    {"headless", no_argument, 0, 'H'},
+    {"cycles", required_argument, 0, 'c'},
+    {"insts", required_argument, 0, 'n'},
+    {"stop", required_argument, 0, 's'},
+    {"farm", required_argument, 0, 'F'},
+    {"jobs", required_argument, 0, 'j'},
+    {"trace", required_argument, 0, 't'},
+    {"trace-bin", required_argument, 0, 'T'},
+    {"profile", required_argument, 0, 'P'},
+    {"symbols", required_argument, 0, 'Y'},
+    {"map-pages", required_argument, 0, 'M'},
+    {"map", required_argument, 0, 'm'},
+    {"no-blocks", no_argument, 0, 'b'},
+    {"jit", no_argument, 0, 'J'},
+    {"save", required_argument, 0, 'S'},
+    {"restore", required_argument, 0, 'R'},
+    {"history", required_argument, 0, 'h'},
+    {"rewind", required_argument, 0, 'w'},
+    {"clock", required_argument, 0, 'k'},
+    {"break", required_argument, 0, 'X'},
+    {"watch", required_argument, 0, 'W'},
+    {"via", required_argument, 0, 'V'},
+    {"acia", required_argument, 0, 'A'},
+    {"screen", required_argument, 0, 'D'},
+    {"fps", required_argument, 0, 'r'},
+    {"help", no_argument, 0, 'u'},
     {0, 0, 0, 0}
   };
   
   // Parse options
-  while ((opt = getopt_long(argc, argv, "dfL:", long_options, NULL)) != -1) {
+  while ((opt = getopt_long(argc, argv, "dfj:L:M:", long_options, NULL)) != -1) {
     switch (opt) {
     case 'd':
       dump_flag = 1;
@@ -50,6 +172,152 @@ int main(int argc, char* argv[]) {
     case 'f':
       follow_flag = 1;
       break;
+    case 'H':
+      headless_flag = 1;
+      break;
+    case 'b':
+      no_blocks_flag = 1;
+      break;
+    case 'J':
+      jit_flag = 1;
+      break;
+    case 'S':
+      save_file = optarg;
+      break;
+    case 'R':
+      restore_file = optarg;
+      break;
+    case 'h':
+      if (parse_budget(optarg, &history_mb) || history_mb > 65536) {
+	fprintf(stderr, "Error: Invalid history size '%s'.\n", optarg);
+	free(load_entries);
+	return EXIT_FAILURE;
+      }
+      break;
+    case 'w':
+      if (parse_budget(optarg, &rewind_cycles)) {
+	fprintf(stderr, "Error: Invalid amount of cycles to rewind '%s'.\n", optarg);
+	free(load_entries);
+	return EXIT_FAILURE;
+      }
+      rewind_flag = 1;
+      break;
+    case 'k':
+      if (parse_budget(optarg, &clock_hz)) {
+	fprintf(stderr, "Error: Invalid clock '%s'.\n", optarg);
+	free(load_entries);
+	return EXIT_FAILURE;
+      }
+      break;
+    case 'c':
+      if (parse_budget(optarg, &headless_config.limits.max_cycles)) {
+	fprintf(stderr, "Error: Invalid cycle budget '%s'.\n", optarg);
+	free(load_entries);
+	return EXIT_FAILURE;
+      }
+      break;
+    case 'n':
+      if (parse_budget(optarg, &headless_config.limits.max_instructions)) {
+	fprintf(stderr, "Error: Invalid instruction budget '%s'.\n", optarg);
+	free(load_entries);
+	return EXIT_FAILURE;
+      }
+      break;
+    case 's':
+      if (!stop_given) {
+	headless_config.limits.stop_on_brk = 0;
+	headless_config.limits.stop_on_self_jump = 0;
+	headless_config.limits.stop_on_idle = 0;
+	stop_given = 1;
+      }
+      if (headless_parse_stop(&headless_config, optarg)) {
+	fprintf(stderr, "Error: Expected --stop brk, --stop self, --stop idle or --stop pc=0x<hex address>\n");
+	free(load_entries);
+	return EXIT_FAILURE;
+      }
+      break;
+    case 'F':
+      farm_file = optarg;
+      break;
+    case 't':
+      trace_file = optarg;
+      break;
+    case 'T':
+      trace_bin_file = optarg;
+      break;
+    case 'P':
+      profile_prefix = optarg;
+      break;
+    case 'Y':
+      symbols_file = optarg;
+      break;
+    case 'V':
+      if (mem_parse_page(optarg, optarg + strlen(optarg), &via_page)) {
+	fprintf(stderr, "Error: Invalid page '%s', expected --via 0x<page>\n", optarg);
+	free(load_entries);
+	return EXIT_FAILURE;
+      }
+      via_flag = 1;
+      break;
+    case 'A':
+      if (mem_parse_page(optarg, optarg + strlen(optarg), &acia_page)) {
+	fprintf(stderr, "Error: Invalid page '%s', expected --acia 0x<page>\n", optarg);
+	free(load_entries);
+	return EXIT_FAILURE;
+      }
+      acia_flag = 1;
+      break;
+    case 'D':
+      if (interface_parse_screen(optarg, &screen_addr, &screen_columns, &screen_rows)) {
+	fprintf(stderr, "Error: Invalid screen '%s', expected 0x<hex address>:<columns>x<rows> of at most %d characters\n", optarg, INTERFACE_SCREEN_MAX);
+	free(load_entries);
+	return EXIT_FAILURE;
+      }
+      screen_flag = 1;
+      break;
+    case 'r':
+      if (parse_budget(optarg, &fps) || fps < 1 || fps > 1000) {
+	fprintf(stderr, "Error: Invalid refresh rate '%s', expected 1 to 1000.\n", optarg);
+	free(load_entries);
+	return EXIT_FAILURE;
+      }
+      break;
+    case 'M':
+    case 'm': {
+      MapEntry *entries = realloc(map_entries, (map_count + 1) * sizeof(MapEntry));
+      if (entries == NULL) {
+	perror("Memory allocation failed");
+	return EXIT_FAILURE;
+      }
+      map_entries = entries;
+      map_entries[map_count].is_file = opt == 'm';
+      map_entries[map_count].arg = optarg;
+      map_count++;
+      break;
+    }
+    case 'X':
+    case 'W': {
+      DebugEntry *entries = realloc(debug_entries, (debug_count + 1) * sizeof(DebugEntry));
+      if (entries == NULL) {
+	perror("Memory allocation failed");
+	return EXIT_FAILURE;
+      }
+      debug_entries = entries;
+      debug_entries[debug_count].is_watch = opt == 'W';
+      debug_entries[debug_count].arg = optarg;
+      debug_count++;
+      break;
+    }
+    case 'j': {
+      uint64_t workers;
+      if (parse_budget(optarg, &workers) || workers == 0 || workers > 4096) {
+	fprintf(stderr, "Error: Invalid amount of workers '%s'.\n", optarg);
+	free(load_entries);
+	return EXIT_FAILURE;
+      }
+      farm_workers = (unsigned)workers;
+      break;
+    }
     case 'L': {
       char *arg = optarg;
       char *colon_pos = strchr(arg, ':');
@@ -103,6 +371,10 @@ int main(int argc, char* argv[]) {
       print_usage(argv[0]);
       free(load_entries);
       return EXIT_FAILURE;
+    case 'u':
+      print_usage(argv[0]);
+      free(load_entries);
+      return EXIT_SUCCESS;
     default:
       print_usage(argv[0]);
       free(load_entries);
@@ -110,16 +382,82 @@ int main(int argc, char* argv[]) {
     }
   }
 
+  // Farm mode: run a whole job list on every core and report
+  if ( farm_file != NULL ) {
+    struct farm farm = {0};
+    int status = EXIT_SUCCESS;
+
+    if ( farm_workers == 0 ) {
+      long online = sysconf(_SC_NPROCESSORS_ONLN);
+      farm_workers = online > 0 ? (unsigned)online : 1;
+    }
+
+    for (size_t i = 0; i < load_count; i++) {
+      free(load_entries[i].filename);
+    }
+    free(load_entries);
+    free(map_entries);
+    free(debug_entries);
+
+    if ( farm_load_jobs(&farm, farm_file) || farm_run(&farm, farm_workers) ) {
+      status = EXIT_FAILURE;
+    } else {
+      farm_report(stdout, &farm, farm_workers);
+    }
+
+    farm_free(&farm);
+    return status;
+  }
+
   // Initialize memory to zeros
   // This also sets the reset vector
-  mem_init();
+  machine_init(&machine);
+  if ( no_blocks_flag ) {
+    machine.blocks.enabled = 0;
+  }
+
+  // The JIT translates blocks of the block cache
+  if ( jit_flag ) {
+    if ( no_blocks_flag ) {
+      fprintf(stderr, "Error: --jit needs the block cache, drop --no-blocks\n");
+      return EXIT_FAILURE;
+    }
+    if ( jit_enable(&machine) ) {
+      fprintf(stderr, "Error: No JIT on this host, it needs Linux on x86-64\n");
+      return EXIT_FAILURE;
+    }
+  }
+
+  // The memory map. -L loads straight into the backing bytes, so ROM
+  // pages get their image too
+  for (size_t i = 0; i < map_count; i++) {
+    if ( map_entries[i].is_file ) {
+      if ( mem_map_load(&machine, map_entries[i].arg) ) return EXIT_FAILURE;
+    } else if ( mem_map_parse(&machine, map_entries[i].arg) ) {
+      fprintf(stderr, "Error: Invalid mapping '%s', expected 0x<first page>[-0x<last page>]:ram|rom|mirror=0x<page>\n", map_entries[i].arg);
+      return EXIT_FAILURE;
+    }
+  }
+  free(map_entries);
+
+  // Peripherals, over the memory map
+  if ( via_flag && via_attach(&machine, &via, via_page) ) {
+    return EXIT_FAILURE;
+  }
+  // headless on stdin and stdout, else on the console pane and the keys
+  if ( acia_flag &&
+       acia_attach(&machine, &acia, acia_page,
+                   headless_flag ? STDIN_FILENO : -1,
+                   headless_flag ? STDOUT_FILENO : -1) ) {
+    return EXIT_FAILURE;
+  }
 
   // Load each file name into memory.
   //
   // !! Note : files may overlap !!
   //
   for (size_t i = 0; i < load_count; i++) {
-    load_program(load_entries[i].address,load_entries[i].filename);
+    load_program(&machine, load_entries[i].address,load_entries[i].filename);
   }
   
   // Free allocated memory
@@ -127,6 +465,139 @@ int main(int argc, char* argv[]) {
     free(load_entries[i].filename);
   }
   free(load_entries);
+
+  // A snapshot replaces the loaded memory and the reset
+  if ( restore_file != NULL && snapshot_load(&machine, restore_file) ) {
+    return EXIT_FAILURE;
+  }
+
+  // Trace records go to a file, or to stderr with "-"
+  FILE *trace_fp = NULL;
+  if ( trace_file != NULL ) {
+    trace_fp = strcmp(trace_file, "-") == 0 ? stderr : fopen(trace_file, "w");
+    if ( trace_fp == NULL ) {
+      perror("Cannot open trace file");
+      return EXIT_FAILURE;
+    }
+    if ( trace_set_hook(&machine, trace_print, trace_fp) ) {
+      fprintf(stderr, "Error: This build has no tracing, use bin/emulator-trace.out\n");
+      return EXIT_FAILURE;
+    }
+  }
+
+  // The binary trace is written by a thread of its own, see src/utils/tracebin.h
+  if ( trace_bin_file != NULL ) {
+    if ( trace_file != NULL ) {
+      fprintf(stderr, "Error: --trace and --trace-bin can't be used together\n");
+      return EXIT_FAILURE;
+    }
+    if ( trace_set_hook(&machine, NULL, NULL) ) {
+      fprintf(stderr, "Error: This build has no tracing, use bin/emulator-trace.out\n");
+      return EXIT_FAILURE;
+    }
+    if ( tracebin_open(&trace_bin, trace_bin_file) ) {
+      return EXIT_FAILURE;
+    }
+    trace_set_hook(&machine, tracebin_hook, &trace_bin);
+    trace_set_events(&machine, TRACEBIN_EVENTS);
+  }
+
+  // Checkpoints to step back to, from the state the run starts from
+  if ( history_mb != 0 ) {
+    if ( history_enable(&machine, (size_t)history_mb * 1024 * 1024) ) {
+      fprintf(stderr, "[FAILED] Error while allocating the history.\n");
+      return EXIT_FAILURE;
+    }
+  } else if ( rewind_flag ) {
+    fprintf(stderr, "Error: --rewind needs the history, drop --history 0\n");
+    return EXIT_FAILURE;
+  }
+
+  // Breakpoints and watchpoints, over the final memory map
+  for (size_t i = 0; i < debug_count; i++) {
+    if ( debug_entries[i].is_watch ) {
+      if ( debug_parse_watch(&machine, debug_entries[i].arg) ) {
+	fprintf(stderr, "Error: Invalid watchpoint '%s', expected 0x<first>[-0x<last>][:r|w|c...]\n", debug_entries[i].arg);
+	return EXIT_FAILURE;
+      }
+    } else if ( debug_parse_break(&machine, debug_entries[i].arg) ) {
+      fprintf(stderr, "Error: Invalid breakpoint '%s', expected 0x<hex address>\n", debug_entries[i].arg);
+      return EXIT_FAILURE;
+    }
+  }
+  free(debug_entries);
+
+  // Counters of the profile, written at exit
+  if ( profile_prefix != NULL && profile_enable(&machine) ) {
+    fprintf(stderr, "[FAILED] Error while allocating the profile.\n");
+    return EXIT_FAILURE;
+  }
+  if ( symbols_file != NULL ) {
+    if ( profile_prefix == NULL ) {
+      fprintf(stderr, "Error: --symbols names the routines of --profile, add it\n");
+      return EXIT_FAILURE;
+    }
+    if ( profile_load_symbols(&machine, symbols_file) ) {
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Headless mode: no ncurses at all, free-run and report
+  if ( headless_flag ) {
+    struct headless_result result;
+    int status = 0;
+
+    if ( restore_file == NULL ) {
+      cpu_reset(&machine);
+    }
+    headless_run(&machine, &headless_config, &result);
+    if ( result.reason == CPU_STOP_IDLE ) {
+      status = HEADLESS_EXIT_IDLE;
+    }
+    // what the guest wrote comes before the report
+    if ( acia_flag ) {
+      acia_flush(&acia);
+    }
+    headless_report(stdout, &result);
+    debug_report(stdout, &machine);
+
+    // e.g. to --save the state some cycles before a crash
+    if ( rewind_flag ) {
+      uint64_t rewound = history_rewind(&machine, rewind_cycles);
+      printf("rewound: %llu\n", (unsigned long long)rewound);
+      printf("rewound-pc: 0x%04X\n", machine.cpu.pc);
+    }
+
+    if ( dump_flag ) {
+      mem_dump(&machine);
+    }
+
+    if ( save_file != NULL && snapshot_save(&machine, save_file) ) {
+      status = EXIT_FAILURE;
+    }
+
+    if ( trace_fp != NULL && trace_fp != stderr ) {
+      fclose(trace_fp);
+    }
+
+    if ( trace_bin_file != NULL ) {
+      trace_set_hook(&machine, NULL, NULL);
+      if ( tracebin_close(&trace_bin) ) {
+	status = EXIT_FAILURE;
+      }
+    }
+
+    if ( profile_prefix != NULL && profile_write(&machine, profile_prefix) ) {
+      status = EXIT_FAILURE;
+    }
+
+    profile_disable(&machine);
+    debug_clear(&machine);
+    history_disable(&machine);
+    acia_detach(&acia);
+    jit_disable(&machine);
+    return status;
+  }
   
   // define rows and columns
   uint32_t rows = MIN_ROWS;
@@ -155,8 +626,7 @@ int main(int argc, char* argv[]) {
     return EXIT_FAILURE;
   }
     
-  start_color();
-  init_pair(1, COLOR_WHITE,COLOR_BLACK);
+  interface_init();
    
   curs_set(0);
   noecho();
@@ -164,35 +634,150 @@ int main(int argc, char* argv[]) {
   interface_display_header(1,1);
   wrefresh(win);
   
-  cpu_init();
-  cpu_reset();
+  if ( restore_file == NULL ) {
+    cpu_reset(&machine);
+  }
+  if ( rewind_flag ) {
+    kinput_set_rewind(rewind_cycles);
+  }
+  kinput_set_refresh((unsigned)fps);
     
+  // the memory panels remember what they drew and only redraw changes
+  struct interface_page panels[INTERFACE_PAGES];
+  // Memory Display A - Zero Page
+  interface_page_init(&panels[0], 7,1,0x0000);
+  // Memory Display B - Stack
+  interface_page_init(&panels[1], 7,76,0x0100);
+  // Memory Display C - Program ( may follow )
+  interface_page_init(&panels[2], 26,1,0x8000);
+  // Memory Display D - need to update this to specify location on command line
+  interface_page_init(&panels[3], 26,76,0x0400);
+  // or the ACIA's console in its place
+  struct interface_console console;
+  char console_title[64];
+  if ( acia_flag ) {
+    snprintf(console_title, sizeof(console_title), "ACIA 0x%02X00 | keys go to it while running, ^G pauses", acia_page);
+    interface_console_init(&console, 26,76, console_title);
+    kinput_set_console(&acia);
+  }
+
+  // The text screen in a window of its own, right of the panels if the
+  // terminal is wide enough, else in place of Memory Display D
+  struct interface_screen screen;
+  int screen_on_d = 0;
+  if ( screen_flag ) {
+    uint32_t width = screen_columns + 2;
+    uint32_t height = screen_rows + 2;
+    int row = 7;
+    int column = MIN_COLUMNS;
+
+    if ( columns < MIN_COLUMNS + width || rows < 7 + height ) {
+      if ( acia_flag || width > 73 || height > 18 ) {
+	endwin();
+	fprintf(stderr, "\n\n[FAILED] Terminal Size less than %ux%u for a %ux%u screen.\n",
+		MIN_COLUMNS + width, 7 + height > MIN_ROWS ? 7 + height : MIN_ROWS,
+		screen_columns, screen_rows);
+	return EXIT_FAILURE;
+      }
+      row = 26;
+      column = 76;
+      screen_on_d = 1;
+    }
+
+    if ( interface_screen_init(&screen, row, column, screen_addr, screen_columns, screen_rows) ) {
+      endwin();
+      fprintf(stderr, "[FAILED] Error creating the screen window.\n");
+      return EXIT_FAILURE;
+    }
+  }
+  // Memory Display D - showing rom space
+  //interface_page_init(&panels[3], 26,76,0xFF00);
+
+  // G runs the machine on a thread of its own, the screen then shows
+  // views it samples
+  struct interface_view view;
+  struct runner runner;
+  for (size_t i = 0; i < INTERFACE_PAGES; i++) {
+    view.page[i] = panels[i].page;
+  }
+  view.screen_addr = screen_addr;
+  view.screen_size = (uint16_t)(screen_columns * screen_rows);
+  runner_init(&runner, &machine, clock_hz, view.page);
+  runner_set_screen(&runner, view.screen_addr, view.screen_size);
+
   do {
-    interface_display_cpu(3,4);
-    // Memory Display A - Zero Page
-    interface_display_page(7,1,0x0000);
-    // Memory Display B - Stack
-    interface_display_page(7,76,0x0100);
-    // Memory Display C - Program ( may follow )
-    interface_display_page(26,1,0x8000);
+    runner_poll(&runner);
+    if ( runner_running(&runner) ) {
+      runner_sample(&runner, &view);
+    } else {
+      interface_view_sample(&machine, &view);
+      view.running = 0;
+    }
 
-    
-    // Memory Display D - need to update this to specify location on command line
-    interface_display_page(26,76,0x0400);
+    interface_display_cpu(&view, 3,4);
+    interface_display_debug(&view, 3,64);
+    for (size_t i = 0; i < INTERFACE_PAGES; i++) {
+      if ( (acia_flag || screen_on_d) && i == 3 ) {
+	continue;
+      }
+      interface_display_page(&panels[i], &view, i);
+    }
 
-    // Memory Display D - showing rom space
-    //interface_display_page(26,76,0xFF00); 
+    // the guest's output since the last frame
+    if ( acia_flag ) {
+      uint8_t out[4096];
+      unsigned n;
+      while ( (n = acia_take(&acia, out, sizeof(out))) > 0 ) {
+	interface_console_write(&console, out, n);
+      }
+      interface_display_console(&console);
+    }
 
-    wrefresh(win);
-    kinput_listen();
+    // the screen window goes over the panels
+    wnoutrefresh(win);
+    if ( screen_flag ) {
+      interface_display_screen(&screen, &view);
+    }
+    doupdate();
+    kinput_listen(&machine, &runner);
   } while (!kinput_should_quit());
-  
+
+  runner_stop(&runner);
+
+  if ( screen_flag ) {
+    interface_screen_free(&screen);
+  }
   delwin(win);
   endwin();
   
   if ( dump_flag ) {
-    mem_dump();
+    mem_dump(&machine);
   }
-  
-  return 0;
+
+  int status = 0;
+  if ( save_file != NULL && snapshot_save(&machine, save_file) ) {
+    status = EXIT_FAILURE;
+  }
+
+  if ( trace_fp != NULL && trace_fp != stderr ) {
+    fclose(trace_fp);
+  }
+
+  if ( trace_bin_file != NULL ) {
+    trace_set_hook(&machine, NULL, NULL);
+    if ( tracebin_close(&trace_bin) ) {
+      status = EXIT_FAILURE;
+    }
+  }
+
+  if ( profile_prefix != NULL && profile_write(&machine, profile_prefix) ) {
+    status = EXIT_FAILURE;
+  }
+
+  profile_disable(&machine);
+  debug_clear(&machine);
+  history_disable(&machine);
+  acia_detach(&acia);
+  jit_disable(&machine);
+  return status;
 }
@@ -1,9 +1,14 @@
 #include "mem.h"
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
+#include "../machine/debug.h"
+#include "../machine/machine.h"
 #include "../utils/misc.h"
 
 /**
@@ -16,15 +21,33 @@
  *
  *  pages are split into different arrays
  *
+ * Each struct machine owns its own struct mem.
+ *
+ * Every access goes through the page table in struct mem, see
+ * machine_read() and machine_write(). After mem_init() every page is RAM
+ * backed by data; mem_map_*() remap ranges of pages, inclusive.
  * */
-struct mem memory;
+
+#define MEM_MAX_LINE 256
+
+// mark_dirty: mark the backing pages of bytes written behind the bus' back
+static void mark_dirty(struct machine* m, size_t offset, size_t len) {
+  if (len == 0) return;
+
+  for (size_t page = offset / MEM_PAGE_SIZE;
+       page <= (offset + len - 1) / MEM_PAGE_SIZE; page++) {
+    m->mem.dirty[page] = MEM_DIRTY_ALL;
+  }
+}
 
 /**
  * load_program: Loads binary into program data memory
+ * @param m The machine
+ * @param address Where the first byte of the binary goes
  * @param path Path to binary on hosst machine
  * @return void
  * */
-void load_program(uint16_t address, char* path) {
+void load_program(struct machine* m, uint16_t address, char* path) {
   FILE* fp = fopen(path, "rb");
   
   if (fp == NULL) {
@@ -36,7 +59,7 @@ void load_program(uint16_t address, char* path) {
   stat(path, &st);
   size_t fsize = st.st_size;
   
-  size_t bytes_read = fread(memory.data + (address), 1, sizeof(memory.data), fp);
+  size_t bytes_read = fread(m->mem.data + (address), 1, sizeof(m->mem.data) - address, fp);
 
   
   
@@ -44,18 +67,41 @@ void load_program(uint16_t address, char* path) {
     fprintf( stderr, "[FAILED] Amount of bytes read doesn't match read file size.\n");
     exit(1);
   }
+
+  mark_dirty(m, address, bytes_read);
+  mem_code_invalidate_all(m);
   
   fclose(fp);
 }
 
+/**
+ * load_image: Copies a binary already read by the host into memory, what
+ * would go past 0xFFFF is dropped
+ * @param m The machine
+ * @param address Where the first byte of the binary goes
+ * @param data The bytes of the binary
+ * @param len The amount of bytes
+ * @return void
+ * */
+void load_image(struct machine* m, uint16_t address, const uint8_t* data, size_t len) {
+  size_t room = sizeof(m->mem.data) - address;
+
+  memcpy(m->mem.data + address, data, len < room ? len : room);
+  mark_dirty(m, address, len < room ? len : room);
+  mem_code_invalidate_all(m);
+}
+
 /**
  * mem_init: Initialize the memory to its initial state
  *
- * @param void
+ * @param m The machine
  * @return void
  * */
-void mem_init(void) {
-  memset(memory.data, 0, sizeof(memory.data));
+void mem_init(struct machine* m) {
+  memset(m->mem.data, 0, sizeof(m->mem.data));
+  memset(m->mem.dirty, 0, sizeof(m->mem.dirty));
+  memset(m->mem.trapped, 0, sizeof(m->mem.trapped));
+  mem_reset(m);
   // The 6502 reset vector is stored at 0xFFFC and 0xFFFD.  The CPU
   // jumps to the address stored there at reset.
   
@@ -70,25 +116,50 @@ void mem_init(void) {
 }
 
 /**
- * mem_get_ptr: returns pointer to currently active memory struct
+ * mem_reset: Bring the memory of a machine that already ran back to the
+ * state mem_init() leaves it in, only zeroing the pages written since
+ * @param m The machine
+ * @return void
  * */
-struct mem* mem_get_ptr(void) {
-  struct mem* mp = &memory;
-  return mp;
+void mem_reset(struct machine* m) {
+  for (unsigned page = 0; page < MEM_PAGES; page++) {
+    if (m->mem.dirty[page] & MEM_DIRTY_INIT) {
+      memset(m->mem.data + page * MEM_PAGE_SIZE, 0, MEM_PAGE_SIZE);
+    }
+  }
+
+  memset(m->mem.dirty, 0, sizeof(m->mem.dirty));
+  memset(m->mem.code, 0, sizeof(m->mem.code));
+  memset(m->mem.code_gen, 0, sizeof(m->mem.code_gen));
+  memset(m->mem.code_writes, 0, sizeof(m->mem.code_writes));
+  m->mem.code_epoch = 0;
+  mem_map_ram(m, 0x00, 0xFF);
 }
 
 /**
- * mem_dump: Dumps the memory to a file called dump.bin
+ * mem_dump: Dumps the memory to a file called dump.bin. Only the pages
+ * written since mem_init() are written, the others are left as holes of
+ * a sparse file, which read as the zeros they hold
  *
- * @param void
+ * @param m The machine
  * @return 0 if success, 1 if fail
  * */
-int mem_dump(void) {
+int mem_dump(struct machine* m) {
   FILE* fp = fopen("dump.bin", "wb+");
   if (fp == NULL) return 1;
-  
-  size_t wb = fwrite(memory.data, 1, sizeof(memory.data), fp);
-  if (wb != sizeof(memory.data)) {
+
+  int err = 0;
+  for (unsigned page = 0; page < MEM_PAGES && !err; page++) {
+    if (!(m->mem.dirty[page] & MEM_DIRTY_INIT)) continue;
+
+    err = fseek(fp, (long)page * MEM_PAGE_SIZE, SEEK_SET) != 0 ||
+          fwrite(m->mem.data + page * MEM_PAGE_SIZE, 1, MEM_PAGE_SIZE, fp) !=
+              MEM_PAGE_SIZE;
+  }
+
+  // the file is 64K whatever the last written page
+  err = err || fflush(fp) != 0 || ftruncate(fileno(fp), TOTAL_MEM) != 0;
+  if (err) {
     printf("[FAILED] Errors while dumping the program data.\n");
     fclose(fp);
     return 1;
@@ -97,3 +168,390 @@ int mem_dump(void) {
   fclose(fp);
   return 0;
 }
+
+// mem_map_changed: recompute the bus fast paths after a remap
+static void mem_map_changed(struct machine* m) {
+  m->mem.read_direct = 1;
+  m->mem.write_direct = 1;
+
+  for (unsigned page = 0; page < MEM_PAGES; page++) {
+    if (m->mem.read_page[page] != page * MEM_PAGE_SIZE) m->mem.read_direct = 0;
+    if (m->mem.write_page[page] != page * MEM_PAGE_SIZE) m->mem.write_direct = 0;
+  }
+
+  // decoded blocks remember backing pages, which may have just moved
+  mem_code_invalidate_all(m);
+}
+
+// set_entries: remap a page, behind its trap if it has one
+static void set_entries(struct machine* m, unsigned page, uint32_t read,
+                        uint32_t write) {
+  if (m->mem.trapped[page]) {
+    m->mem.trap_read[page] = read;
+    m->mem.trap_write[page] = write;
+  } else {
+    m->mem.read_page[page] = read;
+    m->mem.write_page[page] = write;
+  }
+}
+
+/**
+ * mem_map_ram: Back pages with their own bytes of data, read and write
+ * @param m The machine
+ * @param first The first page
+ * @param last The last page
+ * @return void
+ * */
+void mem_map_ram(struct machine* m, uint8_t first, uint8_t last) {
+  for (unsigned page = first; page <= last; page++) {
+    set_entries(m, page, page * MEM_PAGE_SIZE, page * MEM_PAGE_SIZE);
+    memset(&m->mem.io[page], 0, sizeof(m->mem.io[page]));
+  }
+
+  mem_map_changed(m);
+}
+
+/**
+ * mem_map_rom: Make pages read only, writes to them are dropped. The bytes
+ * still come from data, so load the ROM image with -L as usual
+ * @param m The machine
+ * @param first The first page
+ * @param last The last page
+ * @return void
+ * */
+void mem_map_rom(struct machine* m, uint8_t first, uint8_t last) {
+  for (unsigned page = first; page <= last; page++) {
+    set_entries(m, page, page * MEM_PAGE_SIZE, MEM_PAGE_IO);
+    memset(&m->mem.io[page], 0, sizeof(m->mem.io[page]));
+  }
+
+  mem_map_changed(m);
+}
+
+/**
+ * mem_map_mirror: Make pages show the bytes of other pages, e.g. first=0x08,
+ * last=0x0F and target=0x00 mirrors 0x0000-0x07FF at 0x0800-0x0FFF. The
+ * target pages are taken as currently mapped and wrap around at 0xFF
+ * @param m The machine
+ * @param first The first page
+ * @param last The last page
+ * @param target The page first becomes a mirror of
+ * @return void
+ * */
+void mem_map_mirror(struct machine* m, uint8_t first, uint8_t last, uint8_t target) {
+  for (unsigned page = first; page <= last; page++) {
+    uint8_t source = (uint8_t)(target + (page - first));
+
+    set_entries(m, page, mem_page_entry(m, source, 0),
+                mem_page_entry(m, source, 1));
+    m->mem.io[page] = m->mem.io[source];
+  }
+
+  mem_map_changed(m);
+}
+
+/**
+ * mem_map_io: Route pages to handlers, a NULL handler reads 0xFF or drops
+ * the write
+ * @param m The machine
+ * @param first The first page
+ * @param last The last page
+ * @param read Called for every read of these pages
+ * @param write Called for every write to these pages
+ * @param ctx Passed to both handlers
+ * @return void
+ * */
+void mem_map_io(struct machine* m, uint8_t first, uint8_t last,
+                mem_read_handler read, mem_write_handler write, void* ctx) {
+  for (unsigned page = first; page <= last; page++) {
+    set_entries(m, page, MEM_PAGE_IO, MEM_PAGE_IO);
+    m->mem.io[page].read = read;
+    m->mem.io[page].write = write;
+    m->mem.io[page].ctx = ctx;
+  }
+
+  mem_map_changed(m);
+}
+
+/**
+ * mem_dirty: Whether a backing page was written since its consumer last
+ * cleared it
+ * @param m The machine
+ * @param page The backing page (data offset >> 8)
+ * @param bits The MEM_DIRTY_* bit of the consumer
+ * @return 1 if dirty, 0 if not
+ * */
+int mem_dirty(struct machine* m, uint8_t page, uint8_t bits) {
+  return (m->mem.dirty[page] & bits) != 0;
+}
+
+/**
+ * mem_dirty_clear: Mark every page clean for some consumers, the others
+ * keep their view
+ * @param m The machine
+ * @param bits The MEM_DIRTY_* bits of the consumers
+ * @return void
+ * */
+void mem_dirty_clear(struct machine* m, uint8_t bits) {
+  for (unsigned page = 0; page < MEM_PAGES; page++) {
+    m->mem.dirty[page] &= (uint8_t)~bits;
+  }
+}
+
+/**
+ * mem_code_invalidate: Drop the decoded blocks of a backing page, called
+ * by the bus when a write lands on code
+ * @param m The machine
+ * @param page The backing page (data offset >> 8)
+ * @return void
+ * */
+void mem_code_invalidate(struct machine* m, uint8_t page) {
+  m->mem.code[page] = 0;
+  m->mem.code_gen[page]++;
+  m->mem.code_epoch++;
+  if (m->mem.code_writes[page] < MEM_CODE_WRITES_MAX) {
+    m->mem.code_writes[page]++;
+  }
+}
+
+/**
+ * mem_code_invalidate_all: Drop every decoded block, for whoever writes to
+ * data behind the bus' back. Pages single stepped as self-modifying code
+ * are decoded again
+ * @param m The machine
+ * @return void
+ * */
+void mem_code_invalidate_all(struct machine* m) {
+  for (unsigned page = 0; page < MEM_PAGES; page++) {
+    mem_code_invalidate(m, (uint8_t)page);
+  }
+  memset(m->mem.code_writes, 0, sizeof(m->mem.code_writes));
+}
+
+/**
+ * mem_page_entry: The entry a page has in the memory map, whether it is
+ * trapped or not
+ * @param m The machine
+ * @param page The page
+ * @param write Whether the write entry rather than the read one
+ * @return the entry
+ * */
+uint32_t mem_page_entry(struct machine* m, uint8_t page, int write) {
+  if (m->mem.trapped[page]) {
+    return write ? m->mem.trap_write[page] : m->mem.trap_read[page];
+  }
+  return write ? m->mem.write_page[page] : m->mem.read_page[page];
+}
+
+/**
+ * mem_trap: Send every access to a page through mem_read_io() and
+ * mem_write_io(), which still read and write what the page maps to but
+ * show the access to the debugger first. Remapping a trapped page remaps
+ * what it stands for
+ * @param m The machine
+ * @param page The page
+ * @return void
+ * */
+void mem_trap(struct machine* m, uint8_t page) {
+  if (m->mem.trapped[page]) return;
+
+  m->mem.trap_read[page] = m->mem.read_page[page];
+  m->mem.trap_write[page] = m->mem.write_page[page];
+  m->mem.read_page[page] = MEM_PAGE_IO;
+  m->mem.write_page[page] = MEM_PAGE_IO;
+  m->mem.trapped[page] = 1;
+
+  mem_map_changed(m);
+}
+
+/**
+ * mem_untrap: Give a trapped page its fast paths back
+ * @param m The machine
+ * @param page The page
+ * @return void
+ * */
+void mem_untrap(struct machine* m, uint8_t page) {
+  if (!m->mem.trapped[page]) return;
+
+  m->mem.trapped[page] = 0;
+  m->mem.read_page[page] = m->mem.trap_read[page];
+  m->mem.write_page[page] = m->mem.trap_write[page];
+
+  mem_map_changed(m);
+}
+
+/**
+ * mem_read_io: Slow path of machine_read(), for MEM_PAGE_IO pages
+ * @param m The machine
+ * @param addr The address to be read
+ * @return the read byte
+ * */
+uint8_t mem_read_io(struct machine* m, uint16_t addr) {
+  const struct mem_io* io = &m->mem.io[addr >> 8];
+  uint32_t page = MEM_PAGE_IO;
+  uint8_t data;
+
+  if (m->mem.trapped[addr >> 8]) page = m->mem.trap_read[addr >> 8];
+
+  if (page != MEM_PAGE_IO) {
+    data = m->mem.data[page | (addr & 0xFF)];
+  } else {
+    data = io->read != NULL ? io->read(m, addr, io->ctx) : 0xFF;
+  }
+
+  if (m->mem.trapped[addr >> 8]) {
+    debug_access(m, addr, DEBUG_WATCH_READ, data, data);
+  }
+  return data;
+}
+
+/**
+ * mem_write_io: Slow path of machine_write(), for MEM_PAGE_IO pages
+ * @param m The machine
+ * @param addr The address to be written to
+ * @param data The data to be written
+ * @return void
+ * */
+void mem_write_io(struct machine* m, uint16_t addr, uint8_t data) {
+  const struct mem_io* io = &m->mem.io[addr >> 8];
+
+  if (!m->mem.trapped[addr >> 8]) {
+    if (io->write != NULL) io->write(m, addr, data, io->ctx);
+    return;
+  }
+
+  // what machine_write() does for the page it stands for
+  uint32_t page = m->mem.trap_write[addr >> 8];
+  uint8_t old = data;
+
+  if (page != MEM_PAGE_IO) {
+    old = m->mem.data[page | (addr & 0xFF)];
+    m->mem.data[page | (addr & 0xFF)] = data;
+    m->mem.dirty[page >> 8] = MEM_DIRTY_ALL;
+    if (m->mem.code[page >> 8]) mem_code_invalidate(m, page >> 8);
+  } else if (io->write != NULL) {
+    io->write(m, addr, data, io->ctx);
+  }
+
+  debug_access(m, addr, DEBUG_WATCH_WRITE, old, data);
+}
+
+/**
+ * mem_parse_page: Parse a 0x<hex page>, 0x00 to 0xFF, as in mappings and
+ * in the pages of devices
+ * @param str Start of the page
+ * @param end Where it must end, e.g. on a separator
+ * @param page The page, set on success
+ * @return 0 if success, 1 if failure
+ * */
+int mem_parse_page(const char* str, const char* end, uint8_t* page) {
+  char* endptr;
+
+  if (strncmp(str, "0x", 2) != 0 && strncmp(str, "0X", 2) != 0) return 1;
+
+  errno = 0;
+  long val = strtol(str, &endptr, 16);
+  if (errno != 0 || endptr != end || val < 0 || val > 0xFF) return 1;
+
+  *page = (uint8_t)val;
+  return 0;
+}
+
+/**
+ * mem_map_restore: Set the whole page table at once, as saved by a
+ * snapshot. Pages read through handlers keep their current ones, the
+ * caller checks there are some; the others are RAM, ROM or mirrors
+ * @param m The machine
+ * @param read_page Read entry of every page
+ * @param write_page Write entry of every page
+ * @return void
+ * */
+void mem_map_restore(struct machine* m, const uint32_t* read_page,
+                     const uint32_t* write_page) {
+  for (unsigned page = 0; page < MEM_PAGES; page++) {
+    set_entries(m, page, read_page[page], write_page[page]);
+    if (read_page[page] != MEM_PAGE_IO) {
+      memset(&m->mem.io[page], 0, sizeof(m->mem.io[page]));
+    }
+  }
+
+  mem_map_changed(m);
+}
+
+/**
+ * mem_map_parse: Apply one mapping written as
+ *
+ *   0x<first page>[-0x<last page>]:ram|rom|mirror=0x<target page>
+ *
+ * e.g. "0xE0-0xFF:rom" or "0x08-0x0F:mirror=0x00"
+ * @param m The machine
+ * @param spec The mapping
+ * @return 0 if success, 1 if failure
+ * */
+int mem_map_parse(struct machine* m, const char* spec) {
+  const char* colon_pos = strchr(spec, ':');
+  if (colon_pos == NULL) return 1;
+
+  const char* dash_pos = memchr(spec, '-', colon_pos - spec);
+  uint8_t first, last, target;
+
+  if (dash_pos == NULL) {
+    if (mem_parse_page(spec, colon_pos, &first)) return 1;
+    last = first;
+  } else {
+    if (mem_parse_page(spec, dash_pos, &first)) return 1;
+    if (mem_parse_page(dash_pos + 1, colon_pos, &last)) return 1;
+    if (last < first) return 1;
+  }
+
+  const char* kind = colon_pos + 1;
+
+  if (strcasecmp(kind, "ram") == 0) {
+    mem_map_ram(m, first, last);
+  } else if (strcasecmp(kind, "rom") == 0) {
+    mem_map_rom(m, first, last);
+  } else if (strncasecmp(kind, "mirror=", 7) == 0) {
+    if (mem_parse_page(kind + 7, kind + strlen(kind), &target)) return 1;
+    mem_map_mirror(m, first, last, target);
+  } else {
+    return 1;
+  }
+
+  return 0;
+}
+
+/**
+ * mem_map_load: Apply a memory map file, one mem_map_parse() mapping per
+ * line, '#' starts a comment. Later lines win over earlier ones
+ * @param m The machine
+ * @param path Path to the map file
+ * @return 0 if success, 1 if failure
+ * */
+int mem_map_load(struct machine* m, const char* path) {
+  FILE* fp = fopen(path, "r");
+  if (fp == NULL) {
+    fprintf(stderr, "[FAILED] Error while opening memory map '%s'.\n", path);
+    return 1;
+  }
+
+  char line[MEM_MAX_LINE];
+  unsigned line_number = 0;
+
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    line_number++;
+    line[strcspn(line, "#\r\n")] = '\0';
+
+    for (char* word = strtok(line, " \t"); word != NULL;
+         word = strtok(NULL, " \t")) {
+      if (mem_map_parse(m, word)) {
+        fprintf(stderr, "[FAILED] %s:%u: invalid mapping '%s'.\n", path,
+                line_number, word);
+        fclose(fp);
+        return 1;
+      }
+    }
+  }
+
+  fclose(fp);
+  return 0;
+}
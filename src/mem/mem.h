@@ -5,15 +5,106 @@
 #include <stdint.h>
 
 #define TOTAL_MEM 1024 * 64
+#define MEM_PAGES 256
+#define MEM_PAGE_SIZE 256
 
+// page table entry of a page without backing bytes
+#define MEM_PAGE_IO UINT32_MAX
+
+// bits of mem.dirty[], one per consumer, each clears only its own
+#define MEM_DIRTY_INIT 0x01    // written since mem_init() or mem_reset()
+#define MEM_DIRTY_HISTORY 0x02 // written since the last history checkpoint
+#define MEM_DIRTY_ALL 0xFF
+
+// invalidations after which a page is no longer decoded into blocks
+#define MEM_CODE_WRITES_MAX 16
+
+struct machine;
+
+// memory-mapped I/O, addr is the full 16-bit address
+typedef uint8_t (*mem_read_handler)(struct machine* m, uint16_t addr, void* ctx);
+typedef void (*mem_write_handler)(struct machine* m, uint16_t addr, uint8_t data, void* ctx);
+
+struct mem_io {
+  mem_read_handler read;
+  mem_write_handler write;
+  void* ctx;
+};
+
+/**
+ * The page table: every 256-byte page is either backed by bytes of data
+ * (RAM, ROM, mirror), which the bus indexes without any call, or by the
+ * handlers in io[] when its entry is MEM_PAGE_IO. ROM pages have a read
+ * entry, MEM_PAGE_IO as write entry and no write handler, so writes are
+ * dropped.
+ *
+ * Entries are offsets into data rather than pointers: the compiler then
+ * knows a store to memory can't touch the registers, and a struct mem can
+ * be copied as it is.
+ * */
 struct mem {
   uint8_t data[TOTAL_MEM];
+
+  uint32_t read_page[MEM_PAGES];
+  uint32_t write_page[MEM_PAGES];
+  struct mem_io io[MEM_PAGES];
+
+  // set while every page reads (writes) its own bytes of data, the bus
+  // then skips the page table altogether
+  uint8_t read_direct;
+  uint8_t write_direct;
+
+  // backing pages (data offset >> 8) written to, the bus stores
+  // MEM_DIRTY_ALL on every write so that marking costs a single store
+  uint8_t dirty[MEM_PAGES];
+
+  // backing pages the block cache decoded code from,
+  // a write to one of them calls mem_code_invalidate()
+  uint8_t code[MEM_PAGES];
+  uint32_t code_gen[MEM_PAGES];
+
+  // invalidations of each backing page, up to MEM_CODE_WRITES_MAX: past
+  // it the page is self-modifying code and cpu_run() single steps it
+  uint8_t code_writes[MEM_PAGES];
+
+  // bumped by every invalidation
+  uint32_t code_epoch;
+
+  // pages a debugger watches, see mem_trap(): their entries above are
+  // MEM_PAGE_IO and the ones they stand for are kept here
+  uint8_t trapped[MEM_PAGES];
+  uint32_t trap_read[MEM_PAGES];
+  uint32_t trap_write[MEM_PAGES];
 };
 
-void mem_init(void);
-int mem_dump(void);
-void load_program(uint16_t address, char* filename);
-		  
-struct mem* mem_get_ptr(void);
+void mem_init(struct machine* m);
+void mem_reset(struct machine* m);
+int mem_dump(struct machine* m);
+void load_program(struct machine* m, uint16_t address, char* filename);
+void load_image(struct machine* m, uint16_t address, const uint8_t* data, size_t len);
+
+void mem_map_ram(struct machine* m, uint8_t first, uint8_t last);
+void mem_map_rom(struct machine* m, uint8_t first, uint8_t last);
+void mem_map_mirror(struct machine* m, uint8_t first, uint8_t last, uint8_t target);
+void mem_map_io(struct machine* m, uint8_t first, uint8_t last,
+                mem_read_handler read, mem_write_handler write, void* ctx);
+void mem_map_restore(struct machine* m, const uint32_t* read_page,
+                     const uint32_t* write_page);
+int mem_parse_page(const char* str, const char* end, uint8_t* page);
+int mem_map_parse(struct machine* m, const char* spec);
+int mem_map_load(struct machine* m, const char* path);
+uint32_t mem_page_entry(struct machine* m, uint8_t page, int write);
+
+void mem_trap(struct machine* m, uint8_t page);
+void mem_untrap(struct machine* m, uint8_t page);
+
+int mem_dirty(struct machine* m, uint8_t page, uint8_t bits);
+void mem_dirty_clear(struct machine* m, uint8_t bits);
+
+void mem_code_invalidate(struct machine* m, uint8_t page);
+void mem_code_invalidate_all(struct machine* m);
+
+uint8_t mem_read_io(struct machine* m, uint16_t addr);
+void mem_write_io(struct machine* m, uint16_t addr, uint8_t data);
 
 #endif
@@ -0,0 +1,624 @@
+#include "acia.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../machine/machine.h"
+#include "../machine/sched.h"
+#include "../mem/mem.h"
+
+/**
+ * ring_write: Append bytes to a ring, as many as there is room for. Called
+ * by the ring's writer only
+ * @param r The ring
+ * @param buf The bytes
+ * @param size How many
+ * @return how many were appended
+ * */
+static unsigned ring_write(struct acia_ring* r, const uint8_t* buf,
+                           unsigned size) {
+  unsigned head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+  unsigned room = ACIA_RING_SIZE - (head - __atomic_load_n(&r->tail,
+                                                           __ATOMIC_ACQUIRE));
+  unsigned n = size < room ? size : room;
+
+  for (unsigned i = 0; i < n; i++) {
+    r->bytes[(head + i) & (ACIA_RING_SIZE - 1)] = buf[i];
+  }
+
+  __atomic_store_n(&r->head, head + n, __ATOMIC_RELEASE);
+  return n;
+}
+
+/**
+ * ring_read: Take the oldest bytes of a ring. Called by the ring's reader
+ * only
+ * @param r The ring
+ * @param buf Where to put them
+ * @param size How many at most
+ * @return how many were taken
+ * */
+static unsigned ring_read(struct acia_ring* r, uint8_t* buf, unsigned size) {
+  unsigned tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+  unsigned count = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - tail;
+  unsigned n = size < count ? size : count;
+
+  for (unsigned i = 0; i < n; i++) {
+    buf[i] = r->bytes[(tail + i) & (ACIA_RING_SIZE - 1)];
+  }
+
+  __atomic_store_n(&r->tail, tail + n, __ATOMIC_RELEASE);
+  return n;
+}
+
+// ring_full: whether the writer of a ring has to wait
+static int ring_full(const struct acia_ring* r) {
+  return __atomic_load_n(&r->head, __ATOMIC_RELAXED) -
+             __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) ==
+         ACIA_RING_SIZE;
+}
+
+// ring_empty: whether the reader of a ring has nothing to take
+static int ring_empty(const struct acia_ring* r) {
+  return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) ==
+         __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+}
+
+/**
+ * ring_peek: Copy what a ring holds without taking it
+ * @param r The ring
+ * @param buf Where to put the bytes, NULL for their count only
+ * @return how many it holds
+ * */
+static unsigned ring_peek(const struct acia_ring* r, uint8_t* buf) {
+  unsigned tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+  unsigned count = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - tail;
+
+  for (unsigned i = 0; buf != NULL && i < count; i++) {
+    buf[i] = r->bytes[(tail + i) & (ACIA_RING_SIZE - 1)];
+  }
+  return count;
+}
+
+/**
+ * acia_flush: Write the output waiting in the ring to out_fd, if the ACIA
+ * has one. Output that can't be written, to a closed pipe say, is dropped
+ * @param a The ACIA
+ * @return void
+ * */
+void acia_flush(struct acia* a) {
+  struct acia_ring* r = &a->out;
+
+  if (a->out_fd < 0) return;
+
+  while (r->tail != r->head) {
+    unsigned start = r->tail & (ACIA_RING_SIZE - 1);
+    unsigned n = r->head - r->tail;
+    if (n > ACIA_RING_SIZE - start) n = ACIA_RING_SIZE - start;
+
+    ssize_t written = write(a->out_fd, r->bytes + start, n);
+    if (written < 0 && errno == EINTR) continue;
+    if (written <= 0) {
+      r->tail = r->head;
+      break;
+    }
+    r->tail += (unsigned)written;
+  }
+}
+
+/**
+ * fill: Read what the host input has, without blocking, once the guest
+ * took everything it had and at most every ACIA_POLL_CYCLES
+ * @param m The machine
+ * @param a The ACIA
+ * @return void
+ * */
+static void fill(struct machine* m, struct acia* a) {
+  uint64_t now = m->clock.cycles;
+  uint8_t buf[512];
+
+  if (a->in_fd < 0 || a->eof || !ring_empty(&a->in)) return;
+  // a history rewind may take the clock back past the last read
+  if (now >= a->polled && now - a->polled < ACIA_POLL_CYCLES) return;
+  a->polled = now;
+
+  struct pollfd pfd = {a->in_fd, POLLIN, 0};
+  if (poll(&pfd, 1, 0) <= 0) return;
+
+  ssize_t n = read(a->in_fd, buf, sizeof(buf));
+  if (n > 0) {
+    ring_write(&a->in, buf, (unsigned)n);
+  } else if (n == 0 || (errno != EINTR && errno != EAGAIN)) {
+    a->eof = 1;
+  }
+}
+
+/**
+ * give: Put bytes before the pending input
+ * @param a The ACIA
+ * @param buf The bytes
+ * @param size How many
+ * @return void
+ * */
+static void give(struct acia* a, const uint8_t* buf, size_t size) {
+  uint8_t* pending;
+
+  if (size == 0) return;
+  pending = malloc(size + a->pending_count);
+  if (pending == NULL) {
+    fprintf(stderr, "[FAILED] Out of memory for the ACIA's input.\n");
+    return;
+  }
+
+  memcpy(pending, buf, size);
+  if (a->pending_count) {
+    memcpy(pending + size, a->pending + a->pending_head, a->pending_count);
+  }
+  free(a->pending);
+  a->pending = pending;
+  a->pending_head = 0;
+  a->pending_count += size;
+}
+
+/**
+ * settle: Make the input the journal has after the point the history went
+ * back to pending input, the guest gets it again before the host's
+ * @param a The ACIA
+ * @return void
+ * */
+static void settle(struct acia* a) {
+  uint8_t* buf = malloc(a->journaled - a->replay);
+  size_t n = 0;
+
+  if (buf == NULL) {
+    fprintf(stderr, "[FAILED] Out of memory for the ACIA's input.\n");
+  } else {
+    for (size_t i = a->replay; i < a->journaled; i++) {
+      if (a->journal[i].value != ACIA_EOF) buf[n++] = a->journal[i].value;
+    }
+    give(a, buf, n);
+    free(buf);
+  }
+  a->journaled = a->replay;
+}
+
+/**
+ * note: Note what the guest received at this call of the receiver, for
+ * the history to give it again. The oldest half goes once it is full
+ * @param m The machine
+ * @param a The ACIA
+ * @param value The byte or ACIA_EOF
+ * @return void
+ * */
+static void note(struct machine* m, struct acia* a, uint16_t value) {
+  if (m->history == NULL) return;
+
+  if (a->journal == NULL) {
+    a->journal = malloc(ACIA_JOURNAL_MAX * sizeof(*a->journal));
+    if (a->journal == NULL) {
+      a->lost = a->calls;
+      return;
+    }
+  }
+
+  if (a->journaled == ACIA_JOURNAL_MAX) {
+    size_t half = ACIA_JOURNAL_MAX / 2;
+    a->lost = a->journal[half - 1].call;
+    memmove(a->journal, a->journal + half,
+            (ACIA_JOURNAL_MAX - half) * sizeof(*a->journal));
+    a->journaled -= half;
+  }
+
+  a->journal[a->journaled].call = a->calls;
+  a->journal[a->journaled].value = value;
+  a->journaled++;
+  a->replay = a->journaled;
+}
+
+/**
+ * receive: The next byte of the input, from the journal while the history
+ * runs forward again, else pending input first and then the host's
+ * @param m The machine
+ * @param a The ACIA
+ * @param data Where to put it
+ * @return 1 if there was one, else 0
+ * */
+static int receive(struct machine* m, struct acia* a, uint8_t* data) {
+  if (m->replaying) {
+    if (a->replay == a->journaled || a->journal[a->replay].call != a->calls) {
+      return 0;
+    }
+    uint16_t value = a->journal[a->replay++].value;
+    if (value == ACIA_EOF) {
+      a->eof = 1;
+      return 0;
+    }
+    *data = (uint8_t)value;
+    return 1;
+  }
+
+  if (a->replay < a->journaled) settle(a);
+
+  if (a->pending_count) {
+    *data = a->pending[a->pending_head++];
+    a->pending_count--;
+  } else {
+    uint8_t eof = a->eof;
+    fill(m, a);
+    if (!ring_read(&a->in, data, 1)) {
+      if (a->eof && !eof) note(m, a, ACIA_EOF);
+      return 0;
+    }
+  }
+
+  note(m, a, *data);
+  return 1;
+}
+
+/**
+ * service: Move the next byte of the input into the data register if the
+ * receiver is on and the register free, and have the transmitter ready
+ * again once there is room for its byte
+ * @param m The machine
+ * @param a The ACIA
+ * @return void
+ * */
+static void service(struct machine* m, struct acia* a) {
+  a->calls++;
+
+  if ((a->command & ACIA_CMD_DTR) && !(a->status & ACIA_STATUS_RDRF)) {
+    if (receive(m, a, &a->rx)) {
+      a->status |= ACIA_STATUS_RDRF;
+      if (!(a->command & ACIA_CMD_RX_IRQ_OFF)) a->status |= ACIA_STATUS_IRQ;
+    }
+  }
+
+  if (!(a->status & ACIA_STATUS_TDRE) && !ring_full(&a->out)) {
+    a->status |= ACIA_STATUS_TDRE;
+    if ((a->command & ACIA_CMD_TX) == ACIA_CMD_TX_IRQ) {
+      a->status |= ACIA_STATUS_IRQ;
+    }
+  }
+}
+
+/**
+ * update: Drive the IRQ line from the status register, and poll the host
+ * side while it is what an interrupt would come from: a byte for an
+ * enabled receiver, or room for the transmitter's
+ * @param m The machine
+ * @param a The ACIA
+ * @return void
+ * */
+static void update(struct machine* m, struct acia* a) {
+  int rx = (a->command & (ACIA_CMD_DTR | ACIA_CMD_RX_IRQ_OFF)) ==
+               ACIA_CMD_DTR &&
+           !(a->status & ACIA_STATUS_RDRF) && !a->eof;
+  int tx = (a->command & ACIA_CMD_TX) == ACIA_CMD_TX_IRQ &&
+           !(a->status & ACIA_STATUS_TDRE);
+
+  machine_irq(m, MACHINE_IRQ_ACIA, (a->status & ACIA_STATUS_IRQ) != 0);
+
+  if (rx || tx) {
+    if (!sched_pending(&a->poll)) sched_in(m, &a->poll, ACIA_POLL_CYCLES);
+  } else {
+    sched_cancel(m, &a->poll);
+  }
+}
+
+// poll_due: The event polling the host side
+static void poll_due(struct machine* m, struct sched_event* ev) {
+  struct acia* a = ev->ctx;
+
+  service(m, a);
+  update(m, a);
+}
+
+// flush_due: The event writing a batch of output that waited long enough
+static void flush_due(struct machine* m, struct sched_event* ev) {
+  (void)m;
+  acia_flush(ev->ctx);
+}
+
+/**
+ * transmit: Send a byte written to the data register. Headless, a full
+ * ring is flushed to make room; a byte written while TDRE is clear is lost,
+ * and so is one written while the history runs forward again, the host
+ * got it already
+ * @param m The machine
+ * @param a The ACIA
+ * @param data The byte
+ * @return void
+ * */
+static void transmit(struct machine* m, struct acia* a, uint8_t data) {
+  if (!(a->status & ACIA_STATUS_TDRE)) return;
+  a->status &= ~ACIA_STATUS_TDRE;
+  if (m->replaying) return;
+
+  if (a->out_fd >= 0) {
+    if (ring_full(&a->out)) acia_flush(a);
+    if (!sched_pending(&a->flush)) sched_in(m, &a->flush, ACIA_FLUSH_CYCLES);
+  }
+
+  ring_write(&a->out, &data, 1);
+}
+
+static uint8_t acia_read(struct machine* m, uint16_t addr, void* ctx) {
+  struct acia* a = ctx;
+  uint8_t data = 0;
+
+  service(m, a);
+
+  switch (addr & 0x03) {
+  case ACIA_DATA:
+    data = a->rx;
+    a->status &= ~ACIA_STATUS_RDRF;
+    // the next byte right away, a burst of input isn't held up by polling
+    service(m, a);
+    break;
+  case ACIA_STATUS:
+    data = a->status;
+    a->status &= ~ACIA_STATUS_IRQ;
+    break;
+  case ACIA_COMMAND: data = a->command; break;
+  case ACIA_CONTROL: data = a->control; break;
+  }
+
+  update(m, a);
+  return data;
+}
+
+static void acia_write(struct machine* m, uint16_t addr, uint8_t data,
+                       void* ctx) {
+  struct acia* a = ctx;
+
+  switch (addr & 0x03) {
+  case ACIA_DATA: transmit(m, a, data); break;
+  // programmed reset, the parity bits are kept
+  case ACIA_STATUS: a->command &= 0xE0; break;
+  case ACIA_COMMAND: a->command = data; break;
+  case ACIA_CONTROL: a->control = data; break;
+  }
+
+  service(m, a);
+  update(m, a);
+}
+
+/**
+ * acia_reset: Clear the registers, as the RES pin does: receiver off,
+ * transmitter ready and no interrupt. What the rings hold stays there
+ * @param m The machine
+ * @param a The ACIA
+ * @return void
+ * */
+void acia_reset(struct machine* m, struct acia* a) {
+  a->status = ACIA_STATUS_TDRE;
+  a->command = ACIA_CMD_RX_IRQ_OFF;
+  a->control = 0;
+  a->rx = 0;
+
+  update(m, a);
+}
+
+static void put32(uint8_t* p, uint32_t v) {
+  for (int i = 0; i < 4; i++) p[i] = (uint8_t)(v >> (8 * i));
+}
+
+static void put64(uint8_t* p, uint64_t v) {
+  for (int i = 0; i < 8; i++) p[i] = (uint8_t)(v >> (8 * i));
+}
+
+static uint32_t get32(const uint8_t* p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) |
+         ((uint32_t)p[3] << 24);
+}
+
+static uint64_t get64(const uint8_t* p) {
+  uint64_t v = 0;
+
+  for (int i = 7; i >= 0; i--) v = (v << 8) | p[i];
+  return v;
+}
+
+/**
+ * acia_save: The state of an ACIA for snapshots and the history, see
+ * ACIA_STATE_SIZE. A snapshot adds the input and the output still on the
+ * way, taken while nothing feeds nor takes them
+ * @param m The machine
+ * @param ctx The ACIA
+ * @param kind Snapshot, with what is on the way, or checkpoint
+ * @param state Where to write it, NULL for its size only
+ * @return the size of the state
+ * */
+static uint32_t acia_save(struct machine* m, void* ctx,
+                          enum machine_state kind, uint8_t* state) {
+  const struct acia* a = ctx;
+  uint64_t now = m->clock.cycles;
+  uint32_t size = ACIA_STATE_SIZE;
+  uint32_t input = 0;
+
+  if (kind == MACHINE_STATE_SNAPSHOT) {
+    for (size_t i = a->replay; i < a->journaled; i++) {
+      if (a->journal[i].value != ACIA_EOF) input++;
+    }
+    input += (uint32_t)a->pending_count + ring_peek(&a->in, NULL);
+    size += 4 + input + ring_peek(&a->out, NULL);
+  }
+  if (state == NULL) return size;
+
+  state[0] = a->page;
+  state[1] = a->status;
+  state[2] = a->command;
+  state[3] = a->control;
+  state[4] = a->rx;
+  state[5] = a->eof;
+  put64(state + 6, a->calls);
+  state[14] = sched_pending(&a->poll) != 0;
+  put64(state + 15, state[14] && a->poll.when > now ? a->poll.when - now : 0);
+
+  if (kind == MACHINE_STATE_SNAPSHOT) {
+    uint8_t* p = state + ACIA_STATE_SIZE + 4;
+
+    put32(state + ACIA_STATE_SIZE, input);
+    for (size_t i = a->replay; i < a->journaled; i++) {
+      if (a->journal[i].value != ACIA_EOF) *p++ = a->journal[i].value;
+    }
+    memcpy(p, a->pending + a->pending_head, a->pending_count);
+    p += a->pending_count;
+    p += ring_peek(&a->in, p);
+    ring_peek(&a->out, p);
+  }
+  return size;
+}
+
+/**
+ * acia_load: Bring an ACIA back to a state of acia_save(), or reset it for
+ * a snapshot without one. Going back in the history, the journal gives the
+ * input again from there; a snapshot's input is given before the host's
+ * and its output is sent
+ * @param m The machine, its clock restored
+ * @param ctx The ACIA
+ * @param kind Snapshot or checkpoint
+ * @param state The state, NULL to reset
+ * @param size Its size, at least ACIA_STATE_SIZE
+ * @return void
+ * */
+static void acia_load(struct machine* m, void* ctx, enum machine_state kind,
+                      const uint8_t* state, uint32_t size) {
+  struct acia* a = ctx;
+  uint64_t now = m->clock.cycles;
+
+  if (state == NULL) {
+    a->journaled = a->replay = 0;
+    acia_reset(m, a);
+    return;
+  }
+
+  a->status = state[1];
+  a->command = state[2];
+  a->control = state[3];
+  a->rx = state[4];
+  a->eof = state[5] != 0;
+  a->calls = get64(state + 6);
+  // when the host was last read isn't kept, the guest can't tell
+  if (state[14]) {
+    sched_at(m, &a->poll, now + get64(state + 15));
+  } else {
+    sched_cancel(m, &a->poll);
+  }
+
+  if (kind == MACHINE_STATE_CHECKPOINT) {
+    // what was sent before going back stays sent
+    acia_flush(a);
+    sched_cancel(m, &a->flush);
+
+    a->replay = 0;
+    while (a->replay < a->journaled &&
+           a->journal[a->replay].call <= a->calls) {
+      a->replay++;
+    }
+    // the journal lost input from there, what is left doesn't follow it
+    if (a->calls < a->lost) {
+      a->journaled = a->replay = 0;
+      a->lost = a->calls;
+    }
+  } else {
+    uint32_t input = 0;
+
+    a->journaled = a->replay = 0;
+    if (size >= ACIA_STATE_SIZE + 4) {
+      input = get32(state + ACIA_STATE_SIZE);
+      if (input > size - ACIA_STATE_SIZE - 4) {
+        input = size - ACIA_STATE_SIZE - 4;
+      }
+      give(a, state + ACIA_STATE_SIZE + 4, input);
+
+      const uint8_t* out = state + ACIA_STATE_SIZE + 4 + input;
+      uint32_t n = size - ACIA_STATE_SIZE - 4 - input;
+      while (n) {
+        if (ring_full(&a->out)) acia_flush(a);
+        unsigned written = ring_write(&a->out, out, n);
+        if (written == 0) break;
+        out += written;
+        n -= written;
+      }
+      if (a->out_fd >= 0 && !ring_empty(&a->out) &&
+          !sched_pending(&a->flush)) {
+        sched_in(m, &a->flush, ACIA_FLUSH_CYCLES);
+      }
+    }
+  }
+
+  update(m, a);
+}
+
+/**
+ * acia_attach: Map an ACIA on a page and reset it, the page's memory is
+ * hidden while it is mapped. Snapshots and the history keep its state
+ * from then on
+ * @param m The machine
+ * @param a The ACIA
+ * @param page The page its registers are on
+ * @param in_fd Where its input is read from, -1 for acia_feed() only
+ * @param out_fd Where its output is written to, -1 for acia_take() only
+ * @return 0 if success, 1 if too many devices are attached
+ * */
+int acia_attach(struct machine* m, struct acia* a, uint8_t page, int in_fd,
+                int out_fd) {
+  struct machine_device device = {ACIA_STATE_TAG, page, ACIA_STATE_SIZE,
+                                  acia_save, acia_load, a};
+
+  memset(a, 0, sizeof(*a));
+  a->page = page;
+  a->in_fd = in_fd;
+  a->out_fd = out_fd;
+  sched_event_init(&a->flush, flush_due, a);
+  sched_event_init(&a->poll, poll_due, a);
+
+  if (machine_attach(m, &device)) return 1;
+  mem_map_io(m, page, page, acia_read, acia_write, a);
+  acia_reset(m, a);
+  return 0;
+}
+
+/**
+ * acia_detach: Free the journal and the pending input of an ACIA
+ * @param a The ACIA
+ * @return void
+ * */
+void acia_detach(struct acia* a) {
+  free(a->journal);
+  free(a->pending);
+  a->journal = NULL;
+  a->pending = NULL;
+  a->journaled = a->replay = 0;
+  a->pending_head = a->pending_count = 0;
+}
+
+/**
+ * acia_take: Take output of the guest, from the thread drawing it while
+ * the machine may run on another one
+ * @param a The ACIA, without an out_fd
+ * @param buf Where to put the bytes
+ * @param size How many at most
+ * @return how many were taken
+ * */
+unsigned acia_take(struct acia* a, uint8_t* buf, unsigned size) {
+  return ring_read(&a->out, buf, size);
+}
+
+/**
+ * acia_feed: Give input to the guest, from the thread reading the keys
+ * while the machine may run on another one
+ * @param a The ACIA, without an in_fd
+ * @param buf The bytes
+ * @param size How many
+ * @return how many fit in the ring
+ * */
+unsigned acia_feed(struct acia* a, const uint8_t* buf, unsigned size) {
+  return ring_write(&a->in, buf, size);
+}
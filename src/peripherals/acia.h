@@ -0,0 +1,147 @@
+#ifndef INC_6502_ACIA_H
+#define INC_6502_ACIA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../machine/sched.h"
+
+/*
+ * 6551 ACIA, a serial port to the host.
+ *
+ * The 4 registers sit on one I/O page, mirrored every 4 bytes. What the
+ * guest writes to the data register goes into a ring of bytes, and what
+ * it reads comes out of another one, the line itself takes no time: the
+ * transmitter is ready again right after a write and a byte waits in the
+ * receive ring until the data register is free, so the control register
+ * (baud rate, word length) and the parity bits are kept but change
+ * nothing, and there are no framing, parity nor overrun errors.
+ *
+ * Headless, the rings are backed by file descriptors, stdin and stdout.
+ * Output is written in batches: when the ring is full, and at the latest
+ * ACIA_FLUSH_CYCLES after the first byte of a batch, so that a prompt
+ * shows while the guest waits for an answer. Input is read without
+ * blocking, at most every ACIA_POLL_CYCLES, once the guest took all of
+ * it and looks at the receiver or the receiver can interrupt.
+ * In the interface the rings are shared instead with the thread drawing
+ * the screen, which takes the output and feeds the keys typed: each ring
+ * has a single writer and a single reader, on either side, and needs no
+ * lock. Output then waits for room in the ring, TDRE staying clear.
+ *
+ * The receiver is on while DTR (command bit 0) is set. IRQ is status bit
+ * 7, set when a byte is received with command bit 1 clear or when the
+ * transmitter gets ready with command bits 3-2 at 01, and cleared by
+ * reading the status register. Echo mode isn't emulated.
+ *
+ * Snapshots and history checkpoints keep its state, the "ACIA" chunk:
+ * ACIA_STATE_SIZE bytes of the page, status, command, control and data
+ * registers, whether the input ended (u8), the calls of the receiver so
+ * far (u64), whether a poll is scheduled (u8) and the cycles to it (u64).
+ * A snapshot adds the input the guest didn't take yet, a u32 count and the
+ * bytes, then the output the host didn't take, to the end of the chunk.
+ *
+ * The host can't be taken back, so while the history runs forward again
+ * after going back (m->replaying) the output is dropped, it was written
+ * already, and the input is given again from a journal: what the guest
+ * received while the history records, by the call of the receiver it came
+ * in with. The journal keeps the last ACIA_JOURNAL_MAX entries, going back
+ * past them gives the input the journal lost as it comes. Once back, the
+ * input the guest got after that point comes again, first.
+ */
+
+// registers, by the low 2 bits of the address
+#define ACIA_DATA 0x0
+#define ACIA_STATUS 0x1
+#define ACIA_COMMAND 0x2
+#define ACIA_CONTROL 0x3
+
+// status bits
+#define ACIA_STATUS_RDRF 0x08
+#define ACIA_STATUS_TDRE 0x10
+#define ACIA_STATUS_IRQ 0x80
+
+// command bits
+#define ACIA_CMD_DTR 0x01
+#define ACIA_CMD_RX_IRQ_OFF 0x02
+#define ACIA_CMD_TX 0x0C
+#define ACIA_CMD_TX_IRQ 0x04
+
+// bytes of each ring, a power of 2
+#define ACIA_RING_SIZE 65536
+
+// cycles between two reads of the host input
+#define ACIA_POLL_CYCLES 20000
+
+// cycles a batch of output waits at most before being written
+#define ACIA_FLUSH_CYCLES 1000000
+
+#define ACIA_STATE_TAG "ACIA"
+#define ACIA_STATE_SIZE 23
+
+// entries of the input journal, the oldest half is dropped beyond
+#define ACIA_JOURNAL_MAX 65536
+
+// an input journal entry for the end of the input
+#define ACIA_EOF 0x100
+
+struct machine;
+
+// bytes from one thread to another, head and tail count from the start
+struct acia_ring {
+  uint8_t bytes[ACIA_RING_SIZE];
+  unsigned head;
+  unsigned tail;
+};
+
+// what the guest received at a call of the receiver, a byte or ACIA_EOF
+struct acia_input {
+  uint64_t call;
+  uint16_t value;
+};
+
+struct acia {
+  uint8_t page;
+
+  uint8_t status, command, control;
+  uint8_t rx;
+
+  // guest to host and host to guest
+  struct acia_ring out;
+  struct acia_ring in;
+
+  // stdout and stdin headless, -1 when the interface drains and feeds
+  int out_fd;
+  int in_fd;
+  uint8_t eof;
+
+  // cycle of the last read of in_fd
+  uint64_t polled;
+
+  // calls of the receiver so far, the points the guest may get input at
+  uint64_t calls;
+
+  // the input journal, given again from replay on while m->replaying;
+  // lost is the call of the newest entry dropped
+  struct acia_input* journal;
+  size_t journaled;
+  size_t replay;
+  uint64_t lost;
+
+  // input given before the host's, from a snapshot or the journal
+  uint8_t* pending;
+  size_t pending_head;
+  size_t pending_count;
+
+  struct sched_event flush;
+  struct sched_event poll;
+};
+
+int acia_attach(struct machine* m, struct acia* a, uint8_t page, int in_fd,
+                int out_fd);
+void acia_detach(struct acia* a);
+void acia_reset(struct machine* m, struct acia* a);
+void acia_flush(struct acia* a);
+unsigned acia_take(struct acia* a, uint8_t* buf, unsigned size);
+unsigned acia_feed(struct acia* a, const uint8_t* buf, unsigned size);
+
+#endif
@@ -1,125 +1,383 @@
 #include "interface.h"
 
+#include <errno.h>
 #include <ncurses.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "../cpu/cpu.h"
+#include "../machine/debug.h"
+#include "../machine/machine.h"
 #include "../mem/mem.h"
 
+/**
+ * interface_init: Set up the colors, once ncurses is started
+ * @param void
+ * @return void
+ * */
+void interface_init(void) {
+  start_color();
+  init_pair(1, COLOR_YELLOW, COLOR_BLACK);
+}
+
 void interface_display_header(uint8_t row, uint8_t column) {
-  mvprintw(row,column,"6502 Emulator: Press Keys : Enter to Execute Step, R to Reset, Q to Quit");
+  mvprintw(row,column,"6502 Emulator: Press Keys : Enter to Execute Step, b to Step Back, B to Rewind, G to Run/Pause, R to Reset, Q to Quit");
+  mvprintw(row+1,column,"                              X to Toggle a Breakpoint, W to Watch Memory, C to Clear Them");
 }
 
 
+/**
+ * interface_view_sample: Copy the registers, the clock, the state of the
+ * debugger and the bytes of the view's pages and screen out of a machine
+ * @param m The machine
+ * @param view The view, its pages and screen already set
+ * @return void
+ * */
+void interface_view_sample(struct machine* m, struct interface_view* view) {
+  view->cpu = m->cpu;
+  view->clock = m->clock;
+
+  memset(&view->hit, 0, sizeof(view->hit));
+  view->breaks = 0;
+  view->watches = 0;
+  if (m->debug != NULL) {
+    view->breaks = m->debug->break_count;
+    view->watches = m->debug->watch_count;
+    if (m->debug->hit) view->hit = m->debug->last;
+  }
+
+  for (unsigned slot = 0; slot < INTERFACE_PAGES; slot++) {
+    memcpy(view->bytes[slot], m->mem.data + (view->page[slot] & 0xFF00), 256);
+  }
+
+  memcpy(view->screen, m->mem.data + view->screen_addr, view->screen_size);
+}
+
 /**
  * interface_display_cpu: prints CPU status to the screen using ncurses
- * @param void
+ * @param view What to show
  * @return void
  * */
-void interface_display_cpu(uint8_t row, uint8_t column) {
+void interface_display_cpu(const struct interface_view* view, uint8_t row,
+                           uint8_t column) {
 
   uint8_t local_row = row;
   uint8_t local_column = column;
   
-  mvprintw(local_row  , local_column, "A: 0x%02X", cpu.ac);
-  mvprintw(local_row+1, local_column, "X: 0x%02X", cpu.x);
-  mvprintw(local_row+2, local_column, "Y: 0x%02X", cpu.y );
+  mvprintw(local_row  , local_column, "A: 0x%02X", view->cpu.ac);
+  mvprintw(local_row+1, local_column, "X: 0x%02X", view->cpu.x);
+  mvprintw(local_row+2, local_column, "Y: 0x%02X", view->cpu.y );
+
+  mvprintw(local_row  , local_column+10, "PC: 0x%04X", view->cpu.pc);
+  mvprintw(local_row+1, local_column+10, "SP: 0x%02X", view->cpu.sp);
+  mvprintw(local_row+2, local_column+10, "SR: 0x%02X", cpu_sr_pack(&view->cpu));
 
-  mvprintw(local_row  , local_column+10, "PC: 0x%04X", cpu.pc);
-  mvprintw(local_row+1, local_column+10, "SP: 0x%02X", cpu.sp);
-  mvprintw(local_row+2, local_column+10, "SR: 0x%02X", cpu.sr);
+  mvprintw(local_row  , local_column+25, "%-7s", view->running ? "RUNNING" : "PAUSED");
+  mvprintw(local_row+1, local_column+25, "INSTS: %-20llu", (unsigned long long)view->clock.instructions);
+  mvprintw(local_row+2, local_column+25, "CYCLES: %-20llu", (unsigned long long)view->clock.cycles);
 }
 
-void interface_display_page(uint8_t row, uint8_t column, uint16_t addr) {
+/**
+ * interface_display_debug: prints the armed breakpoints and watchpoints
+ * and what stopped the machine
+ * @param view What to show
+ * @param row Top row on screen
+ * @param column Leftmost column on screen
+ * @return void
+ * */
+void interface_display_debug(const struct interface_view* view, uint8_t row,
+                             uint8_t column) {
+  const struct debug_hit* hit = &view->hit;
 
-  struct mem* mp = mem_get_ptr();
-  uint16_t page = (addr) & (uint16_t)0xFF00;
-  uint16_t local_index = 0;
-  uint8_t local_row = row;
-  uint8_t local_column = column;
+  mvprintw(row  , column, "BREAKS: %-6u WATCHED: %-6u", view->breaks, view->watches);
 
-  // print page address in upper left corner 
-  mvprintw( local_row, local_column, "%04X | ", page);
+  move(row+1, column);
+  clrtoeol();
+  if (hit->kind == DEBUG_HIT_BREAK) {
+    mvprintw(row+1, column, "HIT: break at 0x%04X", hit->addr);
+  } else if (hit->kind == DEBUG_WATCH_READ) {
+    mvprintw(row+1, column, "HIT: read 0x%02X at 0x%04X", hit->value, hit->addr);
+  } else if (hit->kind != 0) {
+    mvprintw(row+1, column, "HIT: %s 0x%02X -> 0x%02X at 0x%04X",
+             debug_hit_name(hit->kind), hit->old, hit->value, hit->addr);
+  }
+}
 
+/**
+ * interface_page_init: Place a memory panel, nothing is drawn until the
+ * first interface_display_page()
+ * @param panel The panel
+ * @param row Top row on screen
+ * @param column Leftmost column on screen
+ * @param addr Any address of the page to show
+ * @return void
+ * */
+void interface_page_init(struct interface_page* panel, uint8_t row,
+                         uint8_t column, uint16_t addr) {
+  panel->row = row;
+  panel->column = column;
+  panel->page = addr & 0xFF00;
+  panel->drawn = 0;
+}
 
-  local_row = row;
-  local_column = column;
-  mvprintw( local_row   , local_column+7, "00 01 02 03 04 05 06 07 08 09 0A 0B 0C 0D 0E 0F",page);
-  mvprintw( local_row+1 , local_column+5, "+-------------------------------------------------");
+// interface_draw_frame: the page address, the column and row headers and
+// the borders of the ASCII grid
+static void interface_draw_frame(const struct interface_page* panel) {
+  uint8_t row = panel->row;
+  uint8_t column = panel->column;
 
+  // print page address in upper left corner
+  mvprintw(row, column, "%04X | ", panel->page);
 
-  local_row = row+2;
-  local_column = column+2;
-  for ( local_index = 0; local_index < 16; local_index++ ) {
-    mvprintw( local_row+local_index , local_column, "%02X |",local_index*16);
+  mvprintw(row, column + 7, "00 01 02 03 04 05 06 07 08 09 0A 0B 0C 0D 0E 0F");
+  mvprintw(row + 1, column + 5, "+-------------------------------------------------");
+
+  for (unsigned line = 0; line < 16; line++) {
+    mvprintw(row + 2 + line, column + 2, "%02X |", line * 16);
   }
 
-  
-  local_row = row+2;
-  local_column = column+7;
+  mvprintw(row, column + 55, "|0123456789ABCDEF|");
+  mvprintw(row + 1, column + 55, "+----------------+");
 
+  for (unsigned line = 0; line < 16; line++) {
+    mvaddch(row + 2 + line, column + 55, '|');
+    mvaddch(row + 2 + line, column + 72, '|');
+  }
+}
 
-  start_color();
-  init_pair(1,COLOR_YELLOW,COLOR_BLACK);
+/**
+ * interface_display_page: Draw a page of memory as a hex and an ASCII
+ * grid, the byte at PC and the top of the stack highlighted. The panel
+ * remembers what it drew, so only the bytes whose value or highlight
+ * changed since are drawn again
+ * @param panel The panel
+ * @param view What to show
+ * @param slot Which page of the view is the panel's
+ * @return void
+ * */
+void interface_display_page(struct interface_page* panel,
+                            const struct interface_view* view, unsigned slot) {
+  static const char hex[] = "0123456789ABCDEF";
+  const uint8_t* bytes = view->bytes[slot];
 
-  
-  for ( local_index = 0 ; local_index < 256; local_index++ ) {
-    // print value at the local_index'th offset into page
-    //mvprintw(local_row, local_column, "%02X", mp->data[ page + local_index ] );
-    
-    if (( page == 0x0100 && local_index == cpu.sp ) ||
-	( page + local_index == cpu.pc )
-	) {
-      attron(COLOR_PAIR(1)|A_BOLD);
-      mvprintw(local_row, local_column, "%02X", mp->data[ page + local_index ] );
-      attroff(COLOR_PAIR(1)|A_BOLD);
-    } else {
-      mvprintw(local_row, local_column, "%02X", mp->data[ page + local_index ] );
-    }
+  if (!panel->drawn) interface_draw_frame(panel);
+
+  for (unsigned index = 0; index < 256; index++) {
+    uint8_t value = bytes[index];
+    uint8_t highlight = (panel->page == 0x0100 && index == view->cpu.sp) ||
+                        panel->page + index == view->cpu.pc;
 
-    // if this is not the first and
-    // the next value should be on the following row
-    if ( local_index != 0 && (local_index+1) % 16 == 0 ) {
-      // increment the row by one
-      local_row += 1;
-      // and reset the column back to the left
-      local_column = column+7;
-    } else {
-      // otherwise just move over three for next value
-      local_column += 3;
+    if (panel->drawn && panel->bytes[index] == value &&
+        panel->highlight[index] == highlight) {
+      continue;
     }
+
+    int row = panel->row + 2 + index / 16;
+    int column = panel->column + 7 + (index % 16) * 3;
+
+    if (highlight) attron(COLOR_PAIR(1) | A_BOLD);
+    mvaddch(row, column, hex[value >> 4]);
+    addch(hex[value & 0x0F]);
+    if (highlight) attroff(COLOR_PAIR(1) | A_BOLD);
+
+    mvaddch(row, panel->column + 56 + index % 16,
+            value >= 0x20 && value <= 0x7E ? value : '.');
+
+    panel->bytes[index] = value;
+    panel->highlight[index] = highlight;
   }
 
-  local_column = column + 55;
-  local_row = row;
+  panel->drawn = 1;
+}
 
-  mvprintw( local_row   , local_column, "|0123456789ABCDEF|");
-  mvprintw( local_row+1 , local_column, "+----------------+");
-  
-  local_row = row + 2;
-  for ( int local_index = 0; local_index < 16; local_index ++ ) {
-    mvprintw( local_row + local_index , local_column, "|                |");
+/**
+ * interface_console_init: Place an empty console pane, nothing is drawn
+ * until the first interface_display_console()
+ * @param console The pane
+ * @param row Top row on screen
+ * @param column Leftmost column on screen
+ * @param title Shown above the text, kept as is
+ * @return void
+ * */
+void interface_console_init(struct interface_console* console, uint8_t row,
+                            uint8_t column, const char* title) {
+  console->row = row;
+  console->column = column;
+  console->title = title;
+  memset(console->text, ' ', sizeof(console->text));
+  console->x = 0;
+  console->y = 0;
+  console->drawn = 0;
+}
+
+// console_newline: move to the start of the next line, scrolling the text
+// up from the last one
+static void console_newline(struct interface_console* console) {
+  console->x = 0;
+  if (console->y + 1 < INTERFACE_CONSOLE_ROWS) {
+    console->y++;
+    return;
   }
 
-  
-  local_row = row + 2;
-  local_column = column + 56;
-  
-  for ( local_index = 0 ; local_index < 256; local_index++ ) {
-    
-    if ( ( mp->data[page+local_index] >= 0x20 ) &&  ( mp->data[page+local_index] <= 0x7E ) ) { 
-      mvprintw(local_row, local_column, "%c", mp->data[page+local_index]);
-    } else {
-        mvprintw(local_row, local_column, ".");
+  memmove(console->text[0], console->text[1],
+          sizeof(console->text) - sizeof(console->text[0]));
+  memset(console->text[INTERFACE_CONSOLE_ROWS - 1], ' ',
+         sizeof(console->text[0]));
+}
+
+/**
+ * interface_console_write: Add what a terminal would print of some bytes
+ * to the text: CR and LF, backspace, tabs and printable ASCII, lines
+ * wrapping at the edge. Nothing is drawn yet
+ * @param console The pane
+ * @param bytes The bytes
+ * @param size How many
+ * @return void
+ * */
+void interface_console_write(struct interface_console* console,
+                             const uint8_t* bytes, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    uint8_t byte = bytes[i];
+
+    if (byte == '\n') {
+      console_newline(console);
+    } else if (byte == '\r') {
+      console->x = 0;
+    } else if (byte == '\b' || byte == 0x7F) {
+      if (console->x > 0) console->x--;
+    } else if (byte == '\t') {
+      console->x = (console->x + 8) & ~7u;
+      if (console->x >= INTERFACE_CONSOLE_COLUMNS) console_newline(console);
+    } else if (byte >= 0x20 && byte <= 0x7E) {
+      if (console->x == INTERFACE_CONSOLE_COLUMNS) console_newline(console);
+      console->text[console->y][console->x++] = (char)byte;
     }
-    
-    if ( local_index != 0 && ((local_index+1) % 16 == 0) ) {
-      local_row += 1;
-      local_column = column + 56;
-    } else {
-      local_column += 1;
+  }
+}
+
+/**
+ * interface_display_console: Draw the console pane, only the characters
+ * that changed since it was last drawn
+ * @param console The pane
+ * @return void
+ * */
+void interface_display_console(struct interface_console* console) {
+  if (!console->drawn) {
+    mvprintw(console->row, console->column, "%s", console->title);
+    mvhline(console->row + 1, console->column, '-', INTERFACE_CONSOLE_COLUMNS);
+  }
+
+  for (unsigned y = 0; y < INTERFACE_CONSOLE_ROWS; y++) {
+    for (unsigned x = 0; x < INTERFACE_CONSOLE_COLUMNS; x++) {
+      char c = console->text[y][x];
+
+      if (console->drawn && console->shown[y][x] == c) continue;
+
+      mvaddch(console->row + 2 + y, console->column + x, c);
+      console->shown[y][x] = c;
     }
   }
-  
+
+  console->drawn = 1;
+}
+
+/**
+ * interface_parse_screen: Parse a --screen argument,
+ * 0x<hex address>:<columns>x<rows>, e.g. "0x0400:32x16". The screen must
+ * fit in memory and in INTERFACE_SCREEN_MAX cells
+ * @param arg The argument
+ * @param addr Its first byte, set on success
+ * @param columns Its columns, set on success
+ * @param rows Its rows, set on success
+ * @return 0 if success, 1 if failure
+ * */
+int interface_parse_screen(const char* arg, uint16_t* addr, uint8_t* columns,
+                           uint8_t* rows) {
+  char* endptr;
+
+  if (strncmp(arg, "0x", 2) != 0 && strncmp(arg, "0X", 2) != 0) return 1;
+
+  errno = 0;
+  long first = strtol(arg, &endptr, 16);
+  if (errno != 0 || *endptr != ':' || first < 0 || first > 0xFFFF) return 1;
+
+  const char* size = endptr + 1;
+  long wide = strtol(size, &endptr, 10);
+  if (endptr == size || (*endptr != 'x' && *endptr != 'X')) return 1;
+
+  size = endptr + 1;
+  long high = strtol(size, &endptr, 10);
+  if (endptr == size || *endptr != '\0') return 1;
+
+  if (wide < 1 || wide > 255 || high < 1 || high > 255 ||
+      wide * high > INTERFACE_SCREEN_MAX || first + wide * high > 0x10000) {
+    return 1;
+  }
+
+  *addr = (uint16_t)first;
+  *columns = (uint8_t)wide;
+  *rows = (uint8_t)high;
+  return 0;
+}
+
+/**
+ * interface_screen_init: Open the window of a text screen, boxed, with
+ * its address and size on the top border
+ * @param screen The screen
+ * @param row Top row of the window on screen
+ * @param column Leftmost column of the window on screen
+ * @param addr Its first byte, for the title
+ * @param columns Its columns
+ * @param rows Its rows
+ * @return 0 if success, 1 if ncurses can't make the window
+ * */
+int interface_screen_init(struct interface_screen* screen, int row,
+                          int column, uint16_t addr, uint8_t columns,
+                          uint8_t rows) {
+  screen->win = newwin(rows + 2, columns + 2, row, column);
+  if (screen->win == NULL) return 1;
+
+  screen->columns = columns;
+  screen->rows = rows;
+  screen->drawn = 0;
+
+  box(screen->win, 0, 0);
+  mvwprintw(screen->win, 0, 2, " %04X %ux%u ", addr, columns, rows);
+  return 0;
+}
+
+/**
+ * interface_display_screen: Draw the characters of a text screen that
+ * changed since it was last drawn, printable ASCII as is and other bytes
+ * as blanks. Once per frame: however fast the guest writes, the screen
+ * changes at most at the refresh rate of the interface. Called after the
+ * panels are refreshed and before doupdate(), so that it stays on top
+ * @param screen The screen
+ * @param view What to show
+ * @return void
+ * */
+void interface_display_screen(struct interface_screen* screen,
+                              const struct interface_view* view) {
+  unsigned size = (unsigned)screen->columns * screen->rows;
+
+  for (unsigned cell = 0; cell < size; cell++) {
+    uint8_t value = view->screen[cell];
+
+    if (screen->drawn && screen->shown[cell] == value) continue;
+
+    mvwaddch(screen->win, 1 + cell / screen->columns,
+             1 + cell % screen->columns,
+             value >= 0x20 && value <= 0x7E ? value : ' ');
+    screen->shown[cell] = value;
+  }
+
+  screen->drawn = 1;
+  wnoutrefresh(screen->win);
+}
+
+// interface_screen_free: close the window of a text screen
+void interface_screen_free(struct interface_screen* screen) {
+  delwin(screen->win);
 }
@@ -1,10 +1,104 @@
 #ifndef INC_6502_INTERFACE_H
 #define INC_6502_INTERFACE_H
 
+#include <ncurses.h>
 #include <stddef.h>
 #include <stdint.h>
 
-void interface_display_cpu(uint8_t row, uint8_t column);
+#include "../cpu/cpu.h"
+#include "../machine/debug.h"
+
+#define INTERFACE_PAGES 4
+
+// cells of a text screen, columns * rows
+#define INTERFACE_SCREEN_MAX 4096
+
+// text of the console pane
+#define INTERFACE_CONSOLE_ROWS 16
+#define INTERFACE_CONSOLE_COLUMNS 72
+
+struct machine;
+
+// what the screen shows, sampled from a machine between two instructions
+struct interface_view {
+  struct central_processing_unit cpu;
+  struct cpu_counters clock;
+  uint8_t running;
+
+  // armed breakpoints and watched addresses, the last hit if any
+  unsigned breaks;
+  unsigned watches;
+  struct debug_hit hit;
+
+  // the pages of the panels, set by the caller, and their bytes
+  uint16_t page[INTERFACE_PAGES];
+  uint8_t bytes[INTERFACE_PAGES][256];
+
+  // the memory of the text screen, set by the caller, 0 bytes without one
+  uint16_t screen_addr;
+  uint16_t screen_size;
+  uint8_t screen[INTERFACE_SCREEN_MAX];
+};
+
+// a memory panel and what it last drew
+struct interface_page {
+  uint8_t row;
+  uint8_t column;
+  uint16_t page;
+
+  uint8_t drawn;
+  uint8_t bytes[256];
+  uint8_t highlight[256];
+};
+
+// a scrolling pane of text written by the guest and what it last drew
+struct interface_console {
+  uint8_t row;
+  uint8_t column;
+  const char* title;
+
+  // the text and where the next character goes
+  char text[INTERFACE_CONSOLE_ROWS][INTERFACE_CONSOLE_COLUMNS];
+  unsigned x;
+  unsigned y;
+
+  uint8_t drawn;
+  char shown[INTERFACE_CONSOLE_ROWS][INTERFACE_CONSOLE_COLUMNS];
+};
+
+// a text screen in a window of its own, a byte of memory per character,
+// and what it last drew
+struct interface_screen {
+  WINDOW* win;
+  uint8_t columns;
+  uint8_t rows;
+
+  uint8_t drawn;
+  uint8_t shown[INTERFACE_SCREEN_MAX];
+};
+
+void interface_init(void);
+void interface_view_sample(struct machine* m, struct interface_view* view);
+void interface_display_cpu(const struct interface_view* view, uint8_t row,
+                           uint8_t column);
 void interface_display_header(uint8_t row, uint8_t column);
-void interface_display_page(uint8_t row, uint8_t column, uint16_t addr);
+void interface_display_debug(const struct interface_view* view, uint8_t row,
+                             uint8_t column);
+void interface_page_init(struct interface_page* panel, uint8_t row,
+                         uint8_t column, uint16_t addr);
+void interface_display_page(struct interface_page* panel,
+                            const struct interface_view* view, unsigned slot);
+void interface_console_init(struct interface_console* console, uint8_t row,
+                            uint8_t column, const char* title);
+void interface_console_write(struct interface_console* console,
+                             const uint8_t* bytes, size_t size);
+void interface_display_console(struct interface_console* console);
+int interface_parse_screen(const char* arg, uint16_t* addr, uint8_t* columns,
+                           uint8_t* rows);
+int interface_screen_init(struct interface_screen* screen, int row,
+                          int column, uint16_t addr, uint8_t columns,
+                          uint8_t rows);
+void interface_display_screen(struct interface_screen* screen,
+                              const struct interface_view* view);
+void interface_screen_free(struct interface_screen* screen);
 #endif
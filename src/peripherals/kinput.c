@@ -4,27 +4,146 @@
 #include <stdint.h>
 
 #include "../cpu/cpu.h"
+#include "../machine/debug.h"
+#include "../machine/history.h"
+#include "../machine/machine.h"
+#include "acia.h"
 #include "interface.h"
+#include "runner.h"
 
 uint8_t QUIT = 0;
 
+// cycles the 'B' key goes back
+static uint64_t REWIND = KINPUT_REWIND_DEFAULT;
+
+// screen refreshes per second while running
+static unsigned REFRESH = KINPUT_REFRESH_HZ;
+
+// the serial port the keys go to while running, if any
+static struct acia* CONSOLE = NULL;
+
+/**
+ * prompt: Read a line on the prompt row, echoed
+ * @param label What is asked
+ * @param buf Where to put the line
+ * @param size Size of buf
+ * @return void
+ * */
+static void prompt(const char* label, char* buf, int size) {
+  move(KINPUT_PROMPT_ROW, 1);
+  clrtoeol();
+  mvprintw(KINPUT_PROMPT_ROW, 1, "%s", label);
+
+  echo();
+  curs_set(1);
+  getnstr(buf, size - 1);
+  noecho();
+  curs_set(0);
+
+  move(KINPUT_PROMPT_ROW, 1);
+  clrtoeol();
+}
+
+// complain: tell what was wrong with the last prompt
+static void complain(const char* message) {
+  mvprintw(KINPUT_PROMPT_ROW, 1, "%s", message);
+}
+
 /**
- * kinput_listen: listens for keyboard events and exuctes respective actions
- * @param void
+ * kinput_listen: listens for keyboard events and exuctes respective actions.
+ * While the machine runs on its own, only waits for a refresh period and
+ * only takes G and Q, or with a console hands every key but ^G to the
+ * guest, Enter as a CR. X and W ask for an address on the prompt row
+ * @param m The machine the keys act on
+ * @param r Its runner
  * @return void
  * */
-void kinput_listen(void) {
+void kinput_listen(struct machine* m, struct runner* r) {
+  if (runner_running(r)) {
+    timeout(1000 / REFRESH);
+    int key = getch();
+
+    if (CONSOLE != NULL) {
+      if (key == KINPUT_CONSOLE_PAUSE) {
+        runner_stop(r);
+      } else if (key >= 0 && key <= 0xFF) {
+        uint8_t byte = key == '\n' ? '\r' : (uint8_t)key;
+        acia_feed(CONSOLE, &byte, 1);
+      }
+      return;
+    }
+
+    if (key == 'g' || key == 'G') {
+      runner_stop(r);
+    } else if (key == 'q') {
+      runner_stop(r);
+      QUIT = 1;
+    }
+    return;
+  }
+
+  timeout(-1);
   char c = getch();
   
   switch (c) {
   case '\n':
-    cpu_exec();
+    history_tick(m);
+    cpu_exec(m);
+    break;
+
+  case 'b':
+    history_step_back(m);
+    break;
+
+  case 'B':
+    history_rewind(m, REWIND);
     break;
     
   case 'r':
-    cpu_reset();
+    cpu_reset(m);
+    // the history can't step back across the reset
+    history_clear(m);
     break;
     
+  case 'g':
+  case 'G':
+    runner_start(r);
+    break;
+
+  case 'x':
+  case 'X': {
+    // the current PC when left empty
+    char line[KINPUT_PROMPT_SIZE];
+    uint16_t addr = m->cpu.pc;
+
+    prompt("Toggle breakpoint at (0x<hex address>, PC if empty): ", line,
+           sizeof(line));
+    if (line[0] != '\0' && debug_parse_addr(line, &addr)) {
+      complain("Invalid address, expected 0x<hex address>");
+    } else if (m->debug != NULL && debug_break_at(m->debug, addr)) {
+      debug_unbreak(m, addr);
+    } else if (debug_break(m, addr)) {
+      complain("Out of memory");
+    }
+    break;
+  }
+
+  case 'w':
+  case 'W': {
+    char line[KINPUT_PROMPT_SIZE];
+
+    prompt("Watch (0x<first>[-0x<last>][:r|w|c...]): ", line, sizeof(line));
+    if (line[0] != '\0' && debug_parse_watch(m, line)) {
+      complain("Invalid watchpoint, expected 0x<first>[-0x<last>][:r|w|c...]");
+    }
+    break;
+  }
+
+  case 'c':
+  case 'C':
+    debug_clear(m);
+    break;
+
   case 'q':
     QUIT = 1;
     break;
@@ -34,5 +153,28 @@ void kinput_listen(void) {
   }
 }
 
+/**
+ * kinput_set_rewind: Set how far back the 'B' key goes
+ * @param cycles The cycles to go back
+ * @return void
+ * */
+void kinput_set_rewind(uint64_t cycles) { REWIND = cycles; }
+
+/**
+ * kinput_set_refresh: Set how many times a second the screen is refreshed
+ * while the machine runs on its own
+ * @param hz The refreshes per second, 1 to 1000
+ * @return void
+ * */
+void kinput_set_refresh(unsigned hz) { REFRESH = hz; }
+
+/**
+ * kinput_set_console: Have the keys typed while running go to a serial
+ * port, see kinput_listen()
+ * @param a The port, fed with acia_feed()
+ * @return void
+ * */
+void kinput_set_console(struct acia* a) { CONSOLE = a; }
+
 // kinput_should_quit: sends quit signal by returning QUIT status
 uint8_t kinput_should_quit(void) { return QUIT; }
@@ -3,7 +3,28 @@
 
 #include <stdint.h>
 
-void kinput_listen(void);
+// cycles the 'B' key goes back unless told otherwise
+#define KINPUT_REWIND_DEFAULT 1000
+
+// screen refreshes per second while the machine runs on its own, unless
+// told otherwise
+#define KINPUT_REFRESH_HZ 30
+
+// where X and W ask for an address, below the memory panels
+#define KINPUT_PROMPT_ROW 46
+#define KINPUT_PROMPT_SIZE 32
+
+// pauses a running machine whose keys go to a serial console, ^G
+#define KINPUT_CONSOLE_PAUSE 0x07
+
+struct acia;
+struct machine;
+struct runner;
+
+void kinput_listen(struct machine* m, struct runner* r);
+void kinput_set_rewind(uint64_t cycles);
+void kinput_set_refresh(unsigned hz);
+void kinput_set_console(struct acia* a);
 uint8_t kinput_should_quit(void);
 
 #endif
@@ -0,0 +1,219 @@
+#include "runner.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "../cpu/cpu.h"
+#include "../machine/debug.h"
+#include "../machine/history.h"
+#include "../machine/machine.h"
+#include "interface.h"
+
+// tries of runner_sample() before it keeps the view it has
+#define SAMPLE_TRIES 16
+
+/**
+ * now: Monotonic host time
+ * @param void
+ * @return seconds since an arbitrary starting point
+ * */
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/**
+ * runner_init: Prepare a paused runner
+ * @param r The runner
+ * @param m The machine it runs
+ * @param hz Target clock in Hz, 0 for as fast as possible
+ * @param page The INTERFACE_PAGES pages its views hold
+ * @return void
+ * */
+void runner_init(struct runner* r, struct machine* m, uint64_t hz,
+                 const uint16_t* page) {
+  memset(r, 0, sizeof(*r));
+  r->m = m;
+  r->hz = hz;
+  memcpy(r->page, page, sizeof(r->page));
+}
+
+/**
+ * runner_set_screen: Have the views hold a text screen too
+ * @param r The runner, paused
+ * @param addr Its first byte
+ * @param size Its bytes, up to INTERFACE_SCREEN_MAX, 0 for none
+ * @return void
+ * */
+void runner_set_screen(struct runner* r, uint16_t addr, uint16_t size) {
+  r->screen_addr = addr;
+  r->screen_size = size;
+}
+
+// prepare: set what a view holds before sampling the machine into it
+static void prepare(const struct runner* r, struct interface_view* view) {
+  memcpy(view->page, r->page, sizeof(view->page));
+  view->screen_addr = r->screen_addr;
+  view->screen_size = r->screen_size;
+}
+
+/**
+ * publish: Sample the machine into the view the interface isn't reading
+ * and make it the current one. Called by the thread only
+ * @param r The runner
+ * @param running Whether the machine keeps running after this view
+ * @return void
+ * */
+static void publish(struct runner* r, uint8_t running) {
+  unsigned back = __atomic_load_n(&r->front, __ATOMIC_RELAXED) ^ 1;
+  struct runner_buffer* b = &r->buffers[back];
+  unsigned seq = b->seq;
+
+  __atomic_store_n(&b->seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  prepare(r, &b->view);
+  interface_view_sample(r->m, &b->view);
+  b->view.running = running;
+
+  __atomic_store_n(&b->seq, seq + 2, __ATOMIC_RELEASE);
+  __atomic_store_n(&r->front, back, __ATOMIC_RELEASE);
+}
+
+// runner_main: the thread, runs slices until asked to stop or a stop
+// condition is met
+static void* runner_main(void* arg) {
+  struct runner* r = arg;
+  struct machine* m = r->m;
+  struct cpu_limits limits = {0};
+  uint64_t slice = r->hz ? r->hz / 1000 : RUNNER_SLICE;
+  uint64_t start_cycles = m->clock.cycles;
+  double start = now();
+
+  limits.max_cycles = slice ? slice : 1;
+  limits.stop_on_brk = 1;
+  limits.stop_on_idle = 1;
+
+  // the cycles of a reset sequence
+  if (m->cycles != 0) cpu_exec(m);
+
+  while (!__atomic_load_n(&r->stop, __ATOMIC_ACQUIRE)) {
+    struct cpu_counters counters = {0, 0};
+    enum cpu_stop reason = history_run(m, &limits, &counters);
+
+    if (reason != CPU_STOP_BUDGET) {
+      __atomic_store_n(&r->done, 1, __ATOMIC_RELEASE);
+      break;
+    }
+
+    if (__atomic_exchange_n(&r->want, 0, __ATOMIC_ACQ_REL)) publish(r, 1);
+
+    // ahead of the target clock, wait for the host to catch up
+    if (r->hz) {
+      double ahead = start + (double)(m->clock.cycles - start_cycles) / r->hz -
+                     now();
+
+      if (ahead > 0) {
+        struct timespec ts;
+        ts.tv_sec = (time_t)ahead;
+        ts.tv_nsec = (long)((ahead - (double)ts.tv_sec) * 1e9);
+        nanosleep(&ts, NULL);
+      }
+    }
+  }
+
+  publish(r, 0);
+  return NULL;
+}
+
+/**
+ * runner_start: Hand the machine to a thread that runs it until
+ * runner_stop(), a BRK, an idle loop, a breakpoint or a watchpoint
+ * @param r The runner, paused
+ * @return 0 if success, 1 if failure
+ * */
+int runner_start(struct runner* r) {
+  if (r->active) return 0;
+
+  // the current view until the thread publishes one
+  r->front = 0;
+  r->buffers[0].seq = 0;
+  r->buffers[1].seq = 0;
+  prepare(r, &r->buffers[0].view);
+  interface_view_sample(r->m, &r->buffers[0].view);
+  r->buffers[0].view.running = 1;
+
+  r->stop = 0;
+  r->done = 0;
+  r->want = 0;
+
+  // not to stop right away on the breakpoint it stopped on
+  debug_resume(r->m);
+
+  if (pthread_create(&r->thread, NULL, runner_main, r) != 0) return 1;
+  r->active = 1;
+  return 0;
+}
+
+/**
+ * runner_stop: Pause, the machine is the caller's again when it returns
+ * @param r The runner
+ * @return void
+ * */
+void runner_stop(struct runner* r) {
+  if (!r->active) return;
+
+  __atomic_store_n(&r->stop, 1, __ATOMIC_RELEASE);
+  pthread_join(r->thread, NULL);
+  r->active = 0;
+}
+
+/**
+ * runner_poll: Join the thread if it stopped on its own, once per frame
+ * before drawing
+ * @param r The runner
+ * @return void
+ * */
+void runner_poll(struct runner* r) {
+  if (r->active && __atomic_load_n(&r->done, __ATOMIC_ACQUIRE)) runner_stop(r);
+}
+
+/**
+ * runner_running: Whether the machine belongs to the thread, up to the
+ * next runner_poll() if it stopped on its own
+ * @param r The runner
+ * @return 1 if running, 0 if paused
+ * */
+int runner_running(const struct runner* r) { return r->active; }
+
+/**
+ * runner_sample: Copy the newest view of the running machine without
+ * waiting for the thread, and ask it for a newer one
+ * @param r The runner
+ * @param view Where to copy it
+ * @return 0 if success, 1 if the thread kept writing it, view untouched
+ * */
+int runner_sample(struct runner* r, struct interface_view* view) {
+  __atomic_store_n(&r->want, 1, __ATOMIC_RELEASE);
+
+  for (unsigned tries = 0; tries < SAMPLE_TRIES; tries++) {
+    const struct runner_buffer* b =
+        &r->buffers[__atomic_load_n(&r->front, __ATOMIC_ACQUIRE)];
+    unsigned seq = __atomic_load_n(&b->seq, __ATOMIC_ACQUIRE);
+
+    if (seq & 1) continue;
+
+    struct interface_view copy = b->view;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    if (__atomic_load_n(&b->seq, __ATOMIC_RELAXED) == seq) {
+      *view = copy;
+      return 0;
+    }
+  }
+
+  return 1;
+}
@@ -0,0 +1,66 @@
+#ifndef INC_6502_RUNNER_H
+#define INC_6502_RUNNER_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "../cpu/cpu.h"
+#include "interface.h"
+
+/*
+ * Continuous run for the interface.
+ *
+ * While running, the machine belongs to a thread of its own that runs it
+ * in slices, at full speed or paced to a target clock; pausing joins the
+ * thread, so the interface only ever touches the machine while it is
+ * paused and no lock is needed around it.
+ *
+ * The interface sees a running machine through two views: the thread
+ * writes the one the interface isn't reading and then publishes it. Each
+ * view has a sequence count, odd while being written, that the reader
+ * checks around its copy and retries on. The thread only samples the
+ * machine when the interface asked for a new view since the last one, so
+ * a 30 Hz display costs the core 30 copies of a few pages, and of the text
+ * screen if any, a second.
+ */
+
+// cycles of a slice at full speed, the thread checks for pause between two
+#define RUNNER_SLICE 100000
+
+struct runner_buffer {
+  unsigned seq;
+  struct interface_view view;
+};
+
+struct runner {
+  struct machine* m;
+
+  // target clock in Hz, 0 for as fast as possible
+  uint64_t hz;
+
+  // pages and text screen of the views
+  uint16_t page[INTERFACE_PAGES];
+  uint16_t screen_addr;
+  uint16_t screen_size;
+
+  pthread_t thread;
+  uint8_t active;
+
+  // shared with the thread
+  int stop;
+  int done;
+  int want;
+  unsigned front;
+  struct runner_buffer buffers[2];
+};
+
+void runner_init(struct runner* r, struct machine* m, uint64_t hz,
+                 const uint16_t* page);
+void runner_set_screen(struct runner* r, uint16_t addr, uint16_t size);
+int runner_start(struct runner* r);
+void runner_stop(struct runner* r);
+void runner_poll(struct runner* r);
+int runner_running(const struct runner* r);
+int runner_sample(struct runner* r, struct interface_view* view);
+
+#endif
@@ -0,0 +1,389 @@
+#include "via.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include "../machine/machine.h"
+#include "../machine/sched.h"
+#include "../mem/mem.h"
+
+/**
+ * counter: The value of a timer's counter at some cycle
+ * @param t The timer
+ * @param free Whether it reloads from the latches on underflow
+ * @param now The cycle
+ * @return the counter
+ * */
+static uint16_t counter(const struct via_timer* t, int free, uint64_t now) {
+  // a history rewind may take the clock back past the load
+  uint64_t elapsed = now > t->base ? now - t->base : 0;
+
+  if (!free || elapsed <= t->value) return (uint16_t)(t->value - elapsed);
+
+  // 0xFFFF for a cycle on underflow, then the latch again
+  uint64_t phase = (elapsed - t->value - 1) % ((uint64_t)t->latch + 2);
+  return phase == 0 ? 0xFFFF : (uint16_t)(t->latch - (phase - 1));
+}
+
+/**
+ * load: Start a timer counting down from a value
+ * @param t The timer
+ * @param value The value
+ * @param now The cycle it is loaded at
+ * @return void
+ * */
+static void load(struct via_timer* t, uint16_t value, uint64_t now) {
+  t->value = value;
+  t->base = now;
+  t->next = now + value + 1;
+}
+
+/**
+ * rebase: Reload a timer with the value it has now, so that its mode or
+ * its latches can change from now on without changing its past
+ * @param t The timer
+ * @param free Whether it reloads from the latches, up to now
+ * @param now The cycle
+ * @return void
+ * */
+static void rebase(struct via_timer* t, int free, uint64_t now) {
+  // sync() left the next underflow of an armed timer after now
+  load(t, t->armed ? (uint16_t)(t->next - now - 1) : counter(t, free, now),
+       now);
+}
+
+/**
+ * sync: Set the flags of the underflows that happened up to now
+ * @param m The machine
+ * @param v The VIA
+ * @return void
+ * */
+static void sync(struct machine* m, struct via* v) {
+  uint64_t now = m->clock.cycles;
+
+  if (v->t1.armed && now >= v->t1.next) {
+    v->ifr |= VIA_IRQ_T1;
+    if (v->acr & VIA_ACR_T1_FREE) {
+      uint64_t period = (uint64_t)v->t1.latch + 2;
+      v->t1.next += ((now - v->t1.next) / period + 1) * period;
+    } else {
+      v->t1.armed = 0;
+    }
+  }
+
+  if (v->t2.armed && now >= v->t2.next) {
+    v->ifr |= VIA_IRQ_T2;
+    v->t2.armed = 0;
+  }
+}
+
+/**
+ * schedule: Have the scheduler fire on a timer's next underflow if it can
+ * raise an interrupt: armed, enabled in IER and its flag clear
+ * @param m The machine
+ * @param v The VIA
+ * @param t The timer
+ * @param bit Its IFR and IER bit
+ * @return void
+ * */
+static void schedule(struct machine* m, struct via* v, struct via_timer* t,
+                     uint8_t bit) {
+  if (t->armed && (v->ier & bit) && !(v->ifr & bit)) {
+    if (!sched_pending(&t->underflow) || t->underflow.when != t->next) {
+      sched_at(m, &t->underflow, t->next);
+    }
+  } else {
+    sched_cancel(m, &t->underflow);
+  }
+}
+
+/**
+ * update: Drive the IRQ line from IFR and IER and reschedule the timers,
+ * after anything that may have changed them
+ * @param m The machine
+ * @param v The VIA
+ * @return void
+ * */
+static void update(struct machine* m, struct via* v) {
+  machine_irq(m, MACHINE_IRQ_VIA, (v->ifr & v->ier & 0x7F) != 0);
+  schedule(m, v, &v->t1, VIA_IRQ_T1);
+  schedule(m, v, &v->t2, VIA_IRQ_T2);
+}
+
+// underflow: The event of both timers
+static void underflow(struct machine* m, struct sched_event* ev) {
+  struct via* v = ev->ctx;
+
+  sync(m, v);
+  update(m, v);
+}
+
+static uint8_t port(uint8_t out, uint8_t ddr) {
+  return (out & ddr) | (uint8_t)~ddr;
+}
+
+static uint8_t via_read(struct machine* m, uint16_t addr, void* ctx) {
+  struct via* v = ctx;
+  uint64_t now = m->clock.cycles;
+  uint8_t data = 0;
+
+  sync(m, v);
+
+  switch (addr & 0x0F) {
+  case VIA_ORB: data = port(v->orb, v->ddrb); break;
+  case VIA_ORA:
+  case VIA_ORA_NH: data = port(v->ora, v->ddra); break;
+  case VIA_DDRB: data = v->ddrb; break;
+  case VIA_DDRA: data = v->ddra; break;
+  case VIA_T1CL:
+    data = counter(&v->t1, v->acr & VIA_ACR_T1_FREE, now) & 0xFF;
+    v->ifr &= ~VIA_IRQ_T1;
+    break;
+  case VIA_T1CH:
+    data = counter(&v->t1, v->acr & VIA_ACR_T1_FREE, now) >> 8;
+    break;
+  case VIA_T1LL: data = v->t1.latch & 0xFF; break;
+  case VIA_T1LH: data = v->t1.latch >> 8; break;
+  case VIA_T2CL:
+    data = counter(&v->t2, 0, now) & 0xFF;
+    v->ifr &= ~VIA_IRQ_T2;
+    break;
+  case VIA_T2CH: data = counter(&v->t2, 0, now) >> 8; break;
+  case VIA_SR: data = v->sr; break;
+  case VIA_ACR: data = v->acr; break;
+  case VIA_PCR: data = v->pcr; break;
+  case VIA_IFR:
+    data = v->ifr | ((v->ifr & v->ier & 0x7F) ? VIA_IRQ_ANY : 0);
+    break;
+  case VIA_IER: data = v->ier | 0x80; break;
+  }
+
+  update(m, v);
+  return data;
+}
+
+static void via_write(struct machine* m, uint16_t addr, uint8_t data,
+                      void* ctx) {
+  struct via* v = ctx;
+  uint64_t now = m->clock.cycles;
+  int free = v->acr & VIA_ACR_T1_FREE;
+
+  sync(m, v);
+
+  switch (addr & 0x0F) {
+  case VIA_ORB: v->orb = data; break;
+  case VIA_ORA:
+  case VIA_ORA_NH: v->ora = data; break;
+  case VIA_DDRB: v->ddrb = data; break;
+  case VIA_DDRA: v->ddra = data; break;
+  case VIA_T1CL:
+  case VIA_T1LL:
+    rebase(&v->t1, free, now);
+    v->t1.latch = (v->t1.latch & 0xFF00) | data;
+    break;
+  case VIA_T1CH:
+    v->t1.latch = (v->t1.latch & 0x00FF) | (uint16_t)(data << 8);
+    load(&v->t1, v->t1.latch, now);
+    v->t1.armed = 1;
+    v->ifr &= ~VIA_IRQ_T1;
+    break;
+  case VIA_T1LH:
+    rebase(&v->t1, free, now);
+    v->t1.latch = (v->t1.latch & 0x00FF) | (uint16_t)(data << 8);
+    v->ifr &= ~VIA_IRQ_T1;
+    break;
+  case VIA_T2CL:
+    v->t2.latch = (v->t2.latch & 0xFF00) | data;
+    break;
+  case VIA_T2CH:
+    load(&v->t2, (uint16_t)((data << 8) | (v->t2.latch & 0xFF)), now);
+    v->t2.armed = !(v->acr & VIA_ACR_T2_COUNT);
+    v->ifr &= ~VIA_IRQ_T2;
+    break;
+  case VIA_SR: v->sr = data; break;
+  case VIA_ACR:
+    rebase(&v->t1, free, now);
+    if (!(v->acr & VIA_ACR_T2_COUNT)) rebase(&v->t2, 0, now);
+    v->acr = data;
+    if (v->acr & VIA_ACR_T1_FREE) v->t1.armed = 1;
+    // no pulse to count, the counter holds
+    if (v->acr & VIA_ACR_T2_COUNT) v->t2.armed = 0;
+    break;
+  case VIA_PCR: v->pcr = data; break;
+  case VIA_IFR: v->ifr &= ~(data & 0x7F); break;
+  case VIA_IER:
+    if (data & 0x80) {
+      v->ier |= data & 0x7F;
+    } else {
+      v->ier &= ~data;
+    }
+    break;
+  }
+
+  update(m, v);
+}
+
+/**
+ * via_reset: Clear the registers, as the RES pin does, the timers stop
+ * setting flags and the IRQ line is released
+ * @param m The machine
+ * @param v The VIA
+ * @return void
+ * */
+void via_reset(struct machine* m, struct via* v) {
+  v->orb = v->ora = v->ddrb = v->ddra = 0;
+  v->sr = v->acr = v->pcr = 0;
+  v->ifr = v->ier = 0;
+  v->t1.armed = 0;
+  v->t2.armed = 0;
+
+  update(m, v);
+}
+
+static void put16(uint8_t* p, uint16_t v) {
+  p[0] = v & 0xFF;
+  p[1] = v >> 8;
+}
+
+static void put64(uint8_t* p, uint64_t v) {
+  for (int i = 0; i < 8; i++) p[i] = (uint8_t)(v >> (8 * i));
+}
+
+static uint16_t get16(const uint8_t* p) {
+  return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint64_t get64(const uint8_t* p) {
+  uint64_t v = 0;
+
+  for (int i = 7; i >= 0; i--) v = (v << 8) | p[i];
+  return v;
+}
+
+/**
+ * save_timer: Write a timer relative to the clock, see VIA_STATE_SIZE
+ * @param t The timer, synced
+ * @param now The machine clock
+ * @param p Where to write its 21 bytes
+ * @return void
+ * */
+static void save_timer(const struct via_timer* t, uint64_t now, uint8_t* p) {
+  put16(p, t->value);
+  put16(p + 2, t->latch);
+  p[4] = t->armed;
+  put64(p + 5, now > t->base ? now - t->base : 0);
+  // sync() left the next underflow of an armed timer after now
+  put64(p + 13, t->armed ? t->next - now : 0);
+}
+
+static void load_timer(struct via_timer* t, uint64_t now, const uint8_t* p) {
+  uint64_t elapsed = get64(p + 5);
+
+  t->value = get16(p);
+  t->latch = get16(p + 2);
+  t->armed = p[4] != 0;
+  t->base = now > elapsed ? now - elapsed : 0;
+  t->next = now + get64(p + 13);
+}
+
+/**
+ * via_save: The state of a VIA for snapshots and the history, see
+ * VIA_STATE_SIZE. The flags of the underflows up to now are brought up to
+ * date in the copy, not in the VIA
+ * @param m The machine
+ * @param ctx The VIA
+ * @param kind Snapshot or checkpoint, the same state
+ * @param state Where to write it, NULL for its size only
+ * @return the size of the state
+ * */
+static uint32_t via_save(struct machine* m, void* ctx, enum machine_state kind,
+                         uint8_t* state) {
+  struct via v = *(struct via*)ctx;
+  uint64_t now = m->clock.cycles;
+
+  (void)kind;
+  if (state == NULL) return VIA_STATE_SIZE;
+
+  sync(m, &v);
+  state[0] = v.page;
+  state[1] = v.orb;
+  state[2] = v.ora;
+  state[3] = v.ddrb;
+  state[4] = v.ddra;
+  state[5] = v.sr;
+  state[6] = v.acr;
+  state[7] = v.pcr;
+  state[8] = v.ifr;
+  state[9] = v.ier;
+  save_timer(&v.t1, now, state + 10);
+  save_timer(&v.t2, now, state + 31);
+  return VIA_STATE_SIZE;
+}
+
+/**
+ * via_load: Bring a VIA back to a state of via_save(), its timers counting
+ * from the restored clock and their underflows scheduled again, or reset
+ * it for a snapshot without one
+ * @param m The machine, its clock restored
+ * @param ctx The VIA
+ * @param kind Snapshot or checkpoint, the same state
+ * @param state The state, NULL to reset
+ * @param size Its size, at least VIA_STATE_SIZE
+ * @return void
+ * */
+static void via_load(struct machine* m, void* ctx, enum machine_state kind,
+                     const uint8_t* state, uint32_t size) {
+  struct via* v = ctx;
+  uint64_t now = m->clock.cycles;
+
+  (void)kind;
+  (void)size;
+
+  if (state == NULL) {
+    load(&v->t1, 0xFFFF, now);
+    load(&v->t2, 0xFFFF, now);
+    via_reset(m, v);
+    return;
+  }
+
+  v->orb = state[1];
+  v->ora = state[2];
+  v->ddrb = state[3];
+  v->ddra = state[4];
+  v->sr = state[5];
+  v->acr = state[6];
+  v->pcr = state[7];
+  v->ifr = state[8] & 0x7F;
+  v->ier = state[9] & 0x7F;
+  load_timer(&v->t1, now, state + 10);
+  load_timer(&v->t2, now, state + 31);
+
+  update(m, v);
+}
+
+/**
+ * via_attach: Map a VIA on a page and reset it, the page's memory is
+ * hidden while it is mapped. Snapshots and the history keep its state
+ * from then on
+ * @param m The machine
+ * @param v The VIA
+ * @param page The page its registers are on
+ * @return 0 if success, 1 if too many devices are attached
+ * */
+int via_attach(struct machine* m, struct via* v, uint8_t page) {
+  struct machine_device device = {VIA_STATE_TAG, page, VIA_STATE_SIZE,
+                                  via_save, via_load, v};
+
+  memset(v, 0, sizeof(*v));
+  v->page = page;
+  sched_event_init(&v->t1.underflow, underflow, v);
+  sched_event_init(&v->t2.underflow, underflow, v);
+  load(&v->t1, 0xFFFF, m->clock.cycles);
+  load(&v->t2, 0xFFFF, m->clock.cycles);
+
+  if (machine_attach(m, &device)) return 1;
+  mem_map_io(m, page, page, via_read, via_write, v);
+  via_reset(m, v);
+  return 0;
+}
+
@@ -0,0 +1,106 @@
+#ifndef INC_6502_VIA_H
+#define INC_6502_VIA_H
+
+#include <stdint.h>
+
+#include "../machine/sched.h"
+
+/*
+ * 6522 VIA, the timers and the interrupt logic.
+ *
+ * The 16 registers sit on one I/O page, mirrored every 16 bytes, and are
+ * reached through the bus like memory. The timers aren't ticked: each one
+ * keeps the value it was loaded with and the clock cycle it was loaded
+ * at, a read computes the counter from the cycles elapsed since, and the
+ * underflow that sets its flag is an event of the scheduler, see
+ * src/machine/sched.h. An event is only scheduled while the flag is clear
+ * and enabled in IER, so while no interrupt can come out of a timer the
+ * flags are brought up to date on the next register access instead, and
+ * the VIA costs nothing between two accesses.
+ *
+ * Timer 1 counts down from what was written to T1C-H (with T1C-L's latch)
+ * and sets IFR bit 6 when it passes 0. In one-shot mode (ACR bit 6 clear)
+ * that happens once per write and the counter goes on down from 0xFFFF;
+ * in free-run mode it reloads from the latches every latch + 2 cycles.
+ * Timer 2 is one-shot only and sets IFR bit 5; in pulse counting mode
+ * (ACR bit 5) it doesn't count, there is no PB6 pin to count pulses of.
+ * Reading the low counter or writing the high one clears the flag, as do
+ * writing 1s to IFR and, for timer 1, writing T1L-H.
+ *
+ * IRQ is IFR bit 7: any flag enabled in IER. The ports, the shift
+ * register and PCR are plain registers, no pins are wired: a port reads
+ * its output bits back and its input bits as 1.
+ *
+ * A timer counts from the cycle the instruction that wrote it started
+ * at, which is what m->clock.cycles is during an I/O access. cpu_reset()
+ * leaves the VIA alone, as with a RES pin not wired to the CPU's.
+ *
+ * Snapshots and history checkpoints keep its state, the "VIA " chunk of
+ * VIA_STATE_SIZE bytes: the page, ORB, ORA, DDRB, DDRA, SR, ACR, PCR,
+ * IFR and IER, then for timer 1 and timer 2 the value it was loaded with
+ * (u16), its latch (u16), whether it is armed (u8), the cycles since it
+ * was loaded and those to its next underflow (u64 each). The last two
+ * count from the clock, a restored timer is rebased on it.
+ */
+
+// registers, by the low 4 bits of the address
+#define VIA_ORB 0x0
+#define VIA_ORA 0x1
+#define VIA_DDRB 0x2
+#define VIA_DDRA 0x3
+#define VIA_T1CL 0x4
+#define VIA_T1CH 0x5
+#define VIA_T1LL 0x6
+#define VIA_T1LH 0x7
+#define VIA_T2CL 0x8
+#define VIA_T2CH 0x9
+#define VIA_SR 0xA
+#define VIA_ACR 0xB
+#define VIA_PCR 0xC
+#define VIA_IFR 0xD
+#define VIA_IER 0xE
+#define VIA_ORA_NH 0xF
+
+// IFR and IER bits
+#define VIA_IRQ_T2 0x20
+#define VIA_IRQ_T1 0x40
+#define VIA_IRQ_ANY 0x80
+
+#define VIA_STATE_TAG "VIA "
+#define VIA_STATE_SIZE 52
+
+// ACR bits
+#define VIA_ACR_T2_COUNT 0x20
+#define VIA_ACR_T1_FREE 0x40
+
+struct machine;
+
+struct via_timer {
+  // counter value at the cycle it was loaded at
+  uint16_t value;
+  uint64_t base;
+
+  uint16_t latch;
+
+  // whether an underflow sets the flag, and the cycle of the next one
+  uint8_t armed;
+  uint64_t next;
+
+  struct sched_event underflow;
+};
+
+struct via {
+  uint8_t page;
+
+  uint8_t orb, ora, ddrb, ddra;
+  uint8_t sr, acr, pcr;
+  uint8_t ifr, ier;
+
+  struct via_timer t1;
+  struct via_timer t2;
+};
+
+int via_attach(struct machine* m, struct via* v, uint8_t page);
+void via_reset(struct machine* m, struct via* v);
+
+#endif
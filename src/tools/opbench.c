@@ -0,0 +1,316 @@
+/*
+ * opbench: host cost of every documented opcode, one CSV row each:
+ *
+ *   opcode,name,mode,cycles,ns_median,ns_p99,ns_min
+ *   0x6D,ADC,ABS,4.00,9.812,10.544,9.701
+ *
+ * Every opcode runs alone in a synthetic stream: the instruction unrolled
+ * STREAM times at $8000 and a JMP back, with operands and memory set up so
+ * that it never leaves the stream (see build()). After a warm-up run,
+ * which also lets the JIT translate the stream, the stream is timed in
+ * repeated trials of a fixed number of instructions through cpu_run(), so
+ * whatever core is built in and selected with --core gets measured. cycles
+ * is the average the core counted, branches are always taken and indexed
+ * modes never cross a page. The JMP back, and the PLA that realigns the
+ * stack of RTI, are counted in.
+ *
+ * usage: opbench.out [--core interp|blocks|jit] [--insts N] [--trials N]
+ *                    [--warmup N] [--only ADC,IZY,0x6C...]
+ *
+ * Build with make CORE=fused -B bin/opbench.out for the fused core.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../cpu/cpu.h"
+#include "../cpu/opcodes.h"
+#include "../jit/jit.h"
+#include "../machine/machine.h"
+
+enum mode { IMP, IMM, ZP0, ZPX, ZPY, REL, ABS, ABX, ABY, IND, IZX, IZY };
+
+static const char* const modes[] = {"IMP", "IMM", "ZP0", "ZPX", "ZPY", "REL",
+                                    "ABS", "ABX", "ABY", "IND", "IZX", "IZY"};
+
+static const uint8_t lengths[] = {1, 2, 2, 2, 2, 2, 3, 3, 3, 3, 2, 2};
+
+struct opcode {
+  const char* name;
+  enum mode mode;
+};
+
+static const struct opcode opcodes[256] = {
+#define X(opcode, name, operation, mode, cycles) [opcode] = {name, mode},
+  OPCODES(X)
+#undef X
+};
+
+// instructions per stream, fewer for the ones that need a table each
+#define STREAM 1024
+#define STREAM_IND 256
+#define STREAM_RTS 128
+#define STREAM_RTI 85
+
+#define START 0x8000
+#define DATA 0x0300   // what the memory operands point to
+#define POINTER 0xF0  // zero page pointer to DATA, for IZX and IZY
+#define TARGETS 0x0400 // pointers of JMP (ind), one per instruction
+#define INDEX 0x10    // X and Y
+
+// the 151 documented opcodes, 0xDA and 0xFA are NOPs of other CPUs
+static int documented(unsigned op) {
+  return strcmp(opcodes[op].name, "???") != 0 &&
+         (strcmp(opcodes[op].name, "NOP") != 0 || op == 0xEA);
+}
+
+static struct machine machine;
+
+static void put16(struct machine* m, uint16_t addr, uint16_t v) {
+  machine_write(m, addr, v & 0xFF);
+  machine_write(m, addr + 1, v >> 8);
+}
+
+/**
+ * build: Reset the machine into a stream of one opcode at START:
+ *
+ * - memory operands point to DATA: ZP0/ZPX/ZPY use $20 (+ X or Y), ABS,
+ *   ABX and ABY $0300, IZX ($E0,X) and IZY ($F0),Y the pointer at $F0
+ * - JMP and JSR go to the next instruction, JMP (ind) through a pointer
+ *   of its own, branches jump 0 bytes with the flags set to take them
+ * - RTS and RTI return to the next instruction from a stack page filled
+ *   with return addresses, 128 RTS (or 85 RTI and a PLA) pop it whole
+ * - BRK is alone, its vector points back to it
+ *
+ * @param m The machine
+ * @param op The opcode
+ * @return void
+ * */
+static void build(struct machine* m, uint8_t op) {
+  const struct opcode* o = &opcodes[op];
+  unsigned count = STREAM;
+  uint16_t pc = START;
+
+  machine_reset(m);
+
+  if (o->mode == IND) count = STREAM_IND;
+  if (strcmp(o->name, "RTS") == 0) count = STREAM_RTS;
+  if (strcmp(o->name, "RTI") == 0) count = STREAM_RTI;
+  if (strcmp(o->name, "BRK") == 0) count = 1;
+
+  put16(m, POINTER, DATA);
+  put16(m, 0xFFFE, START);
+
+  for (unsigned i = 0; i < count; i++) {
+    uint16_t next = pc + lengths[o->mode];
+    uint16_t operand = 0;
+
+    switch (o->mode) {
+    case IMM:
+      operand = 0x01;
+      break;
+    case ZP0:
+    case ZPX:
+    case ZPY:
+      operand = 0x20;
+      break;
+    case REL:
+      operand = 0x00;
+      break;
+    case ABS:
+      operand = strcmp(o->name, "JMP") == 0 || strcmp(o->name, "JSR") == 0
+                    ? next
+                    : DATA;
+      break;
+    case ABX:
+    case ABY:
+      operand = DATA;
+      break;
+    case IND:
+      operand = TARGETS + 2 * i;
+      put16(m, operand, next);
+      break;
+    case IZX:
+      operand = POINTER - INDEX;
+      break;
+    case IZY:
+      operand = POINTER;
+      break;
+    default:
+      break;
+    }
+
+    if (strcmp(o->name, "RTS") == 0) {
+      put16(m, 0x0100 + 2 * i, pc);
+    } else if (strcmp(o->name, "RTI") == 0) {
+      machine_write(m, 0x0100 + 3 * i, 0x00);
+      put16(m, 0x0100 + 3 * i + 1, next);
+    }
+
+    machine_write(m, pc, op);
+    if (lengths[o->mode] == 2) machine_write(m, pc + 1, operand & 0xFF);
+    if (lengths[o->mode] == 3) put16(m, pc + 1, operand);
+    pc = next;
+  }
+
+  if (strcmp(o->name, "RTI") == 0) machine_write(m, pc++, 0x68); // PLA
+  machine_write(m, pc, 0x4C); // JMP START
+  put16(m, pc + 1, START);
+
+  m->cpu.pc = START;
+  m->cpu.sp = 0xFF;
+  m->cpu.ac = 0x01;
+  m->cpu.x = INDEX;
+  m->cpu.y = INDEX;
+  // bit 5 of a branch is the value of the flag it tests
+  cpu_sr_unpack(&m->cpu, o->mode == REL && (op & 0x20) ? 0xC3 : 0x00);
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static int compare_double(const void* a, const void* b) {
+  double x = *(const double*)a;
+  double y = *(const double*)b;
+  return x < y ? -1 : x > y;
+}
+
+// selected: whether --only lets an opcode through, by name, mode or value
+static int selected(const char* only, unsigned op) {
+  char list[256];
+
+  if (only == NULL) return 1;
+
+  snprintf(list, sizeof(list), "%s", only);
+  for (char* w = strtok(list, ","); w != NULL; w = strtok(NULL, ",")) {
+    if (strcmp(w, opcodes[op].name) == 0 ||
+        strcmp(w, modes[opcodes[op].mode]) == 0 ||
+        ((w[0] == '0' && (w[1] == 'x' || w[1] == 'X')) &&
+         strtoul(w, NULL, 16) == op)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int parse_count(const char* arg, uint64_t* out) {
+  char* endptr;
+  errno = 0;
+  unsigned long long val = strtoull(arg, &endptr, 10);
+
+  if (errno != 0 || *endptr != '\0' || arg[0] == '-' || val == 0) return 1;
+
+  *out = (uint64_t)val;
+  return 0;
+}
+
+static void print_usage(const char* prog_name) {
+  fprintf(stderr, "Usage: %s [--core interp|blocks|jit] [--insts N] [--trials N] [--warmup N] [--only ADC,IZY,0x6C...]\n", prog_name);
+}
+
+int main(int argc, char* argv[]) {
+  const char* core = "blocks";
+  const char* only = NULL;
+  uint64_t insts = 100000;
+  uint64_t trials = 31;
+  uint64_t warmup = 0;
+  int opt;
+
+  struct option long_options[] = {
+    {"core", required_argument, 0, 'c'},
+    {"insts", required_argument, 0, 'n'},
+    {"trials", required_argument, 0, 't'},
+    {"warmup", required_argument, 0, 'w'},
+    {"only", required_argument, 0, 'o'},
+    {0, 0, 0, 0}
+  };
+
+  while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+    switch (opt) {
+    case 'c':
+      core = optarg;
+      break;
+    case 'n':
+    case 't':
+    case 'w':
+      if (parse_count(optarg, opt == 'n' ? &insts : opt == 't' ? &trials : &warmup)) {
+        fprintf(stderr, "Error: Expected a positive count, got '%s'\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'o':
+      only = optarg;
+      break;
+    default:
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  // by default as long as a trial
+  if (warmup == 0) warmup = insts;
+
+  machine_init(&machine);
+  if (strcmp(core, "interp") == 0) {
+    machine.blocks.enabled = 0;
+  } else if (strcmp(core, "jit") == 0) {
+    if (jit_enable(&machine)) {
+      fprintf(stderr, "Error: No JIT on this host, it needs Linux on x86-64\n");
+      return EXIT_FAILURE;
+    }
+  } else if (strcmp(core, "blocks") != 0) {
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  double* ns = malloc(trials * sizeof(*ns));
+  if (ns == NULL) {
+    perror("Memory allocation failed");
+    return EXIT_FAILURE;
+  }
+
+  printf("opcode,name,mode,cycles,ns_median,ns_p99,ns_min\n");
+
+  for (unsigned op = 0; op < 256; op++) {
+    if (!documented(op) || !selected(only, op)) continue;
+
+    struct cpu_limits limits = {0};
+    struct cpu_counters counters = {0, 0};
+    uint64_t cycles = 0;
+
+    build(&machine, (uint8_t)op);
+
+    limits.max_instructions = warmup;
+    cpu_run(&machine, &limits, &counters);
+
+    limits.max_instructions = insts;
+    for (uint64_t t = 0; t < trials; t++) {
+      counters = (struct cpu_counters){0, 0};
+      double start = now();
+      cpu_run(&machine, &limits, &counters);
+      ns[t] = (now() - start) * 1e9 / (double)counters.instructions;
+      cycles += counters.cycles;
+    }
+
+    qsort(ns, trials, sizeof(*ns), compare_double);
+    // nearest rank
+    uint64_t p99 = (99 * trials + 99) / 100 - 1;
+    double median = trials % 2 ? ns[trials / 2]
+                               : (ns[trials / 2 - 1] + ns[trials / 2]) / 2;
+
+    printf("0x%02X,%s,%s,%.2f,%.3f,%.3f,%.3f\n", op, opcodes[op].name,
+           modes[opcodes[op].mode], (double)cycles / (double)(insts * trials),
+           median, ns[p99], ns[0]);
+  }
+
+  free(ns);
+  jit_disable(&machine);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,282 @@
+/*
+ * trace-dump: decode a binary trace recorded with --trace-bin into one line
+ * per instruction, see src/utils/tracebin.h for the format:
+ *
+ *   #index pc: bytes  disassembly  registers before it [writes]
+ *
+ *   #5 8009: 9D 00 04  STA $0400,X   A=00 X=00 Y=00 SP=FF SR=02 [0400]=00
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../cpu/opcodes.h"
+#include "../utils/tracebin.h"
+
+enum mode { IMP, IMM, ZP0, ZPX, ZPY, REL, IZX, IZY, ABS, ABX, ABY, IND };
+
+struct opcode {
+  const char* name;
+  enum mode mode;
+  uint8_t length;
+};
+
+static const struct opcode opcodes[256] = {
+#define X(opcode, name, operation, mode, cycles) \
+  [opcode] = {name, mode, TRACEBIN_LEN_##mode},
+  OPCODES(X)
+#undef X
+};
+
+// what the records of a chunk are decoded against
+struct state {
+  uint16_t pc;
+  uint16_t next_pc;
+  uint8_t regs[5];
+  uint16_t last_write;
+  uint64_t index;
+};
+
+// a chunk being decoded
+struct reader {
+  const uint8_t* at;
+  const uint8_t* end;
+  int error;
+};
+
+static uint8_t get8(struct reader* r) {
+  if (r->at >= r->end) {
+    r->error = 1;
+    return 0;
+  }
+  return *r->at++;
+}
+
+static uint64_t get_varint(struct reader* r) {
+  uint64_t v = 0;
+
+  for (unsigned shift = 0; shift < 64; shift += 7) {
+    uint8_t byte = get8(r);
+    v |= (uint64_t)(byte & 0x7F) << shift;
+    if (!(byte & 0x80)) return v;
+  }
+  r->error = 1;
+  return 0;
+}
+
+static int32_t unzigzag(uint64_t v) {
+  return (v & 1) ? -(int32_t)(v >> 1) - 1 : (int32_t)(v >> 1);
+}
+
+static uint32_t get32(const uint8_t* p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/**
+ * disassemble: An instruction in assembler syntax
+ * @param out Where to write it
+ * @param size Size of out
+ * @param pc Where the instruction is
+ * @param bytes The opcode and its operand bytes
+ * @return void
+ * */
+static void disassemble(char* out, size_t size, uint16_t pc,
+                        const uint8_t* bytes) {
+  const struct opcode* op = &opcodes[bytes[0]];
+  uint16_t word = bytes[1] | (bytes[2] << 8);
+
+  switch (op->mode) {
+  case IMP: snprintf(out, size, "%s", op->name); break;
+  case IMM: snprintf(out, size, "%s #$%02X", op->name, bytes[1]); break;
+  case ZP0: snprintf(out, size, "%s $%02X", op->name, bytes[1]); break;
+  case ZPX: snprintf(out, size, "%s $%02X,X", op->name, bytes[1]); break;
+  case ZPY: snprintf(out, size, "%s $%02X,Y", op->name, bytes[1]); break;
+  case REL:
+    snprintf(out, size, "%s $%04X", op->name,
+             (uint16_t)(pc + 2 + (int8_t)bytes[1]));
+    break;
+  case IZX: snprintf(out, size, "%s ($%02X,X)", op->name, bytes[1]); break;
+  case IZY: snprintf(out, size, "%s ($%02X),Y", op->name, bytes[1]); break;
+  case ABS: snprintf(out, size, "%s $%04X", op->name, word); break;
+  case ABX: snprintf(out, size, "%s $%04X,X", op->name, word); break;
+  case ABY: snprintf(out, size, "%s $%04X,Y", op->name, word); break;
+  case IND: snprintf(out, size, "%s ($%04X)", op->name, word); break;
+  }
+}
+
+/**
+ * dump_chunk: Decode and print the records of a chunk
+ * @param r The chunk
+ * @param s The decoding state
+ * @param from First index to print
+ * @param count Records left to print, updated
+ * @return 0 if success, 1 if the chunk is corrupted
+ * */
+static int dump_chunk(struct reader* r, struct state* s, uint64_t from,
+                      uint64_t* count) {
+  int first = 1;
+
+  while (r->at < r->end && *count > 0) {
+    uint8_t header = get8(r);
+    uint8_t bytes[3] = {0, 0, 0};
+    uint16_t write_addr[TRACEBIN_MAX_WRITES];
+    uint8_t write_data[TRACEBIN_MAX_WRITES];
+    unsigned writes = 0;
+
+    if (first && !(header & TRACEBIN_SYNC)) return 1;
+    first = 0;
+
+    if (header & TRACEBIN_SYNC) {
+      s->pc = get8(r);
+      s->pc |= get8(r) << 8;
+      s->index = get_varint(r);
+      s->last_write = 0;
+    } else if (header & TRACEBIN_JUMP) {
+      s->pc = (uint16_t)(s->next_pc + unzigzag(get_varint(r)));
+    } else {
+      s->pc = s->next_pc;
+    }
+
+    bytes[0] = get8(r);
+    for (unsigned i = 1; i < opcodes[bytes[0]].length; i++) bytes[i] = get8(r);
+
+    for (unsigned i = 0; i < 5; i++) {
+      if (header & (1 << i)) s->regs[i] = get8(r);
+    }
+
+    if (header & TRACEBIN_WRITES) {
+      writes = get8(r);
+      if (writes > TRACEBIN_MAX_WRITES) return 1;
+      for (unsigned i = 0; i < writes; i++) {
+        s->last_write = (uint16_t)(s->last_write + unzigzag(get_varint(r)));
+        write_addr[i] = s->last_write;
+        write_data[i] = get8(r);
+      }
+    }
+
+    if (r->error) return 1;
+
+    if (s->index >= from) {
+      char text[32];
+      char hex[12];
+      unsigned length = opcodes[bytes[0]].length;
+
+      disassemble(text, sizeof(text), s->pc, bytes);
+      snprintf(hex, sizeof(hex), "%02X", bytes[0]);
+      for (unsigned i = 1; i < length; i++) {
+        snprintf(hex + 3 * i - 1, sizeof(hex) - (3 * i - 1), " %02X", bytes[i]);
+      }
+
+      printf("#%llu %04X: %-9s %-13s A=%02X X=%02X Y=%02X SP=%02X SR=%02X",
+             (unsigned long long)s->index, s->pc, hex, text, s->regs[0],
+             s->regs[1], s->regs[2], s->regs[3], s->regs[4]);
+      for (unsigned i = 0; i < writes; i++) {
+        printf(" [%04X]=%02X", write_addr[i], write_data[i]);
+      }
+      printf("\n");
+      (*count)--;
+    }
+
+    s->next_pc = (uint16_t)(s->pc + opcodes[bytes[0]].length);
+    s->index++;
+  }
+
+  return 0;
+}
+
+// parse a decimal count such as --count 1000
+static int parse_count(const char* arg, uint64_t* out) {
+  char* endptr;
+  errno = 0;
+  unsigned long long val = strtoull(arg, &endptr, 10);
+
+  if (errno != 0 || *endptr != '\0' || arg[0] == '-') return 1;
+
+  *out = (uint64_t)val;
+  return 0;
+}
+
+static void print_usage(const char* prog_name) {
+  fprintf(stderr, "Usage: %s [--from N] [--count N] <trace>\n", prog_name);
+  fprintf(stderr, "       --from N: start at the instruction of index N\n");
+  fprintf(stderr, "       --count N: print at most N instructions\n");
+}
+
+int main(int argc, char* argv[]) {
+  uint64_t from = 0;
+  uint64_t count = UINT64_MAX;
+  int opt;
+
+  struct option long_options[] = {
+    {"from", required_argument, 0, 'f'},
+    {"count", required_argument, 0, 'n'},
+    {0, 0, 0, 0}
+  };
+
+  while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+    uint64_t* out = opt == 'f' ? &from : &count;
+
+    if ((opt != 'f' && opt != 'n') || parse_count(optarg, out)) {
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (optind != argc - 1) {
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  const char* path = argv[optind];
+  FILE* fp = fopen(path, "rb");
+  if (fp == NULL) {
+    fprintf(stderr, "[FAILED] Error while opening trace '%s'.\n", path);
+    return EXIT_FAILURE;
+  }
+
+  uint8_t header[12];
+  if (fread(header, 1, sizeof(header), fp) != sizeof(header) ||
+      memcmp(header, TRACEBIN_MAGIC, 8) != 0) {
+    fprintf(stderr, "[FAILED] '%s' is not a trace.\n", path);
+    fclose(fp);
+    return EXIT_FAILURE;
+  }
+  if (get32(header + 8) > TRACEBIN_VERSION) {
+    fprintf(stderr, "[FAILED] '%s' was made by a newer version.\n", path);
+    fclose(fp);
+    return EXIT_FAILURE;
+  }
+
+  uint8_t* chunk = malloc(TRACEBIN_CHUNK_SIZE);
+  struct state state;
+  int status = EXIT_SUCCESS;
+
+  memset(&state, 0, sizeof(state));
+
+  while (chunk != NULL && count > 0) {
+    uint8_t size[4];
+    size_t got = fread(size, 1, sizeof(size), fp);
+
+    if (got == 0) break;
+
+    uint32_t length = got == sizeof(size) ? get32(size) : UINT32_MAX;
+    struct reader r = {chunk, chunk + length, 0};
+
+    if (length > TRACEBIN_CHUNK_SIZE || fread(chunk, 1, length, fp) != length ||
+        dump_chunk(&r, &state, from, &count)) {
+      fprintf(stderr, "[FAILED] Trace '%s' is truncated or corrupted.\n", path);
+      status = EXIT_FAILURE;
+      break;
+    }
+  }
+
+  if (chunk == NULL) status = EXIT_FAILURE;
+
+  free(chunk);
+  fclose(fp);
+  return status;
+}
@@ -1,12 +1,13 @@
 #ifndef UTILS_H
 #define UTILS_H
 
-#define debug_print(fmt, ...)                         \
-    do {                                              \
-        if (DEBUG) fprintf(stderr, fmt, __VA_ARGS__); \
-    } while (0)
-
-extern uint8_t DEBUG;
+// the fused core wants every addressing mode and operation inlined in its
+// switch, whatever the size heuristics of the compiler say
+#if defined(FUSED_CORE) && defined(__GNUC__)
+#define CORE_INLINE static inline __attribute__((always_inline))
+#else
+#define CORE_INLINE static inline
+#endif
 
 #define SET_BIT(val, pos) (val |= (1U << pos))
 #define CLEAR_BIT(val, pos) (val &= (~(1U << pos)))
@@ -0,0 +1,85 @@
+#include "trace.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "../machine/machine.h"
+
+/**
+ * trace_set_hook: Install the hook receiving the trace records of a machine,
+ * all of them until trace_set_events() says otherwise
+ * @param m The machine
+ * @param hook The hook, NULL to stop tracing
+ * @param ctx Passed untouched to the hook
+ * @return 0 if success, 1 if the core was built without tracing
+ * */
+int trace_set_hook(struct machine* m, trace_hook hook, void* ctx) {
+#ifdef TRACE
+  m->trace = hook;
+  m->trace_ctx = ctx;
+  m->trace_events = TRACE_ALL_EVENTS;
+  return 0;
+#else
+  (void)m;
+  (void)hook;
+  (void)ctx;
+  return 1;
+#endif
+}
+
+/**
+ * trace_set_events: Only hand some events to the hook, the others cost a
+ * test instead of a call
+ * @param m The machine
+ * @param events TRACE_EVENT() bits of the events to receive
+ * @return void
+ * */
+void trace_set_events(struct machine* m, unsigned events) {
+#ifdef TRACE
+  m->trace_events = events;
+#else
+  (void)m;
+  (void)events;
+#endif
+}
+
+/**
+ * trace_print: Hook printing one "key=value" line per record to the FILE*
+ * given as ctx, e.g.
+ *
+ *   exec pc=0x8000 op=0xA9 a=0x00 x=0x00 y=0x00 sp=0xFF sr=0x00
+ *   read addr=0x8001 data=0x00
+ *
+ * @param m The machine
+ * @param rec The record
+ * @param ctx The FILE* to print to
+ * @return void
+ * */
+void trace_print(struct machine* m, const struct trace_record* rec, void* ctx) {
+  FILE* fp = ctx;
+
+  switch (rec->event) {
+  case TRACE_READ:
+    fprintf(fp, "read addr=0x%04X data=0x%02X\n", rec->addr, rec->data);
+    break;
+  case TRACE_WRITE:
+    fprintf(fp, "write addr=0x%04X data=0x%02X\n", rec->addr, rec->data);
+    break;
+  case TRACE_EXEC:
+    fprintf(fp,
+            "exec pc=0x%04X op=0x%02X a=0x%02X x=0x%02X y=0x%02X sp=0x%02X "
+            "sr=0x%02X\n",
+            rec->addr, rec->data, m->cpu.ac, m->cpu.x, m->cpu.y, m->cpu.sp,
+            cpu_sr_pack(&m->cpu));
+    break;
+  case TRACE_BRANCH:
+    fprintf(fp, "branch target=0x%04X\n", rec->addr);
+    break;
+  case TRACE_RESET:
+    fprintf(fp, "reset pc=0x%04X\n", rec->addr);
+    break;
+  case TRACE_IRQ:
+    fprintf(fp, "%s pc=0x%04X\n", rec->data ? "nmi" : "irq", rec->addr);
+    break;
+  }
+}
@@ -0,0 +1,59 @@
+#ifndef INC_6502_TRACE_H
+#define INC_6502_TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Structured tracing of the CPU core.
+ *
+ * Tracing is a build-time feature: the core is compiled once without it
+ * (bin/emulator.out, TRACE_EMIT() expands to nothing, the hot path pays
+ * nothing) and once with -DTRACE (bin/emulator-trace.out), where every
+ * TRACE_EMIT() hands a trace_record to the hook installed in the machine.
+ */
+
+struct machine;
+
+enum trace_event {
+  TRACE_READ,   // addr, data: byte read from memory
+  TRACE_WRITE,  // addr, data: byte written to memory
+  TRACE_EXEC,   // addr, data: PC and opcode of the instruction about to run
+  TRACE_BRANCH, // addr: target of a taken branch
+  TRACE_RESET,  // addr: PC loaded from the reset vector
+  TRACE_IRQ     // addr: PC loaded from the IRQ vector, or the NMI one if
+                // data is 1
+};
+
+// bit of an event in the mask of trace_set_events()
+#define TRACE_EVENT(ev) (1u << (ev))
+#define TRACE_ALL_EVENTS 0x3Fu
+
+struct trace_record {
+  enum trace_event event;
+  uint16_t addr;
+  uint8_t data;
+};
+
+typedef void (*trace_hook)(struct machine* m, const struct trace_record* rec,
+                           void* ctx);
+
+#ifdef TRACE
+#define TRACE_EMIT(m, ev, a, d)                                  \
+  do {                                                           \
+    if ((m)->trace && ((m)->trace_events & TRACE_EVENT(ev))) {   \
+      struct trace_record trace_rec_ = {(ev), (a), (d)};         \
+      (m)->trace((m), &trace_rec_, (m)->trace_ctx);              \
+    }                                                            \
+  } while (0)
+#else
+#define TRACE_EMIT(m, ev, a, d) \
+  do {                          \
+  } while (0)
+#endif
+
+int trace_set_hook(struct machine* m, trace_hook hook, void* ctx);
+void trace_set_events(struct machine* m, unsigned events);
+void trace_print(struct machine* m, const struct trace_record* rec, void* ctx);
+
+#endif
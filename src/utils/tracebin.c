@@ -0,0 +1,395 @@
+#include "tracebin.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../cpu/cpu.h"
+#include "../cpu/opcodes.h"
+#include "../machine/machine.h"
+#include "../mem/mem.h"
+#include "trace.h"
+
+// entries the core copies into the chunks, the first byte is the kind:
+// EXEC is PC (16 bits), opcode, the two bytes after it, A, X, Y, SP, SR;
+// WRITE is address (16 bits) and byte; RESET is padding
+#define ENTRY_EXEC 1
+#define ENTRY_WRITE 2
+#define ENTRY_RESET 3
+#define ENTRY_EXEC_SIZE 12
+#define ENTRY_SIZE 4
+
+static const uint8_t lengths[256] = {
+#define X(opcode, name, operation, mode, cycles) [opcode] = TRACEBIN_LEN_##mode,
+  OPCODES(X)
+#undef X
+};
+
+static uint8_t* put_varint(uint8_t* p, uint64_t v) {
+  while (v >= 0x80) {
+    *p++ = (uint8_t)(v | 0x80);
+    v >>= 7;
+  }
+  *p++ = (uint8_t)v;
+  return p;
+}
+
+// zigzag: small negative deltas as small unsigned ones
+static uint32_t zigzag(int32_t v) {
+  return v < 0 ? ((uint32_t)~v << 1) | 1 : (uint32_t)v << 1;
+}
+
+static void put32(uint8_t* p, uint32_t v) {
+  p[0] = v & 0xFF;
+  p[1] = (v >> 8) & 0xFF;
+  p[2] = (v >> 16) & 0xFF;
+  p[3] = v >> 24;
+}
+
+/**
+ * flush: Write the chunk of records being encoded, the next one starts
+ * with a sync record
+ * @param t The trace
+ * @return void
+ * */
+static void flush(struct tracebin* t) {
+  uint32_t size = (uint32_t)(t->out_at - t->out);
+  uint8_t header[4];
+
+  put32(header, size);
+  if (fwrite(header, 1, sizeof(header), t->fp) != sizeof(header) ||
+      fwrite(t->out, 1, size, t->fp) != size) {
+    t->error = 1;
+  }
+
+  t->out_at = t->out;
+  t->record = NULL;
+  // every chunk decodes on its own
+  t->sync = 1;
+}
+
+/**
+ * encode: Turn a chunk of entries into records. The state the records are
+ * encoded against is kept in locals while it runs: stores of record bytes
+ * could alias it in the struct, which would have it reloaded after each
+ * @param t The trace
+ * @param e The entries
+ * @param size Their size in bytes
+ * @return void
+ * */
+static void encode(struct tracebin* t, const uint8_t* e, uint32_t size) {
+  const uint8_t* end = e + size;
+  // a record started past it could overflow the chunk
+  uint8_t* room = t->out + TRACEBIN_CHUNK_SIZE - TRACEBIN_MAX_RECORD;
+  uint8_t* p = t->out_at;
+  uint8_t* record = t->record;
+  uint8_t* count = t->count;
+  unsigned sync = t->sync;
+  uint16_t next_pc = t->next_pc;
+  uint16_t last_write = t->last_write;
+  uint64_t index = t->index;
+  const uint8_t* last = t->last_regs;
+  uint32_t regs = last[0] | (last[1] << 8) | (last[2] << 16) |
+                  ((uint32_t)last[3] << 24);
+  uint8_t sr = last[4];
+
+  while (e < end) {
+    switch (e[0]) {
+    case ENTRY_EXEC: {
+      if (p > room) {
+        t->out_at = p;
+        flush(t);
+        p = t->out_at;
+        sync = 1;
+      }
+
+      uint16_t pc = e[1] | (e[2] << 8);
+      unsigned length = lengths[e[3]];
+      uint8_t header = 0;
+
+      record = p++;
+      if (sync) {
+        header = TRACEBIN_SYNC;
+        *p++ = e[1];
+        *p++ = e[2];
+        p = put_varint(p, index);
+        last_write = 0;
+      } else if (pc != next_pc) {
+        header = TRACEBIN_JUMP;
+        p = put_varint(p, zigzag((int16_t)(pc - next_pc)));
+      }
+
+      // the record has room for the bytes past the instruction and the
+      // registers that didn't change, they are overwritten
+      memcpy(p, e + 3, 3);
+      p += length;
+
+      // A, X, Y and SP compared at once: bit 7 of each byte of nz is set
+      // if the byte differs, then the 4 bits are gathered in changed
+      uint32_t axys =
+          e[6] | (e[7] << 8) | (e[8] << 16) | ((uint32_t)e[9] << 24);
+      uint32_t diff = axys ^ regs;
+      uint32_t nz =
+          ((((diff & 0x7F7F7F7F) + 0x7F7F7F7F) | diff) & 0x80808080) >> 7;
+      unsigned changed = (nz | (nz >> 7) | (nz >> 14) | (nz >> 21)) & 0x0F;
+
+      changed |= (unsigned)(e[10] != sr) << 4;
+      if (sync) changed = TRACEBIN_REGS;
+
+      // no branch per register, p only moves past the changed ones
+      for (unsigned i = 0; i < 5; i++) {
+        *p = e[6 + i];
+        p += (changed >> i) & 1;
+      }
+      header |= changed;
+      regs = axys;
+      sr = e[10];
+
+      *record = header;
+      count = NULL;
+      sync = 0;
+      next_pc = pc + length;
+      index++;
+      e += ENTRY_EXEC_SIZE;
+      break;
+    }
+
+    case ENTRY_WRITE: {
+      uint16_t addr = e[1] | (e[2] << 8);
+
+      // a reset wrote it, or too many
+      if (record != NULL &&
+          (count == NULL || *count < TRACEBIN_MAX_WRITES)) {
+        if (count == NULL) {
+          *record |= TRACEBIN_WRITES;
+          count = p++;
+          *count = 0;
+        }
+        p = put_varint(p, zigzag((int16_t)(addr - last_write)));
+        *p++ = e[3];
+        last_write = addr;
+        (*count)++;
+      }
+      e += ENTRY_SIZE;
+      break;
+    }
+
+    default:
+      // the registers and the PC start over
+      record = NULL;
+      sync = 1;
+      e += ENTRY_SIZE;
+      break;
+    }
+  }
+
+  t->out_at = p;
+  t->record = record;
+  t->count = count;
+  t->sync = (uint8_t)sync;
+  t->next_pc = next_pc;
+  t->last_write = last_write;
+  t->index = index;
+  t->last_regs[0] = regs & 0xFF;
+  t->last_regs[1] = (regs >> 8) & 0xFF;
+  t->last_regs[2] = (regs >> 16) & 0xFF;
+  t->last_regs[3] = regs >> 24;
+  t->last_regs[4] = sr;
+}
+
+// writer: the thread encoding full chunks into the file, oldest first
+static void* writer(void* arg) {
+  struct tracebin* t = arg;
+
+  pthread_mutex_lock(&t->lock);
+  for (;;) {
+    while (t->full == 0 && !t->stop) pthread_cond_wait(&t->cond, &t->lock);
+    if (t->full == 0) break;
+
+    struct tracebin_chunk* c = &t->chunks[t->head];
+    pthread_mutex_unlock(&t->lock);
+
+    encode(t, c->bytes, c->size);
+
+    pthread_mutex_lock(&t->lock);
+    t->head = (t->head + 1) % TRACEBIN_CHUNKS;
+    t->full--;
+    pthread_cond_broadcast(&t->cond);
+  }
+  pthread_mutex_unlock(&t->lock);
+
+  if (t->out_at != t->out) flush(t);
+
+  return NULL;
+}
+
+/**
+ * submit: Hand the chunk being filled to the writer and start the next
+ * one, waiting for the writer if they are all full
+ * @param t The trace
+ * @return void
+ * */
+static void submit(struct tracebin* t) {
+  pthread_mutex_lock(&t->lock);
+
+  unsigned current = (t->head + t->full) % TRACEBIN_CHUNKS;
+  t->chunks[current].size = (uint32_t)(t->at - t->start);
+  t->full++;
+  pthread_cond_broadcast(&t->cond);
+
+  while (t->full == TRACEBIN_CHUNKS) pthread_cond_wait(&t->cond, &t->lock);
+  current = (t->head + t->full) % TRACEBIN_CHUNKS;
+
+  pthread_mutex_unlock(&t->lock);
+
+  t->start = t->chunks[current].bytes;
+  t->at = t->start;
+  t->end = t->start + TRACEBIN_CHUNK_SIZE;
+}
+
+/**
+ * tracebin_open: Create a trace file and start its writer, install
+ * tracebin_hook() with the trace as ctx and TRACEBIN_EVENTS to record
+ * into it
+ * @param t The trace
+ * @param path Where to write it
+ * @return 0 if success, 1 if failure
+ * */
+int tracebin_open(struct tracebin* t, const char* path) {
+  uint8_t header[12];
+
+  memset(t, 0, sizeof(*t));
+  t->sync = 1;
+
+  t->fp = fopen(path, "wb");
+  if (t->fp == NULL) {
+    fprintf(stderr, "[FAILED] Error while opening trace '%s'.\n", path);
+    return 1;
+  }
+
+  memcpy(header, TRACEBIN_MAGIC, 8);
+  put32(header + 8, TRACEBIN_VERSION);
+
+  t->out = malloc(TRACEBIN_CHUNK_SIZE);
+  if (t->out == NULL) t->error = 1;
+  for (unsigned i = 0; i < TRACEBIN_CHUNKS; i++) {
+    t->chunks[i].bytes = malloc(TRACEBIN_CHUNK_SIZE);
+    if (t->chunks[i].bytes == NULL) t->error = 1;
+  }
+
+  if (t->error || fwrite(header, 1, sizeof(header), t->fp) != sizeof(header) ||
+      pthread_mutex_init(&t->lock, NULL) != 0) {
+    fprintf(stderr, "[FAILED] Error while writing trace '%s'.\n", path);
+    free(t->out);
+    for (unsigned i = 0; i < TRACEBIN_CHUNKS; i++) free(t->chunks[i].bytes);
+    fclose(t->fp);
+    return 1;
+  }
+  pthread_cond_init(&t->cond, NULL);
+
+  t->out_at = t->out;
+  t->start = t->chunks[0].bytes;
+  t->at = t->start;
+  t->end = t->start + TRACEBIN_CHUNK_SIZE;
+
+  if (pthread_create(&t->writer, NULL, writer, t) != 0) {
+    fprintf(stderr, "[FAILED] Error while starting the trace writer.\n");
+    pthread_cond_destroy(&t->cond);
+    pthread_mutex_destroy(&t->lock);
+    free(t->out);
+    for (unsigned i = 0; i < TRACEBIN_CHUNKS; i++) free(t->chunks[i].bytes);
+    fclose(t->fp);
+    return 1;
+  }
+
+  return 0;
+}
+
+/**
+ * tracebin_close: Encode and write what is left and close the file. The
+ * hook must be uninstalled first
+ * @param t The trace
+ * @return 0 if success, 1 if the trace couldn't be written whole
+ * */
+int tracebin_close(struct tracebin* t) {
+  if (t->at != t->start) submit(t);
+
+  pthread_mutex_lock(&t->lock);
+  t->stop = 1;
+  pthread_cond_broadcast(&t->cond);
+  pthread_mutex_unlock(&t->lock);
+  pthread_join(t->writer, NULL);
+
+  pthread_cond_destroy(&t->cond);
+  pthread_mutex_destroy(&t->lock);
+  free(t->out);
+  for (unsigned i = 0; i < TRACEBIN_CHUNKS; i++) free(t->chunks[i].bytes);
+
+  if (fclose(t->fp) != 0) t->error = 1;
+  if (t->error) fprintf(stderr, "[FAILED] Error while writing the trace.\n");
+  return t->error;
+}
+
+/**
+ * peek: A byte of memory as the CPU would read it, without calling I/O
+ * handlers nor emitting trace records
+ * @param m The machine
+ * @param addr The address
+ * @return the byte, 0 on I/O pages
+ * */
+static uint8_t peek(struct machine* m, uint16_t addr) {
+  uint32_t page = m->mem.read_page[addr >> 8];
+
+  // watched pages look like I/O ones
+  if (page == MEM_PAGE_IO) page = mem_page_entry(m, addr >> 8, 0);
+
+  return page != MEM_PAGE_IO ? m->mem.data[page | (addr & 0xFF)] : 0;
+}
+
+/**
+ * tracebin_hook: Trace hook recording into the struct tracebin given as
+ * ctx, see trace_set_hook()
+ * @param m The machine
+ * @param rec The record
+ * @param ctx The trace
+ * @return void
+ * */
+void tracebin_hook(struct machine* m, const struct trace_record* rec,
+                   void* ctx) {
+  struct tracebin* t = ctx;
+
+  if (t->end - t->at < ENTRY_EXEC_SIZE) submit(t);
+
+  uint8_t* e = t->at;
+
+  switch (rec->event) {
+  case TRACE_EXEC:
+    e[0] = ENTRY_EXEC;
+    e[1] = rec->addr & 0xFF;
+    e[2] = rec->addr >> 8;
+    e[3] = rec->data;
+    e[4] = peek(m, rec->addr + 1);
+    e[5] = peek(m, rec->addr + 2);
+    e[6] = m->cpu.ac;
+    e[7] = m->cpu.x;
+    e[8] = m->cpu.y;
+    e[9] = m->cpu.sp;
+    e[10] = cpu_sr_pack(&m->cpu);
+    t->at = e + ENTRY_EXEC_SIZE;
+    break;
+
+  case TRACE_WRITE:
+  case TRACE_RESET:
+    e[0] = rec->event == TRACE_WRITE ? ENTRY_WRITE : ENTRY_RESET;
+    e[1] = rec->addr & 0xFF;
+    e[2] = rec->addr >> 8;
+    e[3] = rec->data;
+    t->at = e + ENTRY_SIZE;
+    break;
+
+  default:
+    break;
+  }
+}
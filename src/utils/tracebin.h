@@ -0,0 +1,124 @@
+#ifndef INC_6502_TRACEBIN_H
+#define INC_6502_TRACEBIN_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "trace.h"
+
+/*
+ * Compact binary instruction trace, for long runs.
+ *
+ * A trace hook (see trace.h) that costs the core as little as possible: it
+ * only copies the PC, bytes and registers of every executed instruction,
+ * and the bytes it writes, as fixed-size entries into chunks of memory. A
+ * thread of its own encodes the full chunks into the format below and
+ * writes them to the file while the core fills the next ones; the core only
+ * waits for it when all TRACEBIN_CHUNKS are full. bin/trace-dump.out
+ * decodes a trace back into text.
+ *
+ * The file is TRACEBIN_MAGIC, a 32-bit version, then chunks of at most
+ * TRACEBIN_CHUNK_SIZE bytes, each a 32-bit size and its records; integers
+ * are little endian. A record is
+ *
+ *   header      TRACEBIN_SYNC, TRACEBIN_JUMP, TRACEBIN_WRITES and the
+ *               TRACEBIN_A..TRACEBIN_SR bits of the registers that follow
+ *   [sync]      absolute PC (16 bits), instruction index (varint)
+ *   [jump]      PC minus the PC after the previous instruction (zigzag
+ *               varint), absent when the previous one just fell through
+ *   opcode      then its operand bytes, TRACEBIN_LEN_* of its mode
+ *   registers   A, X, Y, SP and SR before the instruction, only the ones
+ *               that changed since the previous record
+ *   [writes]    count, then per write the address minus the previous
+ *               write's (zigzag varint) and the byte
+ *
+ * Every chunk starts with a sync record, which has every register, so a
+ * chunk decodes without the ones before it. Reads aren't recorded: the
+ * operands are, and the rest follows from the registers and the writes.
+ */
+
+// what tracebin_hook() needs, see trace_set_events()
+#define TRACEBIN_EVENTS \
+  (TRACE_EVENT(TRACE_EXEC) | TRACE_EVENT(TRACE_WRITE) | TRACE_EVENT(TRACE_RESET))
+
+#define TRACEBIN_MAGIC "6502TRCB"
+#define TRACEBIN_VERSION 1
+
+#define TRACEBIN_A 0x01
+#define TRACEBIN_X 0x02
+#define TRACEBIN_Y 0x04
+#define TRACEBIN_SP 0x08
+#define TRACEBIN_SR 0x10
+#define TRACEBIN_REGS 0x1F
+#define TRACEBIN_JUMP 0x20
+#define TRACEBIN_WRITES 0x40
+#define TRACEBIN_SYNC 0x80
+
+// bytes of an instruction by addressing mode, for the X-macro of opcodes.h
+#define TRACEBIN_LEN_IMP 1
+#define TRACEBIN_LEN_IMM 2
+#define TRACEBIN_LEN_ZP0 2
+#define TRACEBIN_LEN_ZPX 2
+#define TRACEBIN_LEN_ZPY 2
+#define TRACEBIN_LEN_REL 2
+#define TRACEBIN_LEN_IZX 2
+#define TRACEBIN_LEN_IZY 2
+#define TRACEBIN_LEN_ABS 3
+#define TRACEBIN_LEN_ABX 3
+#define TRACEBIN_LEN_ABY 3
+#define TRACEBIN_LEN_IND 3
+
+// writes kept per instruction, BRK makes 3
+#define TRACEBIN_MAX_WRITES 8
+
+// a record never takes more than this
+#define TRACEBIN_MAX_RECORD (1 + 2 + 10 + 3 + 5 + 1 + TRACEBIN_MAX_WRITES * 4)
+
+#define TRACEBIN_CHUNK_SIZE (256 * 1024)
+#define TRACEBIN_CHUNKS 8
+
+struct tracebin_chunk {
+  uint8_t* bytes;
+  uint32_t size;
+};
+
+struct tracebin {
+  FILE* fp;
+
+  // the chunk of entries being filled, by the core only
+  uint8_t* start;
+  uint8_t* at;
+  uint8_t* end;
+
+  // chunks in the order they are filled and encoded, full ones are
+  // head..head+full-1, shared with the writer under lock
+  struct tracebin_chunk chunks[TRACEBIN_CHUNKS];
+  unsigned head;
+  unsigned full;
+  int stop;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t writer;
+
+  // the encoder, by the writer only: the chunk of records being encoded,
+  // the header and the write count of the last record (count is NULL
+  // until its first write), and what the next record is encoded against
+  uint8_t* out;
+  uint8_t* out_at;
+  uint8_t* record;
+  uint8_t* count;
+  uint8_t sync;
+  uint16_t next_pc;
+  uint8_t last_regs[5];
+  uint16_t last_write;
+  uint64_t index;
+  int error;
+};
+
+int tracebin_open(struct tracebin* t, const char* path);
+int tracebin_close(struct tracebin* t);
+void tracebin_hook(struct machine* m, const struct trace_record* rec,
+                   void* ctx);
+
+#endif
@@ -0,0 +1,104 @@
+#!/bin/sh
+#
+# Snapshots and the history keep the state of the devices: a run cut in
+# two by --save and --restore, and a run taken back by --rewind, end in
+# the same state as a straight run to the same point, compared through
+# their --save snapshots. The ACIA's output is written once, whether the
+# run was cut or taken back, and it is the straight run's.
+#
+# usage: tests/device_state.sh [emulator]
+
+emulator=${1:-bin/emulator.out}
+
+dir=$(dirname "$0")
+tmp=${TMPDIR:-/tmp}/device-state.$$
+status=0
+
+mkdir -p "$tmp" || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+fail() {
+  echo "[FAILED] $*" >&2
+  status=1
+}
+
+# the input of the runs, a restored run has none
+input=/dev/null
+
+# value of a line of the report
+field() {
+  awk -v key="$1:" '$1 == key { print $2 }' "$tmp/out"
+}
+
+# what the guest wrote, up to the report
+output() {
+  awk '{ i = index($0, "stop: ") }
+       i { printf "%s", substr($0, 1, i - 1); exit }
+       { print }' "$1"
+}
+
+# name, instructions before the snapshot, after it, and the run's flags
+split_run() {
+  name=$1 first=$2 second=$3
+  shift 3
+  "$emulator" --headless --insts "$first" --save "$tmp/a.snap" "$@" \
+    < "$input" > "$tmp/a.out"
+  "$emulator" --headless --insts "$second" --restore "$tmp/a.snap" \
+    --save "$tmp/b.snap" "$@" < /dev/null > "$tmp/b.out"
+  "$emulator" --headless --insts $((first + second)) --save "$tmp/c.snap" \
+    "$@" < "$input" > "$tmp/c.out"
+  cmp -s "$tmp/b.snap" "$tmp/c.snap" ||
+    fail "$name: --save at $first instructions and --restore differ from a straight run"
+  { output "$tmp/a.out"; output "$tmp/b.out"; } > "$tmp/ab.txt"
+  output "$tmp/c.out" | cmp -s - "$tmp/ab.txt" ||
+    fail "$name: the output cut at $first instructions differs from a straight run's"
+}
+
+# name, cycles of the run, cycles to go back, and the run's flags
+rewind_run() {
+  name=$1 cycles=$2 back=$3
+  shift 3
+  "$emulator" --headless --cycles "$cycles" --rewind "$back" \
+    --save "$tmp/a.snap" "$@" < "$input" > "$tmp/out"
+  # the clock the run went back to, the runs start at 0
+  to=$(( $(field cycles) - $(field rewound) ))
+  "$emulator" --headless --cycles "$to" --save "$tmp/b.snap" "$@" \
+    < "$input" > /dev/null
+  cmp -s "$tmp/a.snap" "$tmp/b.snap" ||
+    fail "$name: --rewind $back differs from a straight run to cycle $to"
+  "$emulator" --headless --cycles "$cycles" "$@" < "$input" > "$tmp/c.out"
+  output "$tmp/out" > "$tmp/a.txt"
+  output "$tmp/c.out" | cmp -s - "$tmp/a.txt" ||
+    fail "$name: --rewind $back wrote other output than a straight run"
+}
+
+irq="--via 0xD0 -L 0x8000:$dir/../bench/irq.bin -L 0xE000:$dir/../rom.bin"
+
+for core in "" --no-blocks --jit; do
+  split_run "irq $core" 30000 15000 $irq $core
+  split_run "irq $core" 12345 54321 $irq $core
+  rewind_run "irq $core" 1000000 500000 $irq $core
+  rewind_run "irq $core" 3333333 2222222 $irq $core
+done
+
+# echoes what the ACIA at $D100 receives, a third of a million cycles
+# apart: LDA #$0B, STA $D102; l: LDA $D101, AND #$08, BEQ l, LDA $D100,
+# STA $D100, LDX #0; d: LDY #0; i: DEY, BNE i, DEX, BNE d, JMP l
+printf '\251\013\215\002\321\255\001\321\051\010\360\371\255\000\321' \
+  > "$tmp/echo.bin"
+printf '\215\000\321\242\000\240\000\210\320\375\312\320\370\114\005\200' \
+  >> "$tmp/echo.bin"
+printf 'hello\nworld\n' > "$tmp/input"
+input=$tmp/input
+echo="--acia 0xD1 -L 0x8000:$tmp/echo.bin -L 0xE000:$dir/../rom.bin"
+
+for core in "" --no-blocks --jit; do
+  split_run "echo $core" 100000 3000000 $echo $core
+  split_run "echo $core" 1000000 2000000 $echo $core
+  rewind_run "echo $core" 6000000 3500000 $echo $core
+  rewind_run "echo $core" 2500000 2000000 $echo $core
+  rewind_run "echo $core" 2500000 2000000 $echo --history 1 $core
+done
+
+[ $status -eq 0 ] && echo ok
+exit $status
@@ -0,0 +1,131 @@
+/*
+ * instructions: the flag and register fixes of the core, one instruction
+ * at a time through cpu_run(), on whichever core the build selects.
+ *
+ * - ORA, AND and EOR set Z from their result and leave C alone
+ * - BIT sets Z from all 8 bits of A & M
+ * - DEX decrements X
+ * - RTI restores I from the stack, only B is dropped
+ * - BRK pushes B set and leaves B of the live register as it was
+ *
+ * Prints "ok" and exits with 0 if it passes.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../src/cpu/cpu.h"
+#include "../src/machine/machine.h"
+
+#define CODE 0x8000
+
+static struct machine machine;
+
+static int failures = 0;
+
+static void check(int ok, const char* what) {
+  if (!ok) {
+    fprintf(stderr, "[FAILED] %s\n", what);
+    failures++;
+  }
+}
+
+/**
+ * step: Run one instruction written at CODE
+ * @param m The machine
+ * @param op The opcode
+ * @param operand Its operand byte, if it has one
+ * @return void
+ * */
+static void step(struct machine* m, uint8_t op, uint8_t operand) {
+  struct cpu_limits limits = {0};
+  struct cpu_counters counters = {0, 0};
+
+  machine_write(m, CODE, op);
+  machine_write(m, CODE + 1, operand);
+  limits.max_instructions = 1;
+  m->cpu.pc = CODE;
+  m->cycles = 0;
+  cpu_run(m, &limits, &counters);
+}
+
+/**
+ * logic: Check that a logic operation with a zero result sets Z and
+ * leaves C alone
+ * @param m The machine
+ * @param op The opcode, immediate
+ * @param ac A before it
+ * @param operand The immediate
+ * @param what The name of the operation
+ * @return void
+ * */
+static void logic(struct machine* m, uint8_t op, uint8_t ac, uint8_t operand,
+                  const char* what) {
+  char line[64];
+
+  for (uint8_t carry = 0; carry < 2; carry++) {
+    m->cpu.ac = ac;
+    cpu_mod_sr(m, Z, 0);
+    cpu_mod_sr(m, C, carry);
+    step(m, op, operand);
+
+    snprintf(line, sizeof(line), "%s with a zero result sets Z", what);
+    check(m->cpu.ac == 0 && cpu_extract_sr(m, Z) == 1, line);
+    snprintf(line, sizeof(line), "%s leaves C at %u", what, carry);
+    check(cpu_extract_sr(m, C) == carry, line);
+  }
+}
+
+int main(void) {
+  struct machine* m = &machine;
+
+  machine_init(m);
+
+  logic(m, 0x09, 0x00, 0x00, "ORA");
+  logic(m, 0x29, 0xF0, 0x0F, "AND");
+  logic(m, 0x49, 0x5A, 0x5A, "EOR");
+
+  // BIT $10 with A & M = $10, only its high nibble set
+  machine_write(m, 0x0010, 0x10);
+  m->cpu.ac = 0x30;
+  step(m, 0x24, 0x10);
+  check(cpu_extract_sr(m, Z) == 0, "BIT with A & M = $10 clears Z");
+  m->cpu.ac = 0x0F;
+  step(m, 0x24, 0x10);
+  check(cpu_extract_sr(m, Z) == 1, "BIT with A & M = 0 sets Z");
+
+  m->cpu.x = 5;
+  step(m, 0xCA, 0);
+  check(m->cpu.x == 4, "DEX decrements X");
+  m->cpu.x = 0;
+  step(m, 0xCA, 0);
+  check(m->cpu.x == 0xFF && cpu_extract_sr(m, N) == 1,
+        "DEX wraps 0 to $FF and sets N");
+
+  // RTI from a frame with I and B set, returning to $1234
+  m->cpu.sp = 0xFC;
+  machine_write(m, 0x01FD, (1 << I) | (1 << B));
+  machine_write(m, 0x01FE, 0x34);
+  machine_write(m, 0x01FF, 0x12);
+  step(m, 0x40, 0);
+  check(m->cpu.pc == 0x1234, "RTI returns to the pushed PC");
+  check(cpu_extract_sr(m, I) == 1, "RTI restores I");
+  check(cpu_extract_sr(m, B) == 0, "RTI drops B");
+
+  // BRK with B already set in the live register
+  m->cpu.sp = 0xFF;
+  cpu_mod_sr(m, B, 1);
+  step(m, 0x00, 0);
+  check(machine_read(m, 0x01FD) & (1 << B), "BRK pushes B set");
+  check(cpu_extract_sr(m, B) == 1, "BRK leaves B of the live register");
+  cpu_mod_sr(m, B, 0);
+  m->cpu.sp = 0xFF;
+  step(m, 0x00, 0);
+  check(machine_read(m, 0x01FD) & (1 << B), "BRK pushes B set");
+  check(cpu_extract_sr(m, B) == 0, "BRK doesn't set B in the live register");
+
+  if (failures) return EXIT_FAILURE;
+  printf("ok\n");
+  return EXIT_SUCCESS;
+}
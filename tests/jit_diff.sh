@@ -0,0 +1,141 @@
+#!/bin/sh
+#
+# Runs the same programs with --jit and with --no-blocks and checks that
+# they stop for the same reason at the same PC, with the same counters and
+# the same machine state, compared through --save snapshots.
+#
+# The programs are those of bench/, under a few stop conditions, and
+# random ones: random documented opcodes but BRK at $8000 with random
+# operands, a JMP $8000 at the end, a random zero page, and sometimes a
+# page mapped as ROM or a mirror.
+#
+# usage: tests/jit_diff.sh [emulator [random programs [first seed]]]
+
+emulator=${1:-bin/emulator.out}
+programs=${2:-200}
+seed=${3:-1}
+
+dir=$(dirname "$0")
+tmp=${TMPDIR:-/tmp}/jit-diff.$$
+status=0
+
+mkdir -p "$tmp" || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+# the report of a run without its timings, and its final state
+run() {
+  core=$1
+  shift
+  "$emulator" --headless --save "$tmp/$core.snap" "$@" |
+    grep -v -e '^seconds:' -e '^mips:' -e '^mhz:' > "$tmp/$core.out"
+}
+
+compare() {
+  name=$1
+  shift
+  run jit --jit "$@"
+  run interp --no-blocks "$@"
+  if ! cmp -s "$tmp/jit.out" "$tmp/interp.out" ||
+     ! cmp -s "$tmp/jit.snap" "$tmp/interp.snap"; then
+    echo "[FAILED] --jit and --no-blocks differ on $name: $*" >&2
+    diff "$tmp/jit.out" "$tmp/interp.out" >&2
+    status=1
+  fi
+}
+
+# octal escapes for printf of random bytes, the code first, or the zero
+# page with "zp"
+random_bytes() {
+  awk -v seed="$1" -v what="$2" '
+    BEGIN {
+      split("IMP 1 IMM 2 ZP0 2 ZPX 2 ZPY 2 REL 2 IZX 2 IZY 2 " \
+            "ABS 3 ABX 3 ABY 3 IND 3", l)
+      for (i = 1; i < 24; i += 2) length_of[l[i]] = l[i + 1]
+    }
+    /X\(0x/ {
+      line = $0
+      sub(/^ *X\(/, "", line)
+      gsub(/[(),"\\]/, " ", line)
+      split(line, f)
+      if (f[2] != "???" && f[2] != "BRK") {
+        op[n] = hex(f[1]); name[n] = f[2]; mode[n] = f[4]; n++
+      }
+    }
+    function hex(s,    v, i, c) {
+      v = 0
+      for (i = 3; i <= length(s); i++) {
+        c = index("0123456789ABCDEF", toupper(substr(s, i, 1))) - 1
+        v = v * 16 + c
+      }
+      return v
+    }
+    function byte(v) { printf "\\%03o", v % 256 }
+    END {
+      srand(seed)
+      if (what == "zp") {
+        for (i = 0; i < 256; i++) byte(int(rand() * 256))
+        exit
+      }
+      size = 0
+      while (size < 200) {
+        k = int(rand() * n)
+        byte(op[k]); size++
+        if (mode[k] == "REL") {
+          r = rand()
+          byte(r < 0.25 ? 254 : r < 0.5 ? 2 : r < 0.6 ? 240 : int(rand() * 256))
+        } else if (length_of[mode[k]] == 3) {
+          r = rand()
+          if (name[k] == "JMP" || name[k] == "JSR") {
+            a = 32768 + int(rand() * (size + 50))
+          } else if (r < 0.33) {
+            a = 512 + int(rand() * 512)
+          } else if (r < 0.66) {
+            a = 32768 + int(rand() * 200)
+          } else {
+            a = int(rand() * 65536)
+          }
+          byte(a % 256); byte(int(a / 256))
+        } else if (length_of[mode[k]] == 2) {
+          byte(int(rand() * 256))
+        }
+        size += length_of[mode[k]] - 1
+      }
+      byte(76); byte(0); byte(128)
+    }' "$dir/../src/cpu/opcodes.h"
+}
+
+for bin in "$dir"/../bench/*.bin; do
+  name=$(basename "$bin" .bin)
+  flags=$(cat "${bin%.bin}.flags" 2>/dev/null)
+
+  for stop in "--insts 300000" "--cycles 777777" "--insts 300000 --stop idle" \
+              "--insts 300000 --stop self" "--insts 300000 --stop pc=0x8010"; do
+    compare "$name" $stop $flags -L "0x8000:$bin" -L "0xE000:$dir/../rom.bin"
+  done
+done
+
+i=0
+while [ "$i" -lt "$programs" ]; do
+  s=$((seed + i))
+  i=$((i + 1))
+
+  printf "$(random_bytes "$s")" > "$tmp/code.bin"
+  printf "$(random_bytes "$s" zp)" > "$tmp/zp.bin"
+
+  case $((s % 4)) in
+  0) map="-M 0x03:rom" ;;
+  1) map="-M 0x03:mirror=0x02" ;;
+  *) map= ;;
+  esac
+  case $((s % 3)) in
+  0) budget="--insts 1000" ;;
+  1) budget="--insts 33333 --stop idle" ;;
+  2) budget="--cycles 50000 --stop self" ;;
+  esac
+
+  compare "seed $s" $budget $map --history 0 -L "0x0000:$tmp/zp.bin" \
+    -L "0x8000:$tmp/code.bin" -L "0xE000:$dir/../rom.bin"
+done
+
+[ $status -eq 0 ] && echo ok
+exit $status
@@ -0,0 +1,115 @@
+/*
+ * jit_flush: blocks that were hot before the JIT buffer got full are
+ * translated again after it is emptied.
+ *
+ * A loop at LOOP runs until its block is translated. Then SECTIONS small
+ * loops at FILLER, each one hot, are translated until the buffer fills up
+ * and is emptied, which drops the translation of LOOP too. LOOP runs again
+ * and has to be translated again, with the same counters as before.
+ *
+ * Built by make test with a small JIT_BUFFER_SIZE, see the Makefile.
+ * Prints "ok" and exits with 0 if it passes.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../src/cpu/block.h"
+#include "../src/cpu/cpu.h"
+#include "../src/jit/jit.h"
+#include "../src/machine/machine.h"
+
+#define LOOP 0x8000
+#define FILLER 0x9100
+#define SECTIONS 400
+#define INSTS 2000
+
+static struct machine machine;
+
+static int failures = 0;
+
+static void check(int ok, const char* what) {
+  if (!ok) {
+    fprintf(stderr, "[FAILED] %s\n", what);
+    failures++;
+  }
+}
+
+// the block cpu_run() keeps for pc, see block_lookup()
+static struct block* slot(struct machine* m, uint16_t pc) {
+  return &m->blocks.blocks[(pc ^ (pc >> 10)) & (BLOCK_CACHE_SIZE - 1)];
+}
+
+/**
+ * run: Run from an address
+ * @param m The machine
+ * @param pc The address, with X cleared
+ * @param insts The budget in instructions, 0 to stop on a jump to itself
+ * @return the counters of the run
+ * */
+static struct cpu_counters run(struct machine* m, uint16_t pc,
+                               uint64_t insts) {
+  struct cpu_limits limits = {0};
+  struct cpu_counters counters = {0, 0};
+
+  limits.max_instructions = insts;
+  limits.stop_on_self_jump = insts == 0;
+  m->cpu.pc = pc;
+  m->cpu.x = 0;
+  cpu_run(m, &limits, &counters);
+  return counters;
+}
+
+int main(void) {
+  struct machine* m = &machine;
+  uint16_t pc = FILLER;
+
+  machine_init(m);
+  if (jit_enable(m)) {
+    fprintf(stderr, "Error: No JIT on this host, it needs Linux on x86-64\n");
+    return EXIT_FAILURE;
+  }
+
+  // LOOP: INX, BNE LOOP, JMP LOOP
+  machine_write(m, LOOP, 0xE8);
+  machine_write(m, LOOP + 1, 0xD0);
+  machine_write(m, LOOP + 2, 0xFD);
+  machine_write(m, LOOP + 3, 0x4C);
+  machine_write(m, LOOP + 4, LOOP & 0xFF);
+  machine_write(m, LOOP + 5, LOOP >> 8);
+
+  // every section: LDY #20, l: DEY, BNE l; then JMP to itself
+  for (unsigned i = 0; i < SECTIONS; i++, pc += 5) {
+    machine_write(m, pc, 0xA0);
+    machine_write(m, pc + 1, 20);
+    machine_write(m, pc + 2, 0x88);
+    machine_write(m, pc + 3, 0xD0);
+    machine_write(m, pc + 4, 0xFD);
+  }
+  machine_write(m, pc, 0x4C);
+  machine_write(m, pc + 1, pc & 0xFF);
+  machine_write(m, pc + 2, pc >> 8);
+
+  struct cpu_counters first = run(m, LOOP, INSTS);
+  check(slot(m, LOOP)->pc == LOOP && slot(m, LOOP)->native != NULL,
+        "LOOP translated on its first run");
+
+  uint64_t flushes = m->jit->flushes;
+  run(m, FILLER, 0);
+  check(m->jit->flushes > flushes, "the sections fill the buffer");
+  check(slot(m, LOOP)->pc == LOOP && slot(m, LOOP)->native == NULL,
+        "emptying the buffer drops the translation of LOOP");
+
+  struct cpu_counters again = run(m, LOOP, INSTS);
+  check(slot(m, LOOP)->native != NULL, "LOOP translated again");
+  check(again.instructions == first.instructions &&
+            again.cycles == first.cycles,
+        "same counters as the first run");
+
+  jit_disable(m);
+
+  if (failures) return EXIT_FAILURE;
+  printf("ok\n");
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,84 @@
+/*
+ * jit_smc: a page rewritten MEM_CODE_WRITES_MAX times is no longer
+ * translated, until mem_code_invalidate_all().
+ *
+ * A hot inner loop at LOOP is translated, then an INC on its own page drops
+ * the translation and the outer loop starts over: without a limit every
+ * pass would translate the inner loop again.
+ *
+ * Prints "ok" and exits with 0 if it passes.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../src/cpu/cpu.h"
+#include "../src/jit/jit.h"
+#include "../src/machine/machine.h"
+
+#define LOOP 0x8000
+#define DATA 0x80F0
+#define PASSES 100
+
+static struct machine machine;
+
+static int failures = 0;
+
+static void check(int ok, const char* what) {
+  if (!ok) {
+    fprintf(stderr, "[FAILED] %s\n", what);
+    failures++;
+  }
+}
+
+/**
+ * run: Run the outer loop from LOOP
+ * @param m The machine
+ * @param passes How many passes of the outer loop
+ * @return void
+ * */
+static void run(struct machine* m, unsigned passes) {
+  struct cpu_limits limits = {0};
+  struct cpu_counters counters = {0, 0};
+
+  // LDX, then DEX and BNE 256 times, INC and JMP
+  limits.max_instructions = passes * (1 + 2 * 256 + 2);
+  m->cpu.pc = LOOP;
+  cpu_run(m, &limits, &counters);
+}
+
+int main(void) {
+  struct machine* m = &machine;
+
+  machine_init(m);
+  if (jit_enable(m)) {
+    fprintf(stderr, "Error: No JIT on this host, it needs Linux on x86-64\n");
+    return EXIT_FAILURE;
+  }
+
+  // LOOP: LDX #0, l: DEX, BNE l, INC DATA, JMP LOOP
+  const uint8_t code[] = {0xA2, 0x00, 0xCA, 0xD0, 0xFD, 0xEE, DATA & 0xFF,
+                          DATA >> 8, 0x4C, LOOP & 0xFF, LOOP >> 8};
+  for (unsigned i = 0; i < sizeof(code); i++) {
+    machine_write(m, LOOP + i, code[i]);
+  }
+
+  run(m, PASSES);
+  check(machine_read(m, DATA) == PASSES, "every pass ran");
+  check(m->mem.code_writes[LOOP >> 8] == MEM_CODE_WRITES_MAX,
+        "the page reached the limit");
+  check(m->jit->compiled <= MEM_CODE_WRITES_MAX,
+        "the inner loop translated at most once per rewrite below the limit");
+
+  uint64_t compiled = m->jit->compiled;
+  mem_code_invalidate_all(m);
+  run(m, 1);
+  check(m->jit->compiled > compiled, "translated again once the count is reset");
+
+  jit_disable(m);
+
+  if (failures) return EXIT_FAILURE;
+  printf("ok\n");
+  return EXIT_SUCCESS;
+}
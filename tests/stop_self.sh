@@ -0,0 +1,48 @@
+#!/bin/sh
+#
+# --stop self stops right after the first jump to itself, even in an idle
+# loop that a budget would otherwise skip to its end: NOP, NOP, JMP $8002
+# at $8000 stops at $8002 after the same instructions and cycles whatever
+# the budget, on every core, headless and in a farm.
+#
+# usage: tests/stop_self.sh [emulator]
+
+emulator=${1:-bin/emulator.out}
+
+dir=$(dirname "$0")
+tmp=${TMPDIR:-/tmp}/stop-self.$$
+status=0
+expected="self-jump 0x8002 2 13"
+
+mkdir -p "$tmp" || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+printf '\352\352\114\002\200' > "$tmp/self.bin"
+
+for core in "" --no-blocks --jit; do
+  for budget in "--insts 1000" "--cycles 5000" ""; do
+    got=$("$emulator" --headless $budget --stop self $core \
+            -L "0x8000:$tmp/self.bin" -L "0xE000:$dir/../rom.bin" |
+          awk '/^stop:/ { s = $2 } /^pc:/ { p = $2 }
+               /^instructions:/ { n = $2 } /^cycles:/ { c = $2 }
+               END { print s, p, n, c }')
+    if [ "$got" != "$expected" ]; then
+      echo "[FAILED] --stop self $budget $core: $got, not $expected" >&2
+      status=1
+    fi
+  done
+done
+
+for budget in "cycles=5000" "insts=1000"; do
+  echo "0x8000:$tmp/self.bin 0xE000:$dir/../rom.bin stop=self $budget" \
+    > "$tmp/jobs"
+  got=$("$emulator" --farm "$tmp/jobs" -j 1 |
+        awk -F '\t' '$1 == "0" { print $2, $3, $4, $5 }')
+  if [ "$got" != "$expected" ]; then
+    echo "[FAILED] farm stop=self $budget: $got, not $expected" >&2
+    status=1
+  fi
+done
+
+[ $status -eq 0 ] && echo ok
+exit $status